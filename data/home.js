@@ -1,6 +1,15 @@
 // Timer used for the popup notifications.
 let timer = undefined;
 
+// The names of the days of the week, in the order used for the alarm times.
+const DAY_NAMES = ["Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"];
+
+// The number of time-of-day brightness caps.
+const BRIGHTNESS_CAP_COUNT = 4;
+
+// The number of LEDs, each with its own calibration gain.
+const LED_COUNT = 32;
+
 function setupPatternListener(patternElemName, colourElemName) {
     const colourElem = document.getElementById(colourElemName);
     document.getElementById(patternElemName).addEventListener("change", (e) => {
@@ -36,10 +45,219 @@ function setup() {
     setupPatternListener("nightPattern", "nightColour");
     setupPatternListener("alarmPattern", "alarmColour");
 
+    // Set up the per-day alarm times.
+    setupAlarmCalendar();
+
+    // Set up the brightness caps.
+    setupBrightnessCaps();
+
+    // Set up the time zone picker.
+    setupTimezones();
+
     // Load the initial configuration.
     loadConfiguration();
 }
 
+/**
+ * Adds a row to the alarm calendar for each day of the week, with its alarm
+ * time and whether the alarm is off that day. These are used when the alarm's
+ * active days are "Calendar", and an empty time uses the main alarm time.
+ */
+function setupAlarmCalendar() {
+    const calendar = document.getElementById("alarmCalendar");
+    const first = document.querySelector("label[for='alarmStartDate']");
+    DAY_NAMES.forEach((name, index) => {
+        const label = document.createElement("label");
+        label.htmlFor = "alarmTime" + index;
+        label.textContent = name;
+
+        const row = document.createElement("div");
+        row.className = "RadioContainer";
+        const time = document.createElement("input");
+        time.type = "time";
+        time.id = "alarmTime" + index;
+        const off = document.createElement("input");
+        off.type = "checkbox";
+        off.id = "alarmOff" + index;
+        off.addEventListener("change", (e) => time.disabled = e.target.checked);
+        const offLabel = document.createElement("label");
+        offLabel.htmlFor = off.id;
+        offLabel.textContent = "Off";
+        row.append(time, off, offLabel);
+
+        calendar.insertBefore(label, first);
+        calendar.insertBefore(row, first);
+    });
+}
+
+/**
+ * Adds a row to the display settings for each brightness cap, with the time
+ * of day that it starts and the maximum brightness until the next cap starts.
+ * Caps without a time are unused.
+ */
+function setupBrightnessCaps() {
+    const display = document.getElementById("displaySettings");
+    for (let ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+        const label = document.createElement("label");
+        label.htmlFor = "capStart" + ii;
+        label.textContent = "Cap " + (ii + 1);
+
+        const row = document.createElement("div");
+        row.className = "Flex";
+        const start = document.createElement("input");
+        start.type = "time";
+        start.id = "capStart" + ii;
+        const max = document.createElement("input");
+        max.type = "range";
+        max.id = "capMax" + ii;
+        max.min = 1;
+        max.max = 15;
+        const value = document.createElement("span");
+        value.className = "RangeValue";
+        max.addEventListener("input", (e) => value.innerHTML = e.target.value);
+        row.append(start, max, value);
+
+        display.append(label, row);
+    }
+}
+
+/**
+ * Shows the brightness caps and colour calibration.
+ * 
+ * @param {*} json The configuration.
+ */
+function showCalibration(json) {
+    document.getElementById("powerBudget").value = json.powerBudget || 0;
+
+    const caps = json.brightnessCaps || [];
+    for (let ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+        const cap = caps[ii];
+        document.getElementById("capStart" + ii).value = (cap === undefined) ? "" :
+            zeroPad(Math.floor(cap.start / 60), 2) + ":" + zeroPad(cap.start % 60, 2);
+        const max = (cap === undefined) ? 15 : cap.max;
+        document.getElementById("capMax" + ii).value = max;
+        document.getElementById("capMax" + ii).nextElementSibling.innerHTML = max;
+    }
+
+    const calibration = json.calibration || {};
+    const gamma = calibration.gamma || [1, 1, 1];
+    document.getElementById("gammaRed").value = gamma[0];
+    document.getElementById("gammaGreen").value = gamma[1];
+    document.getElementById("gammaBlue").value = gamma[2];
+    document.getElementById("whiteBalance").value = colourArrayToHtmlColour(calibration.whiteBalance || "");
+    document.getElementById("ledGain").value = (calibration.ledGain || []).join(", ");
+}
+
+/**
+ * Fills the time zone picker with the names of the time zones known to the
+ * clock. The custom rule is only used when no zone is picked.
+ */
+function setupTimezones() {
+    const zoneName = document.getElementById("zoneName");
+    const timezone = document.getElementById("timezone");
+    zoneName.addEventListener("input", (e) => timezone.disabled = e.target.value !== "");
+    getJson("/timezones", (names) => {
+        const list = document.getElementById("zoneNames");
+        for (const name of names) {
+            const option = document.createElement("option");
+            option.value = name;
+            list.appendChild(option);
+        }
+    });
+}
+
+/**
+ * Shows the per-day alarm times, date range and skipped dates.
+ * 
+ * @param {*} json The configuration.
+ */
+function showAlarmCalendar(json) {
+    const dayAlarmTimes = json.dayAlarmTimes || [];
+    for (let ii = 0; ii < DAY_NAMES.length; ii++) {
+        const dayTime = dayAlarmTimes[ii];
+        const isOff = dayTime === -1;
+        document.getElementById("alarmOff" + ii).checked = isOff;
+        document.getElementById("alarmTime" + ii).disabled = isOff;
+        document.getElementById("alarmTime" + ii).value = (typeof dayTime === "number" && dayTime >= 0) ?
+            zeroPad(Math.floor(dayTime / 60), 2) + ":" + zeroPad(dayTime % 60, 2) : "";
+    }
+    document.getElementById("alarmStartDate").value = json.alarmStartDate || "";
+    document.getElementById("alarmEndDate").value = json.alarmEndDate || "";
+
+    getJson("/skipDates", (skip) => {
+        document.getElementById("skipDates").value = (skip.dates || []).join("\n");
+    });
+    getJson("/nextAlarm", (next) => {
+        document.getElementById("nextAlarm").textContent = next.local || "None";
+    });
+}
+
+/**
+ * Retrieves JSON from the clock, ignoring any failure.
+ * 
+ * @param {*} url The URL to retrieve.
+ * @param {*} callback The function given the retrieved JSON.
+ */
+function getJson(url, callback) {
+    let xhr = new XMLHttpRequest();
+    xhr.addEventListener("load", function() {
+        if (xhr.status === 200) {
+            callback(JSON.parse(xhr.responseText));
+        }
+    });
+    xhr.open("GET", url);
+    xhr.setRequestHeader('Cache-Control', 'no-cache');
+    xhr.send();
+}
+
+/**
+ * Saves the dates on which the alarm is skipped.
+ */
+function saveSkipDates() {
+    const dates = document.getElementById("skipDates").value.split(/[\s,]+/).filter((d) => d !== "");
+    let xhr = new XMLHttpRequest();
+    xhr.addEventListener("load", function() {
+        if (xhr.status !== 200) {
+            showNotification("Unable to save the skip dates: " + xhr.responseText, "error");
+        } else {
+            showNotification("Skip dates saved successfully", "success");
+            loadConfiguration();
+        }
+    });
+    xhr.addEventListener("error", function(e) {
+        showNotification("Unable to save the skip dates", "error");
+    });
+    xhr.open("POST", "/skipDates");
+    xhr.setRequestHeader('Content-Type', 'application/json');
+    xhr.send(JSON.stringify({ dates: dates }));
+}
+
+/**
+ * Posts a message to be shown on the clock in place of the time. Longer
+ * messages scroll across the display.
+ */
+function sendMessage() {
+    const message = {
+        text: document.getElementById("messageText").value,
+        priority: parseInt(document.getElementById("messagePriority").value, 10),
+        duration: parseInt(document.getElementById("messageDuration").value, 10)
+    };
+    let xhr = new XMLHttpRequest();
+    xhr.addEventListener("load", function() {
+        if (xhr.status !== 200) {
+            showNotification("Unable to show the message: " + xhr.responseText, "error");
+        } else {
+            showNotification("Message sent", "success");
+        }
+    });
+    xhr.addEventListener("error", function(e) {
+        showNotification("Unable to show the message", "error");
+    });
+    xhr.open("POST", "/message");
+    xhr.setRequestHeader('Content-Type', 'application/json');
+    xhr.send(JSON.stringify(message));
+}
+
 function loadConfiguration() {
     let xhr = new XMLHttpRequest();
     xhr.addEventListener("load", function() {
@@ -57,13 +275,19 @@ function loadConfiguration() {
                 zeroPad(alarmTime % 60, 2);
             const alarmActivation = json.alarmActivation || "";
             document.getElementById("alarmActivation").value = alarmActivation;
+            const wakeDuration = json.wakeDuration || 0;
+            document.getElementById("wakeDuration").value = wakeDuration;
+            showAlarmCalendar(json);
+            showCalibration(json);
             const isAlarmDisabled = json.isAlarmDisabled || false;
             if (isAlarmDisabled) {
                 document.getElementById("radioSettings").classList.add("Hidden");
                 document.getElementById("alarm").classList.add("Hidden");
+                document.getElementById("alarmCalendar").classList.add("Hidden");
                 document.getElementById("alarmDisplay").classList.add("Hidden");
             } else {
                 document.getElementById("alarm").classList.remove("Hidden");
+                document.getElementById("alarmCalendar").classList.remove("Hidden");
                 document.getElementById("alarmDisplay").classList.remove("Hidden");
                 const isRadioInstalled = json.isRadioInstalled || false;
                 if (!isRadioInstalled) {
@@ -92,12 +316,22 @@ function loadConfiguration() {
             const longitude = json.longitude || 0;
             document.getElementById("longitude").value = longitude;
 
+            const zoneName = json.zoneName || "";
+            document.getElementById("zoneName").value = zoneName;
+
             const timezone = json.timezone || "";
             document.getElementById("timezone").value = timezone;
+            document.getElementById("timezone").disabled = zoneName !== "";
 
+            // The offset is derived from the time zone by the clock.
             const offset = json.offset || 0;
             document.getElementById("offset").value = offset;
 
+            const mqttHost = json.mqttHost || "";
+            document.getElementById("mqttHost").value = mqttHost;
+            const mqttPort = json.mqttPort || 1883;
+            document.getElementById("mqttPort").value = mqttPort;
+
             const dayPattern = json.dayPattern || "SOLID_COLOUR";
             document.getElementById("dayPattern").value = dayPattern;
             document.getElementById("dayColour").value = colourArrayToHtmlColour(json.dayColour || "");
@@ -166,6 +400,21 @@ function configurationToJson() {
     const alarmMinute = parseInt(alarmTime.substring(3), 10) % 60;
     msg.alarmTime = (alarmHour * 60) + alarmMinute;
     msg.alarmActivation = document.getElementById("alarmActivation").value;
+    msg.wakeDuration = parseInt(document.getElementById("wakeDuration").value, 10);
+    msg.dayAlarmTimes = [];
+    for (let ii = 0; ii < DAY_NAMES.length; ii++) {
+        const dayTime = document.getElementById("alarmTime" + ii).value || "";
+        if (document.getElementById("alarmOff" + ii).checked) {
+            msg.dayAlarmTimes.push(-1);
+        } else if (dayTime.length < 5) {
+            msg.dayAlarmTimes.push(null);
+        } else {
+            msg.dayAlarmTimes.push((parseInt(dayTime.substring(0, 2), 10) % 24) * 60 +
+                (parseInt(dayTime.substring(3), 10) % 60));
+        }
+    }
+    msg.alarmStartDate = document.getElementById("alarmStartDate").value;
+    msg.alarmEndDate = document.getElementById("alarmEndDate").value;
     msg.isRadioInstalled = !document.getElementById("radioSettings").classList.contains("Hidden");
     if (msg.isRadioInstalled) {
         msg.radioFrequency = parseFloat(document.getElementById("radioFrequency").value);
@@ -176,14 +425,35 @@ function configurationToJson() {
     msg.is24Hour = document.getElementById("twentyFourHour").checked;
     msg.latitude = document.getElementById("latitude").value;
     msg.longitude = document.getElementById("longitude").value;
+    msg.zoneName = document.getElementById("zoneName").value.trim();
     msg.timezone = document.getElementById("timezone").value;
-    msg.offset = document.getElementById("offset").value;
+    msg.mqttHost = document.getElementById("mqttHost").value.trim();
+    msg.mqttPort = parseInt(document.getElementById("mqttPort").value, 10) || 1883;
     msg.dayPattern = document.getElementById("dayPattern").value;
     msg.dayColour = htmlColourToColourArray(document.getElementById("dayColour").value);
     msg.nightPattern = document.getElementById("nightPattern").value;
     msg.nightColour = htmlColourToColourArray(document.getElementById("nightColour").value);
     msg.alarmPattern = document.getElementById("alarmPattern").value;
     msg.alarmColour = htmlColourToColourArray(document.getElementById("alarmColour").value);
+    msg.powerBudget = parseInt(document.getElementById("powerBudget").value, 10) || 0;
+    msg.brightnessCaps = [];
+    for (let ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+        const start = document.getElementById("capStart" + ii).value || "";
+        if (start.length >= 5) {
+            msg.brightnessCaps.push({
+                start: (parseInt(start.substring(0, 2), 10) % 24) * 60 + (parseInt(start.substring(3), 10) % 60),
+                max: parseInt(document.getElementById("capMax" + ii).value, 10)
+            });
+        }
+    }
+    msg.calibration = {
+        gamma: ["gammaRed", "gammaGreen", "gammaBlue"].map((id) => parseFloat(document.getElementById(id).value) || 1),
+        whiteBalance: htmlColourToColourArray(document.getElementById("whiteBalance").value)
+    };
+    const ledGain = document.getElementById("ledGain").value.split(/[\s,]+/).filter((g) => g !== "");
+    if (ledGain.length === LED_COUNT) {
+        msg.calibration.ledGain = ledGain.map((g) => parseInt(g, 10));
+    }
     return JSON.stringify(msg, null, 2);
 }
 
@@ -319,13 +589,12 @@ async function uploadBackupConfiguration() {
     }
     if (backup.timezone === undefined ||
         backup.timezone.trim() === "" ||
-        backup.timezone.length > 20) {
+        backup.timezone.length > 28) {
         errors.push("Invalid timezone");
     }
-    if (!backup.offset instanceof Number ||
-        backup.offset < -12 ||
-        backup.offset > 12) {
-        errors.push("Invalid offset");
+    if (backup.zoneName !== undefined &&
+        (typeof backup.zoneName !== "string" || backup.zoneName.length > 31)) {
+        errors.push("Invalid time zone name");
     }
     verifyDisplay("day", backup.dayPattern, backup.dayColour, errors);
     verifyDisplay("night", backup.nightPattern, backup.nightColour, errors);
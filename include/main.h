@@ -9,21 +9,39 @@
 #include <WiFiManager.h>          //https://github.com/tzapu/WiFiManager WiFi Configuration Magic
 #include <IPAddress.h>
 #include <WiFiUdp.h>
+#include <PubSubClient.h>
 #include <Preferences.h>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <vector>
 
 // Time handling.
 #include <time.h>
 #include <sys/time.h>
 #include <esp_sntp.h>
+#include <esp_timer.h>
+
+// Buzzer tone generation.
+#include <driver/ledc.h>
 
 // #include <coredecls.h>
 #include <ArduinoOTA.h>
+#include <esp_task_wdt.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <ESPmDNS.h>
+#include <mbedtls/md.h>
 #include <RotaryEncoder.h>
-#include <JC_Button.h>
 #include <NeoPixelBus.h>
 #include <LittleFS.h>
 #include <sunset.h>
+#include <sun_table.h>
+#include <display_frame.h>
+#include <display_recording.h>
 #include <TEA5767.h>
+#include <radio_stations.h>
+#include <seqlock.h>
 
 // Web server.
 #define WEBSERVER_H
@@ -32,9 +50,49 @@
 #include <AsyncJson.h>
 #include <ArduinoJson.h>
 
+// The time zone database.
+#include "timezones.h"
+
 // Disables the writing the configuration to flash for rapid testing/debugging.
 // #define DISABLE_CONFIG_WRITES 1
 
+// The key shared by the fleet for signing configuration bundles and updates,
+// and the ArduinoOTA password, set with a build flag. Bundles and updates are
+// refused, and ArduinoOTA isn't started, when there is no key.
+#ifndef FLEET_KEY
+#define FLEET_KEY ""
+#endif
+
+// The levels of the event log.
+#define LOG_LEVEL_DEBUG   0
+#define LOG_LEVEL_INFO    1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR   3
+
+// The lowest level of event that is logged. Debug events come from hot paths
+// (e.g. the encoder), so they are compiled out unless this is lowered.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// The lowest level of logged event that is also written to the serial port.
+#ifndef LOG_SERIAL_LEVEL
+#define LOG_SERIAL_LEVEL LOG_LEVEL_WARNING
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(event, a, b) log_event(LOG_LEVEL_DEBUG, event, a, b)
+#else
+#define LOG_DEBUG(event, a, b)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(event, a, b) log_event(LOG_LEVEL_INFO, event, a, b)
+#else
+#define LOG_INFO(event, a, b)
+#endif
+#define LOG_WARNING(event, a, b) log_event(LOG_LEVEL_WARNING, event, a, b)
+#define LOG_ERROR(event, a, b) log_event(LOG_LEVEL_ERROR, event, a, b)
+
 // The version of the code, used for identification purposes.
 const char VERSION[] = "1.0";
 
@@ -85,13 +143,10 @@ const uint8_t PIN_NO_ALARM = 33;
 // The pin used for reading the light dependent resistor.
 const uint8_t PIN_LDR = 36;
 
-// The number of segments in a single digit.
-const uint8_t SEGMENTS_PER_DIGIT = 7;
-
-// The server to which debug UDP messages are sent.
+// The server to which telemetry UDP datagrams are sent.
 const IPAddress DEBUG_SERVER = IPAddress(10, 0, 1, 253);
 
-// The port on the server to which debug UDP messages are sent.
+// The port on the server to which telemetry UDP datagrams are sent.
 const uint16_t DEBUG_PORT = 65432;
 
 // Key used for storing and retrieving the configuration.
@@ -100,26 +155,177 @@ const char* KEY_CONFIG = "config";
 // The magic number to use for the configuration.
 const uint32_t MAGIC = 0xc10c0001;
 
+// Key used for storing and retrieving the last known time.
+const char* KEY_LAST_TIME = "lastTime";
+
+// The magic number marking the RTC memory time cache as valid.
+const uint32_t RTC_TIME_MAGIC = 0xc10c7100;
+
+// The magic number marking the alarm state in RTC memory and flash as valid.
+const uint32_t ALARM_STATE_MAGIC = 0xc10ca100;
+
+// Key used for storing and retrieving the alarm state.
+const char* KEY_ALARM_STATE = "alarmState";
+
+// Key used for storing and retrieving the number of alarms resumed after a
+// reset.
+const char* KEY_ALARMS_RECOVERED = "alarmsRecovered";
+
+// The longest reset (s) after which a waking, sounding or snoozing alarm is
+// resumed.
+const time_t ALARM_RESUME_WINDOW = 1800;
+
+// The number of times an alarm is resumed, in case it is causing the resets.
+const uint8_t ALARM_MAX_RECOVERIES = 3;
+
+// The time (s) the loop may stall before the task watchdog resets the clock.
+const uint32_t WATCHDOG_TIMEOUT = 10;
+
+// Key used for storing and retrieving the sequence of the last configuration
+// bundle, so that bundles can't be replayed.
+const char* KEY_FLEET_SEQUENCE = "fleetSeq";
+
+// Key used for storing and retrieving the sunrise/sunset table.
+const char* KEY_SUN_TABLE = "sunTable";
+
+// The days of the sunrise/sunset table calculated in each loop, so that a new
+// table doesn't hold up the display (or trip the watchdog).
+const uint16_t SUN_TABLE_DAYS_PER_LOOP = 4;
+
+// The earliest timestamp treated as a real time (2020-01-01T00:00:00Z).
+// Anything earlier means the system clock has not been set since power-on.
+const time_t MIN_VALID_TIMESTAMP = 1577836800;
+
 // The maximum length of the name of this device.
 const int DEVICE_NAME_MAX_LEN = 40;
 
+// The maximum length of the mDNS host name, derived from the device name.
+const int HOSTNAME_MAX_LEN = 32;
+
+// The mDNS service advertised by every clock, used to discover the fleet.
+const char* MDNS_SERVICE = "_espclock";
+
+// The length of a signature made with the fleet key (HMAC-SHA256, bytes).
+const size_t FLEET_SIGNATURE_LEN = 32;
+
+// The maximum length of a configuration bundle's payload (bytes).
+const size_t MAX_BUNDLE_PAYLOAD_LEN = 2048;
+
+// The maximum length of the MQTT broker's host name.
+const int MQTT_HOST_MAX_LEN = 63;
+
+// The default port of the MQTT broker.
+const uint16_t MQTT_DEFAULT_PORT = 1883;
+
+// The start of every MQTT topic, followed by the host name.
+const char* MQTT_TOPIC_PREFIX = "espclock";
+
+// The maximum length of an MQTT topic.
+const size_t MQTT_TOPIC_LEN = 96;
+
+// The maximum length of an outgoing MQTT payload.
+const size_t MQTT_PAYLOAD_LEN = 48;
+
+// The stack size (bytes) of the MQTT task.
+const uint32_t MQTT_TASK_STACK_SIZE = 4096;
+
+// The priority of the MQTT task.
+const UBaseType_t MQTT_TASK_PRIORITY = 1;
+
+// The time between checks of the MQTT connection and queue (ms).
+const uint32_t MQTT_POLL_INTERVAL = 20;
+
+// The first and longest delays before reconnecting to the broker (ms).
+const uint32_t MQTT_MIN_RETRY = 1000;
+const uint32_t MQTT_MAX_RETRY = 60000;
+
 // The maximum length of a timezone name.
 const int TIMEZONE_MAX_LEN = 28;
 
+// The maximum length of an IANA time zone name, e.g. "America/Argentina/Ushuaia".
+const int ZONE_NAME_MAX_LEN = 31;
+
+// The daylight saving shift (hours) when a POSIX rule doesn't give one.
+const double DEFAULT_DST_SHIFT = 1;
+
 // The amount of time (in seconds) to wait for a network connections before 
 // starting the configuration server,
 const unsigned long CONFIG_TIMEOUT = 300;
 
+// The time allowed for each attempt to connect to WiFi (ms).
+const unsigned long WIFI_CONNECT_TIMEOUT = 15000;
+
+// The first and longest delays before retrying the WiFi connection (ms).
+const unsigned long WIFI_MIN_BACKOFF = 1000;
+const unsigned long WIFI_MAX_BACKOFF = 300000;
+
+// The failed WiFi connections in a row before the configuration portal is
+// started, in case the network has changed.
+const uint8_t WIFI_PORTAL_FAILURES = 8;
+
+// The port used by ArduinoOTA.
+const uint16_t OTA_PORT = 8266;
+
+// Key used for storing and retrieving the number of boots of an OTA update
+// that hasn't yet been confirmed as working (0 = confirmed).
+const char* KEY_OTA_BOOTS = "otaBoots";
+
+// The boots allowed for an OTA update to be confirmed before rolling back.
+const uint8_t OTA_MAX_BOOTS = 3;
+
+// The time (ms) that an OTA update must run to be confirmed as working.
+const unsigned long OTA_CONFIRM_TIME = 60000;
+
+// The slowest that the loop may run on average, as a multiple of LOOP_DELAY,
+// for an OTA update to be confirmed as working.
+const uint32_t OTA_CONFIRM_LOOP_FACTOR = 2;
+
+// The length of the SHA-256 digest of an uploaded update (bytes).
+const size_t OTA_DIGEST_LEN = 32;
+
+// The boot count recorded when an OTA update has been rolled back.
+const uint8_t OTA_ROLLED_BACK = 0xff;
+
+// The error logged when an uploaded update doesn't match its digest.
+const int32_t OTA_VERIFY_ERROR = -1;
+
+// The error logged when an update's upload is abandoned.
+const int32_t OTA_ABANDONED_ERROR = -2;
+
+// Key used for storing and retrieving the last access point connected to.
+const char* KEY_WIFI_CACHE = "wifiCache";
+
+// The magic number marking the cached access point as valid.
+const uint32_t WIFI_CACHE_MAGIC = 0xc10c0f1f;
+
 // The amount of time (in milliseconds) that the user has to hold a button for
 // before it is counted as a long press.
 const uint32_t LONG_PRESS_INTERVAL = 2000;
 
 // The amount of time (in milliseconds) to wait after a click for a 
-// double-click to be triggered.
+// double-click (or triple-click) to be triggered.
 const uint32_t DOUBLE_CLICK_INTERVAL = 300;
 
-// THe number of milliseconds to wait between loop executions.
-const uint32_t LOOP_DELAY = 10;
+// The time (in milliseconds) between repeats while the button is held after
+// a long press.
+const uint32_t HOLD_REPEAT_INTERVAL = 500;
+
+// The time (in milliseconds) that the button must be stable for before a
+// press or release is accepted.
+const uint32_t BUTTON_DEBOUNCE_TIME = 20;
+
+// The number of button edges that can be queued by the button interrupt.
+const uint32_t BUTTON_QUEUE_SIZE = 16;
+
+// The number of encoder acceleration levels.
+const uint8_t ENCODER_ACCELERATION_LEVELS = 3;
+
+// The longest time (in milliseconds) between encoder detents for each
+// acceleration level, fastest first.
+const uint32_t ENCODER_ACCELERATION_INTERVALS[ENCODER_ACCELERATION_LEVELS] = { 15, 30, 60 };
+
+// The amount each detent counts for at each acceleration level.
+const uint8_t ENCODER_ACCELERATION_MULTIPLIERS[ENCODER_ACCELERATION_LEVELS] = { 10, 4, 2 };
 
 // The number of loops to go through before the show alarm state ends.
 const uint32_t SHOW_ALARM_COUNTDOWN = 3 * (1000 / LOOP_DELAY);
@@ -133,8 +339,33 @@ const uint32_t SHOW_CANCEL_COUNTDOWN = 3 * (1000 / LOOP_DELAY);
 // The number of loops to go through before an introduction state ends.
 const uint32_t SHOW_INTRO_COUNTDOWN = 3 * (1000 / LOOP_DELAY);
 
-// The number of loops to go through showing an IP number.
-static const uint8_t SHOW_IP_COUNTDOWN = (1000 / LOOP_DELAY);
+// The maximum length of a message for the display.
+const uint8_t MESSAGE_MAX_LEN = 63;
+
+// The number of messages that can be waiting for the display.
+const uint8_t MESSAGE_SLOTS = 4;
+
+// The number of messages that can be posted before the main loop takes them.
+const uint8_t MESSAGE_QUEUE_SIZE = 8;
+
+// The highest message priority. Higher priority messages are shown first.
+const uint8_t MAX_MESSAGE_PRIORITY = 9;
+
+// The priority of messages posted through the web API or MQTT by default.
+const uint8_t MESSAGE_PRIORITY_DEFAULT = 5;
+
+// The priority of messages from the clock itself, e.g. its IP address.
+const uint8_t MESSAGE_PRIORITY_SYSTEM = 8;
+
+// The default and maximum times that a message is kept (seconds).
+const uint16_t MESSAGE_DEFAULT_DURATION = 10;
+const uint16_t MAX_MESSAGE_DURATION = 3600;
+
+// The time (ms) between each step of a scrolling message.
+const uint32_t MESSAGE_SCROLL_INTERVAL = 350;
+
+// The number of blank digits between repeats of a scrolling message.
+const uint8_t MESSAGE_SCROLL_GAP = 3;
 
 // The alarm duration after which the alarm is stopped automatically (seconds).
 const uint16_t ALARM_DURATION = 600;
@@ -145,12 +376,37 @@ const uint16_t SNOOZE_DURATION = 300;
 // The maximum allowed snooze value.
 const uint16_t MAX_SNOOZE = 5999;
 
+// The shortest wake-up light ramp before the alarm (minutes, 0 = no ramp).
+const uint8_t MIN_WAKE_DURATION = 5;
+
+// The longest wake-up light ramp before the alarm (minutes).
+const uint8_t MAX_WAKE_DURATION = 30;
+
+// The number of points on the wake-up light curve.
+const uint8_t WAKE_CURVE_POINTS = 6;
+
 // The minimum tunable radio frequency (Hz).
 const uint16_t MIN_RADIO_FREQUENCY = 88;
 
 // The maximum tunable radio frequency (Hz).
 const uint16_t MAX_RADIO_FREQUENCY = 107;
 
+// The number of radio station presets kept in the configuration.
+const uint8_t RADIO_PRESET_COUNT = 6;
+
+// The time (in milliseconds) to let the radio settle after tuning, before
+// reading the signal level.
+const uint32_t RADIO_SETTLE_TIME = 50;
+
+// The number of requests that may be waiting for the radio task.
+const uint8_t RADIO_QUEUE_SIZE = 8;
+
+// The stack size (bytes) of the radio task.
+const uint32_t RADIO_TASK_STACK_SIZE = 4096;
+
+// The priority of the radio task.
+const UBaseType_t RADIO_TASK_PRIORITY = 1;
+
 // The maximum brightness read from the LDR.
 const uint16_t MAX_BRIGHTNESS_INPUT = 4095;
 
@@ -166,6 +422,41 @@ const float MAX_BRIGHTNESS_F = (float)MAX_BRIGHTNESS;
 // The number of loops to go through between brightness checks.
 const int32_t BRIGHTNESS_CHECK_COUNTDOWN = 10;
 
+// The number of time-of-day brightness caps.
+const uint8_t BRIGHTNESS_CAP_COUNT = 4;
+
+// The start minute of an unused brightness cap.
+const uint16_t BRIGHTNESS_CAP_UNUSED = 0xffff;
+
+// The smallest and largest calibration gamma values (tenths).
+const uint8_t MIN_GAMMA = 5;
+const uint8_t MAX_GAMMA = 30;
+
+// The default limit on the current drawn by the LEDs (mA).
+const uint16_t DEFAULT_POWER_BUDGET = 1500;
+
+// The lowest limit on the current drawn by the LEDs (mA), other than 0 for
+// no limit.
+const uint16_t MIN_POWER_BUDGET = 100;
+
+// The day/night blend value for full night.
+const uint8_t BLEND_NIGHT = 0;
+
+// The day/night blend value for full day.
+const uint8_t BLEND_DAY = 255;
+
+// The day/night blend value above which the daytime pattern is used.
+const uint8_t BLEND_DAY_THRESHOLD = 128;
+
+// The number of slots in the command queue (must be a power of 2).
+const uint32_t COMMAND_QUEUE_SIZE = 16;
+
+// The default time (in seconds) to preview a pattern for.
+const uint16_t PREVIEW_DURATION = 10;
+
+// The maximum time (in seconds) to preview a pattern for.
+const uint16_t MAX_PREVIEW_DURATION = 60;
+
 // The number of hours in a day.
 const uint8_t HOURS_PER_DAY = 24;
 
@@ -184,9 +475,6 @@ const double LATITUDE = -31.9514;
 // The longitude for sunrise/sunset calculations.
 const double LONGITUDE = 115.8617;
 
-// The timezone offset for sunrise/sunset calculations.
-const double TZ_OFFSET = 8;
-
 // The time zone for time calculations.
 const char* TIMEZONE = "AWST-8";
 
@@ -196,81 +484,148 @@ const int WDAY_SUNDAY = 0;
 // The value for TM_WDAY for Saturday.
 const int WDAY_SATURDAY = 6;
 
-// The number of LEDs to use for the display.
-const uint16_t LED_COUNT = 32;
+// The number of days in a week.
+const uint8_t DAYS_PER_WEEK = 7;
 
-// Black (off) colour used for the LED display.
-static const HslColor BLACK(RgbColor(0, 0, 0));
+// The per-weekday alarm time for a day that uses the main alarm time.
+const uint16_t ALARM_TIME_DEFAULT = 0xffff;
 
-// Menu bright colour. Used in pulsing animation and setting value.
-static const HslColor MENU_BRIGHT(RgbColor(255));
+// The per-weekday alarm time for a day without an alarm.
+const uint16_t ALARM_TIME_NONE = 0xfffe;
 
-// Menu dim colour. Used in pulsing animation.
-static const HslColor MENU_DIM(RgbColor(64));
+// The number of days searched for the next alarm.
+const uint16_t ALARM_LOOKAHEAD_DAYS = 400;
 
-// Pure red colour.
-static const HslColor COLOUR_R(RgbColor(255, 0, 0));
+// The number of permittable alarm patterns, excluding the menu pattern.
+static const uint8_t ALARM_PATTERN_COUNT = 4;
 
-// Pure red colour.
-static const HslColor COLOUR_G(RgbColor(0, 255, 0));
+// The maximum animation period of a custom pattern (loops).
+const uint16_t MAX_PATTERN_PERIOD = 60 * (1000 / LOOP_DELAY);
 
-// Pure red colour.
-static const HslColor COLOUR_B(RgbColor(0, 0, 255));
+// The marker for a custom pattern stored in LittleFS.
+const uint32_t PATTERN_MAGIC = 0xc10c9a70;
 
-// The amount the hue will change between each digit.
-static const float DIGIT_GROUP_MULTIPLIER = 1.0f / 6.0f;
+// The LittleFS directory holding the custom patterns.
+const char *PATTERN_DIR = "/patterns";
 
-// The amount the hue will change between each segment.
-static const float SEGMENT_MULTIPLIER = 1.0f / 32.0f;
+// The number of frames rendered when timing a custom pattern.
+const uint8_t PATTERN_BENCHMARK_FRAMES = 8;
 
-// The amount the hue will change for a full digit pattern each step.
-static const float DIGIT_COLOUR_STEP = 0.005;
+// The longest time that a custom pattern may take to render all LEDs (us).
+const uint32_t MAX_PATTERN_RENDER_TIME = 1000;
 
-// The amount the hue will change for each segment pattern each step.
-static const float SEGMENT_COLOUR_STEP = 0.002;
+// The number of event log entries held in RAM before being written to flash.
+const uint32_t LOG_RAM_ENTRIES = 128;
 
-// The number of animation steps that a flashing pattern is on.
-static const int FLASH_ON_STEPS = (750 / LOOP_DELAY);
+// The number of event log entries kept in the log file.
+const uint32_t LOG_FILE_ENTRIES = 2048;
 
-// The number of animation steps that a flashing pattern is off.
-static const int FLASH_OFF_STEPS = (250 / LOOP_DELAY);
+// The LittleFS file holding the dates on which the alarm is skipped, as a
+// sorted array of uint32_t YYYYMMDD values.
+const char *SKIP_DATES_FILE = "/skip.bin";
 
-// The number of animation steps for each half of a pulse sequence.
-static const int PULSE_STEPS = (1000 / LOOP_DELAY);
+// The LittleFS file that a new list of skipped dates is written to, before
+// replacing the current list.
+const char *SKIP_DATES_TEMP_FILE = "/skip.tmp";
 
-// The maximum animation step when flashing before it restarts.
-static const int MAX_ANIMATION_STEP_FLASH = FLASH_ON_STEPS + FLASH_OFF_STEPS;
+// The maximum number of dates on which the alarm can be skipped.
+const uint16_t MAX_SKIP_DATES = 512;
 
-// The maximum animation step when pulsing before it restarts.
-static const int MAX_ANIMATION_STEP_PULSE = 2 * PULSE_STEPS;
+// The event log file in LittleFS.
+const char *LOG_FILE = "/log.bin";
 
-// The maximum animation step when showing rainbow digits before it restarts.
-static const int MAX_ANIMATION_STEP_RAINBOW_DIGITS = 1.0f / DIGIT_COLOUR_STEP;
+// The marker at the start of the event log file.
+const uint32_t LOG_MAGIC = 0xc10c1060;
 
-// The maximum animation step when showing rainbow segments before it restarts.
-static const int MAX_ANIMATION_STEP_RAINBOW_SEGMENTS = 1.0f / SEGMENT_COLOUR_STEP;
+// The longest time (in milliseconds) that events are held in RAM.
+const uint32_t LOG_FLUSH_INTERVAL = 60000;
 
-// The number of permittable alarm patterns, excluding the menu pattern.
-static const uint8_t ALARM_PATTERN_COUNT = 4;
+// The longest line written when the event log is downloaded as text.
+const size_t LOG_LINE_LEN = 112;
 
-// The number of ticks in a short (on or off) duration.
-const uint8_t BUZZER_SHORT_TICK_COUNT = 60 / LOOP_DELAY;
-
-// The number of ticks in a long (on or off) duration.
-const uint8_t BUZZER_LONG_TICK_COUNT = 540 / LOOP_DELAY;
-
-// The number of ticks for each step in a buzzer sequence.
-const uint8_t BUZZER_STEP_TICKS[] = {
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_SHORT_TICK_COUNT,
-    BUZZER_LONG_TICK_COUNT
-};
-const uint8_t BUZZER_STEP_COUNT = 8;
+// The most event log entries read from the log file for each chunk sent to a
+// web client.
+const uint8_t LOG_STREAM_ENTRIES = 8;
+
+// The shortest time between telemetry datagrams (ms, 0 = no telemetry).
+const uint16_t MIN_TELEMETRY_INTERVAL = 100;
+
+// The longest time between telemetry datagrams (ms), limited so that a
+// second's records fit in a single datagram.
+const uint16_t MAX_TELEMETRY_INTERVAL = 1000;
+
+// The space for telemetry records in each datagram (bytes).
+const size_t TELEMETRY_BUFFER_SIZE = 1200;
+
+// The marker at the start of each telemetry datagram.
+const uint32_t TELEMETRY_MAGIC = 0xc10c7e1e;
+
+// The stack size (bytes) of the telemetry task.
+const uint32_t TELEMETRY_TASK_STACK_SIZE = 3072;
+
+// The priority of the telemetry task.
+const UBaseType_t TELEMETRY_TASK_PRIORITY = 1;
+
+// The loops between samples of the heap and task stacks.
+const uint32_t MEMORY_CHECK_LOOPS = 5 * (1000 / LOOP_DELAY);
+
+// The free heap (bytes) below which the web server is degraded.
+const uint32_t MEMORY_LOW_FREE_HEAP = 24 * 1024;
+
+// The largest free block (bytes) below which the web server is degraded.
+const uint32_t MEMORY_LOW_LARGEST_BLOCK = 8 * 1024;
+
+// The free heap (bytes) above which the web server is restored, which is
+// higher than MEMORY_LOW_FREE_HEAP to avoid flapping.
+const uint32_t MEMORY_RECOVERED_FREE_HEAP = 32 * 1024;
+
+// The largest free block (bytes) above which the web server is restored.
+const uint32_t MEMORY_RECOVERED_LARGEST_BLOCK = 12 * 1024;
+
+// The unused stack (bytes) below which a task's stack is reported as low.
+const int32_t STACK_LOW_WATERMARK = 512;
+
+// The LEDC speed mode used for the buzzer.
+const ledc_mode_t BUZZER_LEDC_MODE = LEDC_LOW_SPEED_MODE;
+
+// The LEDC timer used to generate the buzzer tone.
+const ledc_timer_t BUZZER_LEDC_TIMER = LEDC_TIMER_0;
+
+// The LEDC channel used to drive the buzzer pin.
+const ledc_channel_t BUZZER_LEDC_CHANNEL = LEDC_CHANNEL_0;
+
+// The duty cycle resolution of the buzzer PWM.
+const ledc_timer_bit_t BUZZER_DUTY_RESOLUTION = LEDC_TIMER_10_BIT;
+
+// The duty cycle at full volume (50%, the loudest for a piezo buzzer).
+const uint32_t BUZZER_MAX_DUTY = 512;
+
+// The frequency (Hz) of the buzzer tone when not otherwise specified.
+const uint16_t BUZZER_DEFAULT_FREQUENCY = 2700;
+
+// The minimum frequency (Hz) that the buzzer can be driven at.
+const uint16_t BUZZER_MIN_FREQUENCY = 100;
+
+// The maximum frequency (Hz) that the buzzer can be driven at.
+const uint16_t BUZZER_MAX_FREQUENCY = 20000;
+
+// The maximum number of steps in a buzzer tone pattern.
+const uint8_t MAX_TONE_STEPS = 16;
+
+// The buzzer pattern for the alarm, "frequency:duration[:volume[>volume]]"
+// steps. A frequency of 0 is silence, a second volume fades to that volume
+// over the step, and durations are in milliseconds.
+const char* BUZZER_ALARM_TONES = 
+    "2700:60 0:60 2700:60 0:60 2700:60 0:60 2700:60 0:540";
+
+// The volume level that the alarm starts at.
+const uint8_t BUZZER_ALARM_START_LEVEL = 96;
+
+// The volume level increase each time the alarm pattern repeats.
+const uint8_t BUZZER_ALARM_LEVEL_STEP = 8;
+
+// The buzzer pattern played as feedback when the encoder is turned.
+const char* BUZZER_CLICK_TONES = "2700:5:128";
 
 // The font index to use for the "A" character.
 const uint8_t FONT_A = 10;
@@ -314,73 +669,49 @@ const uint8_t FONT_DASH = 22;
 // The font index to use for blank (empty) character.
 const uint8_t FONT_BLANK = 23;
 
-//      a 
-//     --- 
-//  f | g | b
-//     ---
-//  e |   | c
-//     ---
-//      d
-// Font digit bit order:  Xgfedcba
-const uint8_t FONT[] = {0b00111111, // 0
-                        0b00000110, // 1
-                        0b01011011, // 2
-                        0b01001111, // 3
-                        0b01100110, // 4
-                        0b01101101, // 5
-                        0b01111101, // 6
-                        0b00000111, // 7
-                        0b01111111, // 8
-                        0b01101111, // 9
-                        0b01110111, // A
-                        0b01111100, // b
-                        0b01011000, // c
-                        0b01011110, // d
-                        0b01111001, // E
-                        0b01110001, // F
-                        0b00111101, // G
-                        0b01110110, // H
-                        0b00000100, // i
-                        0b00111000, // L
-                        0b01010100, // n
-                        0b01010000, // r
-                        0b01000000, // -
-                        0b00000000, // (blank)
-                        };
-
-const uint8_t FONT_SEGMENT_ORDER[][7] = {{0, 1, 2, 3, 4, 5, 9}, // 0
-                                         {9, 0, 1, 9, 9, 9, 9}, // 1
-                                         {0, 1, 9, 4, 3, 9, 2}, // 2
-                                         {0, 1, 3, 4, 9, 9, 2}, // 3
-                                         {9, 0, 2, 9, 9, 0, 1}, // 4
-                                         {0, 9, 3, 4, 9, 1, 2}, // 5
-                                         {0, 9, 3, 4, 5, 1, 2}, // 6
-                                         {0, 1, 2, 9, 9, 9, 9}, // 7
-                                         {0, 1, 2, 3, 4, 5, 6}, // 8
-                                         {2, 3, 4, 5, 9, 1, 0}, // 9
-                                         {2, 3, 4, 9, 0, 1, 5}, // A
-                                         {9, 9, 2, 3, 4, 0, 1}, // b
-                                         {9, 9, 9, 0, 1, 9, 2}, // c
-                                         {9, 0, 1, 2, 3, 9, 4}, // d
-                                         {0, 9, 9, 4, 3, 0, 1}, // E
-                                         {0, 9, 9, 9, 3, 0, 1}, // F
-                                         {0, 9, 4, 3, 2, 1, 9}, // G
-                                         {9, 3, 4, 9, 1, 0, 2}, // H
-                                         {9, 9, 0, 9, 9, 9, 9}, // i
-                                         {9, 9, 9, 2, 1, 0, 9}, // L
-                                         {9, 9, 2, 9, 0, 9, 1}, // n
-                                         {9, 9, 9, 9, 0, 9, 1}, // r
-                                         {9, 9, 9, 9, 9, 9, 0}, // -
-                                         {9, 9, 9, 9, 9, 9, 9}  // (blank)
-                                        };
+// The font index to use for the "C" character.
+const uint8_t FONT_UPPER_C = 24;
+
+// The font index to use for the "h" character.
+const uint8_t FONT_LOWER_H = 25;
+
+// The font index to use for the "J" character.
+const uint8_t FONT_J = 26;
+
+// The font index to use for the "o" character.
+const uint8_t FONT_O = 27;
+
+// The font index to use for the "P" character.
+const uint8_t FONT_P = 28;
+
+// The font index to use for the "q" character.
+const uint8_t FONT_Q = 29;
+
+// The font index to use for the "t" character.
+const uint8_t FONT_T = 30;
+
+// The font index to use for the "U" character.
+const uint8_t FONT_U = 31;
+
+// The font index to use for the "u" character.
+const uint8_t FONT_LOWER_U = 32;
+
+// The font index to use for the "y" character.
+const uint8_t FONT_Y = 33;
+
+// The font index to use for the "_" character, also used for ".".
+const uint8_t FONT_UNDERSCORE = 34;
+
+// The font index to use for the degree symbol.
+const uint8_t FONT_DEGREE = 35;
+
+// The font index to use for the "=" character.
+const uint8_t FONT_EQUALS = 36;
 
 // The states that the clock may be in.
 typedef enum {
     INITIALISING,
-    SHOW_IP_1,
-    SHOW_IP_2,
-    SHOW_IP_3,
-    SHOW_IP_4,
+    SHOW_MESSAGE,
     RUNNING,
     SHOW_ALARM,
     SHOW_SNOOZE,
@@ -405,35 +736,36 @@ typedef enum {
 
 typedef enum {
     INACTIVE,
+    WAKING,
     ACTIVE,
     SNOOZE
 } alarm_state_t;
 
+const char* ALARM_STATE_STRINGS[] = {
+    "INACTIVE",
+    "WAKING",
+    "ACTIVE",
+    "SNOOZE"
+};
+
 // The setting values for the alarm.
 typedef enum {
     ALARM_DISABLED,
     ONE_TIME,
     WEEKDAYS,
-    ALL_DAYS
+    ALL_DAYS,
+    CALENDAR   // A time (or no alarm) for each day of the week.
 } alarm_t;
 
 const char* ALARM_STRINGS[] = {
     "ALARM_DISABLED",
     "ONE_TIME",
     "WEEKDAYS",
-    "ALL_DAYS"
+    "ALL_DAYS",
+    "CALENDAR"
 };
 
-const int MAX_ALARM_T_INDEX = static_cast<int>(alarm_t::ALL_DAYS);
-
-typedef enum {
-    SOLID_COLOUR,
-    RAINBOW_DIGITS,
-    RAINBOW_SEGMENTS,
-    FLASHING,
-    PULSING,
-    MENU
-} display_pattern_t;
+const int MAX_ALARM_T_INDEX = static_cast<int>(alarm_t::CALENDAR);
 
 const char* DISPLAY_PATTERN_STRINGS[] = {
     "SOLID_COLOUR",
@@ -441,17 +773,167 @@ const char* DISPLAY_PATTERN_STRINGS[] = {
     "RAINBOW_SEGMENTS",
     "FLASHING",
     "PULSING",
+    "CUSTOM_1",
+    "CUSTOM_2",
+    "CUSTOM_3",
+    "CUSTOM_4",
     "MENU"
 };
 
 const int MAX_DISPLAY_PATTERN_INDEX = static_cast<int>(display_pattern_t::MENU);
 
-// Colour structure used in the configuration.
+// The actions that can be requested of the main loop by other tasks.
+typedef enum {
+    START_ALARM,
+    SNOOZE_ALARM,
+    STOP_ALARM,
+    PREVIEW_PATTERN,
+    SCAN_RADIO,
+    START_RECORDING,
+    STOP_RECORDING,
+    // Internal commands, not available through the web server.
+    RADIO_FALLBACK,
+    LOAD_PATTERN,
+    RELOAD_SKIP_DATES
+} command_type_t;
+
+const char* COMMAND_STRINGS[] = {
+    "START_ALARM",
+    "SNOOZE_ALARM",
+    "STOP_ALARM",
+    "PREVIEW_PATTERN",
+    "SCAN_RADIO",
+    "START_RECORDING",
+    "STOP_RECORDING"
+};
+
+const int MAX_COMMAND_INDEX = static_cast<int>(command_type_t::STOP_RECORDING);
+
+const char* PATTERN_OP_STRINGS[] = {
+    "SET",
+    "TRI",
+    "ADD",
+    "SUB",
+    "MUL",
+    "DIV",
+    "MOD",
+    "MIN",
+    "MAX",
+    "STEP"
+};
+
+const int MAX_PATTERN_OP_INDEX = static_cast<int>(pattern_op_code_t::OP_STEP);
+
+const char* PATTERN_REGISTER_STRINGS[] = {
+    "LED",
+    "GROUP",
+    "PHASE",
+    "FRAME",
+    "H",
+    "S",
+    "L",
+    "T0",
+    "T1",
+    "T2",
+    "T3"
+};
+
+const int MAX_PATTERN_REGISTER_INDEX = static_cast<int>(pattern_register_t::REG_T3);
+
+// The events recorded in the event log. Each has up to two numeric values.
+typedef enum {
+    EVENT_STARTED,
+    EVENT_TIME_RESTORED,
+    EVENT_NTP_TIME,
+    EVENT_CONFIG_CHANGED,
+    EVENT_ALARM_STARTED,
+    EVENT_ALARM_SNOOZED,
+    EVENT_ALARM_STOPPED,
+    EVENT_WAKE_STARTED,
+    EVENT_RADIO_POOR_RECEPTION,
+    EVENT_RADIO_SCANNED,
+    EVENT_RADIO_FALLBACK,
+    EVENT_PATTERN_INVALID,
+    EVENT_OTA_STARTED,
+    EVENT_OTA_FAILED,
+    EVENT_ROTATED,
+    EVENT_GESTURE,
+    EVENT_COUNTDOWN_EXPIRED,
+    EVENT_LOG_LOST,
+    EVENT_MEMORY_LOW,
+    EVENT_MEMORY_RECOVERED,
+    EVENT_STACK_LOW,
+    EVENT_BUNDLE_APPLIED,
+    EVENT_BUNDLE_REJECTED,
+    EVENT_WIFI_CONNECTED,
+    EVENT_WIFI_DISCONNECTED,
+    EVENT_WIFI_PORTAL,
+    EVENT_OTA_COMPLETE,
+    EVENT_OTA_CONFIRMED,
+    EVENT_OTA_ROLLED_BACK,
+    EVENT_ALARM_RECOVERED,
+    EVENT_TONE_TIMER_FAILED,
+    EVENT_MENU_CONFIG_KEPT
+} log_event_t;
+
+// The descriptions of the events, formatted with the event's two values.
+const char* LOG_EVENT_STRINGS[] = {
+    "Clock started, reset reason %ld, boot took %ld ms",
+    "Restored cached time %ld",
+    "Received NTP time %ld in state %ld",
+    "Configuration changed",
+    "Alarm started",
+    "Alarm snoozed for %ld s",
+    "Alarm stopped",
+    "Wake-up light started for %ld minutes",
+    "Poor radio reception on %ld (level %ld)",
+    "Radio scan found %ld stations",
+    "Radio unavailable, using the buzzer",
+    "Ignored invalid pattern in slot %ld",
+    "OTA update started (command %ld, source %ld)",
+    "OTA update failed, error %ld (source %ld)",
+    "Encoder rotated by %ld (x%ld)",
+    "Button gesture %ld in state %ld",
+    "Countdown expired in state %ld",
+    "%ld events were lost",
+    "Memory low (free %ld, largest block %ld), web server degraded",
+    "Memory recovered (free %ld, largest block %ld)",
+    "Task %ld stack low, %ld bytes unused",
+    "Applied configuration bundle %ld",
+    "Rejected configuration bundle %ld (HTTP %ld)",
+    "WiFi connected in %ld ms (RSSI %ld)",
+    "WiFi disconnected after %ld s, retrying in %ld ms",
+    "WiFi configuration portal started after %ld failures",
+    "OTA update of %ld bytes complete, restarting once the alarm is inactive",
+    "OTA update confirmed after %ld boots",
+    "OTA update failed to start %ld times, rolled back",
+    "Alarm resumed in state %ld after a %ld s reset",
+    "Buzzer timer failed to start, error %ld",
+    "Configuration written while the menu was open, keeping the menu's changes"
+};
+
+const int MAX_LOG_EVENT_INDEX = static_cast<int>(log_event_t::EVENT_MENU_CONFIG_KEPT);
+
+// The names of the log levels.
+const char* LOG_LEVEL_STRINGS[] = {
+    "DEBUG",
+    "INFO",
+    "WARNING",
+    "ERROR"
+};
+
+// The requests that can be made of the radio task.
+typedef enum {
+    RADIO_PLAY,
+    RADIO_MUTE,
+    RADIO_SCAN
+} radio_request_type_t;
+
+// A cap on the display's brightness from a time of day, until the next cap.
 typedef struct {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-} colour_t;
+    uint16_t startMinute;       // BRIGHTNESS_CAP_UNUSED = unused.
+    uint8_t maxBrightness;
+} brightness_cap_t;
 
 // The configuration for the clock.
 typedef struct {
@@ -476,6 +958,351 @@ typedef struct {
     bool is24Hour;
     bool isUseRadio;
     char version[VERSION_LEN + 1];
+    uint16_t radioPresets[RADIO_PRESET_COUNT];
+    uint8_t wakeDuration;
+    uint16_t telemetryInterval;
+    char mqttHost[MQTT_HOST_MAX_LEN + 1]; // Empty = no MQTT.
+    uint16_t mqttPort;
+    uint16_t dayAlarmTimes[DAYS_PER_WEEK]; // Sunday first, for CALENDAR alarms.
+    uint32_t alarmStartDate;   // YYYYMMDD, 0 = no start date.
+    uint32_t alarmEndDate;     // YYYYMMDD, 0 = no end date.
+    char zoneName[ZONE_NAME_MAX_LEN + 1]; // Empty = use the timezone rule.
+    calibration_t calibration;
+    brightness_cap_t brightnessCaps[BRIGHTNESS_CAP_COUNT];
+    uint16_t powerBudget;      // The LED current limit (mA), 0 = unlimited.
 } flash_config_t;
 
+// An action queued for the main loop to execute.
+typedef struct {
+    command_type_t type;
+    display_pattern_t pattern;
+    colour_t colour;
+    uint16_t duration;
+    uint8_t slot;
+    int64_t receivedTime;
+} command_t;
+
+// A single slot in the command queue. The sequence number tells producers
+// when the slot is free, and the consumer when it has been filled.
+typedef struct {
+    std::atomic<uint32_t> sequence;
+    command_t command;
+} command_slot_t;
+
+// Statistics on the commands executed by the main loop. Latencies are in
+// microseconds, from the request being received to the command executing.
+typedef struct {
+    std::atomic<uint32_t> executed;
+    std::atomic<uint32_t> dropped;
+    std::atomic<uint32_t> lastLatency;
+    std::atomic<uint32_t> averageLatency;
+    std::atomic<uint32_t> maxLatency;
+} command_stats_t;
+
+// A request for the radio task. The frequencies are tried in order when
+// playing, with 0 marking unused entries.
+typedef struct {
+    radio_request_type_t type;
+    uint16_t frequencies[RADIO_PRESET_COUNT + 1];
+} radio_request_t;
+
+// Statistics on the I2C transactions with the radio. Latencies are in
+// microseconds.
+typedef struct {
+    std::atomic<uint32_t> transactions;
+    std::atomic<uint32_t> averageLatency;
+    std::atomic<uint32_t> maxLatency;
+} i2c_stats_t;
+
+// A single step in a buzzer tone pattern.
+typedef struct {
+    uint16_t frequency;
+    uint16_t duration;
+    uint8_t volume;
+    uint8_t endVolume;
+} tone_step_t;
+
+// A compiled buzzer tone pattern. Repeating patterns get louder by levelStep
+// each time they repeat, starting from startLevel.
+typedef struct {
+    tone_step_t steps[MAX_TONE_STEPS];
+    uint8_t count;
+    bool repeat;
+    uint8_t startLevel;
+    uint8_t levelStep;
+} tone_pattern_t;
+
+// An edge on the button, recorded by the button interrupt.
+typedef struct {
+    uint32_t time;  // The time of the edge (microseconds, wrapping).
+    uint8_t level;  // The level of the button pin after the edge.
+} button_event_t;
+
+// The MQTT topics published, each under "espclock/<hostname>/".
+typedef enum {
+    MQTT_STATUS,
+    MQTT_ALARM,
+    MQTT_BRIGHTNESS,
+    MQTT_DAYTIME
+} mqtt_topic_t;
+
+const char* MQTT_TOPIC_STRINGS[] = {
+    "status",
+    "alarm",
+    "brightness",
+    "daytime"
+};
+
+const int MAX_MQTT_TOPIC_INDEX = static_cast<int>(mqtt_topic_t::MQTT_DAYTIME);
+
+// An outgoing MQTT message, waiting for the broker.
+typedef struct {
+    uint8_t topic;    // mqtt_topic_t
+    bool retain;
+    char payload[MQTT_PAYLOAD_LEN];
+} mqtt_message_t;
+
+// The latest message for an MQTT topic. Only the latest value of each topic
+// is kept while the broker is unreachable, as they are all retained state.
+typedef struct {
+    mqtt_message_t message;
+    uint32_t version;  // Incremented whenever the message is replaced.
+    bool isPending;    // Set until the message has been sent.
+} mqtt_slot_t;
+
+// The statistics for the MQTT client.
+typedef struct {
+    std::atomic<uint32_t> published;
+    std::atomic<uint32_t> dropped;    // Replaced by a newer value before being sent.
+    std::atomic<uint32_t> connects;
+    std::atomic<uint32_t> commands;
+    std::atomic<bool> isConnected;
+} mqtt_stats_t;
+
+// The tasks whose stacks are monitored.
+typedef enum {
+    TASK_LOOP,
+    TASK_RADIO,
+    TASK_TELEMETRY,
+    TASK_MQTT,
+    TASK_ASYNC_TCP
+} monitored_task_t;
+
+const char* MONITORED_TASK_STRINGS[] = {
+    "loop",
+    "radio",
+    "telemetry",
+    "mqtt",
+    "async_tcp"
+};
+
+const int MAX_MONITORED_TASK_INDEX = static_cast<int>(monitored_task_t::TASK_ASYNC_TCP);
+
+// The number of tasks whose stacks are monitored.
+const int MONITORED_TASK_COUNT = MAX_MONITORED_TASK_INDEX + 1;
+
+// The last sample of the heap and task stacks.
+typedef struct {
+    uint32_t freeHeap;
+    uint32_t minFreeHeap;   // The lowest free heap since boot.
+    uint32_t largestBlock;  // The largest block that can be allocated.
+    uint32_t heapSize;
+    int32_t stackUnused[MONITORED_TASK_COUNT]; // High-water marks (bytes, -1 = not running).
+    uint32_t degradedCount; // The number of times the web server was degraded.
+} memory_stats_t;
+
+// The latency between an input and the display showing its effect.
+typedef struct {
+    std::atomic<uint32_t> events;
+    std::atomic<uint32_t> lastLatency;    // Microseconds.
+    std::atomic<uint32_t> averageLatency; // Microseconds.
+    std::atomic<uint32_t> maxLatency;     // Microseconds.
+} input_stats_t;
+
+// A message for the display.
+typedef struct {
+    char text[MESSAGE_MAX_LEN + 1];
+    uint8_t priority;   // 0 - MAX_MESSAGE_PRIORITY, highest first.
+    uint16_t duration;  // How long the message is kept (seconds).
+} message_t;
+
+// A message waiting to be shown, or being shown, by the main loop.
+typedef struct {
+    message_t message;
+    uint32_t posted;    // millis() when the main loop received it.
+    uint32_t expires;   // millis() when it is removed.
+    bool isUsed;
+} message_slot_t;
+
+// The current drawn by the LEDs, as estimated from each frame.
+typedef struct {
+    std::atomic<uint32_t> frames;
+    std::atomic<uint32_t> limitedFrames;  // Frames scaled down to the budget.
+    std::atomic<uint32_t> lastCurrent;    // mA, after any limiting.
+    std::atomic<uint32_t> averageCurrent; // mA, after any limiting.
+    std::atomic<uint32_t> peakCurrent;    // mA, after any limiting.
+    std::atomic<uint32_t> peakDemand;     // mA, before any limiting.
+} power_stats_t;
+
+// An entry in the event log.
+typedef struct {
+    uint32_t time;     // The epoch time of the event, 0 if unknown.
+    uint32_t uptime;   // The time since start-up (ms).
+    uint8_t level;     // LOG_LEVEL_*
+    uint8_t event;     // log_event_t
+    int32_t values[2];
+} log_entry_t;
+
+// The header of the event log file, which is followed by the entries.
+typedef struct {
+    uint32_t magic;
+    uint32_t next;     // The number of entries ever written.
+} log_file_header_t;
+
+// The state of an event log being streamed as text to a web client.
+typedef struct {
+    uint32_t flushCount;      // The flushes before the log was requested.
+    bool isStarted;           // Whether the range of entries to send is known.
+    uint32_t next;            // The next entry to be read.
+    uint32_t end;             // The entry after the last to be read.
+    log_entry_t entries[LOG_STREAM_ENTRIES]; // The entries read for this chunk.
+    uint8_t entryCount;
+    uint8_t entryPos;
+    char line[LOG_LINE_LEN];  // The entry being sent.
+    size_t lineLen;
+    size_t linePos;
+} log_stream_t;
+
+// The types of telemetry record.
+typedef enum {
+    TELEMETRY_LOOP = 1,
+    TELEMETRY_STATE = 2,
+    TELEMETRY_BRIGHTNESS = 3,
+    TELEMETRY_HEAP = 4
+} telemetry_type_t;
+
+// The header of each telemetry datagram, followed by its records. Each record
+// starts with a record_header_t.
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t sequence;   // Incremented for each datagram, to detect losses.
+    uint16_t dropped;    // Records dropped since the last datagram.
+    uint16_t loopDelay;  // The time between loops (ms).
+} telemetry_datagram_t;
+
+// The timing of a loop.
+typedef struct __attribute__((packed)) {
+    uint16_t loopTime;   // The time taken by the loop, excluding its delay (us).
+    uint16_t renderTime; // The time taken to render the display (us).
+} telemetry_loop_t;
+
+// The clock's state, sent whenever it changes.
+typedef struct __attribute__((packed)) {
+    uint8_t state;       // state_t
+    uint8_t alarmState;  // alarm_state_t
+} telemetry_state_t;
+
+// The brightness, sent whenever it is checked.
+typedef struct __attribute__((packed)) {
+    uint16_t ldr;
+    uint8_t brightness;
+} telemetry_brightness_t;
+
+// The heap, sampled by the telemetry task for each datagram.
+typedef struct __attribute__((packed)) {
+    uint32_t freeHeap;
+    uint32_t largestBlock;
+} telemetry_heap_t;
+
+// A point on the wake-up light curve.
+typedef struct {
+    uint8_t level;     // Brightness, 0-255 of the maximum brightness.
+    colour_t colour;
+} wake_point_t;
+
+// The wake-up light curve, from the first glow to daylight. The brightness
+// follows a roughly perceptual (squared) curve while the colour warms from a
+// deep red through orange to a cool white.
+const wake_point_t WAKE_CURVE[WAKE_CURVE_POINTS] = {
+    {   2, { 0xFF, 0x10, 0x00 } },
+    {  10, { 0xFF, 0x30, 0x00 } },
+    {  41, { 0xFF, 0x60, 0x10 } },
+    {  92, { 0xFF, 0x98, 0x40 } },
+    { 163, { 0xFF, 0xC8, 0x90 } },
+    { 255, { 0xFF, 0xF4, 0xE8 } }
+};
+
+// The state of the wake-up ramp, stepped once per loop. Values are 16.16
+// fixed point so that slow ramps still advance every frame.
+typedef struct {
+    uint8_t segment;           // The curve segment being traversed.
+    uint32_t framesRemaining;  // Frames left in the current segment.
+    uint32_t framesPerSegment; // Frames for each segment of the curve.
+    int32_t value[4];          // Level, red, green and blue.
+    int32_t step[4];           // The per-frame change for each value.
+    time_t startTime;          // When the ramp started.
+} wake_ramp_t;
+
+// The states of an OTA update.
+typedef enum {
+    OTA_IDLE,
+    OTA_RECEIVING,
+    OTA_RESTART_PENDING  // Waiting for the alarm to finish before restarting.
+} ota_state_t;
+
+// Where an OTA update came from.
+typedef enum {
+    OTA_SOURCE_ARDUINO,
+    OTA_SOURCE_HTTP
+} ota_source_t;
+
+// The states of the WiFi connection.
+typedef enum {
+    WIFI_PORTAL,      // The configuration portal is running.
+    WIFI_CONNECTING,
+    WIFI_CONNECTED,
+    WIFI_WAITING      // Waiting to retry the connection.
+} wifi_state_t;
+
+const char* WIFI_STATE_STRINGS[] = {
+    "PORTAL",
+    "CONNECTING",
+    "CONNECTED",
+    "WAITING"
+};
+
+// The access point last connected to, for connecting quickly without a scan.
+typedef struct {
+    uint32_t magic;
+    uint8_t bssid[6];
+    int32_t channel;
+} wifi_cache_t;
+
+// The statistics for the WiFi connection.
+typedef struct {
+    wifi_state_t state;
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t failures;         // Failed attempts since the last connection.
+    uint32_t lastConnectTime;  // The time taken by the last connection (ms).
+    unsigned long connectedAt; // When the connection was made (ms).
+    uint32_t totalConnected;   // Connected time before the current connection (s).
+} wifi_stats_t;
+
+// The last known time, kept in RTC memory so that it survives soft resets.
+typedef struct {
+    uint32_t magic;
+    time_t timestamp;
+} rtc_time_cache_t;
+
+// The state of the alarm, kept in RTC memory and flash so that it survives
+// resets.
+typedef struct {
+    uint32_t magic;
+    time_t timestamp;          // When the state was saved.
+    uint8_t state;             // The alarm_state_t.
+    uint8_t recoveries;        // The times this alarm has been resumed.
+    int16_t snoozeRemaining;   // The snooze remaining when saved (s).
+} alarm_persist_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,474 @@
+#include "display_frame.h"
+#include <math.h>
+#include <string.h>
+
+hsl_colour_t colour_to_hsl(colour_t colour) {
+    float r = colour.r / 255.0f;
+    float g = colour.g / 255.0f;
+    float b = colour.b / 255.0f;
+    float max = (r > g && r > b) ? r : ((g > b) ? g : b);
+    float min = (r < g && r < b) ? r : ((g < b) ? g : b);
+
+    hsl_colour_t c;
+    c.l = (max + min) / 2.0f;
+    if (max == min) {
+        c.h = 0.0f;
+        c.s = 0.0f;
+        return c;
+    }
+
+    float d = max - min;
+    c.s = (c.l > 0.5f) ? d / (2.0f - (max + min)) : d / (max + min);
+    if (r > g && r > b) {
+        c.h = ((g - b) / d) + ((g < b) ? 6.0f : 0.0f);
+    } else if (g > b) {
+        c.h = ((b - r) / d) + 2.0f;
+    } else {
+        c.h = ((r - g) / d) + 4.0f;
+    }
+    c.h /= 6.0f;
+    return c;
+}
+
+hsl_colour_t blend_hsl(hsl_colour_t from, hsl_colour_t to, float progress) {
+    float hueDelta = to.h - from.h;
+    float hueBase = from.h;
+    float hueProgress = progress;
+    if (hueDelta > 0.5f) {
+        hueBase = to.h;
+        hueDelta = 1.0f - hueDelta;
+        hueProgress = 1.0f - progress;
+    } else if (hueDelta < -0.5f) {
+        hueDelta = 1.0f + hueDelta;
+    }
+
+    hsl_colour_t c;
+    c.h = hueBase + (hueDelta * hueProgress);
+    if (c.h < 0.0f) {
+        c.h += 1.0f;
+    } else if (c.h > 1.0f) {
+        c.h -= 1.0f;
+    }
+    c.s = from.s + ((to.s - from.s) * progress);
+    c.l = from.l + ((to.l - from.l) * progress);
+    return c;
+}
+
+void init_pattern_registers(const custom_pattern_t *pattern, colour_t colour, uint16_t frame, int32_t *regs) {
+    hsl_colour_t c = colour_to_hsl(colour);
+    memset(regs, 0, PATTERN_REGISTER_COUNT * sizeof(int32_t));
+    regs[REG_PHASE] = ((uint32_t)frame * 256) / pattern->period;
+    regs[REG_FRAME] = frame;
+    regs[REG_H] = (int32_t)(c.h * 255.0f);
+    regs[REG_S] = (int32_t)(c.s * 255.0f);
+    regs[REG_L] = (int32_t)(c.l * 255.0f);
+}
+
+void run_pattern(const custom_pattern_t *pattern, int32_t *regs) {
+    for (uint8_t ii = 0; ii < pattern->opCount; ii++) {
+        const pattern_op_t *op = &pattern->ops[ii];
+        int32_t a = regs[op->a];
+        int32_t x = (op->code & PATTERN_IMMEDIATE) ? op->x : regs[op->x];
+        int32_t result = 0;
+        switch (op->code & ~PATTERN_IMMEDIATE) {
+            case pattern_op_code_t::OP_SET:
+                result = x;
+                break;
+            case pattern_op_code_t::OP_TRI:
+                x &= 0xFF;
+                result = (x < 128) ? x * 2 : (255 - x) * 2;
+                break;
+            case pattern_op_code_t::OP_ADD:
+                result = a + x;
+                break;
+            case pattern_op_code_t::OP_SUB:
+                result = a - x;
+                break;
+            case pattern_op_code_t::OP_MUL:
+                result = (a * x) / 256;
+                break;
+            case pattern_op_code_t::OP_DIV:
+                result = (x == 0) ? 0 : a / x;
+                break;
+            case pattern_op_code_t::OP_MOD:
+                result = (x == 0) ? 0 : a % x;
+                break;
+            case pattern_op_code_t::OP_MIN:
+                result = (a < x) ? a : x;
+                break;
+            case pattern_op_code_t::OP_MAX:
+                result = (a > x) ? a : x;
+                break;
+            case pattern_op_code_t::OP_STEP:
+                result = (a >= x) ? 255 : 0;
+                break;
+        }
+
+        // Keep values in 16 bits, so that multiplication can't overflow.
+        regs[op->dest] = (result > INT16_MAX) ? INT16_MAX : ((result < INT16_MIN) ? INT16_MIN : result);
+    }
+}
+
+/**
+ * Converts the output registers of a custom pattern into a colour.
+ *
+ * @param regs The registers after the pattern has been run.
+ * @return The colour for the LED. The hue wraps, saturation and lightness
+ *         are limited to 0-255.
+ */
+static inline hsl_colour_t pattern_registers_to_colour(const int32_t *regs) {
+    int32_t s = regs[REG_S];
+    int32_t l = regs[REG_L];
+    s = (s < 0) ? 0 : ((s > 255) ? 255 : s);
+    l = (l < 0) ? 0 : ((l > 255) ? 255 : l);
+    hsl_colour_t c = { (regs[REG_H] & 0xFF) / 256.0f, s / 255.0f, l / 255.0f };
+    return c;
+}
+
+hsl_colour_t calculate_custom_colour(const custom_pattern_t *pattern, const int32_t *frameRegs, uint8_t led) {
+    int32_t regs[PATTERN_REGISTER_COUNT];
+    memcpy(regs, frameRegs, sizeof(regs));
+    regs[REG_LED] = led;
+    regs[REG_GROUP] = LED_GROUPS[led];
+    run_pattern(pattern, regs);
+    return pattern_registers_to_colour(regs);
+}
+
+hsl_colour_t calculate_digit_colour(uint8_t group, display_pattern_t pattern, colour_t colour,
+                                    uint16_t step, menu_field_t field) {
+    switch (pattern) {
+        case display_pattern_t::SOLID_COLOUR: {
+            return colour_to_hsl(colour);
+        }
+        case display_pattern_t::RAINBOW_DIGITS: {
+            hsl_colour_t c = COLOUR_R;
+            c.h += (1.0f - (group * DIGIT_GROUP_MULTIPLIER)) + (step * DIGIT_COLOUR_STEP);
+            c.h = c.h > 1.0f ? c.h - (int)c.h : c.h;
+            return c;
+        }
+        case display_pattern_t::FLASHING: {
+            if (step < FLASH_ON_STEPS) {
+                return colour_to_hsl(colour);
+            } else {
+                return BLACK;
+            }
+        }
+        case display_pattern_t::PULSING: {
+            float frac = ((float)step) / PULSE_STEPS;
+            if (frac > 1.0f) {
+                frac = 2.0f - frac;
+            }
+            return blend_hsl(BLACK, colour_to_hsl(colour), frac);
+        }
+        case display_pattern_t::MENU: {
+            if ((field == MENU_FIELD_HOURS && group <= 1) ||
+                (field == MENU_FIELD_MINUTES && (group == 3 || group == 4)) ||
+                (field == MENU_FIELD_RADIO_WHOLE && (group < 4)) ||
+                (field == MENU_FIELD_RADIO_FRACTION && (group != 4))) {
+                return MENU_BRIGHT;
+            } else if (field == MENU_FIELD_RED && group == 0) {
+                return COLOUR_R;
+            } else if (field == MENU_FIELD_GREEN && group == 0) {
+                return COLOUR_G;
+            } else if (field == MENU_FIELD_BLUE && group == 0) {
+                return COLOUR_B;
+            }
+
+            float frac = ((float)step) / PULSE_STEPS;
+            if (frac > 1.0f) {
+                frac = 2.0f - frac;
+            }
+            return blend_hsl(MENU_DIM, MENU_BRIGHT, frac);
+        }
+        default:
+            break;
+    }
+    return colour_to_hsl(colour);
+}
+
+/**
+ * Calculates the colour to be used for an individual segment.
+ *
+ * @param previouslyLitSegments The number of segments lit before the digit this segment belongs to.
+ * @param segmentIndex The index of the segment within the digit being lit, 0 = first.
+ * @param fontIndex The index into the FONT array for the digit being selected. 0xFF = colon.
+ * @param step The animation step.
+ */
+static hsl_colour_t calculate_segment_colour(int previouslyLitSegments, uint8_t segmentIndex, uint8_t fontIndex,
+                                             uint16_t step) {
+    hsl_colour_t c = COLOUR_R;
+    uint8_t segmentOrder;
+    if (fontIndex == 0xFF) {
+        segmentOrder = segmentIndex;
+    } else {
+        segmentOrder = FONT_SEGMENT_ORDER[fontIndex][segmentIndex];
+    }
+    c.h += (1.0f - ((previouslyLitSegments + segmentOrder) * SEGMENT_MULTIPLIER)) +
+            (step * SEGMENT_COLOUR_STEP);
+    c.h = c.h > 1.0f ? c.h - (int)c.h : c.h;
+
+    return c;
+}
+
+void set_led(frame_t *frame, uint16_t ledNumber, hsl_colour_t colour) {
+    frame->hue[ledNumber] = colour.h;
+    frame->sat[ledNumber] = colour.s;
+    frame->lum[ledNumber] = colour.l;
+}
+
+/**
+ * Sets the LED values for a single 7-segment digit.
+ *
+ * @param frame The frame being built.
+ * @param ledBits The bit mask containing which LEDs to light.
+ * @param firstLedNumber The index of the first LED in the digit.
+ * @param digitColour The colour to set any lit segments to.
+ */
+static void set_digit(frame_t *frame, uint8_t ledBits, uint16_t firstLedNumber, hsl_colour_t digitColour) {
+    for (uint16_t ii = 0; ii < SEGMENTS_PER_DIGIT; ii++) {
+        if ((ledBits & (1 << ii)) != 0) {
+            set_led(frame, firstLedNumber + ii, digitColour);
+        } else {
+            set_led(frame, firstLedNumber + ii, BLACK);
+        }
+    }
+}
+
+/**
+ * Sets the LED values for a single 7-segment digit, with each segment a
+ * different colour.
+ *
+ * @param frame The frame being built.
+ * @param fontIndex The index into the FONT array for the digit.
+ * @param firstLedNumber The index of the first LED in the digit.
+ * @param previouslyLitSegments The number of segments lit before this digit.
+ * @param step The animation step.
+ * @return The number of segments lit, including this digit's.
+ */
+static int set_rainbow_digit(frame_t *frame, uint8_t fontIndex, uint16_t firstLedNumber, int previouslyLitSegments,
+                             uint16_t step) {
+    int segmentsLit = previouslyLitSegments;
+    const uint8_t ledBits = FONT[fontIndex];
+    for (uint16_t ii = 0; ii < SEGMENTS_PER_DIGIT; ii++) {
+        if ((ledBits & (1 << ii)) != 0) {
+            segmentsLit++;
+            set_led(frame, firstLedNumber + ii,
+                calculate_segment_colour(previouslyLitSegments, ii, fontIndex, step));
+        } else {
+            set_led(frame, firstLedNumber + ii, BLACK);
+        }
+    }
+    return segmentsLit;
+}
+
+void render_display(frame_t *frame, const display_state_t *state, const custom_pattern_t *custom) {
+    display_pattern_t pattern = static_cast<display_pattern_t>(state->pattern);
+    menu_field_t field = static_cast<menu_field_t>(state->menuField);
+    uint16_t step = state->animationStep;
+    const uint8_t *digits = state->digits;
+    bool isCustom = pattern >= display_pattern_t::CUSTOM_1 && pattern <= display_pattern_t::CUSTOM_4;
+    if (isCustom && (custom == NULL || custom->opCount == 0)) {
+        // Nothing has been uploaded to the slot.
+        pattern = display_pattern_t::SOLID_COLOUR;
+        isCustom = false;
+    }
+
+    if (isCustom) {
+        uint32_t litLeds = ((uint32_t)FONT[digits[0]]) |
+                           (((uint32_t)FONT[digits[1]]) << 7) |
+                           (state->colon ? (0x03UL << 14) : 0) |
+                           (((uint32_t)FONT[digits[2]]) << 16) |
+                           (((uint32_t)FONT[digits[3]]) << 23) |
+                           (state->pm ? (1UL << 30) : 0) |
+                           (state->alarmSet ? (1UL << 31) : 0);
+        int32_t frameRegs[PATTERN_REGISTER_COUNT];
+        init_pattern_registers(custom, state->colour, step, frameRegs);
+        for (uint8_t ii = 0; ii < LED_COUNT; ii++) {
+            if ((litLeds & (1UL << ii)) != 0) {
+                set_led(frame, ii, calculate_custom_colour(custom, frameRegs, ii));
+            } else {
+                set_led(frame, ii, BLACK);
+            }
+        }
+    } else if (pattern == display_pattern_t::RAINBOW_SEGMENTS) {
+        int segmentsLit = 0;
+        segmentsLit = set_rainbow_digit(frame, digits[0], 0, segmentsLit, step);
+        segmentsLit = set_rainbow_digit(frame, digits[1], 7, segmentsLit, step);
+
+        if (state->colon) {
+            set_led(frame, 14, calculate_segment_colour(segmentsLit, 0, 0xFF, step));
+            segmentsLit++;
+            set_led(frame, 15, calculate_segment_colour(segmentsLit, 1, 0xFF, step));
+            segmentsLit++;
+        } else {
+            set_led(frame, 14, BLACK);
+            set_led(frame, 15, BLACK);
+        }
+
+        segmentsLit = set_rainbow_digit(frame, digits[2], 16, segmentsLit, step);
+        segmentsLit = set_rainbow_digit(frame, digits[3], 23, segmentsLit, step);
+
+        if (state->pm) {
+            set_led(frame, 30, calculate_segment_colour(segmentsLit, 0, 0xFF, step));
+            segmentsLit++;
+        } else {
+            set_led(frame, 30, BLACK);
+        }
+
+        if (state->alarmSet) {
+            set_led(frame, 31, calculate_segment_colour(segmentsLit, 1, 0xFF, step));
+        } else {
+            set_led(frame, 31, BLACK);
+        }
+    } else {
+        hsl_colour_t colour = calculate_digit_colour(0, pattern, state->colour, step, field);
+        set_digit(frame, FONT[digits[0]], 0, colour);
+
+        colour = calculate_digit_colour(1, pattern, state->colour, step, field);
+        set_digit(frame, FONT[digits[1]], 7, colour);
+
+        if (state->colon) {
+            colour = calculate_digit_colour(2, pattern, state->colour, step, field);
+            set_led(frame, 14, colour);
+            set_led(frame, 15, colour);
+        } else {
+            set_led(frame, 14, BLACK);
+            set_led(frame, 15, BLACK);
+        }
+
+        colour = calculate_digit_colour(3, pattern, state->colour, step, field);
+        set_digit(frame, FONT[digits[2]], 16, colour);
+
+        colour = calculate_digit_colour(4, pattern, state->colour, step, field);
+        set_digit(frame, FONT[digits[3]], 23, colour);
+
+        if (state->pm || state->alarmSet) {
+            colour = calculate_digit_colour(5, pattern, state->colour, step, field);
+            set_led(frame, 30, state->pm ? colour : BLACK);
+            set_led(frame, 31, state->alarmSet ? colour : BLACK);
+        } else {
+            set_led(frame, 30, BLACK);
+            set_led(frame, 31, BLACK);
+        }
+    }
+}
+
+uint16_t next_animation_step(display_pattern_t pattern, const custom_pattern_t *custom, uint16_t step) {
+    switch (pattern) {
+        case display_pattern_t::FLASHING:
+            return (step + 1) % MAX_ANIMATION_STEP_FLASH;
+        case display_pattern_t::PULSING:
+            return (step + 1) % MAX_ANIMATION_STEP_PULSE;
+        case display_pattern_t::RAINBOW_DIGITS:
+            return (step + 1) % MAX_ANIMATION_STEP_RAINBOW_DIGITS;
+        case display_pattern_t::RAINBOW_SEGMENTS:
+            return (step + 1) % MAX_ANIMATION_STEP_RAINBOW_SEGMENTS;
+        case display_pattern_t::CUSTOM_1: // Fall through
+        case display_pattern_t::CUSTOM_2: // Fall through
+        case display_pattern_t::CUSTOM_3: // Fall through
+        case display_pattern_t::CUSTOM_4:
+            if (custom != NULL && custom->opCount > 0) {
+                return (step + 1) % custom->period;
+            }
+            return step;
+        default:
+            return step;
+    }
+}
+
+void build_led_output(led_output_t *output, const calibration_t *calibration) {
+    const uint8_t balance[3] = {
+        calibration->whiteBalance.r,
+        calibration->whiteBalance.g,
+        calibration->whiteBalance.b
+    };
+    for (uint8_t channel = 0; channel < 3; channel++) {
+        float gamma = (float)calibration->gamma[channel] / GAMMA_SCALE;
+        for (uint16_t value = 0; value < 256; value++) {
+            float level = powf(value / 255.0f, gamma);
+            output->lut[channel][value] = (uint8_t)((level * balance[channel]) + 0.5f);
+        }
+    }
+    memcpy(output->ledGain, calibration->ledGain, LED_COUNT);
+}
+
+/**
+ * Converts one colour component for a frame from HSL to 0-255 values. This
+ * is the branch-free form of the HSL conversion, so that the loop can be
+ * vectorised.
+ *
+ * @param frame The frame to convert.
+ * @param n The component offset (0 = red, 8 = green, 4 = blue).
+ * @param brightness The brightness scale for the frame (0.0-1.0).
+ * @param out Set to the component value for each LED.
+ */
+static void frame_component(const frame_t *__restrict frame, float n, float brightness, float *__restrict out) {
+    for (uint16_t ii = 0; ii < LED_COUNT; ii++) {
+        float l = frame->lum[ii] * brightness;
+        float a = frame->sat[ii] * fminf(l, 1.0f - l);
+        float k = n + (frame->hue[ii] * 12.0f);
+        k -= 12.0f * (float)(k >= 12.0f);
+        float c = fmaxf(-1.0f, fminf(fminf(k - 3.0f, 9.0f - k), 1.0f));
+        out[ii] = ((l - (a * c)) * 255.0f) + 0.5f;
+    }
+}
+
+/**
+ * Calibrates a channel's value for an LED.
+ *
+ * @param lut The calibration lookup table for the channel.
+ * @param value The channel's value (0-255).
+ * @param gain The LED's gain (FULL_LED_GAIN = unchanged).
+ * @return The calibrated value.
+ */
+static inline uint8_t calibrate(const uint8_t *lut, uint8_t value, uint8_t gain) {
+    return (uint8_t)((((uint16_t)lut[value] * gain) + (FULL_LED_GAIN / 2)) / FULL_LED_GAIN);
+}
+
+/**
+ * Keeps the current drawn by the LEDs within the power budget.
+ *
+ * @param pixels The GRB values for the LEDs.
+ * @param totals The total of each channel's values across the frame (GRB).
+ * @param budget The limit on the current drawn (mA), 0 for no limit.
+ * @param power Set to the current drawn by the frame.
+ */
+static void limit_power(uint8_t *pixels, const uint32_t *totals, uint32_t budget, frame_power_t *power) {
+    const uint32_t idle = LED_COUNT * LED_IDLE_MA;
+    power->demand = idle + (((totals[0] * LED_CHANNEL_MA[0]) +
+        (totals[1] * LED_CHANNEL_MA[1]) + (totals[2] * LED_CHANNEL_MA[2])) / 255);
+    power->current = power->demand;
+    power->isLimited = (budget != 0) && (power->demand > budget);
+    if (power->isLimited) {
+        // Scale the lit part of the current to fit (1/256ths).
+        uint32_t scale = (budget > idle) ? ((budget - idle) << 8) / (power->demand - idle) : 0;
+        for (uint16_t ii = 0; ii < LED_COUNT * 3; ii++) {
+            pixels[ii] = (uint8_t)((pixels[ii] * scale) >> 8);
+        }
+        power->current = idle + (((power->demand - idle) * scale) >> 8);
+    }
+}
+
+void frame_to_pixels(const frame_t *frame, float brightness, const led_output_t *output,
+                     uint16_t powerBudget, uint8_t *pixels, frame_power_t *power) {
+    float red[LED_COUNT];
+    float green[LED_COUNT];
+    float blue[LED_COUNT];
+    frame_component(frame, 0.0f, brightness, red);
+    frame_component(frame, 8.0f, brightness, green);
+    frame_component(frame, 4.0f, brightness, blue);
+
+    // Calibrate straight into the GRB buffer, totalling each channel for the
+    // power estimate.
+    const uint8_t *gain = output->ledGain;
+    uint32_t totals[3] = { 0, 0, 0 };
+    for (uint16_t ii = 0; ii < LED_COUNT; ii++) {
+        pixels[(ii * 3)] = calibrate(output->lut[1], (uint8_t)green[ii], gain[ii]);
+        pixels[(ii * 3) + 1] = calibrate(output->lut[0], (uint8_t)red[ii], gain[ii]);
+        pixels[(ii * 3) + 2] = calibrate(output->lut[2], (uint8_t)blue[ii], gain[ii]);
+        totals[0] += pixels[(ii * 3)];
+        totals[1] += pixels[(ii * 3) + 1];
+        totals[2] += pixels[(ii * 3) + 2];
+    }
+    limit_power(pixels, totals, powerBudget, power);
+}
@@ -0,0 +1,443 @@
+#ifndef DISPLAY_FRAME_H
+#define DISPLAY_FRAME_H
+
+#include <stdint.h>
+
+// THe number of milliseconds to wait between loop executions. Animations
+// move on a step each loop.
+const uint32_t LOOP_DELAY = 10;
+
+// The number of LEDs to use for the display.
+const uint16_t LED_COUNT = 32;
+
+// The number of segments in a single digit.
+const uint8_t SEGMENTS_PER_DIGIT = 7;
+
+// The number of digits on the display.
+const uint8_t DISPLAY_DIGITS = 4;
+
+// The scale of the calibration gamma values, i.e. they are in tenths.
+const uint8_t GAMMA_SCALE = 10;
+
+// The per-LED calibration gain for an LED shown at full strength.
+const uint8_t FULL_LED_GAIN = 0xFF;
+
+// The current (mA) drawn by each channel of an LED at full output, in the
+// driver's GRB order.
+const uint32_t LED_CHANNEL_MA[3] = { 20, 20, 20 };
+
+// The current (mA) drawn by each LED when it is dark.
+const uint32_t LED_IDLE_MA = 1;
+
+// The amount the hue will change between each digit.
+static const float DIGIT_GROUP_MULTIPLIER = 1.0f / 6.0f;
+
+// The amount the hue will change between each segment.
+static const float SEGMENT_MULTIPLIER = 1.0f / 32.0f;
+
+// The amount the hue will change for a full digit pattern each step.
+static const float DIGIT_COLOUR_STEP = 0.005;
+
+// The amount the hue will change for each segment pattern each step.
+static const float SEGMENT_COLOUR_STEP = 0.002;
+
+// The number of animation steps that a flashing pattern is on.
+static const int FLASH_ON_STEPS = (750 / LOOP_DELAY);
+
+// The number of animation steps that a flashing pattern is off.
+static const int FLASH_OFF_STEPS = (250 / LOOP_DELAY);
+
+// The number of animation steps for each half of a pulse sequence.
+static const int PULSE_STEPS = (1000 / LOOP_DELAY);
+
+// The maximum animation step when flashing before it restarts.
+static const int MAX_ANIMATION_STEP_FLASH = FLASH_ON_STEPS + FLASH_OFF_STEPS;
+
+// The maximum animation step when pulsing before it restarts.
+static const int MAX_ANIMATION_STEP_PULSE = 2 * PULSE_STEPS;
+
+// The maximum animation step when showing rainbow digits before it restarts.
+static const int MAX_ANIMATION_STEP_RAINBOW_DIGITS = 1.0f / DIGIT_COLOUR_STEP;
+
+// The maximum animation step when showing rainbow segments before it restarts.
+static const int MAX_ANIMATION_STEP_RAINBOW_SEGMENTS = 1.0f / SEGMENT_COLOUR_STEP;
+
+// The number of slots for uploaded (custom) patterns.
+const uint8_t CUSTOM_PATTERN_COUNT = 4;
+
+// The maximum number of instructions in a custom pattern. Programs have no
+// jumps, so this also bounds the instructions executed for each LED.
+const uint8_t MAX_PATTERN_OPS = 32;
+
+// The opcode flag set when the last operand is an immediate value.
+const uint8_t PATTERN_IMMEDIATE = 0x80;
+
+// The digit (0, 1, 3, 4, L-R) or colon (2, 5) group that each LED belongs to.
+const uint8_t LED_GROUPS[LED_COUNT] = {
+    0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1,
+    2, 2,
+    3, 3, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 4, 4, 4,
+    5, 5
+};
+
+//      a 
+//     --- 
+//  f | g | b
+//     ---
+//  e |   | c
+//     ---
+//      d
+// Font digit bit order:  Xgfedcba
+const uint8_t FONT[] = {0b00111111, // 0
+                        0b00000110, // 1
+                        0b01011011, // 2
+                        0b01001111, // 3
+                        0b01100110, // 4
+                        0b01101101, // 5
+                        0b01111101, // 6
+                        0b00000111, // 7
+                        0b01111111, // 8
+                        0b01101111, // 9
+                        0b01110111, // A
+                        0b01111100, // b
+                        0b01011000, // c
+                        0b01011110, // d
+                        0b01111001, // E
+                        0b01110001, // F
+                        0b00111101, // G
+                        0b01110110, // H
+                        0b00000100, // i
+                        0b00111000, // L
+                        0b01010100, // n
+                        0b01010000, // r
+                        0b01000000, // -
+                        0b00000000, // (blank)
+                        0b00111001, // C
+                        0b01110100, // h
+                        0b00011110, // J
+                        0b01011100, // o
+                        0b01110011, // P
+                        0b01100111, // q
+                        0b01111000, // t
+                        0b00111110, // U
+                        0b00011100, // u
+                        0b01101110, // y
+                        0b00001000, // _
+                        0b01100011, // (degree)
+                        0b01001000, // =
+                        };
+
+const uint8_t FONT_SEGMENT_ORDER[][7] = {{0, 1, 2, 3, 4, 5, 9}, // 0
+                                         {9, 0, 1, 9, 9, 9, 9}, // 1
+                                         {0, 1, 9, 4, 3, 9, 2}, // 2
+                                         {0, 1, 3, 4, 9, 9, 2}, // 3
+                                         {9, 0, 2, 9, 9, 0, 1}, // 4
+                                         {0, 9, 3, 4, 9, 1, 2}, // 5
+                                         {0, 9, 3, 4, 5, 1, 2}, // 6
+                                         {0, 1, 2, 9, 9, 9, 9}, // 7
+                                         {0, 1, 2, 3, 4, 5, 6}, // 8
+                                         {2, 3, 4, 5, 9, 1, 0}, // 9
+                                         {2, 3, 4, 9, 0, 1, 5}, // A
+                                         {9, 9, 2, 3, 4, 0, 1}, // b
+                                         {9, 9, 9, 0, 1, 9, 2}, // c
+                                         {9, 0, 1, 2, 3, 9, 4}, // d
+                                         {0, 9, 9, 4, 3, 0, 1}, // E
+                                         {0, 9, 9, 9, 3, 0, 1}, // F
+                                         {0, 9, 4, 3, 2, 1, 9}, // G
+                                         {9, 3, 4, 9, 1, 0, 2}, // H
+                                         {9, 9, 0, 9, 9, 9, 9}, // i
+                                         {9, 9, 9, 2, 1, 0, 9}, // L
+                                         {9, 9, 2, 9, 0, 9, 1}, // n
+                                         {9, 9, 9, 9, 0, 9, 1}, // r
+                                         {9, 9, 9, 9, 9, 9, 0}, // -
+                                         {9, 9, 9, 9, 9, 9, 9}, // (blank)
+                                         {0, 9, 9, 3, 2, 1, 9}, // C
+                                         {9, 9, 3, 9, 1, 0, 2}, // h
+                                         {9, 0, 1, 2, 3, 9, 9}, // J
+                                         {9, 9, 1, 2, 3, 9, 0}, // o
+                                         {2, 3, 9, 9, 0, 1, 4}, // P
+                                         {2, 3, 4, 9, 9, 1, 0}, // q
+                                         {9, 9, 9, 2, 1, 0, 3}, // t
+                                         {9, 4, 3, 2, 1, 0, 9}, // U
+                                         {9, 9, 2, 1, 0, 9, 9}, // u
+                                         {9, 2, 3, 4, 9, 0, 1}, // y
+                                         {9, 9, 9, 0, 9, 9, 9}, // _
+                                         {1, 2, 9, 9, 9, 0, 3}, // (degree)
+                                         {9, 9, 9, 1, 9, 9, 0}  // =
+                                        };
+
+typedef enum {
+    SOLID_COLOUR,
+    RAINBOW_DIGITS,
+    RAINBOW_SEGMENTS,
+    FLASHING,
+    PULSING,
+    CUSTOM_1,
+    CUSTOM_2,
+    CUSTOM_3,
+    CUSTOM_4,
+    MENU
+} display_pattern_t;
+
+// The part of the display being changed in a menu, which is shown bright
+// while the rest pulses.
+typedef enum {
+    MENU_FIELD_NONE,
+    MENU_FIELD_HOURS,
+    MENU_FIELD_MINUTES,
+    MENU_FIELD_RADIO_WHOLE,
+    MENU_FIELD_RADIO_FRACTION,
+    MENU_FIELD_RED,
+    MENU_FIELD_GREEN,
+    MENU_FIELD_BLUE
+} menu_field_t;
+
+// The instructions for custom patterns. Unary instructions take a single
+// operand, "OP DEST X", all others take two, "OP DEST A X". X may be a
+// register or a number, values are 0-255 for 0.0-1.0.
+typedef enum {
+    OP_SET,    // DEST = X
+    OP_TRI,    // DEST = triangle wave of X, 0 -> 255 -> 0 over 0-255
+    OP_ADD,    // DEST = A + X
+    OP_SUB,    // DEST = A - X
+    OP_MUL,    // DEST = A * X / 256
+    OP_DIV,    // DEST = A / X (0 when X is 0)
+    OP_MOD,    // DEST = A modulo X (0 when X is 0)
+    OP_MIN,    // DEST = smaller of A and X
+    OP_MAX,    // DEST = larger of A and X
+    OP_STEP    // DEST = 255 when A >= X, 0 otherwise
+} pattern_op_code_t;
+
+// The registers for custom patterns. The inputs are set for each LED, and the
+// colour is read from H, S and L (starting as the base colour) afterwards.
+typedef enum {
+    REG_LED,    // The LED number (0-31).
+    REG_GROUP,  // The digit (0, 1, 3, 4) or colon (2, 5) group.
+    REG_PHASE,  // The position in the animation period (0-255).
+    REG_FRAME,  // The animation step (0 - period - 1).
+    REG_H,
+    REG_S,
+    REG_L,
+    REG_T0,
+    REG_T1,
+    REG_T2,
+    REG_T3
+} pattern_register_t;
+
+// The number of registers for custom patterns.
+const int PATTERN_REGISTER_COUNT = static_cast<int>(pattern_register_t::REG_T3) + 1;
+
+// Colour structure used in the configuration.
+typedef struct {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} colour_t;
+
+// A colour as hue, saturation and lightness (each 0.0-1.0).
+typedef struct {
+    float h;
+    float s;
+    float l;
+} hsl_colour_t;
+
+// Black (off) colour used for the LED display.
+static const hsl_colour_t BLACK = { 0.0f, 0.0f, 0.0f };
+
+// Menu bright colour. Used in pulsing animation and setting value.
+static const hsl_colour_t MENU_BRIGHT = { 0.0f, 0.0f, 1.0f };
+
+// Menu dim colour. Used in pulsing animation.
+static const hsl_colour_t MENU_DIM = { 0.0f, 0.0f, 64 / 255.0f };
+
+// Pure red colour.
+static const hsl_colour_t COLOUR_R = { 0.0f, 1.0f, 0.5f };
+
+// Pure green colour.
+static const hsl_colour_t COLOUR_G = { 1.0f / 3.0f, 1.0f, 0.5f };
+
+// Pure blue colour.
+static const hsl_colour_t COLOUR_B = { 2.0f / 3.0f, 1.0f, 0.5f };
+
+// The colour calibration of the display. The gamma and white balance of each
+// channel are applied through a lookup table, and then each LED's gain
+// compensates for its diffuser.
+typedef struct {
+    uint8_t gamma[3];           // R, G, B, in tenths (GAMMA_SCALE = linear).
+    colour_t whiteBalance;      // The output for a full channel.
+    uint8_t ledGain[LED_COUNT]; // FULL_LED_GAIN = no attenuation.
+} calibration_t;
+
+// A single custom pattern instruction.
+typedef struct {
+    uint8_t code;   // pattern_op_code_t, plus PATTERN_IMMEDIATE.
+    uint8_t dest;
+    uint8_t a;
+    int16_t x;      // A register, or an immediate value.
+} pattern_op_t;
+
+// A compiled custom pattern, as stored in LittleFS.
+typedef struct {
+    uint32_t magic;
+    uint16_t period;      // Loops before the animation repeats.
+    uint8_t opCount;      // 0 when the slot is empty.
+    uint32_t renderTime;  // Time taken to render all LEDs when uploaded (us).
+    pattern_op_t ops[MAX_PATTERN_OPS];
+} custom_pattern_t;
+
+// Everything that determines what a frame of the display looks like. This
+// is packed as it is also recorded as it is.
+typedef struct __attribute__((packed)) {
+    uint8_t digits[DISPLAY_DIGITS]; // Font indexes, L-R.
+    bool colon;
+    bool pm;
+    bool alarmSet;
+    uint8_t pattern;                // display_pattern_t
+    uint8_t menuField;              // menu_field_t
+    colour_t colour;                // The base colour for the pattern.
+    uint16_t animationStep;
+    float brightness;               // 0.0-1.0
+} display_state_t;
+
+// A frame of LED colours, held as separate arrays for each component so
+// that whole-frame conversions are simple loops the compiler can vectorise.
+typedef struct {
+    float hue[LED_COUNT];
+    float sat[LED_COUNT];
+    float lum[LED_COUNT];
+} frame_t;
+
+// The calibration of the LEDs, prepared for converting frames. This is only
+// built when the calibration changes, so that calibrating each frame is
+// integer-only.
+typedef struct {
+    uint8_t lut[3][256];         // R, G, B
+    uint8_t ledGain[LED_COUNT];
+} led_output_t;
+
+// The current drawn by the LEDs for a frame.
+typedef struct {
+    uint32_t demand;   // mA, before any limiting.
+    uint32_t current;  // mA, after any limiting.
+    bool isLimited;    // Whether the frame was scaled down to the budget.
+} frame_power_t;
+
+/*
+ * Converts a colour to hue, saturation and lightness.
+ *
+ * @param colour The colour to convert.
+ * @return The converted colour.
+ */
+hsl_colour_t colour_to_hsl(colour_t colour);
+
+/*
+ * Blends between two colours, taking the shorter way around the hue circle.
+ *
+ * @param from The colour at the start of the blend.
+ * @param to The colour at the end of the blend.
+ * @param progress How far through the blend (0.0-1.0).
+ * @return The blended colour.
+ */
+hsl_colour_t blend_hsl(hsl_colour_t from, hsl_colour_t to, float progress);
+
+/*
+ * Sets up the registers for a frame of a custom pattern. Only the LED inputs
+ * need to be set after this for each LED.
+ *
+ * @param pattern The custom pattern being rendered.
+ * @param colour The base colour.
+ * @param frame The animation step.
+ * @param regs The registers to be set up.
+ */
+void init_pattern_registers(const custom_pattern_t *pattern, colour_t colour, uint16_t frame, int32_t *regs);
+
+/*
+ * Runs a custom pattern's program for a single LED. As there are no jumps,
+ * this never executes more than MAX_PATTERN_OPS instructions.
+ *
+ * @param pattern The custom pattern to run.
+ * @param regs The registers, with the inputs set. The colour is left in the
+ *             H, S and L registers.
+ */
+void run_pattern(const custom_pattern_t *pattern, int32_t *regs);
+
+/*
+ * Calculates the colour of a single LED for a custom pattern.
+ *
+ * @param pattern The custom pattern.
+ * @param frameRegs The registers for the frame, from init_pattern_registers().
+ * @param led The LED number (0-31).
+ * @return The colour for the LED.
+ */
+hsl_colour_t calculate_custom_colour(const custom_pattern_t *pattern, const int32_t *frameRegs, uint8_t led);
+
+/*
+ * Calculates the colour to be used for a digit or colon.
+ *
+ * @param group The digit (0, 1, 3, 4, L-R) or colon (2, 5) being calculated.
+ * @param pattern The pattern in use.
+ * @param colour The base colour, if used by the pattern.
+ * @param step The animation step.
+ * @param field The part of the display being changed, for the menu pattern.
+ * @return The colour for the digit or colon.
+ */
+hsl_colour_t calculate_digit_colour(uint8_t group, display_pattern_t pattern, colour_t colour,
+                                    uint16_t step, menu_field_t field);
+
+/*
+ * Sets the colour for a single LED in a frame. The brightness is applied to
+ * the whole frame when it is converted.
+ *
+ * @param frame The frame being built.
+ * @param ledNumber The LED number (0-31) to set.
+ * @param colour The colour to set the LED to.
+ */
+void set_led(frame_t *frame, uint16_t ledNumber, hsl_colour_t colour);
+
+/*
+ * Builds a frame of the display.
+ *
+ * @param frame The frame to build.
+ * @param state What is to be displayed.
+ * @param custom The custom pattern, if the state's pattern is one. An empty
+ *               (or missing) custom pattern is shown as a solid colour.
+ */
+void render_display(frame_t *frame, const display_state_t *state, const custom_pattern_t *custom);
+
+/*
+ * Moves a pattern's animation on by a step.
+ *
+ * @param pattern The pattern being displayed.
+ * @param custom The custom pattern, if the pattern is one.
+ * @param step The current animation step.
+ * @return The next animation step.
+ */
+uint16_t next_animation_step(display_pattern_t pattern, const custom_pattern_t *custom, uint16_t step);
+
+/*
+ * Prepares a calibration for converting frames.
+ *
+ * @param output The prepared calibration.
+ * @param calibration The calibration of the display.
+ */
+void build_led_output(led_output_t *output, const calibration_t *calibration);
+
+/*
+ * Converts a frame to RGB in a single pass for each component, calibrates
+ * it, and limits its power. The current is estimated from the channel totals
+ * of the calibrated frame and, when it is over budget, the whole frame is
+ * scaled down in a single integer pass.
+ *
+ * @param frame The frame to convert.
+ * @param brightness The brightness of the display (0.0-1.0).
+ * @param output The calibration of the LEDs.
+ * @param powerBudget The limit on the current drawn (mA), 0 for no limit.
+ * @param pixels Set to the values for the LEDs, in the driver's GRB order.
+ * @param power Set to the current drawn by the frame.
+ */
+void frame_to_pixels(const frame_t *frame, float brightness, const led_output_t *output,
+                     uint16_t powerBudget, uint8_t *pixels, frame_power_t *power);
+
+#endif
@@ -0,0 +1,329 @@
+#include "display_recording.h"
+#include <string.h>
+
+// The records made in a loop, as a bit for each record_type_t.
+#define RECORDED(type) (1 << (type))
+
+/**
+ * Finds the custom pattern used for a display pattern.
+ *
+ * @param patterns The custom patterns (CUSTOM_PATTERN_COUNT).
+ * @param pattern The display pattern (display_pattern_t).
+ * @return The custom pattern, or NULL if the display pattern isn't custom.
+ */
+static const custom_pattern_t *custom_pattern(const custom_pattern_t *patterns, uint8_t pattern) {
+    if (pattern < display_pattern_t::CUSTOM_1 || pattern > display_pattern_t::CUSTOM_4) {
+        return NULL;
+    }
+    return &patterns[pattern - display_pattern_t::CUSTOM_1];
+}
+
+void recording_clear(recording_t *recording) {
+    recording->start = 0;
+    recording->used = 0;
+}
+
+/**
+ * Appends data to a recording, which must have room for it.
+ *
+ * @param recording The recording to append to.
+ * @param data The data to append.
+ * @param length The length of the data.
+ */
+static void recording_write(recording_t *recording, const void *data, uint32_t length) {
+    uint32_t pos = (recording->start + recording->used) % RECORDING_SIZE;
+    uint32_t first = (length < RECORDING_SIZE - pos) ? length : RECORDING_SIZE - pos;
+    memcpy(&recording->data[pos], data, first);
+    memcpy(recording->data, ((const uint8_t *)data) + first, length - first);
+    recording->used += length;
+}
+
+void recording_add(recording_t *recording, record_type_t type, uint32_t loop, const void *data, uint8_t length) {
+    record_header_t header;
+    header.type = type;
+    header.length = length;
+    header.loop = loop;
+    uint32_t size = sizeof(record_header_t) + length;
+    while (RECORDING_SIZE - recording->used < size) {
+        uint8_t oldLength = recording->data[(recording->start + offsetof(record_header_t, length)) % RECORDING_SIZE];
+        uint32_t oldSize = sizeof(record_header_t) + oldLength;
+        recording->start = (recording->start + oldSize) % RECORDING_SIZE;
+        recording->used -= oldSize;
+    }
+    recording_write(recording, &header, sizeof(record_header_t));
+    recording_write(recording, data, length);
+}
+
+uint32_t recording_copy(const recording_t *recording, uint8_t *records) {
+    uint32_t length = recording->used;
+    uint32_t first = (length < RECORDING_SIZE - recording->start) ? length : RECORDING_SIZE - recording->start;
+    memcpy(records, &recording->data[recording->start], first);
+    memcpy(&records[first], recording->data, length - first);
+    return length;
+}
+
+/**
+ * Adds a record to the recording, counting its size towards the next full
+ * frame.
+ *
+ * @param recorder The recorder.
+ * @param write Adds the record to the recording.
+ * @param type The type of record.
+ * @param loop The loop number that the record was made in.
+ * @param data The data for the record.
+ * @param length The length of the data.
+ */
+static void record(recorder_t *recorder, record_writer_t write, record_type_t type, uint32_t loop,
+                   const void *data, uint8_t length) {
+    write(type, loop, data, length);
+    recorder->keyFrameBytes += sizeof(record_header_t) + length;
+}
+
+void recorder_begin(recorder_t *recorder, uint32_t loop) {
+    memset(recorder, 0, sizeof(recorder_t));
+    recorder->lastKeyFrame = loop - RECORDING_KEYFRAME_LOOPS;
+    recorder->patternSlot = -1;
+}
+
+/**
+ * Records the LEDs that have changed since the last recorded frame.
+ *
+ * @param recorder The recorder.
+ * @param current The loop being recorded.
+ * @param isKeyFrame Whether to record all of the LEDs.
+ * @param write Adds the record to the recording.
+ */
+static void record_frame(recorder_t *recorder, const recorded_loop_t *current, bool isKeyFrame, record_writer_t write) {
+    uint8_t data[sizeof(recorded_frame_t) + (LED_COUNT * sizeof(recorded_led_t))];
+    recorded_frame_t *frame = (recorded_frame_t *)data;
+    recorded_led_t *changes = (recorded_led_t *)&data[sizeof(recorded_frame_t)];
+    uint8_t count = 0;
+    for (uint8_t ii = 0; ii < LED_COUNT; ii++) {
+        const uint8_t *pixel = &current->pixels[ii * 3];
+        uint8_t *recorded = &recorder->pixels[ii * 3];
+        if (isKeyFrame || memcmp(pixel, recorded, 3) != 0) {
+            changes[count].led = ii;
+            changes[count].g = pixel[0];
+            changes[count].r = pixel[1];
+            changes[count].b = pixel[2];
+            memcpy(recorded, pixel, 3);
+            count++;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    frame->renderTime = (current->renderTime > UINT16_MAX) ? UINT16_MAX : current->renderTime;
+    frame->count = count;
+    record(recorder, write, record_type_t::RECORD_FRAME, current->loop, data, sizeof(recorded_frame_t) + (count * sizeof(recorded_led_t)));
+}
+
+void recorder_loop(recorder_t *recorder, const recorded_loop_t *current, record_writer_t write) {
+    bool isKeyFrame = (current->loop - recorder->lastKeyFrame) >= RECORDING_KEYFRAME_LOOPS ||
+        recorder->keyFrameBytes >= RECORDING_KEYFRAME_BYTES;
+    if (isKeyFrame) {
+        recorder->lastKeyFrame = current->loop;
+        recorder->keyFrameBytes = 0;
+        recorder->patternSlot = -1;
+    }
+
+    if (isKeyFrame || memcmp(&current->output, &recorder->output, sizeof(recorded_output_t)) != 0) {
+        record(recorder, write, record_type_t::RECORD_OUTPUT, current->loop, &current->output, sizeof(recorded_output_t));
+        memcpy(&recorder->output, &current->output, sizeof(recorded_output_t));
+    }
+
+    // Patterns are copied whole, as memcmp() also compares their padding.
+    const custom_pattern_t *custom = custom_pattern(current->patterns, current->display.pattern);
+    if (custom != NULL) {
+        int8_t slot = current->display.pattern - display_pattern_t::CUSTOM_1;
+        if (slot != recorder->patternSlot || memcmp(custom, &recorder->pattern, sizeof(custom_pattern_t)) != 0) {
+            recorded_pattern_t pattern;
+            pattern.slot = slot;
+            memcpy(&pattern.pattern, custom, sizeof(custom_pattern_t));
+            record(recorder, write, record_type_t::RECORD_PATTERN, current->loop, &pattern, sizeof(recorded_pattern_t));
+            recorder->patternSlot = slot;
+            memcpy(&recorder->pattern, custom, sizeof(custom_pattern_t));
+        }
+    }
+
+    if (isKeyFrame || memcmp(&current->inputs, &recorder->inputs, sizeof(recorded_inputs_t)) != 0) {
+        record(recorder, write, record_type_t::RECORD_INPUTS, current->loop, &current->inputs, sizeof(recorded_inputs_t));
+        recorder->inputs = current->inputs;
+    }
+
+    if (isKeyFrame || memcmp(&current->display, &recorder->display, sizeof(display_state_t)) != 0) {
+        record(recorder, write, record_type_t::RECORD_DISPLAY, current->loop, &current->display, sizeof(display_state_t));
+    }
+    recorder->display = current->display;
+    recorder->display.animationStep = next_animation_step(
+        static_cast<display_pattern_t>(current->display.pattern), custom, current->display.animationStep);
+
+    record_frame(recorder, current, isKeyFrame, write);
+}
+
+/**
+ * Reads the header of a record in a replay.
+ *
+ * @param replay The replay.
+ * @param pos The position of the record.
+ * @param header Set to the record's header.
+ * @return true if the whole record is in the recording, false otherwise.
+ */
+static bool read_record(const replay_t *replay, uint32_t pos, record_header_t *header) {
+    if (replay->length - pos < sizeof(record_header_t)) {
+        return false;
+    }
+    memcpy(header, &replay->records[pos], sizeof(record_header_t));
+    return replay->length - pos - sizeof(record_header_t) >= header->length;
+}
+
+/**
+ * Applies a record to the state being replayed.
+ *
+ * @param replay The replay.
+ * @param header The record's header.
+ * @param data The record's data.
+ */
+static void apply_record(replay_t *replay, const record_header_t *header, const uint8_t *data) {
+    switch (header->type) {
+        case record_type_t::RECORD_INPUTS:
+            if (header->length == sizeof(recorded_inputs_t)) {
+                memcpy(&replay->inputs, data, sizeof(recorded_inputs_t));
+            }
+            break;
+        case record_type_t::RECORD_DISPLAY:
+            if (header->length == sizeof(display_state_t)) {
+                memcpy(&replay->display, data, sizeof(display_state_t));
+            }
+            break;
+        case record_type_t::RECORD_OUTPUT:
+            if (header->length == sizeof(recorded_output_t)) {
+                recorded_output_t output;
+                memcpy(&output, data, sizeof(recorded_output_t));
+                build_led_output(&replay->output, &output.calibration);
+                replay->powerBudget = output.powerBudget;
+            }
+            break;
+        case record_type_t::RECORD_PATTERN:
+            if (header->length == sizeof(recorded_pattern_t) && data[0] < CUSTOM_PATTERN_COUNT) {
+                memcpy(&replay->patterns[data[0]], &data[offsetof(recorded_pattern_t, pattern)],
+                    sizeof(custom_pattern_t));
+            }
+            break;
+        case record_type_t::RECORD_FRAME: {
+            recorded_frame_t frame;
+            if (header->length < sizeof(recorded_frame_t)) {
+                break;
+            }
+            memcpy(&frame, data, sizeof(recorded_frame_t));
+            if (header->length != sizeof(recorded_frame_t) + (frame.count * sizeof(recorded_led_t))) {
+                break;
+            }
+            const recorded_led_t *changes = (const recorded_led_t *)&data[sizeof(recorded_frame_t)];
+            for (uint8_t ii = 0; ii < frame.count; ii++) {
+                if (changes[ii].led < LED_COUNT) {
+                    uint8_t *pixel = &replay->recorded[changes[ii].led * 3];
+                    pixel[0] = changes[ii].g;
+                    pixel[1] = changes[ii].r;
+                    pixel[2] = changes[ii].b;
+                }
+            }
+            replay->hasFrame = true;
+            replay->renderTime = frame.renderTime;
+            break;
+        }
+    }
+}
+
+bool replay_begin(replay_t *replay, const uint8_t *dump, size_t length) {
+    memset(replay, 0, sizeof(replay_t));
+    recording_dump_t header;
+    if (length < sizeof(recording_dump_t)) {
+        return false;
+    }
+    memcpy(&header, dump, sizeof(recording_dump_t));
+    if (header.magic != RECORDING_MAGIC || header.ledCount != LED_COUNT ||
+            header.length > length - sizeof(recording_dump_t)) {
+        return false;
+    }
+    replay->records = &dump[sizeof(recording_dump_t)];
+    replay->length = header.length;
+
+    // Find the first full frame recorded along with everything it was
+    // rendered from, which all comes before it in the same loop.
+    uint32_t loopStart = 0;
+    uint32_t loop = 0;
+    uint8_t recorded = 0;
+    bool isCustom = false;
+    bool isStarted = false;
+    record_header_t record;
+    for (uint32_t pos = 0; read_record(replay, pos, &record); pos += sizeof(record_header_t) + record.length) {
+        const uint8_t *data = &replay->records[pos + sizeof(record_header_t)];
+        if (pos == 0 || record.loop != loop) {
+            loopStart = pos;
+            loop = record.loop;
+            recorded = 0;
+            isCustom = false;
+        }
+        recorded |= (record.type < 8) ? RECORDED(record.type) : 0;
+        if (record.type == record_type_t::RECORD_DISPLAY && record.length == sizeof(display_state_t)) {
+            uint8_t pattern = data[offsetof(display_state_t, pattern)];
+            isCustom = pattern >= display_pattern_t::CUSTOM_1 && pattern <= display_pattern_t::CUSTOM_4;
+        }
+        bool isFullFrame = record.type == record_type_t::RECORD_FRAME &&
+            record.length >= sizeof(recorded_frame_t) && data[offsetof(recorded_frame_t, count)] == LED_COUNT;
+        if (!isStarted && isFullFrame &&
+                (recorded & RECORDED(RECORD_DISPLAY)) && (recorded & RECORDED(RECORD_OUTPUT)) &&
+                (!isCustom || (recorded & RECORDED(RECORD_PATTERN)))) {
+            replay->pos = loopStart;
+            replay->loop = loop - 1;
+            isStarted = true;
+        }
+        replay->lastLoop = record.loop;
+    }
+    return isStarted;
+}
+
+bool replay_loop(replay_t *replay) {
+    if (replay->loop == replay->lastLoop) {
+        return false;
+    }
+    replay->loop++;
+    replay->hasFrame = false;
+
+    // Move the animation on as loop() does, unless this loop records that
+    // something else happened.
+    const custom_pattern_t *custom = custom_pattern(replay->patterns, replay->display.pattern);
+    replay->display.animationStep = next_animation_step(
+        static_cast<display_pattern_t>(replay->display.pattern), custom, replay->display.animationStep);
+
+    record_header_t record;
+    while (read_record(replay, replay->pos, &record) && record.loop <= replay->loop) {
+        apply_record(replay, &record, &replay->records[replay->pos + sizeof(record_header_t)]);
+        replay->pos += sizeof(record_header_t) + record.length;
+    }
+
+    custom = custom_pattern(replay->patterns, replay->display.pattern);
+    render_display(&replay->frame, &replay->display, custom);
+    frame_power_t power;
+    frame_to_pixels(&replay->frame, replay->display.brightness, &replay->output,
+        replay->powerBudget, replay->pixels, &power);
+    return true;
+}
+
+int replay_compare(const replay_t *replay, uint8_t tolerance, uint8_t *difference) {
+    int first = -1;
+    *difference = 0;
+    for (uint16_t ii = 0; ii < LED_COUNT * 3; ii++) {
+        int delta = (int)replay->pixels[ii] - (int)replay->recorded[ii];
+        uint8_t size = (uint8_t)((delta < 0) ? -delta : delta);
+        if (size > *difference) {
+            *difference = size;
+        }
+        if (size > tolerance && first < 0) {
+            first = ii / 3;
+        }
+    }
+    return first;
+}
@@ -0,0 +1,218 @@
+#ifndef DISPLAY_RECORDING_H
+#define DISPLAY_RECORDING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <display_frame.h>
+
+// The size of the ring buffer holding the display recording (bytes).
+const size_t RECORDING_SIZE = 16384;
+
+// The marker at the start of a dumped display recording.
+const uint32_t RECORDING_MAGIC = 0xc10cf4a0;
+
+// The loops between full frames in the display recording, so that a
+// replay can start part way through the ring buffer.
+const uint32_t RECORDING_KEYFRAME_LOOPS = 5 * (1000 / LOOP_DELAY);
+
+// The most that is recorded between full frames (bytes), so that a busy
+// display that fills the ring buffer quickly still has full frames in it.
+const uint32_t RECORDING_KEYFRAME_BYTES = RECORDING_SIZE / 4;
+
+// The types of record in the display recording. Within a loop the frame is
+// recorded last, after what it was rendered from.
+typedef enum {
+    RECORD_INPUTS = 1,
+    RECORD_FRAME = 2,
+    RECORD_DISPLAY = 3,
+    RECORD_OUTPUT = 4,
+    RECORD_PATTERN = 5
+} record_type_t;
+
+// The header of each record in the display recording.
+typedef struct __attribute__((packed)) {
+    uint8_t type;       // record_type_t
+    uint8_t length;     // The length of the data following the header.
+    uint32_t loop;      // The loop number that the record was made in.
+} record_header_t;
+
+// The inputs to the main loop, recorded whenever one of them changes.
+typedef struct __attribute__((packed)) {
+    uint32_t time;
+    int32_t encoder;
+    uint8_t button;
+    uint16_t ldr;
+} recorded_inputs_t;
+
+// The start of a frame record. It is followed by the LEDs that changed
+// since the last frame.
+typedef struct __attribute__((packed)) {
+    uint16_t renderTime; // The time taken to render the frame (us).
+    uint8_t count;       // The number of LEDs that changed.
+} recorded_frame_t;
+
+// An LED that changed in a frame record, in GRB order as sent to the LEDs.
+typedef struct __attribute__((packed)) {
+    uint8_t led;
+    uint8_t g;
+    uint8_t r;
+    uint8_t b;
+} recorded_led_t;
+
+// How frames are sent to the LEDs, recorded with each full frame and
+// whenever it changes.
+typedef struct __attribute__((packed)) {
+    calibration_t calibration;
+    uint16_t powerBudget;  // mA, 0 for no limit.
+} recorded_output_t;
+
+// A custom pattern, recorded with each full frame and whenever the display
+// changes to a different one.
+typedef struct __attribute__((packed)) {
+    uint8_t slot;
+    custom_pattern_t pattern;
+} recorded_pattern_t;
+
+// The header of a dumped display recording, followed by its records.
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t ledCount;
+    uint16_t loopDelay;  // The time between loops (ms).
+    uint32_t length;     // The length of the records.
+} recording_dump_t;
+
+// The ring buffer holding a recording, oldest record first. Nothing here
+// locks, callers sharing a recording between tasks must.
+typedef struct {
+    uint8_t data[RECORDING_SIZE];
+    uint32_t start;
+    uint32_t used;
+} recording_t;
+
+// Adds a record to a recording.
+typedef void (*record_writer_t)(record_type_t type, uint32_t loop, const void *data, uint8_t length);
+
+// What a loop showed on the display, and what it was shown from.
+typedef struct {
+    uint32_t loop;
+    recorded_inputs_t inputs;
+    display_state_t display;
+    const custom_pattern_t *patterns;  // The custom patterns (CUSTOM_PATTERN_COUNT).
+    recorded_output_t output;
+    const uint8_t *pixels;             // As sent to the LEDs (GRB).
+    uint32_t renderTime;               // The time taken to render the frame (us).
+} recorded_loop_t;
+
+// What has been recorded so far, so that only the changes are recorded.
+typedef struct {
+    uint32_t lastKeyFrame;
+    uint32_t keyFrameBytes;     // Recorded since the last full frame.
+    recorded_inputs_t inputs;
+    display_state_t display;    // Moved on to the next loop's animation step.
+    recorded_output_t output;
+    int8_t patternSlot;         // The last custom pattern recorded, -1 for none.
+    custom_pattern_t pattern;
+    uint8_t pixels[LED_COUNT * 3];
+} recorder_t;
+
+// The state of a replay, which renders each loop of a recording again and
+// compares it with what was recorded.
+typedef struct {
+    const uint8_t *records;
+    uint32_t length;
+    uint32_t pos;
+    uint32_t loop;            // The loop last replayed.
+    uint32_t lastLoop;        // The last loop in the recording.
+    recorded_inputs_t inputs;
+    display_state_t display;
+    custom_pattern_t patterns[CUSTOM_PATTERN_COUNT];
+    led_output_t output;
+    uint16_t powerBudget;
+    frame_t frame;
+    uint8_t recorded[LED_COUNT * 3];  // The recorded LEDs (GRB).
+    uint8_t pixels[LED_COUNT * 3];    // The replayed LEDs (GRB).
+    bool hasFrame;            // Whether the loop had a frame record.
+    uint16_t renderTime;      // The recorded render time, if it did (us).
+} replay_t;
+
+/*
+ * Empties a recording.
+ *
+ * @param recording The recording to empty.
+ */
+void recording_clear(recording_t *recording);
+
+/*
+ * Adds a record to a recording, dropping the oldest records if the ring
+ * buffer is full.
+ *
+ * @param recording The recording to add to.
+ * @param type The type of record.
+ * @param loop The loop number that the record was made in.
+ * @param data The data for the record.
+ * @param length The length of the data.
+ */
+void recording_add(recording_t *recording, record_type_t type, uint32_t loop, const void *data, uint8_t length);
+
+/*
+ * Copies the records out of a recording, oldest first.
+ *
+ * @param recording The recording to copy.
+ * @param records Set to the records, which needs RECORDING_SIZE bytes.
+ * @return The length of the records.
+ */
+uint32_t recording_copy(const recording_t *recording, uint8_t *records);
+
+/*
+ * Starts recording, so that the next loop is recorded in full.
+ *
+ * @param recorder The recorder to start.
+ * @param loop The loop number of the next loop.
+ */
+void recorder_begin(recorder_t *recorder, uint32_t loop);
+
+/*
+ * Records whatever changed in a loop. Every RECORDING_KEYFRAME_LOOPS loops,
+ * or RECORDING_KEYFRAME_BYTES, everything is recorded instead, so that a
+ * replay can start from any of these full frames. The display state is only
+ * recorded when it differs from the last one moved on a step, as most
+ * animations just step each loop.
+ *
+ * @param recorder The recorder.
+ * @param current The loop to record.
+ * @param write Adds each record to the recording.
+ */
+void recorder_loop(recorder_t *recorder, const recorded_loop_t *current, record_writer_t write);
+
+/*
+ * Starts replaying a dumped recording. The replay starts at the first full
+ * frame that has everything needed to render it.
+ *
+ * @param replay The replay to start.
+ * @param dump The dumped recording, which must outlive the replay.
+ * @param length The length of the dump.
+ * @return true if the dump has something to replay, false otherwise.
+ */
+bool replay_begin(replay_t *replay, const uint8_t *dump, size_t length);
+
+/*
+ * Replays the next loop of a recording, rendering what was displayed from
+ * its recorded state with this build's display code.
+ *
+ * @param replay The replay.
+ * @return true if a loop was replayed, false at the end of the recording.
+ */
+bool replay_loop(replay_t *replay);
+
+/*
+ * Compares the replayed LEDs with the recorded ones for the last loop.
+ *
+ * @param replay The replay.
+ * @param tolerance The largest difference in a channel to ignore.
+ * @param difference Set to the largest difference in any channel.
+ * @return The first LED that differs by more than the tolerance, or -1 if
+ *         none do.
+ */
+int replay_compare(const replay_t *replay, uint8_t tolerance, uint8_t *difference);
+
+#endif
@@ -0,0 +1,57 @@
+#include "radio_stations.h"
+#include <string.h>
+
+uint8_t radio_rank_stations(const uint8_t *levels, radio_station_t *stations) {
+    uint8_t count = 0;
+    for (uint16_t ii = 0; ii < RADIO_SCAN_COUNT; ii++) {
+        uint8_t level = levels[ii];
+        if (level < RADIO_MIN_STATION_LEVEL ||
+            (ii > 0 && levels[ii - 1] > level) ||
+            (ii < RADIO_SCAN_COUNT - 1 && levels[ii + 1] >= level)) {
+            continue;
+        }
+
+        // Insert the station in order of signal level, dropping the weakest.
+        uint8_t pos = count;
+        while (pos > 0 && stations[pos - 1].level < level) {
+            pos--;
+        }
+        if (pos >= MAX_RADIO_STATIONS) {
+            continue;
+        }
+        if (count < MAX_RADIO_STATIONS) {
+            count++;
+        }
+        memmove(&stations[pos + 1], &stations[pos], (count - 1 - pos) * sizeof(radio_station_t));
+        stations[pos].frequency = RADIO_SCAN_START + ii;
+        stations[pos].level = level;
+    }
+    return count;
+}
+
+uint8_t radio_scan_band(const radio_driver_t *driver, radio_station_t *stations) {
+    driver->setMute(true);
+
+    uint8_t levels[RADIO_SCAN_COUNT];
+    for (uint16_t ii = 0; ii < RADIO_SCAN_COUNT; ii++) {
+        levels[ii] = driver->tune(RADIO_SCAN_START + ii);
+    }
+    return radio_rank_stations(levels, stations);
+}
+
+int radio_play_first(const radio_driver_t *driver, const uint16_t *frequencies, uint8_t count, uint8_t *levels) {
+    // Stay quiet while hunting for a station.
+    driver->setMute(true);
+    memset(levels, 0, count);
+    for (uint8_t ii = 0; ii < count; ii++) {
+        if (frequencies[ii] == 0) {
+            continue;
+        }
+        levels[ii] = driver->tune(frequencies[ii]);
+        if (levels[ii] >= RADIO_MIN_ALARM_LEVEL) {
+            driver->setMute(false);
+            return ii;
+        }
+    }
+    return -1;
+}
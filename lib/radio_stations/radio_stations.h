@@ -0,0 +1,75 @@
+#ifndef RADIO_STATIONS_H
+#define RADIO_STATIONS_H
+
+#include <stdint.h>
+
+// The maximum number of stations kept from a band scan.
+const uint8_t MAX_RADIO_STATIONS = 16;
+
+// The lowest frequency in the band scan (100 kHz units).
+const uint16_t RADIO_SCAN_START = 875;
+
+// The highest frequency in the band scan (100 kHz units).
+const uint16_t RADIO_SCAN_END = 1080;
+
+// The number of frequencies checked in a band scan.
+const uint16_t RADIO_SCAN_COUNT = RADIO_SCAN_END - RADIO_SCAN_START + 1;
+
+// The minimum signal level (0-15) for a frequency to count as a station when
+// scanning.
+const uint8_t RADIO_MIN_STATION_LEVEL = 7;
+
+// The minimum signal level (0-15) for the radio to be used for the alarm,
+// below which the buzzer is used instead.
+const uint8_t RADIO_MIN_ALARM_LEVEL = 5;
+
+// A station found by a band scan.
+typedef struct {
+    uint16_t frequency;
+    uint8_t level;
+} radio_station_t;
+
+// The operations on the radio receiver. On the clock these are I2C
+// transactions with the TEA5767, made only from the radio task.
+typedef struct {
+    // Tunes to a frequency (100 kHz units) and returns the signal level
+    // (0-15) once the receiver has settled.
+    uint8_t (*tune)(uint16_t frequency);
+
+    // Mutes (true) or unmutes (false) the receiver.
+    void (*setMute)(bool mute);
+} radio_driver_t;
+
+/*
+ * Picks the stations out of the signal levels across the band. Only peaks
+ * count, as a strong station also shows on the neighbouring frequencies.
+ *
+ * @param levels The signal level at each frequency of the scan.
+ * @param stations Filled with the strongest stations, strongest first.
+ * @return The number of stations found (up to MAX_RADIO_STATIONS).
+ */
+uint8_t radio_rank_stations(const uint8_t *levels, radio_station_t *stations);
+
+/*
+ * Scans the band with the receiver muted, and ranks the stations found.
+ *
+ * @param driver The radio receiver.
+ * @param stations Filled with the strongest stations, strongest first.
+ * @return The number of stations found (up to MAX_RADIO_STATIONS).
+ */
+uint8_t radio_scan_band(const radio_driver_t *driver, radio_station_t *stations);
+
+/*
+ * Plays the first of a list of frequencies with reasonable reception.
+ *
+ * @param driver The radio receiver.
+ * @param frequencies The frequencies to try in order, 0 for unused entries.
+ * @param count The number of frequencies.
+ * @param levels Filled with the signal level found at each frequency tried,
+ *               and 0 for the rest.
+ * @return The index of the frequency playing, or -1 if none had reasonable
+ *         reception, in which case the receiver is left muted.
+ */
+int radio_play_first(const radio_driver_t *driver, const uint16_t *frequencies, uint8_t count, uint8_t *levels);
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+// Let another task run, even if it is on this core.
+#define SEQLOCK_YIELD() vTaskDelay(1)
+#else
+#include <thread>
+#define SEQLOCK_YIELD() std::this_thread::yield()
+#endif
+
+// A value shared between tasks, guarded by a sequence lock. The sequence
+// number is odd while a write is in progress, so readers can detect (and
+// retry) a torn copy without ever blocking the writer. Writers are serialised
+// by a spin lock.
+template <typename T>
+struct seqlock_t {
+    std::atomic<uint32_t> sequence{0};
+    std::atomic_flag writeLock = ATOMIC_FLAG_INIT;
+    T value;
+};
+
+/*
+ * Publishes a new value, but only if nothing else has been published since
+ * the value it was based on was read, so that another task's update isn't
+ * overwritten. Readers are never blocked.
+ *
+ * @param lock The shared value.
+ * @param value The value to be published.
+ * @param expected The sequence number of the value it was based on.
+ * @param sequence Set to the sequence number of the published value.
+ * @return true if the value was published, false if another was published
+ *         since the expected one.
+ */
+template <typename T>
+bool seqlock_publish_if(seqlock_t<T> *lock, const T *value, uint32_t expected, uint32_t *sequence) {
+    while (lock->writeLock.test_and_set(std::memory_order_acquire)) {
+        // Another task is publishing, let it finish.
+        SEQLOCK_YIELD();
+    }
+
+    uint32_t current = lock->sequence.load(std::memory_order_relaxed);
+    bool isPublished = current == expected;
+    if (isPublished) {
+        lock->sequence.store(current + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&lock->value, value, sizeof(T));
+        lock->sequence.store(current + 2, std::memory_order_release);
+        *sequence = current + 2;
+    }
+
+    lock->writeLock.clear(std::memory_order_release);
+    return isPublished;
+}
+
+/*
+ * Publishes a new value, for other tasks to read. Readers are never blocked.
+ *
+ * @param lock The shared value.
+ * @param value The value to be published.
+ * @return The sequence number of the published value.
+ */
+template <typename T>
+uint32_t seqlock_publish(seqlock_t<T> *lock, const T *value) {
+    uint32_t sequence;
+    while (!seqlock_publish_if(lock, value, lock->sequence.load(std::memory_order_relaxed), &sequence)) {
+        // Another task published in between, publish over it.
+    }
+    return sequence;
+}
+
+/*
+ * Makes a single attempt at copying the shared value.
+ *
+ * @param lock The shared value.
+ * @param dest The value into which the shared value is copied.
+ * @param sequence Set to the sequence number of the copied value.
+ * @return true if the copy is consistent, false if it raced with a writer.
+ */
+template <typename T>
+bool seqlock_try_read(seqlock_t<T> *lock, T *dest, uint32_t *sequence) {
+    uint32_t before = lock->sequence.load(std::memory_order_acquire);
+    if ((before & 1) != 0) {
+        // A write is in progress.
+        return false;
+    }
+
+    memcpy(dest, &lock->value, sizeof(T));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint32_t after = lock->sequence.load(std::memory_order_relaxed);
+    *sequence = before;
+    return before == after;
+}
+
+/*
+ * Copies the shared value, retrying until a consistent copy is made.
+ *
+ * @param lock The shared value.
+ * @param dest The value into which the shared value is copied.
+ * @return The sequence number of the copied value.
+ */
+template <typename T>
+uint32_t seqlock_read(seqlock_t<T> *lock, T *dest) {
+    uint32_t sequence;
+    while (!seqlock_try_read(lock, dest, &sequence)) {
+        // Let the writer finish.
+        SEQLOCK_YIELD();
+    }
+    return sequence;
+}
+
+/*
+ * Gets the sequence number of the shared value, to check whether it has been
+ * published since it was last read.
+ *
+ * @param lock The shared value.
+ * @return The current sequence number.
+ */
+template <typename T>
+uint32_t seqlock_sequence(const seqlock_t<T> *lock) {
+    return lock->sequence.load(std::memory_order_acquire);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "sun_table.h"
+#include <math.h>
+
+/*
+ * Determines whether the sun is up all day (rather than down all day) on a
+ * day that has no sunrise or sunset.
+ *
+ * @param latitude The latitude of the location.
+ * @param day The day of the (leap) year.
+ * @return true if it is the summer half of the year at the location.
+ */
+static bool is_polar_summer(double latitude, uint16_t day) {
+    bool isNorthernSummer = day >= SUN_TABLE_MARCH_EQUINOX && day < SUN_TABLE_SEPTEMBER_EQUINOX;
+    return (latitude >= 0) == isNorthernSummer;
+}
+
+/*
+ * Converts a calculated time into a table entry. There is no time (NaN) when
+ * the sun doesn't cross the horizon, in which case the time is moved so that
+ * the whole day is light (polar day) or dark (polar night).
+ *
+ * @param minutes The calculated time (minutes into the day).
+ * @param isRise Flag set for a sunrise, clear for a sunset.
+ * @param isSummer Flag set when a missing time means the sun is always up.
+ * @param isPolar Set when the time is missing, left alone otherwise.
+ * @return The time to store in the table.
+ */
+static uint16_t sun_table_minute(double minutes, bool isRise, bool isSummer, bool *isPolar) {
+    if (isnan(minutes)) {
+        *isPolar = true;
+        if (isSummer) {
+            return isRise ? 0 : SUN_TABLE_MINUTES;
+        }
+        return SUN_TABLE_MINUTES / 2;
+    } else if (minutes < 0) {
+        return 0;
+    } else if (minutes > SUN_TABLE_MINUTES) {
+        return SUN_TABLE_MINUTES;
+    }
+    return static_cast<uint16_t>(minutes);
+}
+
+void sun_table_begin(sun_table_t *table, double latitude, double longitude, double offset) {
+    table->latitude = latitude;
+    table->longitude = longitude;
+    table->offset = offset;
+    table->days = 0;
+    table->polarDays = 0;
+}
+
+bool sun_table_matches(const sun_table_t *table, double latitude, double longitude, double offset) {
+    return table->days == SUN_TABLE_DAYS &&
+        table->latitude == latitude &&
+        table->longitude == longitude &&
+        table->offset == offset;
+}
+
+bool sun_table_step(sun_table_t *table, SunSet *sun, uint16_t days) {
+    sun->setPosition(table->latitude, table->longitude, table->offset);
+    uint8_t month = 0;
+    for (uint16_t ii = 0; ii < days && table->days < SUN_TABLE_DAYS; ii++) {
+        uint16_t day = table->days;
+        while (month < 11 && day >= DAYS_BEFORE_MONTH[month + 1]) {
+            month++;
+        }
+        sun->setCurrentDate(SUN_TABLE_YEAR, month + 1, day - DAYS_BEFORE_MONTH[month] + 1);
+
+        bool isSummer = is_polar_summer(table->latitude, day);
+        bool isPolar = false;
+        table->civilSunrise[day] = sun_table_minute(sun->calcCivilSunrise(), true, isSummer, &isPolar);
+        table->sunrise[day] = sun_table_minute(sun->calcSunrise(), true, isSummer, &isPolar);
+        table->sunset[day] = sun_table_minute(sun->calcSunset(), false, isSummer, &isPolar);
+        table->civilSunset[day] = sun_table_minute(sun->calcCivilSunset(), false, isSummer, &isPolar);
+        if (isPolar) {
+            table->polarDays++;
+        }
+        table->days++;
+    }
+    return table->days == SUN_TABLE_DAYS;
+}
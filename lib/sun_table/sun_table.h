@@ -0,0 +1,76 @@
+#ifndef SUN_TABLE_H
+#define SUN_TABLE_H
+
+#include <stdint.h>
+#include <sunset.h>
+
+// The number of days in the sunrise/sunset table. This is a leap year, so that
+// every calendar date has its own entry.
+const uint16_t SUN_TABLE_DAYS = 366;
+
+// The (leap) year used when calculating the sunrise/sunset table.
+const int SUN_TABLE_YEAR = 2024;
+
+// The number of days before the start of each month in a leap year, used to
+// index the sunrise/sunset table.
+const uint16_t DAYS_BEFORE_MONTH[] = {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335};
+
+// The minutes in a day, the latest time held in the table.
+const uint16_t SUN_TABLE_MINUTES = 1440;
+
+// The days of the (leap) year between the equinoxes, when the northern
+// hemisphere has its polar days.
+const uint16_t SUN_TABLE_MARCH_EQUINOX = 79;
+const uint16_t SUN_TABLE_SEPTEMBER_EQUINOX = 265;
+
+// Sunrise/sunset times (minutes into the day) for every day of the year at a
+// single location, so that the daily values are a lookup rather than a
+// calculation. Missing times, on days when the sun (or civil twilight) doesn't
+// cross the horizon, are clamped so that the whole day is light or dark, and
+// those days are counted in polarDays.
+typedef struct {
+    double latitude;
+    double longitude;
+    double offset;
+    uint16_t days;
+    uint16_t polarDays;
+    uint16_t civilSunrise[SUN_TABLE_DAYS];
+    uint16_t sunrise[SUN_TABLE_DAYS];
+    uint16_t sunset[SUN_TABLE_DAYS];
+    uint16_t civilSunset[SUN_TABLE_DAYS];
+} sun_table_t;
+
+/*
+ * Starts a new, empty table for a location.
+ *
+ * @param table The table to start.
+ * @param latitude The latitude of the location.
+ * @param longitude The longitude of the location.
+ * @param offset The timezone offset (hours) for the calculations.
+ */
+void sun_table_begin(sun_table_t *table, double latitude, double longitude, double offset);
+
+/*
+ * Determines whether a table has been calculated for a location.
+ *
+ * @param table The table to check.
+ * @param latitude The latitude of the location.
+ * @param longitude The longitude of the location.
+ * @param offset The timezone offset (hours) for the calculations.
+ * @return true if the table is complete and for the location, false otherwise.
+ */
+bool sun_table_matches(const sun_table_t *table, double latitude, double longitude, double offset);
+
+/*
+ * Calculates the next few days of a table. This is split up so that the
+ * calculation (double precision trig, which is slow without a double FPU) can
+ * be spread over several loops.
+ *
+ * @param table The table being calculated.
+ * @param sun The calculator to use, which is moved to the table's location.
+ * @param days The most days to calculate.
+ * @return true if the table is complete, false if there are days left.
+ */
+bool sun_table_step(sun_table_t *table, SunSet *sun, uint16_t days);
+
+#endif
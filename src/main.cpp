@@ -1,11 +1,29 @@
 #include "main.h"
 
-// The object used to send UDP debug messages.
+// The object used to send UDP telemetry datagrams.
 WiFiUDP udp;
 
 // The IP address of this device.
 IPAddress myIPAddress;
 
+// The queue of messages posted for the display, from any task.
+QueueHandle_t myMessageQueue = NULL;
+
+// The messages waiting to be shown, or being shown, by the main loop.
+message_slot_t myMessages[MESSAGE_SLOTS];
+
+// The slot of the message being shown, or -1 when there is none.
+int8_t myMessageSlot = -1;
+
+// The font indexes for the message being shown.
+uint8_t myMessageGlyphs[MESSAGE_MAX_LEN];
+
+// The number of font indexes in the message being shown.
+uint8_t myMessageLength = 0;
+
+// When (millis()) the message being shown was started, for scrolling.
+uint32_t myMessageStart = 0;
+
 // The current operating state of the clock.
 state_t myState = state_t::INITIALISING;
 
@@ -27,6 +45,12 @@ flash_config_t myConfiguration;
 // The new configuration values while the user is editing it in the menu.
 flash_config_t myNewConfiguration;
 
+// The published configuration, shared with the web server task.
+seqlock_t<flash_config_t> mySharedConfiguration;
+
+// The sequence number of the shared configuration last applied by loop().
+uint32_t myConfigSequence = 0;
+
 // The last timestamp that we processed.
 time_t myLastTimestamp = 0;
 
@@ -45,15 +69,69 @@ uint16_t mySunrise = 0;
 // The number of minutes into the day when sunset occurs.
 uint16_t mySunset = 0;
 
+// The number of minutes into the day when civil twilight starts (dawn).
+uint16_t myCivilSunrise = 0;
+
+// The number of minutes into the day when civil twilight ends (dusk).
+uint16_t myCivilSunset = 0;
+
+// The number of minutes that daylight saving moves the clock forward.
+int16_t myDstShift = 0;
+
 // Day (true) or night (false)?
 boolean myIsDaytime = true;
 
+// The day/night blend currently displayed (BLEND_NIGHT - BLEND_DAY).
+uint8_t myDayBlend = BLEND_DAY;
+
+// The day/night blend that the display is moving towards.
+uint8_t myDayBlendTarget = BLEND_DAY;
+
 // The current brightness of the clock.
 uint8_t myBrightness = MAX_BRIGHTNESS;
 
 // The counter until the next brightness check.
 int32_t myBrightnessCounter = 0;
 
+// The calibration of the LEDs, built from the configured calibration.
+led_output_t myLedOutput;
+
+// The frame being built for the LEDs.
+frame_t myFrame;
+
+// What was last shown on the display.
+display_state_t myDisplay;
+
+// The number of loops run since start-up.
+uint32_t myLoopCount = 0;
+
+// The last light level read from the LDR.
+uint16_t myLdr = 0;
+
+// Whether the display and its inputs are being recorded.
+bool myIsRecording = false;
+
+// The ring buffer holding the display recording.
+recording_t myRecording;
+
+// Guards the display recording, which is dumped by the web server.
+portMUX_TYPE myRecordingMux = portMUX_INITIALIZER_UNLOCKED;
+
+// What has been recorded so far, so that only the changes are recorded.
+recorder_t myRecorder;
+
+// The uploaded (custom) patterns.
+custom_pattern_t myPatterns[CUSTOM_PATTERN_COUNT];
+
+// The wake-up ramp before the alarm.
+wake_ramp_t myWakeRamp;
+
+// The brightness of the wake-up light (0 - MAX_BRIGHTNESS_F), 0 when unused.
+float myWakeBrightness = 0.0f;
+
+// The colour of the wake-up light.
+colour_t myWakeColour;
+
 // Timer used for counting down to an event.
 uint32_t myCountdownTimer = 0;
 
@@ -66,29 +144,136 @@ boolean myFlashValue = true;
 // The animation step, if animations are active.
 int myAnimationStep = 0;
 
-// The buzzer step, if the buzzer is sounding.
-uint8_t myBuzzerStep = 0;
+// The pattern being previewed, if a preview has been requested.
+display_pattern_t myPreviewPattern = display_pattern_t::SOLID_COLOUR;
+
+// The colour of the pattern being previewed.
+colour_t myPreviewColour;
+
+// The number of loops remaining for the pattern preview, 0 = no preview.
+uint32_t myPreviewRemaining = 0;
+
+// The queue of commands for the main loop, filled by other tasks.
+command_slot_t myCommandSlots[COMMAND_QUEUE_SIZE];
+
+// The position in the command queue that the next command is written to.
+std::atomic<uint32_t> myCommandHead(0);
+
+// The position in the command queue that the next command is read from.
+// This is only used by the main loop.
+uint32_t myCommandTail = 0;
+
+// Statistics for the executed commands.
+command_stats_t myCommandStats;
 
-// The number of ticks remaining in this step.
-uint16_t myBuzzerTicksRemaining;
+// The compiled buzzer pattern for the alarm.
+tone_pattern_t myAlarmTones;
+
+// The compiled buzzer pattern for encoder feedback.
+tone_pattern_t myClickTones;
+
+// The buzzer pattern currently playing, NULL when silent.
+const tone_pattern_t *myTonePattern = NULL;
+
+// The next step to be played in the buzzer pattern.
+uint8_t myToneStep = 0;
+
+// The volume level (0-255) that the buzzer pattern is scaled by.
+uint8_t myToneLevel = 0;
+
+// Counts the changes of buzzer pattern, so that a timer callback that is
+// already running when the pattern changes doesn't carry on the old one.
+uint32_t myToneGeneration = 0;
+
+// Guards the buzzer pattern state, shared with the timer callback.
+portMUX_TYPE myToneMux = portMUX_INITIALIZER_UNLOCKED;
+
+// The hardware timer used to step through the buzzer pattern.
+esp_timer_handle_t myToneTimer;
 
 // Reads the position of the encoder.
 RotaryEncoder myEncoder(PIN_ENCODER_A, PIN_ENCODER_B);
 
-// The last encoder position.
-uint32_t myLastPosition = -999;
+// The last encoder position handled by the main loop.
+long myEncoderPosition = 0;
+
+// The time (microseconds, wrapping) of the last encoder interrupt.
+std::atomic<uint32_t> myEncoderTickTime(0);
 
-// The button on the encoder.
-Button myButton(PIN_ENCODER_SW);
+// The time (microseconds, wrapping) of the last encoder movement handled.
+uint32_t myEncoderMoveTime = 0;
 
-// Flag to indicate that the button has been pressed.
-// This allows us to differentiate single and double clicks.
-boolean myWasPressed = false;
+// The button edges queued by the button interrupt.
+button_event_t myButtonEvents[BUTTON_QUEUE_SIZE];
+
+// The number of button edges queued by the interrupt, ever.
+std::atomic<uint32_t> myButtonHead(0);
+
+// The number of button edges taken by the main loop, ever.
+std::atomic<uint32_t> myButtonTail(0);
+
+// The number of button edges dropped as the queue was full.
+std::atomic<uint32_t> myButtonDropped(0);
+
+// The last button edge, waiting to be accepted once the button is stable.
+button_event_t myButtonEdge;
+
+// Flag to indicate that the button is pressed (after debouncing).
+boolean myIsButtonPressed = false;
+
+// The time (microseconds, wrapping) of the last accepted press and release.
+uint32_t myButtonPressTime = 0;
+uint32_t myButtonReleaseTime = 0;
+
+// The number of clicks in the current click gesture.
+uint8_t myClickCount = 0;
 
 // Flag to indicate that the button has been held long enough to register as a
 // long press.
 boolean myIsLongPress = false;
 
+// The time (microseconds, wrapping) of the next repeat while holding.
+uint32_t myHoldRepeatTime = 0;
+
+// Flag set when an input has been handled, but not yet displayed.
+boolean myIsInputPending = false;
+
+// The time (microseconds, wrapping) of the input waiting to be displayed.
+uint32_t myInputTime = 0;
+
+// The input-to-display latency statistics.
+input_stats_t myInputStats;
+
+// The LED current statistics.
+power_stats_t myPowerStats;
+
+// The event log entries held in RAM.
+log_entry_t myLog[LOG_RAM_ENTRIES];
+
+// The number of events ever logged.
+uint32_t myLogHead = 0;
+
+// The number of events ever written to (or lost before) the log file.
+uint32_t myLogFlushed = 0;
+
+// Guards the event log in RAM, as events are logged by several tasks.
+portMUX_TYPE myLogMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Serialises access to the log file.
+SemaphoreHandle_t myLogFileMutex = NULL;
+
+// Whether the log file is ready to be written.
+std::atomic<bool> myIsLogFileReady(false);
+
+// When the event log was last written to the log file (ms).
+unsigned long myLogFlushTime = 0;
+
+// Set to have loop() write the event log to the log file.
+std::atomic<bool> myIsLogFlushRequested(false);
+
+// The number of times that writing the event log to the log file finished.
+std::atomic<uint32_t> myLogFlushCount(0);
+
 // Flag to indicate if the user's alarm switch is set to enabled.
 boolean myIsAlarmSwitchEnabled = true;
 
@@ -101,1253 +286,5464 @@ Preferences prefs;
 // The sunrise/sunset calculator.
 SunSet sun;
 
+// The sunrise/sunset times for each day of the year at the current location.
+sun_table_t mySunTable;
+
+// The sunrise/sunset table being calculated for a new location. mySunTable is
+// used until it is complete.
+sun_table_t myNewSunTable;
+
+// Whether myNewSunTable is being calculated.
+bool myIsSunTableBuilding = false;
+
 // The FM radio receiver.
 TEA5767 radio;
 
+// The queue of requests for the radio task.
+QueueHandle_t myRadioQueue = NULL;
+
+// The radio task, once started.
+TaskHandle_t myRadioTask = NULL;
+
+// The stations found by the last band scan, strongest first.
+radio_station_t myRadioStations[MAX_RADIO_STATIONS];
+
+// The number of stations found by the last band scan.
+uint8_t myRadioStationCount = 0;
+
+// Guards the station table, which is shared with the web server.
+portMUX_TYPE myRadioMux = portMUX_INITIALIZER_UNLOCKED;
+
+// The band scans waiting for, or being run by, the radio task. The alarm uses
+// the buzzer while there are any, rather than waiting behind them.
+std::atomic<uint8_t> myRadioScansPending(0);
+
+// Statistics for the I2C transactions with the radio.
+i2c_stats_t myI2cStats;
+
+// The telemetry records waiting to be sent.
+uint8_t myTelemetry[TELEMETRY_BUFFER_SIZE];
+
+// The number of bytes of telemetry records waiting to be sent.
+size_t myTelemetryUsed = 0;
+
+// The number of telemetry records dropped since the last datagram.
+uint16_t myTelemetryDropped = 0;
+
+// Guards the telemetry records, which are sent by the telemetry task.
+portMUX_TYPE myTelemetryMux = portMUX_INITIALIZER_UNLOCKED;
+
+// The time between telemetry datagrams (ms, 0 = no telemetry).
+std::atomic<uint16_t> myTelemetryInterval(0);
+
+// The telemetry task, once started.
+TaskHandle_t myTelemetryTask = NULL;
+
+// The last state sent as telemetry.
+telemetry_state_t myTelemetryState = {0xFF, 0xFF};
+
+// The network connection to the MQTT broker.
+WiFiClient myMqttWifiClient;
+
+// The MQTT client, only used by the MQTT task.
+PubSubClient myMqtt(myMqttWifiClient);
+
+// The outgoing MQTT messages, one per topic, kept while the broker is
+// unreachable.
+mqtt_slot_t myMqttSlots[MAX_MQTT_TOPIC_INDEX + 1];
+
+// Guards the outgoing MQTT messages, which are sent by the MQTT task.
+portMUX_TYPE myMqttMux = portMUX_INITIALIZER_UNLOCKED;
+
+// The MQTT task, once started.
+TaskHandle_t myMqttTask = NULL;
+
+// The statistics for the MQTT client.
+mqtt_stats_t myMqttStats;
+
+// The alarm state last published with MQTT.
+alarm_state_t myMqttAlarmState = alarm_state_t::INACTIVE;
+
+// The brightness last published with MQTT.
+uint8_t myMqttBrightness = 0;
+
+// Whether it was daytime when last published with MQTT.
+boolean myMqttIsDaytime = true;
+
+// Whether the state has been published with MQTT since starting.
+boolean myIsMqttStatePublished = false;
+
+// The state of the OTA update.
+std::atomic<uint8_t> myOtaState(ota_state_t::OTA_IDLE);
+
+// The progress of the OTA update (percent).
+std::atomic<uint8_t> myOtaProgress(0);
+
+// Whether the OTA update is of the file system, which must be unmounted.
+boolean myIsOtaFilesystem = false;
+
+// The hash of the firmware being uploaded over HTTP.
+mbedtls_md_context_t myOtaHash;
+
+// The expected SHA-256 digest of the firmware being uploaded over HTTP.
+uint8_t myOtaDigest[OTA_DIGEST_LEN];
+
+// The bytes of the firmware received over HTTP.
+size_t myOtaReceived = 0;
+
+// Whether ArduinoOTA is receiving an update.
+boolean myIsArduinoOtaStarted = false;
+
+// When the progress of an ArduinoOTA update was last displayed (ms).
+unsigned long myLastOtaProgressTime = 0;
+
+// The web request uploading an update, if any.
+AsyncWebServerRequest *myOtaRequest = NULL;
+
+// Why the update being uploaded failed, or NULL if it hasn't.
+const char *myOtaError = NULL;
+
+// Whether this firmware is an OTA update that hasn't been confirmed yet.
+boolean myIsOtaUnconfirmed = false;
+
+// The last sample of the heap and task stacks.
+memory_stats_t myMemoryStats;
+
+// Guards the memory statistics, which are shared with the web server.
+portMUX_TYPE myMemoryMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Whether memory is low, so the web server only serves the memory statistics.
+std::atomic<bool> myIsMemoryLow(false);
+
+// The tasks whose stacks have been reported as low.
+uint8_t myStackLowReported = 0;
+
 // The web server used for configuration.
 AsyncWebServer *webServer;
 
-/*
- * Sends debugging information to the server via UDP.
+// The WiFi manager, run in non-blocking mode so that the clock can start
+// before the network is available.
+WiFiManager wifiManager;
+
+// Whether the network services (web server, OTA, NTP) have been started.
+boolean myIsNetworkStarted = false;
+
+// The mDNS host name, derived from the device name.
+char myHostname[HOSTNAME_MAX_LEN + 1] = "espclock";
+
+// The sequence of the last configuration bundle applied.
+uint32_t myFleetSequence = 0;
+
+// Whether the WiFi configuration portal has been started.
+boolean myIsPortalStarted = false;
+
+// The statistics for the WiFi connection, including its state.
+wifi_stats_t myWifiStats;
+
+// Guards the WiFi statistics, which are shared with the web server.
+portMUX_TYPE myWifiMux = portMUX_INITIALIZER_UNLOCKED;
+
+// When the current WiFi connection attempt started (ms).
+unsigned long myWifiAttemptTime = 0;
+
+// When the WiFi connection will next be retried (ms).
+unsigned long myWifiRetryTime = 0;
+
+// The delay before the next WiFi retry (ms), doubling with each failure.
+unsigned long myWifiBackoff = WIFI_MIN_BACKOFF;
+
+// The access point last connected to.
+wifi_cache_t myWifiCache;
+
+// Whether the current attempt uses the cached access point.
+boolean myIsWifiFastConnect = false;
+
+// Whether the time being shown is the cached time, not yet confirmed by NTP.
+boolean myIsTimeProvisional = false;
+
+// Whether the cached time came from flash, so could be out by the time the
+// power was off. Alarms aren't checked until NTP confirms the time.
+boolean myIsTimeStale = false;
+
+// The last known time, retained in RTC memory across soft resets.
+RTC_NOINIT_ATTR rtc_time_cache_t myRtcTimeCache;
+
+// Whether an alarm saved in flash is waiting for NTP to confirm the time, so
+// that how long the clock was off is known before resuming it.
+boolean myIsAlarmResumePending = false;
+
+// The alarm saved in flash, waiting to be resumed.
+alarm_persist_t myPendingAlarm;
+
+// Whether LittleFS is mounted. It is unmounted while a file system update is
+// written.
+std::atomic<bool> myIsFilesystemMounted(false);
+
+// Incremented whenever LittleFS is mounted or unmounted, so that anything
+// cached from it is read again.
+std::atomic<uint32_t> myFilesystemGeneration(0);
+
+// The last date checked against the skipped dates (YYYYMMDD), 0 = none.
+uint32_t mySkipCacheDate = 0;
+
+// The file system generation that mySkipCacheDate was checked against.
+uint32_t mySkipCacheGeneration = 0;
+
+// Whether the alarm is skipped on mySkipCacheDate.
+bool myIsSkipCacheDate = false;
+
+// The state of the alarm, kept in RTC memory so that it survives crashes.
+RTC_NOINIT_ATTR alarm_persist_t myRtcAlarmState;
+
+// The times the current alarm has been resumed after a reset.
+uint8_t myAlarmRecoveries = 0;
+
+// The number of alarms resumed after a reset.
+uint32_t myRecoveredAlarms = 0;
+
+// The time (in milliseconds since boot) at which the last boot phase ended.
+unsigned long myBootPhaseTime = 0;
+
+/**
+ * Formats an event log entry as a line of text.
  * 
- * @param format The "printf" formatting string.
- * @param ... The values to be used when referenced from the format string.
+ * @param entry The entry to format.
+ * @param line The buffer for the line.
+ * @param size The size of the buffer.
+ * @return The length of the line, including the newline.
  */
-/*
-void debug_printf(const char *format, ...) {
-    uint8_t buf[64];
-    uint8_t *buffer = buf;
-
-    // Format the supplied string as per the formatting rules.
-    va_list arg;
-    va_start(arg, format);
-    size_t strlen = vsnprintf((char *)buf, sizeof(buf), format, arg);
-    Serial.printf(format, arg);
-    va_end(arg);
-
-    // if (strlen > sizeof(buf) - 1) {
-    //     // The formatted string is too big for the buffer, create a bigger one.
-    //     buffer = new uint8_t[strlen + 1];
-    //     if (buffer == nullptr) {
-    //         // We couldn't allocate enough memory for it, do nothing.
-    //         return;
-    //     }
-        
-    //     va_start(arg, format);
-    //     vsnprintf((char *)buffer, strlen + 1, format, arg);
-    //     va_end(arg);
-    // }
+size_t format_log_entry(const log_entry_t *entry, char *line, size_t size) {
+    char timestamp[20] = "-";
+    if (entry->time != 0) {
+        time_t time = entry->time;
+        tm tm_val;
+        localtime_r(&time, &tm_val);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_val);
+    }
+    const char *level = (entry->level <= LOG_LEVEL_ERROR) ? LOG_LEVEL_STRINGS[entry->level] : "?";
+    int len = snprintf(line, size, "%s %lu.%03lu %s ", timestamp, 
+        (unsigned long)(entry->uptime / 1000), (unsigned long)(entry->uptime % 1000), level);
+    if (len > 0 && (size_t)len < size) {
+        const char *format = (entry->event <= MAX_LOG_EVENT_INDEX) ? 
+            LOG_EVENT_STRINGS[entry->event] : "Unknown event %ld %ld";
+        len += snprintf(&line[len], size - len, format, (long)entry->values[0], (long)entry->values[1]);
+    }
+    if (len < 0) {
+        len = 0;
+    } else if ((size_t)len > size - 2) {
+        len = size - 2;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+/**
+ * Adds an event to the event log. This is cheap, as the event is only
+ * formatted if it is also written to the serial port. Use the LOG_* macros,
+ * so that events below LOG_LEVEL are compiled out.
+ * 
+ * @param level The level of the event (LOG_LEVEL_*).
+ * @param event The event.
+ * @param a The first value for the event.
+ * @param b The second value for the event.
+ */
+void log_event(uint8_t level, log_event_t event, int32_t a, int32_t b) {
+    log_entry_t entry;
+    time_t now;
+    time(&now);
+    entry.time = (now >= MIN_VALID_TIMESTAMP) ? (uint32_t)now : 0;
+    entry.uptime = millis();
+    entry.level = level;
+    entry.event = event;
+    entry.values[0] = a;
+    entry.values[1] = b;
+
+    portENTER_CRITICAL(&myLogMux);
+    myLog[myLogHead % LOG_RAM_ENTRIES] = entry;
+    myLogHead++;
+    portEXIT_CRITICAL(&myLogMux);
+
+    if (level >= LOG_SERIAL_LEVEL) {
+        char line[LOG_LINE_LEN];
+        format_log_entry(&entry, line, sizeof(line));
+        Serial.print(line);
+    }
+}
+
+/**
+ * Creates the log file if it is missing or damaged. It is created at its full
+ * size, so that flushing only ever overwrites entries.
+ */
+void init_log_file() {
+    if (myLogFileMutex == NULL) {
+        myLogFileMutex = xSemaphoreCreateMutex();
+    }
+
+    log_file_header_t header;
+    File file = LittleFS.open(LOG_FILE, FILE_READ);
+    bool isValid = file && 
+        file.size() == sizeof(log_file_header_t) + (LOG_FILE_ENTRIES * sizeof(log_entry_t)) &&
+        file.read((uint8_t *)&header, sizeof(log_file_header_t)) == sizeof(log_file_header_t) &&
+        header.magic == LOG_MAGIC;
+    file.close();
+
+    if (!isValid) {
+        file = LittleFS.open(LOG_FILE, FILE_WRITE);
+        if (!file) {
+            Serial.println("Unable to create the log file.");
+            return;
+        }
+        header.magic = LOG_MAGIC;
+        header.next = 0;
+        file.write((const uint8_t *)&header, sizeof(log_file_header_t));
+        log_entry_t blank = {};
+        for (uint32_t ii = 0; ii < LOG_FILE_ENTRIES; ii++) {
+            file.write((const uint8_t *)&blank, sizeof(log_entry_t));
+        }
+        file.close();
+    }
+    myIsLogFileReady = true;
+}
+
+/**
+ * Writes the events held in RAM to the log file. This may be called from
+ * any task other than the radio task, but not from an interrupt.
+ */
+void flush_log() {
+    static log_entry_t entries[LOG_RAM_ENTRIES];
+    myLogFlushTime = millis();
+    myIsLogFlushRequested = false;
+    if (!myIsLogFileReady || xSemaphoreTake(myLogFileMutex, portMAX_DELAY) != pdTRUE) {
+        myLogFlushCount++;
+        return;
+    }
 
-    // udp.beginPacket(DEBUG_SERVER, DEBUG_PORT);
-    // udp.write(buffer, strlen);
-    // udp.endPacket();
+    // Take the entries that haven't been written, noting any overwritten.
+    portENTER_CRITICAL(&myLogMux);
+    uint32_t pending = myLogHead - myLogFlushed;
+    uint32_t lost = (pending > LOG_RAM_ENTRIES) ? pending - LOG_RAM_ENTRIES : 0;
+    uint32_t count = pending - lost;
+    uint32_t first = myLogFlushed + lost;
+    for (uint32_t ii = 0; ii < count; ii++) {
+        entries[ii] = myLog[(first + ii) % LOG_RAM_ENTRIES];
+    }
+    portEXIT_CRITICAL(&myLogMux);
+
+    bool isWritten = (count == 0);
+    if (count > 0) {
+        File file = LittleFS.open(LOG_FILE, "r+");
+        log_file_header_t header;
+        if (file && file.read((uint8_t *)&header, sizeof(log_file_header_t)) == sizeof(log_file_header_t)) {
+            // Write the entries in at most two runs, either side of the wrap.
+            isWritten = true;
+            uint32_t written = 0;
+            while (isWritten && written < count) {
+                uint32_t pos = header.next % LOG_FILE_ENTRIES;
+                uint32_t run = count - written;
+                if (run > LOG_FILE_ENTRIES - pos) {
+                    run = LOG_FILE_ENTRIES - pos;
+                }
+                file.seek(sizeof(log_file_header_t) + (pos * sizeof(log_entry_t)));
+                isWritten = file.write((const uint8_t *)&entries[written], run * sizeof(log_entry_t)) == 
+                    run * sizeof(log_entry_t);
+                written += run;
+                header.next += run;
+            }
+            file.seek(0);
+            isWritten = isWritten && 
+                file.write((const uint8_t *)&header, sizeof(log_file_header_t)) == sizeof(log_file_header_t);
+        }
+        file.close();
+    }
+
+    // Only count the entries as written once they are, so that they're tried
+    // again if the log file couldn't be written.
+    portENTER_CRITICAL(&myLogMux);
+    myLogFlushed = isWritten ? first + count : first;
+    portEXIT_CRITICAL(&myLogMux);
+    xSemaphoreGive(myLogFileMutex);
+    myLogFlushCount++;
 
-    if (buf != buffer) {
-        // We had allocated a new buffer earlier, clear it now.
-        delete[] buffer;
+    if (lost > 0) {
+        LOG_WARNING(EVENT_LOG_LOST, lost, 0);
     }
-}*/
+}
 
 /*
- * Syncs the sun calculations for the current time.
+ * Logs the completion of a phase of the boot process, along with its timing.
  *
- * @param tm_val The current time.
+ * @param phase The name of the boot phase that has completed.
  */
-void syncSunClock(const struct tm *tm_val) {
-    sun.setCurrentDate(tm_val->tm_year + 1900, tm_val->tm_mon + 1, tm_val->tm_mday);
-    double sunrise = sun.calcSunrise();
-    double sunset = sun.calcSunset();
-    mySunrise = static_cast<uint16_t>(sunrise);
-    mySunset = static_cast<uint16_t>(sunset);
-
+void log_boot_phase(const char *phase) {
+    unsigned long now = millis();
     #ifndef HIDE_DEBUG
-    int srHour = mySunrise / 60;
-    int srMinute = mySunrise - (srHour * 60);
-    int ssHour = mySunset / 60;
-    int ssMinute = mySunset - (ssHour * 60);
-    Serial.printf("Updated sunrise: %d:%d (%d), sunset: %d:%d (%d).\n", 
-        srHour, srMinute, mySunrise, ssHour, ssMinute, mySunset);
+    Serial.printf("Boot phase '%s' complete at %lu ms (took %lu ms).\n",
+        phase, now, now - myBootPhaseTime);
     #endif
+    myBootPhaseTime = now;
 }
 
 /*
- * Checks whether it is day time or night time.
+ * Records the current time so that it can be shown straight away after a
+ * reset. The RTC memory copy is always updated, the flash copy only when
+ * requested, to limit flash wear.
  *
- * @param tm_val The current time.
+ * @param now The current time.
+ * @param writeFlash Flag set when the time should also be written to flash.
  */
-void checkDaytime(const struct tm *tm_val) {
-    if (myMinuteOfDay >= mySunset) {
-        // It's after sunset, not daytime.
-        myIsDaytime = false;
-    } else if (myConfiguration.alarmActivation == alarm_t::ALARM_DISABLED ||
-               (myConfiguration.alarmActivation == alarm_t::WEEKDAYS && 
-                (tm_val->tm_wday == 0 || tm_val->tm_wday == 6))) {
-        // No alarm today, use the sunrise time.
-        myIsDaytime = myMinuteOfDay >= mySunrise;
-    } else {
-        // There is an alarm, treat "day" as after the alarm.
-        myIsDaytime = myMinuteOfDay >= myConfiguration.alarmTime;
+void persist_time(time_t now, bool writeFlash = false) {
+    if (now < MIN_VALID_TIMESTAMP) {
+        // We don't know the time, so there's nothing worth keeping.
+        return;
+    }
+
+    myRtcTimeCache.magic = RTC_TIME_MAGIC;
+    myRtcTimeCache.timestamp = now;
+
+    if (writeFlash) {
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putBytes(KEY_LAST_TIME, &now, sizeof(time_t));
+        #endif
     }
 }
 
-/* 
- * Callback used when the NTP time has been updated.
+/*
+ * Restores the last known time into the system clock, if the system clock
+ * hasn't kept the time itself. RTC memory is preferred (soft resets), falling
+ * back to the time last written to flash (power cycles).
+ *
+ * @return true if there is a time that can be displayed, false otherwise.
  */
-void ntp_time_received_cb(struct timeval *timeval) {
+bool restore_cached_time() {
     time_t now;
     time(&now);
-    Serial.printf("Received NTP update: %ld in state %d.\n", now, myState);
+    if (now >= MIN_VALID_TIMESTAMP) {
+        // The system clock has survived the reset.
+        LOG_INFO(EVENT_TIME_RESTORED, now, 0);
+        return true;
+    }
 
-    if (myState == INITIALISING ||
-        myState == SHOW_IP_1 ||
-        myState == SHOW_IP_2 ||
-        myState == SHOW_IP_3 ||
-        myState == SHOW_IP_4) {
-        // This is the first time we've had a time to display.
-        myLastTimestamp = now - SECONDS_PER_HOUR;
-        if (myState == INITIALISING) {
-            myState = RUNNING;
-        }
-        
-        tm *tm_val = localtime(&now);
-        syncSunClock(tm_val);
-        checkDaytime(tm_val);
-    } else if (myState == SETUP_MENU_RADIO_WHOLE ||
-               myState == SETUP_MENU_RADIO_FRACTION ||
-               myState == SETUP_MENU_12_24_HOURS ||
-               myState == SETUP_MENU_BRIGHTNESS ||
-               myState == SETUP_MENU_DAY_COLOUR_INTRO ||
-               myState == SETUP_MENU_DAY_COLOUR_R ||
-               myState == SETUP_MENU_DAY_COLOUR_G ||
-               myState == SETUP_MENU_DAY_COLOUR_B ||
-               myState == SETUP_MENU_NIGHT_COLOUR_INTRO ||
-               myState == SETUP_MENU_NIGHT_COLOUR_R ||
-               myState == SETUP_MENU_NIGHT_COLOUR_G ||
-               myState == SETUP_MENU_NIGHT_COLOUR_B ||
-               myState == SETUP_MENU_ALARM_PATTERN) {
-        // Set the last timestamp, so that we know that the time has been
-        // received once we exit the setup menu.
-        myLastTimestamp = now;
-    } else {
-        // TODO: Time changes.
+    time_t cached = 0;
+    if (esp_reset_reason() != ESP_RST_POWERON && myRtcTimeCache.magic == RTC_TIME_MAGIC) {
+        cached = myRtcTimeCache.timestamp;
+    }
+    time_t stored = 0;
+    if (prefs.getBytes(KEY_LAST_TIME, &stored, sizeof(time_t)) == sizeof(time_t) &&
+        stored > cached) {
+        cached = stored;
+        myIsTimeStale = true;
     }
-}
 
-/*
- * Sets the brightness of the LED display.
- * 
- * @param brightness The new brightness value [0-4095].
- */
-void set_brightness(uint16_t brightness) {
-    float bri = (float)brightness / (float)MAX_BRIGHTNESS_INPUT;
-    float cfg = (float)myConfiguration.brightness / MAX_BRIGHTNESS_F;
-    myBrightness = (uint8_t)ceilf((bri * cfg) * MAX_BRIGHTNESS_F);
-    if (myBrightness < MIN_BRIGHTNESS) { 
-        myBrightness = MIN_BRIGHTNESS;
+    if (cached < MIN_VALID_TIMESTAMP) {
+        // We have never known the time.
+        myRtcTimeCache.magic = 0;
+        return false;
     }
+
+    struct timeval tv = { .tv_sec = cached, .tv_usec = 0 };
+    settimeofday(&tv, NULL);
+    LOG_INFO(EVENT_TIME_RESTORED, cached, 0);
+    return true;
 }
 
 /**
- * Starts sounding the alarm.
+ * Records the state of the alarm so that it can be resumed after a reset. The
+ * RTC memory copy is always updated, the flash copy only when requested, as
+ * the RTC memory copy is lost when the power is.
+ * 
+ * @param writeFlash Flag set when the state should also be written to flash.
  */
-void start_alarm() {
-    myAlarmState = alarm_state_t::ACTIVE;
-    myAlarmRemaining = ALARM_DURATION;
-    mySnoozeRemaining = 0;
-    
-    if (myConfiguration.isRadioInstalled && myConfiguration.isUseRadio) {
-        // Turn on the radio.
-        radio.setBandFrequency(RADIO_BAND_FM, myConfiguration.radioFrequency);
-        radio.setMute(false);
+void persist_alarm(bool writeFlash) {
+    if (myAlarmState == alarm_state_t::WAKING) {
+        // Keep when the ramp started, so that a resumed ramp carries on from
+        // where it was.
+        myRtcAlarmState.timestamp = myWakeRamp.startTime;
     } else {
-        // Start the buzzer.
-        myBuzzerStep = 0;
-        myBuzzerTicksRemaining = BUZZER_STEP_TICKS[myBuzzerStep];
-        digitalWrite(PIN_BUZZER, HIGH);
+        time(&myRtcAlarmState.timestamp);
+    }
+    myRtcAlarmState.state = myAlarmState;
+    myRtcAlarmState.recoveries = myAlarmRecoveries;
+    myRtcAlarmState.snoozeRemaining = mySnoozeRemaining;
+    myRtcAlarmState.magic = ALARM_STATE_MAGIC;
+
+    if (writeFlash) {
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putBytes(KEY_ALARM_STATE, &myRtcAlarmState, sizeof(alarm_persist_t));
+        #endif
     }
 }
 
-void snooze_alarm() {
-    myAlarmState = alarm_state_t::SNOOZE;
-    myAlarmRemaining = 0;
-    mySnoozeRemaining = SNOOZE_DURATION;
-
-    // Turn off the radio/buzzer.
-    if (myConfiguration.isRadioInstalled && myConfiguration.isUseRadio) {
-        radio.setMute(true);
-    } else {
-        digitalWrite(PIN_BUZZER, LOW);
-    }
+/**
+ * Compares a time zone name with a time zone database entry, for bsearch().
+ *
+ * @param key The time zone name.
+ * @param entry The time zone database entry.
+ * @return The result of comparing the names.
+ */
+int compare_zone_name(const void *key, const void *entry) {
+    return strcmp((const char *)key, ((const zone_rule_t *)entry)->name);
 }
 
-void stop_alarm() {
-    myAlarmState = alarm_state_t::INACTIVE;
-    myAlarmRemaining = 0;
-    mySnoozeRemaining = 0;
+/**
+ * Finds a time zone in the time zone database.
+ *
+ * @param name The IANA name of the time zone, e.g. "Australia/Perth".
+ * @return The time zone's entry, or NULL if there is no such time zone.
+ */
+const zone_rule_t *find_zone(const char *name) {
+    return (const zone_rule_t *)bsearch(name, ZONE_RULES, ZONE_RULE_COUNT, sizeof(zone_rule_t), 
+        compare_zone_name);
+}
 
-    // Turn off the radio/buzzer.
-    if (myConfiguration.isRadioInstalled && myConfiguration.isUseRadio) {
-        radio.setMute(true);
+/**
+ * Retrieves the POSIX TZ rule for a configuration. This is the rule for the
+ * configured time zone name, or the custom rule if there isn't one.
+ *
+ * @param config The configuration.
+ * @return The POSIX TZ rule.
+ */
+const char *posix_timezone(const flash_config_t *config) {
+    const zone_rule_t *zone = (config->zoneName[0] == '\0') ? NULL : find_zone(config->zoneName);
+    return (zone == NULL) ? config->timezone : zone->rule;
+}
+
+/**
+ * Skips the zone abbreviation in a POSIX TZ rule, e.g. "AWST" or "<+0530>".
+ *
+ * @param str The position in the rule, moved past the abbreviation.
+ * @return true if there was an abbreviation, false otherwise.
+ */
+bool skip_tz_name(const char **str) {
+    const char *pos = *str;
+    if (*pos == '<') {
+        const char *end = strchr(pos, '>');
+        if ((end == NULL) || (end - pos < 4)) {
+            return false;
+        }
+        pos = end + 1;
     } else {
-        digitalWrite(PIN_BUZZER, LOW);
+        while (isalpha((unsigned char)*pos)) {
+            pos++;
+        }
+        if (pos - *str < 3) {
+            return false;
+        }
     }
+    *str = pos;
+    return true;
 }
 
-/* 
- * Copies the configuration data from one structure to another.
- * 
- * @param dest Pointer to the configuration into which the values are copied.
- * @param src The configuration from which the values are sorced.
- * @return Pointer to the destination structure.
+/**
+ * Parses an offset in a POSIX TZ rule, e.g. "-8" or "3:30".
+ *
+ * @param str The position in the rule, moved past the offset.
+ * @param hours Filled with the offset (hours west of UTC).
+ * @return true if there was an offset, false otherwise.
  */
-flash_config_t *copy_config(flash_config_t *dest, const flash_config_t *src) {
-    memcpy(dest, src, sizeof(flash_config_t));
-
-    return dest;
+bool parse_tz_offset(const char **str, double *hours) {
+    const char *pos = *str;
+    double sign = 1;
+    if ((*pos == '+') || (*pos == '-')) {
+        sign = (*pos == '-') ? -1 : 1;
+        pos++;
+    }
+    double value = 0;
+    double scale = 1;
+    for (uint8_t part = 0; part < 3; part++) {
+        // Hours, then minutes, then seconds.
+        if (!isdigit((unsigned char)*pos)) {
+            return false;
+        }
+        int number = 0;
+        while (isdigit((unsigned char)*pos)) {
+            number = (number * 10) + (*pos++ - '0');
+        }
+        value += number / scale;
+        scale *= 60;
+        if (*pos != ':') {
+            break;
+        }
+        pos++;
+    }
+    *hours = sign * value;
+    *str = pos;
+    return true;
 }
 
-/* 
- * Compares two configuration structures, returning true if they match.
+/**
+ * Determines the UTC offsets of a POSIX TZ rule. Rules with negative
+ * transition times (e.g. "M3.5.0/-1") are refused, as newlib can't use them.
  *
- * @param a The first structure to test.
- * @param b The second structure to test.
- * @return true if every field in the two structures match, false otherwise.
+ * @param rule The POSIX TZ rule, e.g. "AEST-10AEDT,M10.1.0,M4.1.0/3".
+ * @param offset Filled with the standard time offset (hours east of UTC).
+ * @param dstShift Filled with the daylight saving shift (hours), or 0 if the
+ *                 rule has no daylight saving.
+ * @return true if the rule is valid, false otherwise.
  */
-bool compare_config(flash_config_t a, flash_config_t b) {
-    return memcmp(&a, &b, sizeof(flash_config_t)) == 0;
+bool tz_rule_offsets(const char *rule, double *offset, double *dstShift) {
+    double stdWest;
+    if (!skip_tz_name(&rule) || !parse_tz_offset(&rule, &stdWest)) {
+        return false;
+    }
+    *offset = 0 - stdWest;
+    *dstShift = 0;
+    if (*rule == '\0') {
+        return true;
+    }
+
+    double dstWest;
+    if (!skip_tz_name(&rule)) {
+        return false;
+    }
+    *dstShift = parse_tz_offset(&rule, &dstWest) ? stdWest - dstWest : DEFAULT_DST_SHIFT;
+    return (*rule == '\0') || ((*rule == ',') && (strstr(rule, "/-") == NULL));
 }
 
 /*
- * Write the configuration to the flash storage.
+ * Syncs the sun calculations for the current time.
  *
- * @param config The configuration to be written to flash storage.
+ * @param tm_val The current time.
  */
-inline void write_config(flash_config_t *config) {
-    #ifndef DISABLE_CONFIG_WRITES
-    prefs.putBytes(KEY_CONFIG, config, sizeof(flash_config_t));
+void syncSunClock(const struct tm *tm_val) {
+    // The table is in standard time.
+    uint16_t day = DAYS_BEFORE_MONTH[tm_val->tm_mon] + tm_val->tm_mday - 1;
+    int16_t shift = (tm_val->tm_isdst > 0) ? myDstShift : 0;
+    myCivilSunrise = mySunTable.civilSunrise[day] + shift;
+    mySunrise = mySunTable.sunrise[day] + shift;
+    mySunset = mySunTable.sunset[day] + shift;
+    myCivilSunset = mySunTable.civilSunset[day] + shift;
+
+    #ifndef HIDE_DEBUG
+    int srHour = mySunrise / 60;
+    int srMinute = mySunrise - (srHour * 60);
+    int ssHour = mySunset / 60;
+    int ssMinute = mySunset - (ssHour * 60);
+    Serial.printf("Updated sunrise: %d:%d (%d), sunset: %d:%d (%d).\n", 
+        srHour, srMinute, mySunrise, ssHour, ssMinute, mySunset);
     #endif
 }
 
 /*
- * Enters the configuration menu.
+ * Calculates how far through a twilight transition the current time is.
  *
- * @param isSetupMenu Flag set when the menu to enter is the setup menu (true).
- *                    When false, the alarm menu is shown.
+ * @param minute The current minute of the day.
+ * @param start The minute of the day that the transition starts.
+ * @param end The minute of the day that the transition ends.
+ * @return BLEND_NIGHT before the start, BLEND_DAY after the end, and
+ *         proportionally between the two during the transition.
  */
-void enter_menu(bool isSetupMenu = false) {
-    myState = isSetupMenu ? state_t::SETUP_MENU_RADIO_WHOLE : state_t::MENU_ALARM_MINUTES;
-    myIsInMenu = true;
-    copy_config(&myNewConfiguration, &myConfiguration);
-    myFlashCounter = 0;
-    myFlashValue = false;
-    myCountdownTimer = 0;
+uint8_t twilight_blend(int32_t minute, int32_t start, int32_t end) {
+    if (minute < start) {
+        return BLEND_NIGHT;
+    } else if (minute >= end) {
+        return BLEND_DAY;
+    }
+    return static_cast<uint8_t>(((minute - start) * BLEND_DAY) / (end - start));
 }
 
-/*
- * Exits the configuration menu, saving the configuration if necessary.
+/**
+ * Converts a date into the YYYYMMDD form used by the alarm rules, which sorts
+ * in date order.
  * 
- * @param discardChanges Flag set when any changes should be ignored.
+ * @param tm_val The date.
+ * @return The date as YYYYMMDD.
  */
-void exit_menu(boolean discardChanges = false, bool isSetupMenu = false) {
-    myState = state_t::RUNNING;
-    myIsInMenu = false;
-    myFlashCounter = -1;
-    myCountdownTimer = 0;
-    if (!discardChanges && !compare_config(myConfiguration, myNewConfiguration)) {
-        // The configuration has changed.
-        Serial.printf("Configuration values changed.\n");
-        copy_config(&myConfiguration, &myNewConfiguration);
-        write_config(&myConfiguration);
-    }
-}
-
-inline HslColor colourt_to_hsl_colour(colour_t colour) {
-    HslColor c(RgbColor(colour.r, colour.g, colour.b));
-    return c;
+uint32_t date_value(const struct tm *tm_val) {
+    return ((uint32_t)(tm_val->tm_year + 1900) * 10000) + ((tm_val->tm_mon + 1) * 100) + tm_val->tm_mday;
 }
 
 /**
- * Calculates the colour to be used for a digit or colon.
+ * Searches an open skipped dates file for a date. The file is sorted, so only
+ * O(log n) of its dates are read.
  * 
- * @param group The digit (0, 1, 3, 4, L-R) or colon (2, 5) being calculated.
- * @param pattern The pattern in use.
- * @param colour The base colour, if used by the pattern.
+ * @param file The skipped dates file.
+ * @param date The date to find (YYYYMMDD).
+ * @return true if the date is in the file, false otherwise.
  */
-HslColor calculate_digit_colour(uint8_t group, display_pattern_t pattern, colour_t colour) {
-    switch (pattern) {
-        case display_pattern_t::SOLID_COLOUR: {
-            return colourt_to_hsl_colour(colour);
-        }
-        case display_pattern_t::RAINBOW_DIGITS: {
-            HslColor c(RgbColor(255, 0, 0));
-            c.H += (1.0f - (group * DIGIT_GROUP_MULTIPLIER)) + (myAnimationStep * DIGIT_COLOUR_STEP);
-            c.H = c.H > 1.0f ? c.H - (int)c.H : c.H;
-            return c;
-        }
-        case display_pattern_t::FLASHING: {
-            if (myAnimationStep < FLASH_ON_STEPS) {
-                return colourt_to_hsl_colour(colour);
-            } else {
-                return BLACK;
-            }
+bool find_skip_date(File &file, uint32_t date) {
+    size_t low = 0;
+    size_t high = file.size() / sizeof(uint32_t);
+    while (low < high) {
+        size_t mid = low + ((high - low) / 2);
+        uint32_t value;
+        if (!file.seek(mid * sizeof(uint32_t)) || 
+                file.read((uint8_t *)&value, sizeof(uint32_t)) != sizeof(uint32_t)) {
+            return false;
         }
-        case display_pattern_t::PULSING: {
-            float frac = ((float)myAnimationStep) / PULSE_STEPS;
-            if (frac > 1.0f) {
-                frac = 2.0f - frac;
-            }
-            HslColor fc = colourt_to_hsl_colour(colour);
-            HslColor hc = HslColor::LinearBlend<NeoHueBlendShortestDistance>(
-                BLACK, fc, frac);
-            return hc;
-        }
-        case display_pattern_t::MENU: {
-            if ((myState == state_t::MENU_ALARM_HOURS && group <= 1) ||
-                (myState == state_t::MENU_ALARM_MINUTES && (group == 3 || group == 4)) ||
-                (myState == state_t::SETUP_MENU_RADIO_WHOLE && (group < 4)) ||
-                (myState == state_t::SETUP_MENU_RADIO_FRACTION && (group != 4))) {
-                return MENU_BRIGHT;
-            } else if (myState == state_t::SETUP_MENU_DAY_COLOUR_R && group == 0) {
-                return COLOUR_R;
-            } else if (myState == state_t::SETUP_MENU_DAY_COLOUR_G && group == 0) {
-                return COLOUR_G;
-            } else if (myState == state_t::SETUP_MENU_DAY_COLOUR_B && group == 0) {
-                return COLOUR_B;
-            }
-
-            float frac = ((float)myAnimationStep) / PULSE_STEPS;
-            if (frac > 1.0f) {
-                frac = 2.0f - frac;
-            }
-            return HslColor::LinearBlend<NeoHueBlendShortestDistance>(
-                MENU_DIM, MENU_BRIGHT, frac);
+        if (value == date) {
+            return true;
+        } else if (value < date) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-    return colourt_to_hsl_colour(colour);
+    return false;
 }
 
 /**
- * Calculates the colour to be used for an individual segment.
+ * Notes whether LittleFS is mounted, so that anything cached from it is read
+ * again.
  * 
- * @param previouslyLitSegments The number of segments lit before the digit this segment belongs to.
- * @param segmentIndex The index of the segment within the digit being lit, 0 = first.
- * @param fontIndex The index into the FONT array for the digit being selected. 0xFF = colon.
+ * @param isMounted Flag set when the file system has been mounted.
  */
-HslColor calculate_segment_colour(int previouslyLitSegments, uint8_t segmentIndex, uint8_t fontIndex) {
-    HslColor c(RgbColor(255, 0, 0));
-    uint8_t segmentOrder;
-    if (fontIndex == 0xFF) {
-        segmentOrder = segmentIndex;
-    } else {
-        segmentOrder = FONT_SEGMENT_ORDER[fontIndex][segmentIndex];
-    }
-    c.H += (1.0f - ((previouslyLitSegments + segmentOrder) * SEGMENT_MULTIPLIER)) + 
-            (myAnimationStep * SEGMENT_COLOUR_STEP);
-    c.H = c.H > 1.0f ? c.H - (int)c.H : c.H;
-    
-    return c;
+void set_filesystem_mounted(bool isMounted) {
+    myIsFilesystemMounted = isMounted;
+    myFilesystemGeneration++;
 }
 
 /**
- * Sets the colour for a single LED, scaling the brightness as necessary.
+ * Determines whether the alarm is skipped on a date. This is checked each
+ * minute, so the answer for the last date checked is kept.
  * 
- * @param ledNumber The LED number (0-31) to set.
- * @param colour The colour to set the LED to.
+ * @param date The date to check (YYYYMMDD).
+ * @return true if the alarm is skipped on the date, false otherwise.
  */
-void set_led(uint16_t ledNumber, HslColor colour) {
-    HslColor scaled;
-    scaled.H = colour.H;
-    scaled.S = colour.S;
-    scaled.L = (colour.L * myBrightness) / MAX_BRIGHTNESS_F;
-    leds.SetPixelColor(ledNumber, scaled);
+bool is_skip_date(uint32_t date) {
+    if (!myIsFilesystemMounted) {
+        // The skipped dates can't be read, so don't keep this answer.
+        return false;
+    }
+    uint32_t generation = myFilesystemGeneration;
+    if (date != mySkipCacheDate || generation != mySkipCacheGeneration) {
+        myIsSkipCacheDate = false;
+        if (LittleFS.exists(SKIP_DATES_FILE)) {
+            File file = LittleFS.open(SKIP_DATES_FILE, FILE_READ);
+            myIsSkipCacheDate = file && find_skip_date(file, date);
+            file.close();
+        }
+        mySkipCacheDate = date;
+        mySkipCacheGeneration = generation;
+    }
+    return myIsSkipCacheDate;
 }
 
 /**
- * Sets the LED values for a single 7-segment digit.
+ * Finds the time of the alarm on a day, by applying the alarm rules: the days
+ * the alarm is active, the per-weekday times, the date range and the skipped
+ * dates.
  * 
- * @param ledBits The bit mask containing which LEDs to light.
- * @param firstLedNumber The index of the first LED in the digit.
- * @param digitColour The colour to set any lit segments to.
+ * @param config The configuration holding the alarm rules.
+ * @param tm_val The day.
+ * @param isSkipped Flag set when the day is one of the skipped dates.
+ * @return The minute of the day the alarm sounds, or -1 if it doesn't.
  */
-void set_digit(uint8_t ledBits, uint16_t firstLedNumber, HslColor digitColour) {
-    for (uint16_t ii = 0; ii < 7; ii++) {
-        if ((ledBits & (1 << ii)) != 0) {
-            set_led(firstLedNumber + ii, digitColour);
-        } else {
-            set_led(firstLedNumber + ii, BLACK);
+int32_t alarm_minute(const flash_config_t *config, const struct tm *tm_val, bool isSkipped) {
+    uint32_t date = date_value(tm_val);
+    if (config->alarmActivation == alarm_t::ALARM_DISABLED || isSkipped ||
+            (config->alarmStartDate != 0 && date < config->alarmStartDate) ||
+            (config->alarmEndDate != 0 && date > config->alarmEndDate)) {
+        return -1;
+    }
+
+    switch (config->alarmActivation) {
+        case alarm_t::WEEKDAYS:
+            if (tm_val->tm_wday == WDAY_SUNDAY || tm_val->tm_wday == WDAY_SATURDAY) {
+                return -1;
+            }
+            break;
+        case alarm_t::CALENDAR: {
+            uint16_t dayTime = config->dayAlarmTimes[tm_val->tm_wday];
+            if (dayTime == ALARM_TIME_NONE) {
+                return -1;
+            } else if (dayTime != ALARM_TIME_DEFAULT) {
+                return dayTime;
+            }
+            break;
         }
+        default:
+            break;
     }
+    return config->alarmTime;
 }
 
-
 /**
- * Sets the LED values for a single 7-segment digit.
+ * Finds when the alarm next sounds, checking each day in turn. This may be
+ * called from any task, as it doesn't use the skipped date cache.
  * 
- * @param fontIndex The index into the FONT array for the digit.
- * @param firstLedNumber The index of the first LED in the digit.
+ * @param config The configuration holding the alarm rules.
+ * @param now The current time.
+ * @return The time of the next alarm, or 0 if there isn't one within
+ *         ALARM_LOOKAHEAD_DAYS.
  */
-int set_digit(uint8_t fontIndex, uint16_t firstLedNumber, int previouslyLitSegments) {
-    int segmentsLit = previouslyLitSegments;
-    const uint8_t ledBits = FONT[fontIndex];
-    for (uint16_t ii = 0; ii < SEGMENTS_PER_DIGIT; ii++) {
-        if ((ledBits & (1 << ii)) != 0) {
-            segmentsLit++;
-            HslColor colour = calculate_segment_colour(previouslyLitSegments, ii, fontIndex);
-            set_led(firstLedNumber + ii, colour);
-        }
-        else
-        {
-            set_led(firstLedNumber + ii, BLACK);
-        }
+time_t next_alarm(const flash_config_t *config, time_t now) {
+    if (config->isAlarmDisabled || config->alarmActivation == alarm_t::ALARM_DISABLED) {
+        return 0;
+    }
+
+    File file;
+    if (LittleFS.exists(SKIP_DATES_FILE)) {
+        file = LittleFS.open(SKIP_DATES_FILE, FILE_READ);
     }
+    time_t result = 0;
+    struct tm day;
+    localtime_r(&now, &day);
+    for (uint16_t ii = 0; ii < ALARM_LOOKAHEAD_DAYS && result == 0; ii++) {
+        int32_t minute = alarm_minute(config, &day, file && find_skip_date(file, date_value(&day)));
+        if (minute >= 0) {
+            struct tm alarm = day;
+            alarm.tm_hour = minute / MINUTES_PER_HOUR;
+            alarm.tm_min = minute % MINUTES_PER_HOUR;
+            alarm.tm_sec = 0;
+            alarm.tm_isdst = -1;
+            time_t when = mktime(&alarm);
+            if (when > now) {
+                result = when;
+            }
+        }
 
-    return segmentsLit;
+        // Move to midday tomorrow, letting mktime() fix the date and weekday.
+        day.tm_mday++;
+        day.tm_hour = 12;
+        day.tm_isdst = -1;
+        mktime(&day);
+    }
+    file.close();
+    return result;
 }
 
 /*
- * Sends the values for the 4 7-segment LED displays to the LED driver chip.
- * 
- * @param farLeft The value for the first 7-segment display on the far left.
- * @param middleLeft The value for the second 7-segment display on the left of
- *                   middle.
- * @param middleRight The value for the third 7-segment display on the right
- *                    of middle.
- * @param farRight The value for the first 7-segment display on the far right.
- * @param colon Flag as to whether to show the : in the middle of the clock.
- * @param pm Flag as to whether to show the LED for "PM".
- * @param alarmSet Flag as to whether to show the "alarm set" LED.
+ * Checks whether it is day time or night time. Rather than switching at a
+ * single minute, the display blends between the night and day settings over
+ * the civil twilight period.
+ *
+ * @param tm_val The current time.
+ * @param immediate Flag set when the display should jump straight to the new
+ *                  blend, rather than fading to it.
  */
-void display(uint8_t farLeft, uint8_t middleLeft, uint8_t middleRight, uint8_t farRight, 
-             bool colon = true, bool pm = false, bool alarmSet = false) {
-
-    display_pattern_t pattern;
-    colour_t baseColour;
-    if (myIsInMenu) {
-        pattern = display_pattern_t::MENU;
-        baseColour.r = baseColour.g = baseColour.b = 0xFF;
-    } else if (myAlarmState == alarm_state_t::ACTIVE) {
-        pattern = myConfiguration.alarmPattern;
-        baseColour = myConfiguration.alarmColour;
-    } else if (myIsDaytime) {
-        pattern = myConfiguration.dayPattern;
-        baseColour = myConfiguration.dayColour;
-    } else {
-        pattern = myConfiguration.nightPattern;
-        baseColour = myConfiguration.nightColour;
-    }
-
-    // Serial.printf(
-    //     "display: %02x %02x %02x %02x c=%s pm=%s as=%s day=%s pat=%d animStep=%d.\n",
-    //              farLeft & 0xFF,
-    //              middleLeft & 0xFF,
-    //              middleRight & 0xFF,
-    //              farRight & 0xFF,
-    //              colon ? "t" : "f",
-    //              pm ? "t" : "f",
-    //              alarmSet ? "t" : "f",
-    //              myIsDaytime ? "t" : "f",
-    //              pattern,
-    //              myAnimationStep);
-
-    if (pattern == display_pattern_t::RAINBOW_SEGMENTS) {
-        int segmentsLit = 0;
-        segmentsLit = set_digit(farLeft, 0, segmentsLit);
-        segmentsLit = set_digit(middleLeft, 7, segmentsLit);
-        
-        if (colon) {
-            HslColor colour = calculate_segment_colour(segmentsLit, 0, 0xFF);
-            set_led(14, colour);
-            segmentsLit++;
-            
-            colour = calculate_segment_colour(segmentsLit, 1, 0xFF);
-            set_led(15, colour);
-            segmentsLit++;
-        } else {
-            set_led(14, BLACK);
-            set_led(15, BLACK);
-        }
-
-        segmentsLit = set_digit(middleRight, 16, segmentsLit);
-        segmentsLit = set_digit(farRight, 23, segmentsLit);
-        
-        if (pm) {
-            HslColor colour = calculate_segment_colour(segmentsLit, 0, 0xFF);
-            set_led(30, colour);
-            segmentsLit++;
-        } else {
-            set_led(30, BLACK);
-        }
+void checkDaytime(const struct tm *tm_val, bool immediate = false) {
+    // If there is an alarm today, treat "day" as after the alarm.
+    int32_t dayStart = alarm_minute(&myConfiguration, tm_val, is_skip_date(date_value(tm_val)));
+    if (dayStart < 0) {
+        // No alarm today, use the sunrise time.
+        dayStart = mySunrise;
+    }
 
-        if (alarmSet) {
-            HslColor colour = calculate_segment_colour(segmentsLit, 1, 0xFF);
-            set_led(31, colour);
-        } else {
-            set_led(31, BLACK);
-        }
-    } else {
-        HslColor colour = calculate_digit_colour(0, pattern, baseColour);
-        // Serial.printf("fl: h=%f s=%f l=%f)\n", colour.H, colour.S, colour.L);
-        set_digit(FONT[farLeft], 0, colour);
+    // Dawn leads up to the start of the day, dusk follows sunset.
+    int32_t dawnLength = (mySunrise > myCivilSunrise) ? mySunrise - myCivilSunrise : 0;
+    uint8_t dawn = twilight_blend(myMinuteOfDay, dayStart - dawnLength, dayStart);
+    uint8_t dusk = BLEND_DAY - twilight_blend(myMinuteOfDay, mySunset, 
+        (myCivilSunset > mySunset) ? myCivilSunset : mySunset);
+    myDayBlendTarget = (dawn < dusk) ? dawn : dusk;
 
-        colour = calculate_digit_colour(1, pattern, baseColour);
-        set_digit(FONT[middleLeft], 7, colour);
+    if (immediate) {
+        myDayBlend = myDayBlendTarget;
+        myIsDaytime = myDayBlend >= BLEND_DAY_THRESHOLD;
+    }
+}
 
-        if (colon) {
-            colour = calculate_digit_colour(2, pattern, baseColour);
-            set_led(14, colour);
-            set_led(15, colour);
-        } else {
-            set_led(14, BLACK);
-            set_led(15, BLACK);
-        }
+/*
+ * Calculates the next few days of a new sunrise/sunset table, and switches to
+ * it once it is complete.
+ *
+ * @return true if there is no table left to calculate, false otherwise.
+ */
+bool step_sun_table() {
+    if (!myIsSunTableBuilding) {
+        return true;
+    }
+    if (!sun_table_step(&myNewSunTable, &sun, SUN_TABLE_DAYS_PER_LOOP)) {
+        return false;
+    }
 
-        colour = calculate_digit_colour(3, pattern, baseColour);
-        set_digit(FONT[middleRight], 16, colour);
+    memcpy(&mySunTable, &myNewSunTable, sizeof(sun_table_t));
+    myIsSunTableBuilding = false;
+    #ifndef DISABLE_CONFIG_WRITES
+    prefs.putBytes(KEY_SUN_TABLE, &mySunTable, sizeof(sun_table_t));
+    #endif
 
-        colour = calculate_digit_colour(4, pattern, baseColour);
-        set_digit(FONT[farRight], 23, colour);
+    #ifndef HIDE_DEBUG
+    Serial.printf("Calculated sunrise/sunset table (%u days without a sunrise or sunset).\n", 
+        mySunTable.polarDays);
+    #endif
 
-        if (pm || alarmSet) {
-            colour = calculate_digit_colour(5, pattern, baseColour);
-            if (pm) {
-                set_led(30, colour);
-            } else {
-                set_led(30, BLACK);
-            }
-            if (alarmSet) {
-                set_led(31, colour);
-            } else {
-                set_led(31, BLACK);
-            }
-        } else {
-            set_led(30, BLACK);
-            set_led(31, BLACK);
-        }
+    if (myState != state_t::INITIALISING) {
+        time_t now;
+        time(&now);
+        tm *tm_val = localtime(&now);
+        syncSunClock(tm_val);
+        checkDaytime(tm_val);
     }
-    leds.Show();
+    return true;
 }
 
 /*
- * Displays the current time on the 7-segment LEDs.
- * 
- * @param hour The hour to be displayed.
- * @param minute The minute to be displayed.
+ * Sets the location used for the sun calculations. The sunrise/sunset table
+ * for the location is loaded from flash, or calculated (and stored) if the
+ * location has changed. The calculation is spread over the following loops by
+ * step_sun_table(), unless it is needed straight away.
+ *
+ * @param latitude The latitude of the clock.
+ * @param longitude The longitude of the clock.
+ * @param offset The timezone offset (hours) for the sun calculations.
+ * @param immediate Flag set when the table must be complete on return.
  */
-void display_time(uint8_t hour, uint8_t minute, bool show24Hour = true) {
-    uint8_t digits[4];
-    //Serial.printf("Displaying time %02hhu:%02hhu.\n", hour, minute);
+void set_sun_position(double latitude, double longitude, double offset, bool immediate = false) {
+    size_t res = prefs.getBytes(KEY_SUN_TABLE, &myNewSunTable, sizeof(sun_table_t));
+    if (res == sizeof(sun_table_t) && sun_table_matches(&myNewSunTable, latitude, longitude, offset)) {
+        // The stored table is for this location.
+        memcpy(&mySunTable, &myNewSunTable, sizeof(sun_table_t));
+        myIsSunTableBuilding = false;
+        return;
+    }
 
-    // Hour digits.
-    boolean pm = (hour >= 12);
-    if (!show24Hour) {
-        hour %= 12;
-        if (hour == 0) {
-            hour = 12;
+    sun_table_begin(&myNewSunTable, latitude, longitude, offset);
+    myIsSunTableBuilding = true;
+    if (immediate) {
+        while (!step_sun_table()) {
+            // Keep going until the table is complete.
         }
     }
-    if (hour >= 10) {
-        digits[0] = hour / 10;
-    } else {
-        digits[0] = FONT_BLANK;
-    }
-    digits[1] = hour % 10;
-
-    // Minute digits.
-    digits[2] = minute / 10;
-    digits[3] = minute % 10;
+}
 
-    bool showAlarm = myConfiguration.alarmActivation != alarm_t::ALARM_DISABLED && myIsAlarmSwitchEnabled;
-    display(digits[0], digits[1], digits[2], digits[3], true, !show24Hour && pm, showAlarm);
+/*
+ * Applies the configured time zone to the local time calculations, and moves
+ * the sun calculations to the configured location, using the time zone's
+ * standard time offset.
+ *
+ * @param immediate Flag set when the sunrise/sunset table must be ready on
+ *                  return, rather than calculated over the following loops.
+ */
+void apply_timezone(bool immediate = false) {
+    const char *rule = posix_timezone(&myConfiguration);
+    double offset;
+    double dstShift;
+    if (!tz_rule_offsets(rule, &offset, &dstShift)) {
+        // Only custom rules from old configurations can be invalid.
+        offset = myConfiguration.offset;
+        dstShift = 0;
+    }
+    setenv("TZ", rule, 1);
+    tzset();
+    myDstShift = static_cast<int16_t>(dstShift * MINUTES_PER_HOUR);
+    set_sun_position(myConfiguration.latitude, myConfiguration.longitude, offset, immediate);
 }
 
-void display_number(uint8_t number) {
-    uint8_t hundreds = (number >= 100) ? number / 100 : FONT_BLANK;
-    uint8_t tens = (number >= 10) ? (number % 100) / 10 : FONT_BLANK;
-    uint8_t ones = number % 10;
-    display(FONT_BLANK, hundreds, tens, ones);
+/*
+ * Moves the displayed day/night blend one step towards its target. This is
+ * called every frame, so transitions (including those caused by the minute
+ * changing) fade rather than jump.
+ */
+void step_day_blend() {
+    if (myDayBlend < myDayBlendTarget) {
+        myDayBlend++;
+    } else if (myDayBlend > myDayBlendTarget) {
+        myDayBlend--;
+    }
+    myIsDaytime = myDayBlend >= BLEND_DAY_THRESHOLD;
 }
 
 /* 
- * Update the 7 segment displays, if necessary.
+ * Callback used when the NTP time has been updated.
  */
-void update_display() {
-    switch (myState) {
-        case state_t::INITIALISING: // Fall through
-        case state_t::CANCELLED:
-                display(FONT_DASH, FONT_DASH, FONT_DASH, FONT_DASH, false);
-            break;
-        case state_t::RUNNING:
-            display_time(myHour, myMinute, myConfiguration.is24Hour);
-            break;
-        case state_t::SHOW_IP_1:
-            display_number(myIPAddress[0]);
-            break;
-        case state_t::SHOW_IP_2:
-            display_number(myIPAddress[1]);
-            break;
-        case state_t::SHOW_IP_3:
-            display_number(myIPAddress[2]);
-            break;
-        case state_t::SHOW_IP_4:
-            display_number(myIPAddress[3]);
-            break;
-        case state_t::SHOW_SNOOZE:
-            // Show the sleep time remaining.
-            display_time(mySnoozeRemaining / SECONDS_PER_MINUTE,
-                         mySnoozeRemaining % SECONDS_PER_MINUTE);
-            break;
-        case state_t::SHOW_ALARM: // Fall-through
-        case state_t::MENU_ALARM_MINUTES: // Fall-through
-        case state_t::MENU_ALARM_HOURS:
-            // Show the alarm time.
-            display_time(myNewConfiguration.alarmTime / MINUTES_PER_HOUR,
-                         myNewConfiguration.alarmTime % MINUTES_PER_HOUR,
-                         myNewConfiguration.is24Hour);
-            break;
-        case state_t::MENU_ALARM_DAYS:
-            // We're showing which days the alarm is to sound.
-            switch (myNewConfiguration.alarmActivation) {
-                case alarm_t::ALARM_DISABLED:
-                    // The alarm is disabled.
-                    display(FONT_BLANK, 0, FONT_F, FONT_F, false);
-                    break;
-                case alarm_t::WEEKDAYS:
-                    // The alarm only sounds on weekdays.
-                    display(FONT_BLANK, 1, FONT_DASH, 5, false, false, true);
-                    break;
+void ntp_time_received_cb(struct timeval *timeval) {
+    time_t now;
+    time(&now);
+    LOG_INFO(EVENT_NTP_TIME, now, myState);
+    boolean wasProvisional = myIsTimeProvisional;
+    myIsTimeProvisional = false;
+    myIsTimeStale = false;
+    persist_time(now, wasProvisional);
+
+    if (myState == INITIALISING ||
+        myState == SHOW_MESSAGE) {
+        // This is the first time we've had a time to display.
+        myLastTimestamp = now - SECONDS_PER_HOUR;
+        if (myState == INITIALISING) {
+            myState = RUNNING;
+        }
+        
+        tm *tm_val = localtime(&now);
+        syncSunClock(tm_val);
+        checkDaytime(tm_val, true);
+    } else if (myState == SETUP_MENU_RADIO_WHOLE ||
+               myState == SETUP_MENU_RADIO_FRACTION ||
+               myState == SETUP_MENU_12_24_HOURS ||
+               myState == SETUP_MENU_BRIGHTNESS ||
+               myState == SETUP_MENU_DAY_COLOUR_INTRO ||
+               myState == SETUP_MENU_DAY_COLOUR_R ||
+               myState == SETUP_MENU_DAY_COLOUR_G ||
+               myState == SETUP_MENU_DAY_COLOUR_B ||
+               myState == SETUP_MENU_NIGHT_COLOUR_INTRO ||
+               myState == SETUP_MENU_NIGHT_COLOUR_R ||
+               myState == SETUP_MENU_NIGHT_COLOUR_G ||
+               myState == SETUP_MENU_NIGHT_COLOUR_B ||
+               myState == SETUP_MENU_ALARM_PATTERN) {
+        // Set the last timestamp, so that we know that the time has been
+        // received once we exit the setup menu.
+        myLastTimestamp = now;
+    } else if (wasProvisional) {
+        // The cached time was being shown, force a full refresh of the clock.
+        myLastTimestamp = now - SECONDS_PER_HOUR;
+    } else {
+        // TODO: Time changes.
+    }
+}
+
+/**
+ * Adds a record to the next telemetry datagram. This never blocks, if the
+ * datagram is full the record is dropped.
+ * 
+ * @param type The type of record.
+ * @param data The data for the record.
+ * @param length The length of the data.
+ */
+void send_telemetry(telemetry_type_t type, const void *data, uint8_t length) {
+    if (myTelemetryInterval.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    record_header_t header;
+    header.type = type;
+    header.length = length;
+    header.loop = myLoopCount;
+    size_t size = sizeof(record_header_t) + length;
+
+    portENTER_CRITICAL(&myTelemetryMux);
+    if (TELEMETRY_BUFFER_SIZE - myTelemetryUsed < size) {
+        if (myTelemetryDropped < UINT16_MAX) {
+            myTelemetryDropped++;
+        }
+    } else {
+        memcpy(&myTelemetry[myTelemetryUsed], &header, sizeof(record_header_t));
+        memcpy(&myTelemetry[myTelemetryUsed + sizeof(record_header_t)], data, length);
+        myTelemetryUsed += size;
+    }
+    portEXIT_CRITICAL(&myTelemetryMux);
+}
+
+/**
+ * Finds the brightness cap in effect at a time of day. This is the cap that
+ * started most recently, which may be the last one to start yesterday.
+ * 
+ * @param config The configuration containing the brightness caps.
+ * @param minute The minute of the day.
+ * @return The maximum brightness, which is MAX_BRIGHTNESS when there are no
+ *         caps.
+ */
+uint8_t brightness_cap(const flash_config_t *config, uint16_t minute) {
+    int32_t todayStart = -1;
+    int32_t lastStart = -1;
+    uint8_t todayCap = MAX_BRIGHTNESS;
+    uint8_t lastCap = MAX_BRIGHTNESS;
+    for (uint8_t ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+        const brightness_cap_t *cap = &config->brightnessCaps[ii];
+        if (cap->startMinute == BRIGHTNESS_CAP_UNUSED) {
+            continue;
+        }
+        if (cap->startMinute <= minute && (int32_t)cap->startMinute > todayStart) {
+            todayStart = cap->startMinute;
+            todayCap = cap->maxBrightness;
+        }
+        if ((int32_t)cap->startMinute > lastStart) {
+            lastStart = cap->startMinute;
+            lastCap = cap->maxBrightness;
+        }
+    }
+    return (todayStart >= 0) ? todayCap : lastCap;
+}
+
+/*
+ * Sets the brightness of the LED display.
+ * 
+ * @param brightness The new brightness value [0-4095].
+ */
+void set_brightness(uint16_t brightness) {
+    float bri = (float)brightness / (float)MAX_BRIGHTNESS_INPUT;
+    float cfg = (float)myConfiguration.brightness / MAX_BRIGHTNESS_F;
+    myBrightness = (uint8_t)ceilf((bri * cfg) * MAX_BRIGHTNESS_F);
+    uint8_t cap = brightness_cap(&myConfiguration, myMinuteOfDay);
+    if (myBrightness > cap) {
+        myBrightness = cap;
+    }
+    if (myBrightness < MIN_BRIGHTNESS) { 
+        myBrightness = MIN_BRIGHTNESS;
+    }
+
+    telemetry_brightness_t telemetry;
+    telemetry.ldr = brightness;
+    telemetry.brightness = myBrightness;
+    send_telemetry(telemetry_type_t::TELEMETRY_BRIGHTNESS, &telemetry, sizeof(telemetry_brightness_t));
+}
+
+/**
+ * Builds the calibration lookup tables from the configured calibration. This
+ * is only done when the calibration changes, so that calibrating each frame
+ * is integer-only.
+ */
+void build_calibration() {
+    build_led_output(&myLedOutput, &myConfiguration.calibration);
+}
+
+/**
+ * Compiles a textual buzzer pattern into the form played by the buzzer.
+ * Steps are separated by spaces, each "frequency:duration[:volume[>volume]]"
+ * with the frequency in Hz (0 = silent), the duration in milliseconds and
+ * volumes 0-255. When a second volume is given, the volume fades to it over
+ * the step.
+ * 
+ * @param text The textual pattern.
+ * @param repeat Flag set when the pattern repeats until stopped.
+ * @param startLevel The volume level the pattern starts at.
+ * @param levelStep The volume level increase each time the pattern repeats.
+ * @param pattern The pattern to be filled in.
+ * @return true if the text is a valid pattern, false otherwise.
+ */
+bool compile_tone_pattern(const char *text, bool repeat, uint8_t startLevel, 
+                          uint8_t levelStep, tone_pattern_t *pattern) {
+    pattern->count = 0;
+    pattern->repeat = repeat;
+    pattern->startLevel = startLevel;
+    pattern->levelStep = levelStep;
+
+    const char *p = text;
+    char *end;
+    while (*p != '\0') {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        if (pattern->count >= MAX_TONE_STEPS) {
+            return false;
+        }
+
+        unsigned long frequency = strtoul(p, &end, 10);
+        if (end == p || *end != ':' ||
+            (frequency != 0 && (frequency < BUZZER_MIN_FREQUENCY || frequency > BUZZER_MAX_FREQUENCY))) {
+            return false;
+        }
+        p = end + 1;
+        unsigned long duration = strtoul(p, &end, 10);
+        if (end == p || duration == 0 || duration > UINT16_MAX) {
+            return false;
+        }
+        p = end;
+        unsigned long volume = 255;
+        if (*p == ':') {
+            volume = strtoul(++p, &end, 10);
+            if (end == p || volume > 255) {
+                return false;
+            }
+            p = end;
+        }
+        unsigned long endVolume = volume;
+        if (*p == '>') {
+            endVolume = strtoul(++p, &end, 10);
+            if (end == p || endVolume > 255) {
+                return false;
+            }
+            p = end;
+        }
+        if (*p != ' ' && *p != '\0') {
+            return false;
+        }
+
+        tone_step_t *step = &pattern->steps[pattern->count++];
+        step->frequency = frequency;
+        step->duration = duration;
+        step->volume = volume;
+        step->endVolume = endVolume;
+    }
+
+    return pattern->count > 0;
+}
+
+/**
+ * Calculates the buzzer duty cycle for a step volume at a level.
+ * 
+ * @param volume The volume of the step (0-255).
+ * @param level The level (0-255) that the pattern is scaled by.
+ * @return The LEDC duty cycle.
+ */
+inline uint32_t tone_duty(uint8_t volume, uint8_t level) {
+    return ((uint32_t)volume * level * BUZZER_MAX_DUTY) / (255 * 255);
+}
+
+/**
+ * Plays the next step of the buzzer pattern. This runs from the hardware
+ * timer, so the tone timing does not depend on loop(). The pattern can change
+ * while this is running, in which case the timer is left for change_tones()
+ * to restart.
+ * 
+ * @param arg Unused.
+ */
+void play_tone_step(void *arg) {
+    portENTER_CRITICAL(&myToneMux);
+    const tone_pattern_t *pattern = myTonePattern;
+    if (pattern != NULL && myToneStep >= pattern->count) {
+        if (pattern->repeat) {
+            // Start again, a little louder.
+            myToneStep = 0;
+            myToneLevel = (myToneLevel > 255 - pattern->levelStep) ? 
+                255 : myToneLevel + pattern->levelStep;
+        } else {
+            myTonePattern = NULL;
+            pattern = NULL;
+        }
+    }
+    const tone_step_t *step = (pattern == NULL) ? NULL : &pattern->steps[myToneStep++];
+    uint8_t level = myToneLevel;
+    uint32_t generation = myToneGeneration;
+    portEXIT_CRITICAL(&myToneMux);
+
+    if (step == NULL) {
+        // Nothing (left) to play.
+        ledc_set_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL, 0);
+        ledc_update_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL);
+        return;
+    }
+
+    if (step->frequency == 0) {
+        ledc_set_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL, 0);
+        ledc_update_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL);
+    } else {
+        ledc_set_freq(BUZZER_LEDC_MODE, BUZZER_LEDC_TIMER, step->frequency);
+        ledc_set_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL, tone_duty(step->volume, level));
+        ledc_update_duty(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL);
+        if (step->endVolume != step->volume) {
+            // Let the LEDC hardware fade the volume across the step.
+            ledc_set_fade_time_and_start(BUZZER_LEDC_MODE, BUZZER_LEDC_CHANNEL,
+                tone_duty(step->endVolume, level), step->duration, LEDC_FADE_NO_WAIT);
+        }
+    }
+
+    // Only time the next step if the pattern hasn't changed in the meantime.
+    // The timer calls only take a spin lock, so they can be made in here.
+    esp_err_t err = ESP_OK;
+    portENTER_CRITICAL(&myToneMux);
+    if (generation == myToneGeneration) {
+        err = esp_timer_start_once(myToneTimer, step->duration * 1000ULL);
+    }
+    portEXIT_CRITICAL(&myToneMux);
+    if (err != ESP_OK) {
+        LOG_WARNING(EVENT_TONE_TIMER_FAILED, err, 0);
+    }
+}
+
+/**
+ * Switches the buzzer to a pattern (or to silence), and has the timer play
+ * the first step straight away.
+ * 
+ * @param pattern The pattern to be played, NULL for silence.
+ */
+void change_tones(const tone_pattern_t *pattern) {
+    portENTER_CRITICAL(&myToneMux);
+    myTonePattern = pattern;
+    myToneStep = 0;
+    myToneLevel = (pattern == NULL) ? 0 : pattern->startLevel;
+    myToneGeneration++;
+
+    // Stopping a timer that isn't running fails (ESP_ERR_INVALID_STATE),
+    // which is fine. A callback that is running won't restart it, as the
+    // generation has changed.
+    esp_timer_stop(myToneTimer);
+    esp_err_t err = esp_timer_start_once(myToneTimer, 0);
+    portEXIT_CRITICAL(&myToneMux);
+    if (err != ESP_OK) {
+        LOG_WARNING(EVENT_TONE_TIMER_FAILED, err, 0);
+    }
+}
+
+/**
+ * Starts playing a buzzer pattern, replacing any pattern already playing.
+ * 
+ * @param pattern The pattern to be played.
+ */
+void start_tones(const tone_pattern_t *pattern) {
+    change_tones(pattern);
+}
+
+/**
+ * Stops any buzzer pattern that is playing.
+ */
+void stop_tones() {
+    change_tones(NULL);
+}
+
+/**
+ * Sets up the LEDC peripheral and timer used to drive the buzzer.
+ */
+void setupBuzzer() {
+    ledc_timer_config_t timerConfig = {};
+    timerConfig.speed_mode = BUZZER_LEDC_MODE;
+    timerConfig.duty_resolution = BUZZER_DUTY_RESOLUTION;
+    timerConfig.timer_num = BUZZER_LEDC_TIMER;
+    timerConfig.freq_hz = BUZZER_DEFAULT_FREQUENCY;
+    timerConfig.clk_cfg = LEDC_AUTO_CLK;
+    ledc_timer_config(&timerConfig);
+
+    ledc_channel_config_t channelConfig = {};
+    channelConfig.gpio_num = PIN_BUZZER;
+    channelConfig.speed_mode = BUZZER_LEDC_MODE;
+    channelConfig.channel = BUZZER_LEDC_CHANNEL;
+    channelConfig.intr_type = LEDC_INTR_DISABLE;
+    channelConfig.timer_sel = BUZZER_LEDC_TIMER;
+    channelConfig.duty = 0;
+    channelConfig.hpoint = 0;
+    ledc_channel_config(&channelConfig);
+    ledc_fade_func_install(0);
+
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = play_tone_step;
+    timerArgs.name = "buzzer";
+    esp_timer_create(&timerArgs, &myToneTimer);
+
+    compile_tone_pattern(BUZZER_ALARM_TONES, true, 
+        BUZZER_ALARM_START_LEVEL, BUZZER_ALARM_LEVEL_STEP, &myAlarmTones);
+    compile_tone_pattern(BUZZER_CLICK_TONES, false, 255, 0, &myClickTones);
+}
+
+/**
+ * Checks that a custom pattern is safe to run.
+ * 
+ * @param pattern The custom pattern to check.
+ * @return true if the pattern is valid, false otherwise.
+ */
+bool validate_pattern(const custom_pattern_t *pattern) {
+    if (pattern->magic != PATTERN_MAGIC || pattern->opCount > MAX_PATTERN_OPS ||
+        pattern->period == 0 || pattern->period > MAX_PATTERN_PERIOD) {
+        return false;
+    }
+    for (uint8_t ii = 0; ii < pattern->opCount; ii++) {
+        const pattern_op_t *op = &pattern->ops[ii];
+        if ((op->code & ~PATTERN_IMMEDIATE) > MAX_PATTERN_OP_INDEX ||
+            op->dest >= PATTERN_REGISTER_COUNT || op->a >= PATTERN_REGISTER_COUNT ||
+            (!(op->code & PATTERN_IMMEDIATE) && (op->x < 0 || op->x >= PATTERN_REGISTER_COUNT))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a custom pattern from LittleFS.
+ * 
+ * @param slot The slot (0 - CUSTOM_PATTERN_COUNT - 1) to read.
+ * @param pattern Set to the pattern, or an empty pattern if there isn't a
+ *                valid one in the slot.
+ * @return true if a valid pattern was read, false otherwise.
+ */
+bool read_pattern(uint8_t slot, custom_pattern_t *pattern) {
+    char path[24];
+    snprintf(path, sizeof(path), "%s/%u.bin", PATTERN_DIR, slot + 1);
+    memset(pattern, 0, sizeof(custom_pattern_t));
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    size_t res = file.read((uint8_t *)pattern, sizeof(custom_pattern_t));
+    file.close();
+    if (res != sizeof(custom_pattern_t) || !validate_pattern(pattern)) {
+        LOG_WARNING(EVENT_PATTERN_INVALID, slot + 1, 0);
+        memset(pattern, 0, sizeof(custom_pattern_t));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes a custom pattern to LittleFS.
+ * 
+ * @param slot The slot (0 - CUSTOM_PATTERN_COUNT - 1) to write.
+ * @param pattern The pattern to be written.
+ * @return true if the pattern was written, false otherwise.
+ */
+bool write_pattern(uint8_t slot, const custom_pattern_t *pattern) {
+    char path[24];
+    snprintf(path, sizeof(path), "%s/%u.bin", PATTERN_DIR, slot + 1);
+    File file = LittleFS.open(path, FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+    size_t res = file.write((const uint8_t *)pattern, sizeof(custom_pattern_t));
+    file.close();
+    return res == sizeof(custom_pattern_t);
+}
+
+/**
+ * Loads all of the custom patterns from LittleFS.
+ */
+void load_patterns() {
+    if (!LittleFS.exists(PATTERN_DIR)) {
+        LittleFS.mkdir(PATTERN_DIR);
+    }
+    for (uint8_t ii = 0; ii < CUSTOM_PATTERN_COUNT; ii++) {
+        read_pattern(ii, &myPatterns[ii]);
+    }
+}
+
+/**
+ * Adds a record to the display recording, dropping the oldest records if the
+ * ring buffer is full.
+ * 
+ * @param type The type of record.
+ * @param loop The loop number that the record was made in.
+ * @param data The data for the record.
+ * @param length The length of the data.
+ */
+void record(record_type_t type, uint32_t loop, const void *data, uint8_t length) {
+    portENTER_CRITICAL(&myRecordingMux);
+    recording_add(&myRecording, type, loop, data, length);
+    portEXIT_CRITICAL(&myRecordingMux);
+}
+
+/**
+ * Records what changed on the display in this loop, along with the inputs
+ * and everything else that the frame was rendered from.
+ * 
+ * @param encoder The position of the rotary encoder.
+ * @param renderTime The time taken to render the frame (microseconds).
+ */
+void record_loop(int32_t encoder, uint32_t renderTime) {
+    recorded_loop_t current;
+    current.loop = myLoopCount;
+    time_t now;
+    time(&now);
+    current.inputs.time = (uint32_t)now;
+    current.inputs.encoder = encoder;
+    current.inputs.button = myIsButtonPressed ? 1 : 0;
+    current.inputs.ldr = myLdr;
+    current.display = myDisplay;
+    current.patterns = myPatterns;
+    current.output.calibration = myConfiguration.calibration;
+    current.output.powerBudget = myConfiguration.powerBudget;
+    current.pixels = leds.Pixels();
+    current.renderTime = renderTime;
+    recorder_loop(&myRecorder, &current, record);
+}
+
+/**
+ * Clears the display recording and starts recording.
+ */
+void start_recording() {
+    portENTER_CRITICAL(&myRecordingMux);
+    recording_clear(&myRecording);
+    portEXIT_CRITICAL(&myRecordingMux);
+
+    // Make sure the first loop records everything.
+    recorder_begin(&myRecorder, myLoopCount);
+    myIsRecording = true;
+}
+
+/**
+ * Sends the telemetry for a loop, along with the state when it changes.
+ * 
+ * @param loopTime The time taken by the loop (us).
+ * @param renderTime The time taken to render the display (us).
+ */
+void send_loop_telemetry(uint32_t loopTime, uint32_t renderTime) {
+    telemetry_loop_t timing;
+    timing.loopTime = (loopTime > UINT16_MAX) ? UINT16_MAX : loopTime;
+    timing.renderTime = (renderTime > UINT16_MAX) ? UINT16_MAX : renderTime;
+    send_telemetry(telemetry_type_t::TELEMETRY_LOOP, &timing, sizeof(telemetry_loop_t));
+
+    telemetry_state_t state;
+    state.state = static_cast<uint8_t>(myState);
+    state.alarmState = static_cast<uint8_t>(myAlarmState);
+    if (memcmp(&state, &myTelemetryState, sizeof(telemetry_state_t)) != 0) {
+        myTelemetryState = state;
+        send_telemetry(telemetry_type_t::TELEMETRY_STATE, &state, sizeof(telemetry_state_t));
+    }
+}
+
+/**
+ * The telemetry task, which sends the waiting records to DEBUG_SERVER at the
+ * configured interval, so that the main loop never waits for the network.
+ * 
+ * @param arg Unused.
+ */
+void telemetry_task(void *arg) {
+    static uint8_t datagram[sizeof(telemetry_datagram_t) + TELEMETRY_BUFFER_SIZE + 
+                            sizeof(record_header_t) + sizeof(telemetry_heap_t)];
+    telemetry_datagram_t *header = (telemetry_datagram_t *)datagram;
+    header->magic = TELEMETRY_MAGIC;
+    header->sequence = 0;
+    header->loopDelay = LOOP_DELAY;
+    TickType_t wakeTime = xTaskGetTickCount();
+    while (true) {
+        uint16_t interval = myTelemetryInterval.load(std::memory_order_relaxed);
+        vTaskDelayUntil(&wakeTime, pdMS_TO_TICKS((interval == 0) ? MAX_TELEMETRY_INTERVAL : interval));
+        if (interval == 0) {
+            continue;
+        }
+
+        // Take the waiting records.
+        size_t length = sizeof(telemetry_datagram_t);
+        portENTER_CRITICAL(&myTelemetryMux);
+        memcpy(&datagram[length], myTelemetry, myTelemetryUsed);
+        length += myTelemetryUsed;
+        header->dropped = myTelemetryDropped;
+        myTelemetryUsed = 0;
+        myTelemetryDropped = 0;
+        portEXIT_CRITICAL(&myTelemetryMux);
+
+        // Add the state of the heap.
+        record_header_t heapHeader;
+        heapHeader.type = telemetry_type_t::TELEMETRY_HEAP;
+        heapHeader.length = sizeof(telemetry_heap_t);
+        heapHeader.loop = myLoopCount;
+        telemetry_heap_t heap;
+        heap.freeHeap = ESP.getFreeHeap();
+        heap.largestBlock = ESP.getMaxAllocHeap();
+        memcpy(&datagram[length], &heapHeader, sizeof(record_header_t));
+        memcpy(&datagram[length + sizeof(record_header_t)], &heap, sizeof(telemetry_heap_t));
+        length += sizeof(record_header_t) + sizeof(telemetry_heap_t);
+
+        udp.beginPacket(DEBUG_SERVER, DEBUG_PORT);
+        udp.write(datagram, length);
+        udp.endPacket();
+        header->sequence++;
+    }
+}
+
+/**
+ * Starts the telemetry task, once the network is available.
+ */
+void start_telemetry() {
+    if (myTelemetryTask == NULL) {
+        xTaskCreate(telemetry_task, "telemetry", TELEMETRY_TASK_STACK_SIZE, NULL, 
+            TELEMETRY_TASK_PRIORITY, &myTelemetryTask);
+    }
+}
+
+/**
+ * Queues a message for the MQTT broker. This never blocks. Only the latest
+ * message for each topic is kept, replacing any not yet sent, so that a
+ * frequently changing topic can't push out the others.
+ * 
+ * @param topic The topic to publish to.
+ * @param retain Whether the broker should retain the message.
+ * @param format The "printf" formatting string for the payload.
+ * @param ... The values to be used when referenced from the format string.
+ */
+void publish_mqtt(mqtt_topic_t topic, bool retain, const char *format, ...) {
+    mqtt_message_t message;
+    message.topic = topic;
+    message.retain = retain;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message.payload, sizeof(message.payload), format, args);
+    va_end(args);
+
+    mqtt_slot_t *slot = &myMqttSlots[topic];
+    portENTER_CRITICAL(&myMqttMux);
+    bool isReplaced = slot->isPending;
+    slot->message = message;
+    slot->version++;
+    slot->isPending = true;
+    portEXIT_CRITICAL(&myMqttMux);
+    if (isReplaced) {
+        myMqttStats.dropped++;
+    }
+}
+
+/**
+ * Publishes the alarm state, brightness and day/night with MQTT when they
+ * change.
+ */
+void publish_state_changes() {
+    if (myConfiguration.mqttHost[0] == '\0') {
+        return;
+    }
+    if (!myIsMqttStatePublished || myAlarmState != myMqttAlarmState) {
+        myMqttAlarmState = myAlarmState;
+        publish_mqtt(mqtt_topic_t::MQTT_ALARM, true, "%s", 
+            ALARM_STATE_STRINGS[static_cast<int>(myAlarmState)]);
+    }
+    if (!myIsMqttStatePublished || myBrightness != myMqttBrightness) {
+        myMqttBrightness = myBrightness;
+        publish_mqtt(mqtt_topic_t::MQTT_BRIGHTNESS, true, "%u", myBrightness);
+    }
+    if (!myIsMqttStatePublished || myIsDaytime != myMqttIsDaytime) {
+        myMqttIsDaytime = myIsDaytime;
+        publish_mqtt(mqtt_topic_t::MQTT_DAYTIME, true, "%s", myIsDaytime ? "day" : "night");
+    }
+    myIsMqttStatePublished = true;
+}
+
+/**
+ * Derives the mDNS host name from the device name, keeping letters and
+ * digits, and replacing anything else with hyphens.
+ * 
+ * @param name The device name.
+ * @param hostname The buffer for the host name (HOSTNAME_MAX_LEN + 1).
+ */
+void make_hostname(const char *name, char *hostname) {
+    size_t len = 0;
+    for (const char *ch = name; *ch != '\0' && len < HOSTNAME_MAX_LEN; ch++) {
+        if (isalnum(*ch)) {
+            hostname[len++] = tolower(*ch);
+        } else if (len > 0 && hostname[len - 1] != '-') {
+            hostname[len++] = '-';
+        }
+    }
+    while (len > 0 && hostname[len - 1] == '-') {
+        len--;
+    }
+    hostname[len] = '\0';
+    if (len == 0) {
+        strcpy(hostname, "espclock");
+    }
+}
+
+/**
+ * Advertises the clock with mDNS/DNS-SD, as <hostname>.local with the device
+ * name as the instance name, so that the fleet can be discovered.
+ */
+void start_mdns() {
+    if (!MDNS.begin(myHostname)) {
+        Serial.println("Unable to start mDNS.");
+        return;
+    }
+    MDNS.setInstanceName(myConfiguration.deviceName);
+    MDNS.addService("_http", "_tcp", 80);
+    MDNS.addService(MDNS_SERVICE, "_tcp", 80);
+    MDNS.addServiceTxt(MDNS_SERVICE, "_tcp", "version", VERSION);
+}
+
+/**
+ * Updates the mDNS names after the device name has changed.
+ */
+void update_mdns() {
+    char hostname[HOSTNAME_MAX_LEN + 1];
+    make_hostname(myConfiguration.deviceName, hostname);
+    if (strcmp(hostname, myHostname) == 0) {
+        MDNS.setInstanceName(myConfiguration.deviceName);
+        return;
+    }
+    strcpy(myHostname, hostname);
+
+    // Neither mDNS nor ArduinoOTA can be renamed while running, so restart
+    // them. Ending ArduinoOTA also ends mDNS, and starting it again starts
+    // mDNS with its _arduino service.
+    if (strlen(FLEET_KEY) == 0) {
+        MDNS.end();
+    } else {
+        ArduinoOTA.end();
+        ArduinoOTA.setHostname(myHostname);
+        ArduinoOTA.begin();
+    }
+    start_mdns();
+}
+
+/**
+ * Samples the heap and the task stacks. When memory runs low the web server
+ * is degraded, refusing requests, until memory recovers.
+ */
+void check_memory() {
+    memory_stats_t stats;
+    stats.freeHeap = ESP.getFreeHeap();
+    stats.minFreeHeap = ESP.getMinFreeHeap();
+    stats.largestBlock = ESP.getMaxAllocHeap();
+    stats.heapSize = ESP.getHeapSize();
+
+    TaskHandle_t tasks[MONITORED_TASK_COUNT];
+    tasks[monitored_task_t::TASK_LOOP] = xTaskGetCurrentTaskHandle();
+    tasks[monitored_task_t::TASK_RADIO] = myRadioTask;
+    tasks[monitored_task_t::TASK_TELEMETRY] = myTelemetryTask;
+    tasks[monitored_task_t::TASK_MQTT] = myMqttTask;
+    tasks[monitored_task_t::TASK_ASYNC_TCP] = myIsNetworkStarted ? xTaskGetHandle("async_tcp") : NULL;
+    for (uint8_t ii = 0; ii < MONITORED_TASK_COUNT; ii++) {
+        stats.stackUnused[ii] = (tasks[ii] == NULL) ? -1 : uxTaskGetStackHighWaterMark(tasks[ii]);
+        if (tasks[ii] != NULL && stats.stackUnused[ii] < STACK_LOW_WATERMARK && 
+                (myStackLowReported & (1 << ii)) == 0) {
+            myStackLowReported |= (1 << ii);
+            LOG_WARNING(EVENT_STACK_LOW, ii, stats.stackUnused[ii]);
+        }
+    }
+
+    if (!myIsMemoryLow && 
+            (stats.freeHeap < MEMORY_LOW_FREE_HEAP || stats.largestBlock < MEMORY_LOW_LARGEST_BLOCK)) {
+        myIsMemoryLow = true;
+        myMemoryStats.degradedCount++;
+        LOG_WARNING(EVENT_MEMORY_LOW, stats.freeHeap, stats.largestBlock);
+    } else if (myIsMemoryLow && 
+            stats.freeHeap >= MEMORY_RECOVERED_FREE_HEAP && stats.largestBlock >= MEMORY_RECOVERED_LARGEST_BLOCK) {
+        myIsMemoryLow = false;
+        LOG_INFO(EVENT_MEMORY_RECOVERED, stats.freeHeap, stats.largestBlock);
+    }
+
+    portENTER_CRITICAL(&myMemoryMux);
+    stats.degradedCount = myMemoryStats.degradedCount;
+    myMemoryStats = stats;
+    portEXIT_CRITICAL(&myMemoryMux);
+}
+
+/**
+ * Checks that there is enough memory to handle a web request. This is used as
+ * a filter on the web handlers, so that requests fall through to the 404
+ * handler while memory is low.
+ * 
+ * @param request The web request.
+ * @return true if the request may be handled, false otherwise.
+ */
+bool is_memory_available(AsyncWebServerRequest *request) {
+    return !myIsMemoryLow;
+}
+
+/*
+ * Initialises the command queue, marking every slot as free.
+ */
+void init_command_queue() {
+    for (uint32_t ii = 0; ii < COMMAND_QUEUE_SIZE; ii++) {
+        myCommandSlots[ii].sequence.store(ii, std::memory_order_relaxed);
+    }
+    myCommandHead.store(0, std::memory_order_relaxed);
+    myCommandTail = 0;
+}
+
+/*
+ * Adds a batch of commands to the queue for the main loop. The batch is
+ * queued in full or not at all, so a retried batch never runs twice. This is
+ * safe to call from any task, and never blocks.
+ *
+ * @param commands The commands to be queued.
+ * @param count The number of commands (1 to COMMAND_QUEUE_SIZE).
+ * @return true if the commands were queued, false if there isn't room.
+ */
+bool queue_commands(const command_t *commands, uint32_t count) {
+    uint32_t pos = myCommandHead.load(std::memory_order_relaxed);
+    while (true) {
+        // The loop frees slots in order, so if the last slot needed is free
+        // then so are the rest.
+        uint32_t last = pos + count - 1;
+        uint32_t sequence = myCommandSlots[last % COMMAND_QUEUE_SIZE].sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(sequence - last);
+        if (diff == 0) {
+            // The slots are free, try to claim them all.
+            if (myCommandHead.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                for (uint32_t ii = 0; ii < count; ii++) {
+                    command_slot_t *slot = &myCommandSlots[(pos + ii) % COMMAND_QUEUE_SIZE];
+                    slot->command = commands[ii];
+                    slot->sequence.store(pos + ii + 1, std::memory_order_release);
+                }
+                return true;
+            }
+        } else if (diff < 0) {
+            // The queue is too full.
+            myCommandStats.dropped += count;
+            return false;
+        } else {
+            // Another task claimed the slots first, try the next ones.
+            pos = myCommandHead.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Adds a command to the queue for the main loop. This is safe to call from
+ * any task, and never blocks.
+ *
+ * @param command The command to be queued.
+ * @return true if the command was queued, false if the queue is full.
+ */
+bool queue_command(const command_t *command) {
+    return queue_commands(command, 1);
+}
+
+/*
+ * Takes the next command from the queue. Only the main loop may call this.
+ *
+ * @param command The structure into which the command is copied.
+ * @return true if a command was read, false if the queue is empty.
+ */
+bool dequeue_command(command_t *command) {
+    command_slot_t *slot = &myCommandSlots[myCommandTail % COMMAND_QUEUE_SIZE];
+    uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if ((int32_t)(sequence - (myCommandTail + 1)) < 0) {
+        // The queue is empty.
+        return false;
+    }
+
+    *command = slot->command;
+    slot->sequence.store(myCommandTail + COMMAND_QUEUE_SIZE, std::memory_order_release);
+    myCommandTail++;
+    return true;
+}
+
+/**
+ * Records the duration of an I2C transaction with the radio.
+ * 
+ * @param startTime The time (microseconds) that the transaction started.
+ */
+void record_i2c_transaction(int64_t startTime) {
+    uint32_t latency = (uint32_t)(esp_timer_get_time() - startTime);
+    uint32_t average = myI2cStats.averageLatency;
+    myI2cStats.transactions++;
+    myI2cStats.averageLatency = (myI2cStats.transactions == 1) ? 
+        latency : average - (average / 8) + (latency / 8);
+    if (latency > myI2cStats.maxLatency) {
+        myI2cStats.maxLatency = latency;
+    }
+}
+
+/**
+ * Mutes or unmutes the radio. Only the radio task may call this.
+ * 
+ * @param mute Flag set when the radio is to be muted.
+ */
+void radio_set_mute(bool mute) {
+    int64_t startTime = esp_timer_get_time();
+    radio.setMute(mute);
+    record_i2c_transaction(startTime);
+}
+
+/**
+ * Tunes the radio and measures the signal. Only the radio task may call this.
+ * 
+ * @param frequency The frequency to tune to (100 kHz units).
+ * @return The signal level (0-15) at the frequency.
+ */
+uint8_t radio_tune(uint16_t frequency) {
+    // The radio library works in 10 kHz units.
+    int64_t startTime = esp_timer_get_time();
+    radio.setBandFrequency(RADIO_BAND_FM, frequency * 10);
+    record_i2c_transaction(startTime);
+
+    vTaskDelay(pdMS_TO_TICKS(RADIO_SETTLE_TIME));
+
+    RADIO_INFO info;
+    startTime = esp_timer_get_time();
+    radio.getRadioInfo(&info);
+    record_i2c_transaction(startTime);
+    return info.rssi;
+}
+
+// The radio task's access to the receiver.
+const radio_driver_t TEA5767_DRIVER = { radio_tune, radio_set_mute };
+
+/**
+ * Plays the first of the requested frequencies with reasonable reception.
+ * If none are good enough, the main loop is asked to use the buzzer instead.
+ * 
+ * @param request The request containing the frequencies to try.
+ */
+void radio_play(const radio_request_t *request) {
+    uint8_t levels[RADIO_PRESET_COUNT + 1];
+    int played = radio_play_first(&TEA5767_DRIVER, request->frequencies, RADIO_PRESET_COUNT + 1, levels);
+    for (int ii = 0; ii < (played < 0 ? RADIO_PRESET_COUNT + 1 : played); ii++) {
+        if (request->frequencies[ii] != 0) {
+            LOG_INFO(EVENT_RADIO_POOR_RECEPTION, request->frequencies[ii], levels[ii]);
+        }
+    }
+    if (played >= 0) {
+        return;
+    }
+
+    LOG_WARNING(EVENT_RADIO_FALLBACK, 0, 0);
+    command_t command = {};
+    command.type = command_type_t::RADIO_FALLBACK;
+    command.receivedTime = esp_timer_get_time();
+    queue_command(&command);
+}
+
+/**
+ * Scans the FM band, building a table of the strongest stations.
+ */
+void radio_scan() {
+    radio_station_t stations[MAX_RADIO_STATIONS];
+    uint8_t count = radio_scan_band(&TEA5767_DRIVER, stations);
+
+    portENTER_CRITICAL(&myRadioMux);
+    memcpy(myRadioStations, stations, count * sizeof(radio_station_t));
+    myRadioStationCount = count;
+    portEXIT_CRITICAL(&myRadioMux);
+
+    LOG_INFO(EVENT_RADIO_SCANNED, count, 0);
+}
+
+/**
+ * The radio task, which performs all of the (slow) I2C communication with the
+ * radio so that the main loop never waits for it.
+ * 
+ * @param arg Unused.
+ */
+void radio_task(void *arg) {
+    radio_request_t request;
+    while (true) {
+        if (xQueueReceive(myRadioQueue, &request, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        switch (request.type) {
+            case radio_request_type_t::RADIO_PLAY:
+                radio_play(&request);
+                break;
+            case radio_request_type_t::RADIO_MUTE:
+                radio_set_mute(true);
+                break;
+            case radio_request_type_t::RADIO_SCAN:
+                radio_scan();
+                myRadioScansPending--;
+                break;
+        }
+    }
+}
+
+/**
+ * Sends a request to the radio task. Radio plays use the configured alarm
+ * frequency, followed by the presets.
+ * 
+ * @param type The type of request.
+ * @return true if the request was queued, false otherwise.
+ */
+bool request_radio(radio_request_type_t type) {
+    if (myRadioQueue == NULL) {
+        return false;
+    }
+
+    radio_request_t request = {};
+    request.type = type;
+    request.frequencies[0] = myConfiguration.radioFrequency;
+    memcpy(&request.frequencies[1], myConfiguration.radioPresets, sizeof(myConfiguration.radioPresets));
+    if (type == radio_request_type_t::RADIO_SCAN) {
+        myRadioScansPending++;
+    }
+    if (xQueueSend(myRadioQueue, &request, 0) != pdTRUE) {
+        if (type == radio_request_type_t::RADIO_SCAN) {
+            myRadioScansPending--;
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Aims the wake-up ramp at the end of its current curve segment, so that each
+ * frame only needs to add the per-frame steps.
+ */
+void start_wake_segment() {
+    const wake_point_t *from = &WAKE_CURVE[myWakeRamp.segment];
+    const wake_point_t *to = &WAKE_CURVE[myWakeRamp.segment + 1];
+    int32_t frames = (int32_t)myWakeRamp.framesPerSegment;
+    myWakeRamp.framesRemaining = myWakeRamp.framesPerSegment;
+    myWakeRamp.value[0] = (int32_t)from->level << 16;
+    myWakeRamp.value[1] = (int32_t)from->colour.r << 16;
+    myWakeRamp.value[2] = (int32_t)from->colour.g << 16;
+    myWakeRamp.value[3] = (int32_t)from->colour.b << 16;
+    myWakeRamp.step[0] = (((int32_t)to->level - from->level) << 16) / frames;
+    myWakeRamp.step[1] = (((int32_t)to->colour.r - from->colour.r) << 16) / frames;
+    myWakeRamp.step[2] = (((int32_t)to->colour.g - from->colour.g) << 16) / frames;
+    myWakeRamp.step[3] = (((int32_t)to->colour.b - from->colour.b) << 16) / frames;
+}
+
+/**
+ * Starts the wake-up light ramp that leads up to the alarm.
+ * 
+ * @param elapsed How far into the ramp to start (s), when resuming it.
+ */
+void start_wake(uint32_t elapsed = 0) {
+    LOG_INFO(EVENT_WAKE_STARTED, myConfiguration.wakeDuration, elapsed);
+    time_t now;
+    time(&now);
+    myAlarmState = alarm_state_t::WAKING;
+    myWakeRamp.startTime = now - elapsed;
+    myWakeRamp.framesPerSegment = ((uint32_t)myConfiguration.wakeDuration * SECONDS_PER_MINUTE * 
+        (1000 / LOOP_DELAY)) / (WAKE_CURVE_POINTS - 1);
+
+    // Skip the segments, and the frames of this segment, already passed.
+    uint32_t frames = elapsed * (1000 / LOOP_DELAY);
+    uint32_t segment = frames / myWakeRamp.framesPerSegment;
+    if (segment > WAKE_CURVE_POINTS - 2) {
+        segment = WAKE_CURVE_POINTS - 2;
+    }
+    myWakeRamp.segment = segment;
+    start_wake_segment();
+    uint32_t skipped = frames - (segment * myWakeRamp.framesPerSegment);
+    if (skipped > myWakeRamp.framesRemaining) {
+        skipped = myWakeRamp.framesRemaining;
+    }
+    for (uint8_t ii = 0; ii < 4; ii++) {
+        myWakeRamp.value[ii] += myWakeRamp.step[ii] * (int32_t)skipped;
+    }
+    myWakeRamp.framesRemaining -= skipped;
+
+    myWakeBrightness = ((myWakeRamp.value[0] >> 16) * MAX_BRIGHTNESS_F) / 255.0f;
+    myWakeColour.r = myWakeRamp.value[1] >> 16;
+    myWakeColour.g = myWakeRamp.value[2] >> 16;
+    myWakeColour.b = myWakeRamp.value[3] >> 16;
+    persist_alarm(true);
+}
+
+/**
+ * Advances the wake-up ramp by a single frame. The light holds at the end of
+ * the curve until the alarm starts.
+ */
+void step_wake() {
+    if (myAlarmState != alarm_state_t::WAKING || myWakeRamp.framesRemaining == 0) {
+        return;
+    }
+
+    for (uint8_t ii = 0; ii < 4; ii++) {
+        myWakeRamp.value[ii] += myWakeRamp.step[ii];
+    }
+    myWakeRamp.framesRemaining--;
+    if (myWakeRamp.framesRemaining == 0 && myWakeRamp.segment < WAKE_CURVE_POINTS - 2) {
+        // Snap to the next point, so rounding errors don't accumulate.
+        myWakeRamp.segment++;
+        start_wake_segment();
+    }
+
+    myWakeBrightness = ((myWakeRamp.value[0] >> 16) * MAX_BRIGHTNESS_F) / 255.0f;
+    myWakeColour.r = myWakeRamp.value[1] >> 16;
+    myWakeColour.g = myWakeRamp.value[2] >> 16;
+    myWakeColour.b = myWakeRamp.value[3] >> 16;
+}
+
+/**
+ * Determines whether the alarm is set to go off at the given time.
+ * 
+ * @param time The time to check, which is matched to the minute.
+ * @return true if the alarm is due at the time, false otherwise.
+ */
+bool is_alarm_due(time_t time) {
+    if (myConfiguration.isAlarmDisabled || !myIsAlarmSwitchEnabled) {
+        return false;
+    }
+
+    tm tm_val;
+    localtime_r(&time, &tm_val);
+    int32_t minuteOfDay = (((int32_t)tm_val.tm_hour) * MINUTES_PER_HOUR) + tm_val.tm_min;
+    return minuteOfDay == alarm_minute(&myConfiguration, &tm_val, is_skip_date(date_value(&tm_val)));
+}
+
+/**
+ * Starts sounding the alarm.
+ */
+void start_alarm() {
+    LOG_INFO(EVENT_ALARM_STARTED, 0, 0);
+    myAlarmState = alarm_state_t::ACTIVE;
+    myAlarmRemaining = ALARM_DURATION;
+    mySnoozeRemaining = 0;
+    persist_alarm(true);
+    
+    if (myConfiguration.isRadioInstalled && myConfiguration.isUseRadio &&
+        myRadioScansPending == 0 && request_radio(radio_request_type_t::RADIO_PLAY)) {
+        // The radio task turns on the radio, or asks for the buzzer instead.
+    } else {
+        // Start the buzzer, which is also used rather than waiting for a
+        // band scan to finish.
+        start_tones(&myAlarmTones);
+    }
+}
+
+void snooze_alarm() {
+    LOG_INFO(EVENT_ALARM_SNOOZED, SNOOZE_DURATION, 0);
+    myAlarmState = alarm_state_t::SNOOZE;
+    myWakeBrightness = 0.0f;
+    myAlarmRemaining = 0;
+    mySnoozeRemaining = SNOOZE_DURATION;
+    persist_alarm(true);
+
+    // Turn off the radio/buzzer. The buzzer may be on in place of the radio.
+    if (myConfiguration.isRadioInstalled && myConfiguration.isUseRadio) {
+        request_radio(radio_request_type_t::RADIO_MUTE);
+    }
+    stop_tones();
+}
+
+void stop_alarm() {
+    LOG_INFO(EVENT_ALARM_STOPPED, 0, 0);
+    myAlarmState = alarm_state_t::INACTIVE;
+    myWakeBrightness = 0.0f;
+    myAlarmRemaining = 0;
+    mySnoozeRemaining = 0;
+    myAlarmRecoveries = 0;
+    persist_alarm(true);
+
+    // Turn off the radio/buzzer. The buzzer may be on in place of the radio.
+    if (myConfiguration.isRadioInstalled && myConfiguration.isUseRadio) {
+        request_radio(radio_request_type_t::RADIO_MUTE);
+    }
+    stop_tones();
+}
+
+/**
+ * Resumes a saved alarm, unless the clock was off for longer than
+ * ALARM_RESUME_WINDOW. A waking alarm is saved when the ramp started, so the
+ * window is from the end of the ramp.
+ * 
+ * @param saved The alarm saved when the clock was reset.
+ */
+void resume_saved_alarm(const alarm_persist_t *saved) {
+    time_t now;
+    time(&now);
+    time_t elapsed = now - saved->timestamp;
+    time_t wakeDuration = (time_t)myConfiguration.wakeDuration * SECONDS_PER_MINUTE;
+    time_t window = ALARM_RESUME_WINDOW + ((saved->state == alarm_state_t::WAKING) ? wakeDuration : 0);
+    if (saved->state == alarm_state_t::INACTIVE || now < MIN_VALID_TIMESTAMP || 
+            elapsed < 0 || elapsed > window) {
+        return;
+    }
+    if (saved->recoveries >= ALARM_MAX_RECOVERIES || 
+            myConfiguration.isAlarmDisabled || !myIsAlarmSwitchEnabled) {
+        // Don't keep resuming an alarm that could be causing the resets.
+        stop_alarm();
+        return;
+    }
+
+    myAlarmRecoveries = saved->recoveries + 1;
+    int16_t snoozeRemaining = (int16_t)(saved->snoozeRemaining - elapsed);
+    if (saved->state == alarm_state_t::WAKING) {
+        // The alarm only starts on its minute, so if that passed while the
+        // clock was off, start it now rather than holding the light.
+        if (elapsed >= wakeDuration) {
+            start_alarm();
+        } else {
+            start_wake((uint32_t)elapsed);
+        }
+    } else if (saved->state == alarm_state_t::SNOOZE && snoozeRemaining > 0) {
+        myAlarmState = alarm_state_t::SNOOZE;
+        mySnoozeRemaining = snoozeRemaining;
+        persist_alarm(true);
+    } else {
+        start_alarm();
+    }
+
+    myRecoveredAlarms++;
+    #ifndef DISABLE_CONFIG_WRITES
+    prefs.putUInt(KEY_ALARMS_RECOVERED, myRecoveredAlarms);
+    #endif
+    LOG_WARNING(EVENT_ALARM_RECOVERED, saved->state, elapsed);
+}
+
+/**
+ * Resumes an alarm that was waking, sounding or snoozing when the clock was
+ * reset. RTC memory is preferred (crashes and soft resets), and is resumed
+ * straight away. Otherwise the state last written to flash (power cycles) is
+ * used, but if the time came from flash too, how long the power was off
+ * isn't known, so it waits for NTP (see update_time()).
+ */
+void resume_alarm() {
+    if (esp_reset_reason() != ESP_RST_POWERON && myRtcAlarmState.magic == ALARM_STATE_MAGIC) {
+        alarm_persist_t saved = myRtcAlarmState;
+        resume_saved_alarm(&saved);
+        return;
+    }
+    if (prefs.getBytes(KEY_ALARM_STATE, &myPendingAlarm, sizeof(alarm_persist_t)) != sizeof(alarm_persist_t) ||
+            myPendingAlarm.magic != ALARM_STATE_MAGIC || myPendingAlarm.state == alarm_state_t::INACTIVE) {
+        return;
+    }
+
+    time_t now;
+    time(&now);
+    if (myIsTimeStale || now < MIN_VALID_TIMESTAMP) {
+        myIsAlarmResumePending = true;
+    } else {
+        resume_saved_alarm(&myPendingAlarm);
+    }
+}
+
+/*
+ * Executes a command taken from the command queue.
+ *
+ * @param command The command to execute.
+ */
+void execute_command(const command_t *command) {
+    switch (command->type) {
+        case command_type_t::START_ALARM:
+            if (!myConfiguration.isAlarmDisabled) {
+                start_alarm();
+            }
+            break;
+        case command_type_t::SNOOZE_ALARM:
+            if (myAlarmState == alarm_state_t::ACTIVE) {
+                snooze_alarm();
+            }
+            break;
+        case command_type_t::STOP_ALARM:
+            if (myAlarmState != alarm_state_t::INACTIVE) {
+                stop_alarm();
+            }
+            break;
+        case command_type_t::PREVIEW_PATTERN:
+            myPreviewPattern = command->pattern;
+            myPreviewColour = command->colour;
+            myPreviewRemaining = command->duration * (1000 / LOOP_DELAY);
+            myAnimationStep = 0;
+            break;
+        case command_type_t::SCAN_RADIO:
+            if (myConfiguration.isRadioInstalled && myAlarmState != alarm_state_t::ACTIVE) {
+                request_radio(radio_request_type_t::RADIO_SCAN);
+            }
+            break;
+        case command_type_t::RADIO_FALLBACK:
+            if (myAlarmState == alarm_state_t::ACTIVE) {
+                start_tones(&myAlarmTones);
+            }
+            break;
+        case command_type_t::START_RECORDING:
+            start_recording();
+            break;
+        case command_type_t::STOP_RECORDING:
+            myIsRecording = false;
+            break;
+        case command_type_t::LOAD_PATTERN:
+            read_pattern(command->slot, &myPatterns[command->slot]);
+            myAnimationStep = 0;
+            break;
+        case command_type_t::RELOAD_SKIP_DATES:
+            // Check the new list of skipped dates from now on.
+            mySkipCacheDate = 0;
+            if (myState != state_t::INITIALISING) {
+                time_t now;
+                time(&now);
+                checkDaytime(localtime(&now));
+            }
+            break;
+    }
+
+    // Record how long the command took to get here.
+    uint32_t latency = (uint32_t)(esp_timer_get_time() - command->receivedTime);
+    uint32_t average = myCommandStats.averageLatency;
+    myCommandStats.executed++;
+    myCommandStats.lastLatency = latency;
+    myCommandStats.averageLatency = (myCommandStats.executed == 1) ? 
+        latency : average - (average / 8) + (latency / 8);
+    if (latency > myCommandStats.maxLatency) {
+        myCommandStats.maxLatency = latency;
+    }
+}
+
+/*
+ * Executes all of the commands waiting in the command queue.
+ */
+void process_commands() {
+    command_t command;
+    for (uint32_t ii = 0; ii < COMMAND_QUEUE_SIZE && dequeue_command(&command); ii++) {
+        execute_command(&command);
+    }
+}
+
+/* 
+ * Copies the configuration data from one structure to another.
+ * 
+ * @param dest Pointer to the configuration into which the values are copied.
+ * @param src The configuration from which the values are sorced.
+ * @return Pointer to the destination structure.
+ */
+flash_config_t *copy_config(flash_config_t *dest, const flash_config_t *src) {
+    memcpy(dest, src, sizeof(flash_config_t));
+
+    return dest;
+}
+
+/* 
+ * Compares two configuration structures, returning true if they match.
+ *
+ * @param a The first structure to test.
+ * @param b The second structure to test.
+ * @return true if every field in the two structures match, false otherwise.
+ */
+bool compare_config(flash_config_t a, flash_config_t b) {
+    return memcmp(&a, &b, sizeof(flash_config_t)) == 0;
+}
+
+/*
+ * Write the configuration to the flash storage.
+ *
+ * @param config The configuration to be written to flash storage.
+ */
+inline void write_config(flash_config_t *config) {
+    #ifndef DISABLE_CONFIG_WRITES
+    prefs.putBytes(KEY_CONFIG, config, sizeof(flash_config_t));
+    #endif
+}
+
+/*
+ * Publishes a configuration to the shared copy, for other tasks to read.
+ * Writers are serialised with a spin lock, but readers are never blocked.
+ *
+ * @param config The configuration to be published.
+ * @return The sequence number of the published configuration.
+ */
+uint32_t publish_config(const flash_config_t *config) {
+    return seqlock_publish(&mySharedConfiguration, config);
+}
+
+/*
+ * Publishes a configuration to the shared copy, but only if nothing else has
+ * been published since the configuration it was based on.
+ *
+ * @param config The configuration to be published.
+ * @param expected The sequence number of the configuration it was based on.
+ * @param sequence Set to the sequence number of the published configuration.
+ * @return true if the configuration was published, false if another was
+ *         published first.
+ */
+bool publish_config_if(const flash_config_t *config, uint32_t expected, uint32_t *sequence) {
+    return seqlock_publish_if(&mySharedConfiguration, config, expected, sequence);
+}
+
+/*
+ * Makes a single attempt at copying the shared configuration.
+ *
+ * @param dest The configuration into which the shared values are copied.
+ * @param sequence Set to the sequence number of the copied configuration.
+ * @return true if the copy is consistent, false if it raced with a writer.
+ */
+bool try_read_config(flash_config_t *dest, uint32_t *sequence) {
+    return seqlock_try_read(&mySharedConfiguration, dest, sequence);
+}
+
+/*
+ * Copies the shared configuration, retrying until a consistent copy is made.
+ * This is for use outside of loop(), which uses try_read_config() instead.
+ *
+ * @param dest The configuration into which the shared values are copied.
+ * @return The sequence number of the copied configuration.
+ */
+uint32_t read_config(flash_config_t *dest) {
+    return seqlock_read(&mySharedConfiguration, dest);
+}
+
+/*
+ * Keeps a value changed in the menu when taking a configuration published by
+ * another task.
+ *
+ * @param merged The value in the configuration being merged.
+ * @param menu The value in the menu.
+ * @param base The value the menu started from.
+ * @param published The value published by the other task.
+ * @return true if the other task's change to the value was overridden.
+ */
+template <typename T>
+bool keep_menu_value(T *merged, const T *menu, const T *base, const T *published) {
+    if (memcmp(menu, base, sizeof(T)) == 0) {
+        // Not changed in the menu, so take the published value.
+        return false;
+    }
+    memcpy(merged, menu, sizeof(T));
+    return memcmp(published, base, sizeof(T)) != 0;
+}
+
+/*
+ * Takes a configuration published by another task while the menu is open,
+ * keeping the values already changed in the menu so that what the user has
+ * dialled in isn't lost. This must be called before the published
+ * configuration replaces myConfiguration, which the menu started from.
+ *
+ * @param config The published configuration.
+ */
+void merge_menu_config(const flash_config_t *config) {
+    flash_config_t merged;
+    copy_config(&merged, config);
+    const flash_config_t *menu = &myNewConfiguration;
+    const flash_config_t *base = &myConfiguration;
+    bool isOverridden = false;
+    isOverridden |= keep_menu_value(&merged.alarmTime, &menu->alarmTime, &base->alarmTime, &config->alarmTime);
+    isOverridden |= keep_menu_value(&merged.alarmActivation, &menu->alarmActivation, 
+        &base->alarmActivation, &config->alarmActivation);
+    isOverridden |= keep_menu_value(&merged.alarmPattern, &menu->alarmPattern, 
+        &base->alarmPattern, &config->alarmPattern);
+    isOverridden |= keep_menu_value(&merged.radioFrequency, &menu->radioFrequency, 
+        &base->radioFrequency, &config->radioFrequency);
+    isOverridden |= keep_menu_value(&merged.is24Hour, &menu->is24Hour, &base->is24Hour, &config->is24Hour);
+    isOverridden |= keep_menu_value(&merged.brightness, &menu->brightness, &base->brightness, &config->brightness);
+    isOverridden |= keep_menu_value(&merged.dayColour, &menu->dayColour, &base->dayColour, &config->dayColour);
+    isOverridden |= keep_menu_value(&merged.nightColour, &menu->nightColour, 
+        &base->nightColour, &config->nightColour);
+    copy_config(&myNewConfiguration, &merged);
+    if (isOverridden) {
+        LOG_WARNING(EVENT_MENU_CONFIG_KEPT, 0, 0);
+    }
+}
+
+/*
+ * Applies any configuration published by another task (e.g. the web server)
+ * since the last loop, and writes it to flash, so that only loop() writes the
+ * configuration to flash. This never waits: if a write is in progress, the
+ * new configuration is picked up on the next loop instead.
+ */
+void sync_config() {
+    if (seqlock_sequence(&mySharedConfiguration) == myConfigSequence) {
+        // Nothing has changed.
+        return;
+    }
+
+    flash_config_t config;
+    uint32_t sequence;
+    if (!try_read_config(&config, &sequence)) {
+        return;
+    }
+
+    bool updateName = strncmp(config.deviceName, myConfiguration.deviceName, DEVICE_NAME_MAX_LEN) != 0;
+    bool updateLocation = 
+        strncmp(config.timezone, myConfiguration.timezone, TIMEZONE_MAX_LEN) != 0 ||
+        strncmp(config.zoneName, myConfiguration.zoneName, ZONE_NAME_MAX_LEN) != 0 ||
+        config.latitude != myConfiguration.latitude ||
+        config.longitude != myConfiguration.longitude;
+    bool updateCalibration = 
+        memcmp(&config.calibration, &myConfiguration.calibration, sizeof(calibration_t)) != 0;
+    bool updateCaps = 
+        memcmp(config.brightnessCaps, myConfiguration.brightnessCaps, sizeof(config.brightnessCaps)) != 0;
+
+    if (myIsInMenu) {
+        merge_menu_config(&config);
+    }
+    copy_config(&myConfiguration, &config);
+    myConfigSequence = sequence;
+    write_config(&myConfiguration);
+    myTelemetryInterval = myConfiguration.telemetryInterval;
+
+    if (updateName && myIsNetworkStarted) {
+        update_mdns();
+    }
+
+    if (updateCalibration) {
+        build_calibration();
+    }
+    if (updateCaps) {
+        // Check the brightness on the next loop.
+        myBrightnessCounter = 0;
+    }
+
+    if (updateLocation) {
+        apply_timezone();
+        if (myState != state_t::INITIALISING) {
+            time_t now;
+            time(&now);
+            tm *tm_val = localtime(&now);
+            syncSunClock(tm_val);
+            checkDaytime(tm_val);
+        }
+    }
+}
+
+/*
+ * Enters the configuration menu.
+ *
+ * @param isSetupMenu Flag set when the menu to enter is the setup menu (true).
+ *                    When false, the alarm menu is shown.
+ */
+void enter_menu(bool isSetupMenu = false) {
+    myState = isSetupMenu ? state_t::SETUP_MENU_RADIO_WHOLE : state_t::MENU_ALARM_MINUTES;
+    myIsInMenu = true;
+    copy_config(&myNewConfiguration, &myConfiguration);
+    myFlashCounter = 0;
+    myFlashValue = false;
+    myCountdownTimer = 0;
+}
+
+/*
+ * Exits the configuration menu, saving the configuration if necessary.
+ * 
+ * @param discardChanges Flag set when any changes should be ignored.
+ */
+void exit_menu(boolean discardChanges = false, bool isSetupMenu = false) {
+    myState = state_t::RUNNING;
+    myFlashCounter = -1;
+    myCountdownTimer = 0;
+    if (!discardChanges && !compare_config(myConfiguration, myNewConfiguration)) {
+        // The configuration has changed.
+        LOG_INFO(EVENT_CONFIG_CHANGED, 0, 0);
+        uint32_t sequence;
+        while (!publish_config_if(&myNewConfiguration, myConfigSequence, &sequence)) {
+            // Another task published since the last loop, so merge its
+            // changes rather than overwriting them.
+            delay(1);
+            sync_config();
+        }
+        copy_config(&myConfiguration, &myNewConfiguration);
+        myConfigSequence = sequence;
+        write_config(&myConfiguration);
+    }
+    myIsInMenu = false;
+}
+
+/**
+ * Blends between two colours using integer arithmetic.
+ * 
+ * @param from The colour when the blend is 0.
+ * @param to The colour when the blend is 255.
+ * @param blend The amount of the "to" colour to use (0-255).
+ * @return The blended colour.
+ */
+inline colour_t blend_colour(colour_t from, colour_t to, uint8_t blend) {
+    colour_t c;
+    c.r = from.r + (((int16_t)to.r - from.r) * blend) / 255;
+    c.g = from.g + (((int16_t)to.g - from.g) * blend) / 255;
+    c.b = from.b + (((int16_t)to.b - from.b) * blend) / 255;
+    return c;
+}
+
+/**
+ * Determines the pattern (and its base colour) to be displayed.
+ * 
+ * @param baseColour Set to the base colour for the pattern.
+ * @return The pattern to be displayed.
+ */
+display_pattern_t get_display_pattern(colour_t *baseColour) {
+    if (myIsInMenu) {
+        baseColour->r = baseColour->g = baseColour->b = 0xFF;
+        return display_pattern_t::MENU;
+    } else if (myPreviewRemaining > 0) {
+        *baseColour = myPreviewColour;
+        return myPreviewPattern;
+    } else if (myAlarmState == alarm_state_t::WAKING) {
+        *baseColour = myWakeColour;
+        return display_pattern_t::SOLID_COLOUR;
+    } else if (myAlarmState == alarm_state_t::ACTIVE) {
+        *baseColour = myConfiguration.alarmColour;
+        return myConfiguration.alarmPattern;
+    } else {
+        *baseColour = blend_colour(myConfiguration.nightColour, myConfiguration.dayColour, myDayBlend);
+        return myIsDaytime ? myConfiguration.dayPattern : myConfiguration.nightPattern;
+    }
+}
+
+/**
+ * Finds the custom pattern used for a display pattern.
+ * 
+ * @param pattern The display pattern.
+ * @return The custom pattern, or NULL if the display pattern isn't custom.
+ */
+inline const custom_pattern_t *get_custom_pattern(display_pattern_t pattern) {
+    if (pattern < display_pattern_t::CUSTOM_1 || pattern > display_pattern_t::CUSTOM_4) {
+        return NULL;
+    }
+    return &myPatterns[pattern - display_pattern_t::CUSTOM_1];
+}
+
+/**
+ * Times the rendering of a custom pattern for all of the LEDs, across a
+ * spread of frames.
+ * 
+ * @param pattern The custom pattern to time.
+ * @return The average time taken to render a frame (microseconds).
+ */
+uint32_t benchmark_pattern(const custom_pattern_t *pattern) {
+    colour_t white = { 0xFF, 0xFF, 0xFF };
+    int32_t frameRegs[PATTERN_REGISTER_COUNT];
+    volatile float sink = 0.0f;
+    int64_t startTime = esp_timer_get_time();
+    for (uint8_t frame = 0; frame < PATTERN_BENCHMARK_FRAMES; frame++) {
+        init_pattern_registers(pattern, white, (frame * pattern->period) / PATTERN_BENCHMARK_FRAMES, frameRegs);
+        for (uint8_t led = 0; led < LED_COUNT; led++) {
+            sink = sink + calculate_custom_colour(pattern, frameRegs, led).l;
+        }
+    }
+    return (uint32_t)((esp_timer_get_time() - startTime) / PATTERN_BENCHMARK_FRAMES);
+}
+
+/**
+ * Determines which part of the display is being changed in the menu.
+ * 
+ * @return The part being changed, MENU_FIELD_NONE if not in a menu.
+ */
+menu_field_t get_menu_field() {
+    switch (myState) {
+        case state_t::MENU_ALARM_HOURS:
+            return MENU_FIELD_HOURS;
+        case state_t::MENU_ALARM_MINUTES:
+            return MENU_FIELD_MINUTES;
+        case state_t::SETUP_MENU_RADIO_WHOLE:
+            return MENU_FIELD_RADIO_WHOLE;
+        case state_t::SETUP_MENU_RADIO_FRACTION:
+            return MENU_FIELD_RADIO_FRACTION;
+        case state_t::SETUP_MENU_DAY_COLOUR_R:
+            return MENU_FIELD_RED;
+        case state_t::SETUP_MENU_DAY_COLOUR_G:
+            return MENU_FIELD_GREEN;
+        case state_t::SETUP_MENU_DAY_COLOUR_B:
+            return MENU_FIELD_BLUE;
+        default:
+            return MENU_FIELD_NONE;
+    }
+}
+
+/**
+ * Determines the brightness of the display.
+ * 
+ * @return The brightness (0.0-1.0).
+ */
+float display_brightness() {
+    // The wake-up light may be brighter than the room calls for.
+    float brightness = (myWakeBrightness > myBrightness) ? myWakeBrightness : myBrightness;
+    return brightness / MAX_BRIGHTNESS_F;
+}
+
+/**
+ * Converts the frame to RGB, calibrates it, limits its power, and sends it
+ * to the LEDs.
+ * 
+ * @param brightness The brightness of the display (0.0-1.0).
+ */
+void show_frame(float brightness) {
+    frame_power_t power;
+    frame_to_pixels(&myFrame, brightness, &myLedOutput, myConfiguration.powerBudget, leds.Pixels(), &power);
+    leds.Dirty();
+    leds.Show();
+
+    if (power.isLimited) {
+        myPowerStats.limitedFrames++;
+    }
+    uint32_t average = myPowerStats.averageCurrent;
+    myPowerStats.frames++;
+    myPowerStats.lastCurrent = power.current;
+    myPowerStats.averageCurrent = (myPowerStats.frames == 1) ? 
+        power.current : average - (average / 64) + (power.current / 64);
+    if (power.current > myPowerStats.peakCurrent) {
+        myPowerStats.peakCurrent = power.current;
+    }
+    if (power.demand > myPowerStats.peakDemand) {
+        myPowerStats.peakDemand = power.demand;
+    }
+}
+
+/*
+ * Sends the values for the 4 7-segment LED displays to the LED driver chip.
+ * 
+ * @param farLeft The value for the first 7-segment display on the far left.
+ * @param middleLeft The value for the second 7-segment display on the left of
+ *                   middle.
+ * @param middleRight The value for the third 7-segment display on the right
+ *                    of middle.
+ * @param farRight The value for the first 7-segment display on the far right.
+ * @param colon Flag as to whether to show the : in the middle of the clock.
+ * @param pm Flag as to whether to show the LED for "PM".
+ * @param alarmSet Flag as to whether to show the "alarm set" LED.
+ */
+void display(uint8_t farLeft, uint8_t middleLeft, uint8_t middleRight, uint8_t farRight, 
+             bool colon = true, bool pm = false, bool alarmSet = false) {
+    colour_t baseColour;
+    display_pattern_t pattern = get_display_pattern(&baseColour);
+    myDisplay.digits[0] = farLeft;
+    myDisplay.digits[1] = middleLeft;
+    myDisplay.digits[2] = middleRight;
+    myDisplay.digits[3] = farRight;
+    myDisplay.colon = colon;
+    myDisplay.pm = pm;
+    myDisplay.alarmSet = alarmSet;
+    myDisplay.pattern = pattern;
+    myDisplay.menuField = get_menu_field();
+    myDisplay.colour = baseColour;
+    myDisplay.animationStep = myAnimationStep;
+    myDisplay.brightness = display_brightness();
+
+    render_display(&myFrame, &myDisplay, get_custom_pattern(pattern));
+    show_frame(myDisplay.brightness);
+}
+
+/*
+ * Displays the current time on the 7-segment LEDs.
+ * 
+ * @param hour The hour to be displayed.
+ * @param minute The minute to be displayed.
+ * @param show24Hour Flag set when the time is to be shown in 24-hour format.
+ * @param colon Flag as to whether to show the : in the middle of the clock.
+ */
+void display_time(uint8_t hour, uint8_t minute, bool show24Hour = true, bool colon = true) {
+    uint8_t digits[4];
+    //Serial.printf("Displaying time %02hhu:%02hhu.\n", hour, minute);
+
+    // Hour digits.
+    boolean pm = (hour >= 12);
+    if (!show24Hour) {
+        hour %= 12;
+        if (hour == 0) {
+            hour = 12;
+        }
+    }
+    if (hour >= 10) {
+        digits[0] = hour / 10;
+    } else {
+        digits[0] = FONT_BLANK;
+    }
+    digits[1] = hour % 10;
+
+    // Minute digits.
+    digits[2] = minute / 10;
+    digits[3] = minute % 10;
+
+    bool showAlarm = myConfiguration.alarmActivation != alarm_t::ALARM_DISABLED && myIsAlarmSwitchEnabled;
+    display(digits[0], digits[1], digits[2], digits[3], colon, !show24Hour && pm, showAlarm);
+}
+
+/**
+ * Finds the font index to show for a character. Letters without a glyph of
+ * their own use the closest one, e.g. "m" is shown as "n", and characters
+ * that can't be shown at all are blank.
+ * 
+ * @param c The character.
+ * @return The font index for the character.
+ */
+uint8_t char_to_glyph(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    switch (c) {
+        case 'a': case 'A': return FONT_A;
+        case 'b': case 'B': return FONT_B;
+        case 'c':           return FONT_C;
+        case 'C':           return FONT_UPPER_C;
+        case 'd': case 'D': return FONT_D;
+        case 'e': case 'E': return FONT_E;
+        case 'f': case 'F': return FONT_F;
+        case 'g': case 'G': return FONT_G;
+        case 'h':           return FONT_LOWER_H;
+        case 'H': case 'k': case 'K': case 'x': case 'X': return FONT_H;
+        case 'i':           return FONT_I;
+        case 'I':           return 1;
+        case 'j': case 'J': return FONT_J;
+        case 'l': case 'L': return FONT_L;
+        case 'm': case 'M': case 'n': case 'N': return FONT_N;
+        case 'o':           return FONT_O;
+        case 'O':           return 0;
+        case 'p': case 'P': return FONT_P;
+        case 'q': case 'Q': return FONT_Q;
+        case 'r': case 'R': return FONT_R;
+        case 's': case 'S': return 5;
+        case 't': case 'T': return FONT_T;
+        case 'u': case 'v': case 'w': return FONT_LOWER_U;
+        case 'U': case 'V': case 'W': return FONT_U;
+        case 'y': case 'Y': return FONT_Y;
+        case 'z': case 'Z': return 2;
+        case '-':           return FONT_DASH;
+        case '_': case '.': case ',': return FONT_UNDERSCORE;
+        case '*':           return FONT_DEGREE;
+        case '=':           return FONT_EQUALS;
+        default:            return FONT_BLANK;
+    }
+}
+
+/**
+ * Converts text to the font indexes that show it. A UTF-8 degree sign is
+ * shown as the degree symbol, as is "*".
+ * 
+ * @param text The text to convert.
+ * @param glyphs Filled with the font indexes.
+ * @param maxGlyphs The most font indexes that glyphs can hold.
+ * @return The number of font indexes.
+ */
+uint8_t text_to_glyphs(const char *text, uint8_t *glyphs, uint8_t maxGlyphs) {
+    uint8_t count = 0;
+    for (const char *pos = text; *pos != '\0' && count < maxGlyphs; pos++) {
+        if ((uint8_t)pos[0] == 0xC2 && (uint8_t)pos[1] == 0xB0) {
+            glyphs[count++] = FONT_DEGREE;
+            pos++;
+        } else {
+            glyphs[count++] = char_to_glyph(*pos);
+        }
+    }
+    return count;
+}
+
+/**
+ * Posts a message for the display. This is safe to call from any task, and
+ * never blocks. Messages are shown while the clock is showing the time,
+ * highest priority first, until they are dismissed or expire.
+ * 
+ * @param text The text of the message, shortened if it is too long.
+ * @param priority The priority of the message (0 - MAX_MESSAGE_PRIORITY).
+ * @param duration How long the message is kept (seconds).
+ * @return true if the message was posted, false if the queue is full.
+ */
+bool post_message(const char *text, uint8_t priority, uint16_t duration) {
+    if (myMessageQueue == NULL) {
+        return false;
+    }
+
+    message_t message = {};
+    strncpy(message.text, text, MESSAGE_MAX_LEN);
+    message.priority = (priority > MAX_MESSAGE_PRIORITY) ? MAX_MESSAGE_PRIORITY : priority;
+    message.duration = duration;
+    return xQueueSend(myMessageQueue, &message, 0) == pdTRUE;
+}
+
+/**
+ * Posts the clock's IP address for the display, kept long enough for it to
+ * scroll past once.
+ */
+void post_ip_address() {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", 
+        myIPAddress[0], myIPAddress[1], myIPAddress[2], myIPAddress[3]);
+    uint32_t scrollTime = (strlen(text) + MESSAGE_SCROLL_GAP) * MESSAGE_SCROLL_INTERVAL;
+    post_message(text, MESSAGE_PRIORITY_SYSTEM, (scrollTime + 999) / 1000);
+}
+
+/**
+ * Adds a posted message to the waiting messages. When they are all in use,
+ * it replaces the lowest priority message, oldest first, unless that is of a
+ * higher priority.
+ * 
+ * @param message The posted message.
+ * @param now The current time (millis()).
+ */
+void add_message(const message_t *message, uint32_t now) {
+    int8_t slot = -1;
+    for (uint8_t ii = 0; ii < MESSAGE_SLOTS; ii++) {
+        const message_slot_t *candidate = &myMessages[ii];
+        if (!candidate->isUsed) {
+            slot = ii;
+            break;
+        }
+        if (slot < 0 || 
+                candidate->message.priority < myMessages[slot].message.priority ||
+                (candidate->message.priority == myMessages[slot].message.priority && 
+                    (int32_t)(candidate->posted - myMessages[slot].posted) < 0)) {
+            slot = ii;
+        }
+    }
+    if (myMessages[slot].isUsed && myMessages[slot].message.priority > message->priority) {
+        // Everything waiting is more important.
+        return;
+    }
+
+    if (slot == myMessageSlot) {
+        myMessageSlot = -1;
+    }
+    myMessages[slot].message = *message;
+    myMessages[slot].posted = now;
+    myMessages[slot].expires = now + (message->duration * 1000UL);
+    myMessages[slot].isUsed = true;
+}
+
+/**
+ * Dismisses the message being shown, moving on to the next one, if any.
+ */
+void dismiss_message() {
+    if (myMessageSlot >= 0) {
+        myMessages[myMessageSlot].isUsed = false;
+        myMessageSlot = -1;
+    }
+}
+
+/**
+ * Takes the posted messages, removes the expired ones, and picks the message
+ * to show. Messages are only shown in place of the time, and never while the
+ * alarm is sounding or snoozing.
+ */
+void update_messages() {
+    uint32_t now = millis();
+    message_t message;
+    while (myMessageQueue != NULL && xQueueReceive(myMessageQueue, &message, 0) == pdTRUE) {
+        add_message(&message, now);
+    }
+
+    int8_t best = -1;
+    for (uint8_t ii = 0; ii < MESSAGE_SLOTS; ii++) {
+        message_slot_t *slot = &myMessages[ii];
+        if (slot->isUsed && (int32_t)(now - slot->expires) >= 0) {
+            slot->isUsed = false;
+            if (ii == myMessageSlot) {
+                myMessageSlot = -1;
+            }
+        }
+        if (slot->isUsed && (best < 0 || 
+                slot->message.priority > myMessages[best].message.priority ||
+                (slot->message.priority == myMessages[best].message.priority && 
+                    (int32_t)(slot->posted - myMessages[best].posted) < 0))) {
+            best = ii;
+        }
+    }
+
+    bool isAlarmQuiet = myAlarmState == alarm_state_t::INACTIVE || myAlarmState == alarm_state_t::WAKING;
+    if (myState == state_t::SHOW_MESSAGE && (best < 0 || !isAlarmQuiet)) {
+        // Go back to the time.
+        myState = (myLastTimestamp > 0) ? state_t::RUNNING : state_t::INITIALISING;
+        myMessageSlot = -1;
+    } else if (best >= 0 && isAlarmQuiet && best != myMessageSlot &&
+            (myState == state_t::RUNNING || myState == state_t::INITIALISING || 
+                myState == state_t::SHOW_MESSAGE)) {
+        // Start showing the message, from its beginning.
+        myMessageSlot = best;
+        myMessageLength = text_to_glyphs(myMessages[best].message.text, myMessageGlyphs, MESSAGE_MAX_LEN);
+        myMessageStart = now;
+        myState = state_t::SHOW_MESSAGE;
+    }
+}
+
+/**
+ * Displays up to DISPLAY_DIGITS font indexes, right-aligned like numbers.
+ * 
+ * @param glyphs The font indexes to display.
+ * @param count The number of font indexes.
+ * @param alarmSet Flag as to whether to show the "alarm set" LED.
+ */
+void display_glyphs(const uint8_t *glyphs, uint8_t count, bool alarmSet = false) {
+    uint8_t digits[DISPLAY_DIGITS];
+    uint8_t padding = (count < DISPLAY_DIGITS) ? DISPLAY_DIGITS - count : 0;
+    for (uint8_t ii = 0; ii < DISPLAY_DIGITS; ii++) {
+        digits[ii] = (ii < padding) ? FONT_BLANK : glyphs[ii - padding];
+    }
+    display(digits[0], digits[1], digits[2], digits[3], false, false, alarmSet);
+}
+
+/**
+ * Displays text that fits on the display, e.g. a menu value.
+ * 
+ * @param text The text to display, right-aligned.
+ * @param alarmSet Flag as to whether to show the "alarm set" LED.
+ */
+void display_text(const char *text, bool alarmSet = false) {
+    uint8_t glyphs[DISPLAY_DIGITS];
+    display_glyphs(glyphs, text_to_glyphs(text, glyphs, DISPLAY_DIGITS), alarmSet);
+}
+
+/**
+ * Displays the message being shown. Messages that fit on the display are
+ * right-aligned, and longer ones scroll to the left.
+ */
+void display_message() {
+    if (myMessageLength <= DISPLAY_DIGITS) {
+        display_glyphs(myMessageGlyphs, myMessageLength);
+        return;
+    }
+
+    uint8_t digits[DISPLAY_DIGITS];
+    uint16_t period = myMessageLength + MESSAGE_SCROLL_GAP;
+    uint16_t offset = ((millis() - myMessageStart) / MESSAGE_SCROLL_INTERVAL) % period;
+    for (uint8_t ii = 0; ii < DISPLAY_DIGITS; ii++) {
+        uint16_t pos = (offset + ii) % period;
+        digits[ii] = (pos < myMessageLength) ? myMessageGlyphs[pos] : FONT_BLANK;
+    }
+    display(digits[0], digits[1], digits[2], digits[3], false);
+}
+
+/**
+ * Shows the progress of an OTA update as a bar filling the LEDs, digit by
+ * digit from the left.
+ */
+void display_ota_progress() {
+    colour_t baseColour;
+    get_display_pattern(&baseColour);
+    hsl_colour_t colour = colour_to_hsl(baseColour);
+    uint16_t lit = ((uint16_t)myOtaProgress * LED_COUNT) / 100;
+    for (uint16_t ii = 0; ii < LED_COUNT; ii++) {
+        set_led(&myFrame, ii, (ii < lit) ? colour : BLACK);
+    }
+    show_frame(display_brightness());
+}
+
+/* 
+ * Update the 7 segment displays, if necessary.
+ */
+void update_display() {
+    if (myOtaState == ota_state_t::OTA_RECEIVING) {
+        display_ota_progress();
+        return;
+    }
+    switch (myState) {
+        case state_t::INITIALISING: // Fall through
+        case state_t::CANCELLED:
+                display(FONT_DASH, FONT_DASH, FONT_DASH, FONT_DASH, false);
+            break;
+        case state_t::RUNNING:
+            // Flash the colon while the time is still unconfirmed by NTP.
+            display_time(myHour, myMinute, myConfiguration.is24Hour,
+                         !myIsTimeProvisional || (myLastTimestamp % 2) == 0);
+            break;
+        case state_t::SHOW_MESSAGE:
+            display_message();
+            break;
+        case state_t::SHOW_SNOOZE:
+            // Show the sleep time remaining.
+            display_time(mySnoozeRemaining / SECONDS_PER_MINUTE,
+                         mySnoozeRemaining % SECONDS_PER_MINUTE);
+            break;
+        case state_t::SHOW_ALARM: // Fall-through
+        case state_t::MENU_ALARM_MINUTES: // Fall-through
+        case state_t::MENU_ALARM_HOURS:
+            // Show the alarm time.
+            display_time(myNewConfiguration.alarmTime / MINUTES_PER_HOUR,
+                         myNewConfiguration.alarmTime % MINUTES_PER_HOUR,
+                         myNewConfiguration.is24Hour);
+            break;
+        case state_t::MENU_ALARM_DAYS:
+            // We're showing which days the alarm is to sound.
+            switch (myNewConfiguration.alarmActivation) {
+                case alarm_t::ALARM_DISABLED:
+                    // The alarm is disabled.
+                    display_text("OFF");
+                    break;
+                case alarm_t::WEEKDAYS:
+                    // The alarm only sounds on weekdays.
+                    display_text("1-5", true);
+                    break;
                 case alarm_t::ALL_DAYS:
                     // The alarm will sound every day.
-                    display(FONT_BLANK, 0, FONT_DASH, 6, false, false, true);
+                    display_text("0-6", true);
                     break;
                 case alarm_t::ONE_TIME:
                     // The alarm will sound tomorrow only.
-                    display(0, FONT_N, FONT_C, FONT_E, false, false, true);
+                    display_text("Once", true);
+                    break;
+                case alarm_t::CALENDAR:
+                    // The alarm follows the calendar set through the web page.
+                    display_text("cAL", true);
+                    break;
+            }
+            break;
+        case state_t::SETUP_MENU_RADIO_WHOLE:    // Fall-through
+        case state_t::SETUP_MENU_RADIO_FRACTION:
+            // We're showing the radio frequency.
+            if (myNewConfiguration.isUseRadio) {
+                display(myNewConfiguration.radioFrequency / 1000,
+                        (myNewConfiguration.radioFrequency / 100) % 10,
+                        (myNewConfiguration.radioFrequency / 10) % 10,
+                        myNewConfiguration.radioFrequency % 10,
+                        false);
+            } else {
+                display_text("rOFF");
+            }
+            break;
+        case state_t::SETUP_MENU_12_24_HOURS:
+            if (myNewConfiguration.is24Hour) {
+                display_text("24H");
+            } else {
+                display_text("12H");
+            }
+            break;
+        case state_t::SETUP_MENU_BRIGHTNESS:
+            display(FONT_B,
+                    FONT_R,
+                    FONT_I,
+                    myNewConfiguration.brightness % MAX_BRIGHTNESS,
+                    false);
+            break;
+    }
+}
+
+/*
+ * Interrupt Service Routine (ISR) for updating the rotary encoder's value in
+ * response to the user rotating it.
+ */
+void IRAM_ATTR rotary_tick() {
+    myEncoder.tick();
+    myEncoderTickTime.store((uint32_t)esp_timer_get_time(), std::memory_order_relaxed);
+}
+
+/*
+ * Interrupt Service Routine (ISR) for the button, queuing each edge with the
+ * time that it happened for the main loop to debounce.
+ */
+void IRAM_ATTR button_isr() {
+    uint32_t head = myButtonHead.load(std::memory_order_relaxed);
+    if (head - myButtonTail.load(std::memory_order_acquire) >= BUTTON_QUEUE_SIZE) {
+        myButtonDropped++;
+        return;
+    }
+    button_event_t *event = &myButtonEvents[head % BUTTON_QUEUE_SIZE];
+    event->time = (uint32_t)esp_timer_get_time();
+    event->level = digitalRead(PIN_ENCODER_SW);
+    myButtonHead.store(head + 1, std::memory_order_release);
+}
+
+/*
+ * Records that an input has been handled, so that the time until the display
+ * shows it can be measured.
+ * 
+ * @param time The time (microseconds, wrapping) of the input.
+ */
+inline void input_handled(uint32_t time) {
+    if (!myIsInputPending) {
+        myIsInputPending = true;
+        myInputTime = time;
+    }
+}
+
+/*
+ * Records the latency of the last input, now that it has been displayed.
+ */
+void input_displayed() {
+    if (!myIsInputPending) {
+        return;
+    }
+    myIsInputPending = false;
+    uint32_t latency = (uint32_t)esp_timer_get_time() - myInputTime;
+    uint32_t average = myInputStats.averageLatency;
+    myInputStats.events++;
+    myInputStats.lastLatency = latency;
+    myInputStats.averageLatency = (myInputStats.events == 1) ? 
+        latency : average - (average / 8) + (latency / 8);
+    if (latency > myInputStats.maxLatency) {
+        myInputStats.maxLatency = latency;
+    }
+}
+
+/*
+ * Handles the user rotating the rotary encoder.
+ * 
+ * @param amount The number of detents that the encoder has been rotated.
+ *               Negative values are clockwise.
+ * @param acceleration The multiplier for values with a large range, based on
+ *                     how fast the encoder is being turned.
+ */
+void rotate(int32_t amount, uint8_t acceleration = 1) {
+    uint8_t hour;
+    uint8_t minute;
+    int32_t alarmTime;
+    uint16_t freqWhole;
+    uint8_t freqFrac;
+    amount *= -1;
+    int32_t fastAmount = amount * acceleration;
+    switch (myState) {
+        case state_t::SHOW_SNOOZE:
+            // Increase/decrease the snooze.
+            mySnoozeRemaining += (fastAmount * SECONDS_PER_MINUTE);
+            if (mySnoozeRemaining <= 0) {
+                // Turn the alarm off.
+                stop_alarm();
+            } else {
+                if (mySnoozeRemaining > MAX_SNOOZE) {
+                    mySnoozeRemaining = MAX_SNOOZE;
+                }
+                persist_alarm(false);
+            }
+            break;
+        case state_t::MENU_ALARM_MINUTES:
+            // Change the minute value for the alarm, carrying into the hours.
+            alarmTime = ((int32_t)myNewConfiguration.alarmTime + fastAmount) % 
+                (HOURS_PER_DAY * MINUTES_PER_HOUR);
+            if (alarmTime < 0) {
+                alarmTime += HOURS_PER_DAY * MINUTES_PER_HOUR;
+            }
+            myNewConfiguration.alarmTime = alarmTime;
+            break;
+        case state_t::MENU_ALARM_HOURS:
+            // Change the hour value for the alarm.
+            hour = myNewConfiguration.alarmTime / MINUTES_PER_HOUR;
+            minute = myNewConfiguration.alarmTime % MINUTES_PER_HOUR;
+            hour = (hour + amount + HOURS_PER_DAY) % HOURS_PER_DAY;
+            myNewConfiguration.alarmTime = (hour * MINUTES_PER_HOUR) + minute;
+            break;
+        case state_t::MENU_ALARM_DAYS:
+            // Change the alarm enabled days.
+            switch (myNewConfiguration.alarmActivation) {
+                case alarm_t::ALARM_DISABLED:
+                    if (amount > 0) {
+                        myNewConfiguration.alarmActivation = alarm_t::WEEKDAYS;
+                    } else {
+                        myNewConfiguration.alarmActivation = alarm_t::CALENDAR;
+                    }
+                    break;
+                case alarm_t::WEEKDAYS:
+                    if (amount > 0) {
+                        myNewConfiguration.alarmActivation = alarm_t::ALL_DAYS;
+                    } else {
+                        myNewConfiguration.alarmActivation = alarm_t::ALARM_DISABLED;
+                    }
+                    break;
+                case alarm_t::ALL_DAYS:
+                    if (amount > 0) {
+                        myNewConfiguration.alarmActivation = alarm_t::ONE_TIME;
+                    } else {
+                        myNewConfiguration.alarmActivation = alarm_t::WEEKDAYS;
+                    }
+                    break;
+                case alarm_t::ONE_TIME:
+                    if (amount > 0) {
+                        myNewConfiguration.alarmActivation = alarm_t::CALENDAR;
+                    } else {
+                        myNewConfiguration.alarmActivation = alarm_t::ALL_DAYS;
+                    }
+                    break;
+                case alarm_t::CALENDAR:
+                    if (amount > 0) {
+                        myNewConfiguration.alarmActivation = alarm_t::ALARM_DISABLED;
+                    } else {
+                        myNewConfiguration.alarmActivation = alarm_t::ONE_TIME;
+                    }
                     break;
             }
             break;
-        case state_t::SETUP_MENU_RADIO_WHOLE:    // Fall-through
+        case state_t::SETUP_MENU_RADIO_WHOLE:
+            // Change the radio frequency whole digits.
+            freqWhole = myNewConfiguration.radioFrequency / 10;
+            freqFrac = myNewConfiguration.radioFrequency % 10;
+            freqWhole += amount;
+            while (freqWhole > MAX_RADIO_FREQUENCY) {
+                freqWhole -= freqWhole - MAX_RADIO_FREQUENCY + MIN_RADIO_FREQUENCY - 1;
+            }
+            while (freqWhole < MIN_RADIO_FREQUENCY) {
+                freqWhole = freqWhole + MAX_RADIO_FREQUENCY - MIN_RADIO_FREQUENCY + 1;
+            }
+            myNewConfiguration.radioFrequency = (freqWhole * 10) + freqFrac;
+            break;
+        case state_t::SETUP_MENU_RADIO_FRACTION:
+            // Change the radio frequency fractional digit.
+            freqWhole = myNewConfiguration.radioFrequency / 10;
+            freqFrac = myNewConfiguration.radioFrequency % 10;
+            freqFrac = (freqFrac + amount + 10) % 10;
+            myNewConfiguration.radioFrequency = (freqWhole * 10) + freqFrac;
+            break;
+        case state_t::SETUP_MENU_12_24_HOURS:
+            if ((amount % 2) != 0) {
+                myNewConfiguration.is24Hour = !myNewConfiguration.is24Hour;
+            }
+            break;
+        case state_t::SETUP_MENU_BRIGHTNESS:
+            myNewConfiguration.brightness = 
+                (myNewConfiguration.brightness + amount + MAX_BRIGHTNESS) % MAX_BRIGHTNESS;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_R:
+            // Colour will automatically wrap around as it's only 8 bits.
+            myNewConfiguration.dayColour.r += fastAmount;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_G:
+            // Colour will automatically wrap around as it's only 8 bits.
+            myNewConfiguration.dayColour.g += fastAmount;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_B:
+            // Colour will automatically wrap around as it's only 8 bits.
+            myNewConfiguration.dayColour.b += fastAmount;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_R:
+            // Colour will automatically wrap around as it's only 8 bits.
+            myNewConfiguration.nightColour.r += fastAmount;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_G:
+            // Colour will automatically wrap around as it's only 8 bits.
+            myNewConfiguration.nightColour.g += fastAmount;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_B:
+            // Colour will automatically wrap around as it's only 8 bits.
+            myNewConfiguration.nightColour.b += fastAmount;
+            break;
+        case state_t::SETUP_MENU_ALARM_PATTERN: {
+            uint8_t val = myNewConfiguration.alarmPattern;
+            val = (val + amount + ALARM_PATTERN_COUNT) % ALARM_PATTERN_COUNT;
+            myNewConfiguration.alarmPattern = static_cast<display_pattern_t>(val);
+            break;
+        }
+        default:
+            // Do nothing.
+            break;
+    }
+}
+
+/*
+ * Handles the user clicking on the button in the rotary encoder.
+ */
+void click() {
+    LOG_DEBUG(EVENT_GESTURE, 1, myState);
+    switch (myState) {
+        case state_t::INITIALISING: // Fall through
+        case state_t::RUNNING:
+            if (myAlarmState == alarm_state_t::INACTIVE || myAlarmState == alarm_state_t::WAKING) {
+                // Show the alarm time.
+                myState = state_t::SHOW_ALARM;
+                myCountdownTimer = SHOW_ALARM_COUNTDOWN;
+            } else {
+                // Show the snooze time.
+                myState = state_t::SHOW_SNOOZE;
+                myCountdownTimer = SHOW_SNOOZE_COUNTDOWN;
+                if (myAlarmState == alarm_state_t::ACTIVE) {
+                    snooze_alarm();
+                }
+            }
+            break;
+        case state_t::SHOW_MESSAGE:
+            // Move on to the next message, or back to the time.
+            dismiss_message();
+            break;
+        case state_t::SHOW_ALARM:
+            // Start setting the alarm values.
+            enter_menu();
+            break;
+        case state_t::MENU_ALARM_MINUTES:
+            // Move to the next alarm menu.
+            myState = state_t::MENU_ALARM_HOURS;
+            break;
+        case state_t::MENU_ALARM_HOURS:
+            // Move to the next alarm menu.
+            myState = state_t::MENU_ALARM_DAYS;
+            break;
+        case state_t::MENU_ALARM_DAYS:
+            // Menu is finished, back to running.
+            exit_menu();
+            break;
+        case state_t::SETUP_MENU_RADIO_WHOLE:
+            myState = state_t::SETUP_MENU_RADIO_FRACTION;
+            break;
         case state_t::SETUP_MENU_RADIO_FRACTION:
-            // We're showing the radio frequency.
-            if (myNewConfiguration.isUseRadio) {
-                display(myNewConfiguration.radioFrequency / 1000,
-                        (myNewConfiguration.radioFrequency / 100) % 10,
-                        (myNewConfiguration.radioFrequency / 10) % 10,
-                        myNewConfiguration.radioFrequency % 10,
-                        false);
+            myState = state_t::SETUP_MENU_12_24_HOURS;
+            break;
+        case state_t::SETUP_MENU_12_24_HOURS:
+            myState = state_t::SETUP_MENU_BRIGHTNESS;
+            break;
+        case state_t::SETUP_MENU_BRIGHTNESS:
+            myState = state_t::SETUP_MENU_DAY_COLOUR_INTRO;
+            myCountdownTimer = SHOW_INTRO_COUNTDOWN;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:
+            myState = state_t::SETUP_MENU_DAY_COLOUR_R;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_R:
+            myState = state_t::SETUP_MENU_DAY_COLOUR_G;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_G:
+            myState = state_t::SETUP_MENU_DAY_COLOUR_B;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_B:
+            myState = state_t::SETUP_MENU_NIGHT_COLOUR_INTRO;
+            myCountdownTimer = SHOW_INTRO_COUNTDOWN;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO:
+            myState = state_t::SETUP_MENU_NIGHT_COLOUR_R;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_R:
+            myState = state_t::SETUP_MENU_NIGHT_COLOUR_G;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_G:
+            myState = state_t::SETUP_MENU_NIGHT_COLOUR_B;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_B:
+            myState = state_t::SETUP_MENU_ALARM_PATTERN;
+            break;
+        case state_t::SETUP_MENU_ALARM_PATTERN:
+            // Menu is finished, back to running.
+            exit_menu();
+            break;
+        case state_t::CANCELLED:
+            myState = state_t::RUNNING;
+            break;
+    }
+}
+
+/*
+ * Handles the user double-clicking on the button on the rotary encoder.
+ */
+void double_click() {
+    LOG_DEBUG(EVENT_GESTURE, 2, myState);
+    switch (myState) {
+        case state_t::RUNNING:    // Fall-through
+        case state_t::SHOW_ALARM:
+            // Start the menu for setting the alarm values.
+            enter_menu();
+            break;
+        case state_t::SHOW_SNOOZE:
+            // Stop the alarm and snooze.
+            stop_alarm();
+            break;
+        case state_t::MENU_ALARM_MINUTES:            // Fall-through
+        case state_t::MENU_ALARM_HOURS:              // Fall-through
+        case state_t::MENU_ALARM_DAYS:               // Fall-through
+        case state_t::SETUP_MENU_RADIO_WHOLE:        // Fall-through
+        case state_t::SETUP_MENU_RADIO_FRACTION:     // Fall-through
+        case state_t::SETUP_MENU_12_24_HOURS:        // Fall-through
+        case state_t::SETUP_MENU_BRIGHTNESS:         // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:   // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_R:       // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_G:       // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_B:       // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO: // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_R:     // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_G:     // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_B:     // Fall-through
+        case state_t::SETUP_MENU_ALARM_PATTERN:
+            // Exit the menu.
+            exit_menu();
+            break;
+        default:
+            // Do nothing.
+            break;
+    }
+}
+
+/*
+ * Handles the user long-pressing on the button on the rotary encoder.
+ * Long presses are used to cancel out of the menu.
+ */
+void long_press() {
+    LOG_DEBUG(EVENT_GESTURE, 4, myState);
+    switch (myState) {
+        case state_t::MENU_ALARM_MINUTES:            // Fall-through
+        case state_t::MENU_ALARM_HOURS:              // Fall-through
+        case state_t::MENU_ALARM_DAYS:               // Fall-through
+        case state_t::SETUP_MENU_RADIO_WHOLE:        // Fall-through
+        case state_t::SETUP_MENU_RADIO_FRACTION:     // Fall-through
+        case state_t::SETUP_MENU_12_24_HOURS:        // Fall-through
+        case state_t::SETUP_MENU_BRIGHTNESS:         // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:   // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_R:       // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_G:       // Fall-through
+        case state_t::SETUP_MENU_DAY_COLOUR_B:       // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO: // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_R:     // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_G:     // Fall-through
+        case state_t::SETUP_MENU_NIGHT_COLOUR_B:     // Fall-through
+        case state_t::SETUP_MENU_ALARM_PATTERN:
+            // Exit the menu, discarding changes.
+            exit_menu(true);
+            myState = state_t::CANCELLED;
+            myCountdownTimer = SHOW_ALARM_COUNTDOWN;
+            break;
+        default:
+            // Do nothing.
+            break;
+    }
+}
+
+/*
+ * Handles the user triple-clicking on the button on the rotary encoder.
+ * This shows the IP address again.
+ */
+void triple_click() {
+    LOG_DEBUG(EVENT_GESTURE, 3, myState);
+    switch (myState) {
+        case state_t::RUNNING:
+            if (WiFi.status() == WL_CONNECTED) {
+                myIPAddress = WiFi.localIP();
+                post_ip_address();
+            }
+            break;
+        default:
+            // Do nothing.
+            break;
+    }
+}
+
+/*
+ * Handles the user continuing to hold the button on the rotary encoder after
+ * a long press, which repeats every HOLD_REPEAT_INTERVAL.
+ */
+void hold_repeat() {
+    LOG_DEBUG(EVENT_GESTURE, 5, myState);
+    switch (myState) {
+        case state_t::SHOW_SNOOZE:
+            // Add to the snooze, as if the encoder was turned clockwise.
+            rotate(-1);
+            myCountdownTimer = SHOW_SNOOZE_COUNTDOWN;
+            break;
+        default:
+            // Do nothing.
+            break;
+    }
+}
+
+/*
+ * Initialises the button, and starts its interrupt. A button held down at
+ * start-up (to enter the setup menu) is treated as a long press, so that its
+ * release is ignored.
+ */
+void init_button() {
+    myIsButtonPressed = digitalRead(PIN_ENCODER_SW) == LOW;
+    myIsLongPress = myIsButtonPressed;
+    myHoldRepeatTime = (uint32_t)esp_timer_get_time() + ((LONG_PRESS_INTERVAL + HOLD_REPEAT_INTERVAL) * 1000);
+    myButtonEdge.level = myIsButtonPressed ? LOW : HIGH;
+    attachInterrupt(digitalPinToInterrupt(PIN_ENCODER_SW), button_isr, CHANGE);
+}
+
+/*
+ * Handles any movement of the rotary encoder. The faster the encoder is
+ * turned, the more each detent counts for.
+ */
+void process_encoder() {
+    long encoderPos = myEncoder.getPosition();
+    if (encoderPos == myEncoderPosition) {
+        return;
+    }
+
+    int32_t amount = encoderPos - myEncoderPosition;
+    uint32_t tickTime = myEncoderTickTime.load(std::memory_order_relaxed);
+    uint32_t interval = (tickTime - myEncoderMoveTime) / (1000 * abs(amount));
+    uint8_t acceleration = 1;
+    for (uint8_t ii = 0; ii < ENCODER_ACCELERATION_LEVELS; ii++) {
+        if (interval < ENCODER_ACCELERATION_INTERVALS[ii]) {
+            acceleration = ENCODER_ACCELERATION_MULTIPLIERS[ii];
+            break;
+        }
+    }
+    myEncoderMoveTime = tickTime;
+    myEncoderPosition = encoderPos;
+
+    if (myTonePattern == NULL || myTonePattern == &myClickTones) {
+        // Give a click as feedback, unless the alarm is sounding.
+        start_tones(&myClickTones);
+    }
+    LOG_DEBUG(EVENT_ROTATED, amount, acceleration);
+    rotate(amount, acceleration);
+    input_handled(tickTime);
+}
+
+/*
+ * Debounces the button edges queued by the button interrupt, and recognises
+ * clicks, double-clicks, triple-clicks, long presses and holding.
+ */
+void process_button() {
+    // Only the last edge matters, as the button must then be stable.
+    uint32_t head = myButtonHead.load(std::memory_order_acquire);
+    uint32_t tail = myButtonTail.load(std::memory_order_relaxed);
+    while (tail != head) {
+        myButtonEdge = myButtonEvents[tail % BUTTON_QUEUE_SIZE];
+        tail++;
+    }
+    myButtonTail.store(tail, std::memory_order_release);
+
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    bool isPressed = myButtonEdge.level == LOW;
+    if (isPressed != myIsButtonPressed && (now - myButtonEdge.time) >= (BUTTON_DEBOUNCE_TIME * 1000)) {
+        myIsButtonPressed = isPressed;
+        if (isPressed) {
+            myButtonPressTime = myButtonEdge.time;
+            myHoldRepeatTime = myButtonPressTime + ((LONG_PRESS_INTERVAL + HOLD_REPEAT_INTERVAL) * 1000);
+        } else if (myIsLongPress) {
+            // The release of a long press ends the gesture.
+            myIsLongPress = false;
+            myClickCount = 0;
+        } else {
+            myButtonReleaseTime = myButtonEdge.time;
+            myClickCount++;
+        }
+    }
+
+    if (myIsButtonPressed) {
+        if (!myIsLongPress && (now - myButtonPressTime) >= (LONG_PRESS_INTERVAL * 1000)) {
+            myIsLongPress = true;
+            myClickCount = 0;
+            long_press();
+            input_handled(myButtonPressTime + (LONG_PRESS_INTERVAL * 1000));
+        } else if (myIsLongPress && (int32_t)(now - myHoldRepeatTime) >= 0) {
+            hold_repeat();
+            input_handled(myHoldRepeatTime);
+            myHoldRepeatTime += HOLD_REPEAT_INTERVAL * 1000;
+        }
+    } else if (myClickCount > 0 && (now - myButtonReleaseTime) >= (DOUBLE_CLICK_INTERVAL * 1000)) {
+        // No more clicks are coming.
+        if (myClickCount == 1) {
+            click();
+        } else if (myClickCount == 2) {
+            double_click();
+        } else {
+            triple_click();
+        }
+        myClickCount = 0;
+        input_handled(myButtonReleaseTime);
+    }
+}
+
+/*
+ * Handles the expiry of the countdown timer.
+ */
+void countdown_expired() {
+    LOG_DEBUG(EVENT_COUNTDOWN_EXPIRED, myState, 0);
+    switch (myState) {
+        case state_t::SHOW_ALARM: // Fall-through
+        case state_t::SHOW_SNOOZE: // Fall-through
+        case state_t::CANCELLED:
+            // It's time to show the clock again.
+            myState = state_t::RUNNING;
+            break;
+        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:
+            myState = state_t::SETUP_MENU_DAY_COLOUR_R;
+            break;
+        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO:
+            myState = state_t::SETUP_MENU_NIGHT_COLOUR_R;
+            break;
+    }
+}
+
+/**
+ * Converts an alarm_t value into a representative string.
+ * 
+ * @param alarm The alarm to convert.
+ * @return String representation of the alarm.
+ */
+const std::string alarmtToString(alarm_t alarm) {
+    return ALARM_STRINGS[static_cast<int>(alarm)];
+}
+
+/**
+ * Converts a display_pattern_t value into a representative string.
+ * 
+ * @param pattern The pattern to convert.
+ * @return String representation of the pattern.
+ */
+const std::string displayPatternToString(display_pattern_t pattern) {
+    return DISPLAY_PATTERN_STRINGS[static_cast<int>(pattern)];
+}
+
+/**
+ * Converts a string to an alarm_t.
+ * 
+ * @param str The string to be converted.
+ * @return The alarm_t that is represented by the string.
+ */
+alarm_t stringToAlarmt(std::string str) {
+    for (int ii = 0; ii <= MAX_ALARM_T_INDEX; ii++) {
+        if (str == ALARM_STRINGS[ii]) {
+            return static_cast<alarm_t>(ii);
+        }
+    }
+
+    return alarm_t::ALARM_DISABLED;
+}
+
+/**
+ * Converts a YYYYMMDD date into a "YYYY-MM-DD" string.
+ * 
+ * @param date The date to convert, 0 for no date.
+ * @param buffer The buffer for the string, at least 11 characters.
+ * @param len The length of the buffer.
+ */
+void dateToString(uint32_t date, char *buffer, size_t len) {
+    if (date == 0) {
+        buffer[0] = '\0';
+    } else {
+        snprintf(buffer, len, "%04lu-%02lu-%02lu", (unsigned long)(date / 10000), 
+            (unsigned long)((date / 100) % 100), (unsigned long)(date % 100));
+    }
+}
+
+/**
+ * Converts a "YYYY-MM-DD" string into a YYYYMMDD date.
+ * 
+ * @param str The string to convert, empty for no date.
+ * @param date The converted date, 0 for no date.
+ * @return true if the string is a valid date (or empty), false otherwise.
+ */
+bool stringToDate(const char *str, uint32_t *date) {
+    unsigned int year;
+    unsigned int month;
+    unsigned int day;
+    if (str == NULL) {
+        return false;
+    } else if (str[0] == '\0') {
+        *date = 0;
+        return true;
+    } else if (strlen(str) != 10 || sscanf(str, "%4u-%2u-%2u", &year, &month, &day) != 3 ||
+            year < 2000 || year > 2099 || month < 1 || month > 12 || day < 1 || day > 31) {
+        return false;
+    }
+    *date = (year * 10000) + (month * 100) + day;
+    return true;
+}
+
+/**
+ * Converts a string to an display_pattern_t.
+ * 
+ * @param str The string to be converted.
+ * @param pattern Set to the display_pattern_t that is represented by the string.
+ * @return true if the string is a valid pattern, false otherwise.
+ */
+bool stringToPattern(std::string str, display_pattern_t *pattern) {
+    for (int ii = 0; ii < MAX_DISPLAY_PATTERN_INDEX; ii++) {
+        if (str == DISPLAY_PATTERN_STRINGS[ii]) {
+            *pattern = static_cast<display_pattern_t>(ii);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Converts a string to an display_pattern_t.
+ * 
+ * @param str The string to be converted.
+ * @return The display_pattern_t that is represented by the string.
+ */
+display_pattern_t stringToPattern(std::string str) {
+    display_pattern_t pattern = display_pattern_t::SOLID_COLOUR;
+    stringToPattern(str, &pattern);
+    return pattern;
+}
+
+/**
+ * Converts a JSON array to a colour_t.
+ * 
+ * @param arr The JSON array containing red, green and blue values.
+ * @return The colour_t representation of the colour data.
+ */
+colour_t arrayToColour(JsonArray arr) {
+    colour_t colour;
+    if (arr.size() != 3) {
+        colour.r = 255;
+        colour.g = 255;
+        colour.b = 255;
+    } else {
+        colour.r = arr[0];
+        colour.g = arr[1];
+        colour.b = arr[2];
+    }
+
+    return colour;
+}
+
+/**
+ * Sends a response to a request with a printf-style message.
+ * 
+ * @param request The request to which the reply is sent.
+ * @param code The HTTP response code.
+ * @param format The format of the message (printf-style.)
+ * @param ... Variable arguments for filling in the format.
+ */
+void sendResponsePrintf(AsyncWebServerRequest *request, const int code, const char *format, ...) {
+    // Prepare the buffer with the contents of the message.
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+
+    // Send the response.
+    if (request != NULL) {
+        request->send(code, "text/plain", buffer);
+    }
+    // Clean up the variable length arguments.
+    va_end(args);
+}
+
+/**
+ * Retrieves a JSON representation of the current configuration.
+ * 
+ * @param request The web request retrieving the configuration.
+ */
+void getConfig(AsyncWebServerRequest *request) {
+    #ifndef HIDE_DEBUG
+    Serial.println("Retriving configuration for web client");
+    #endif
+    flash_config_t config;
+    read_config(&config);
+
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+
+    root["deviceName"] = config.deviceName;
+    root["alarmTime"] = config.alarmTime;
+    root["alarmActivation"] = alarmtToString(config.alarmActivation);
+    root["radioFrequency"] = config.radioFrequency;
+    root["brightness"] = config.brightness;
+    JsonArray dayColour = root["dayColour"].to<JsonArray>();
+    dayColour.add(config.dayColour.r);
+    dayColour.add(config.dayColour.g);
+    dayColour.add(config.dayColour.b);
+    JsonArray nightColour = root["nightColour"].to<JsonArray>();
+    nightColour.add(config.nightColour.r);
+    nightColour.add(config.nightColour.g);
+    nightColour.add(config.nightColour.b);
+    JsonArray alarmColour = root["alarmColour"].to<JsonArray>();
+    alarmColour.add(config.alarmColour.r);
+    alarmColour.add(config.alarmColour.g);
+    alarmColour.add(config.alarmColour.b);
+    root["dayPattern"] = displayPatternToString(config.dayPattern);
+    root["nightPattern"] = displayPatternToString(config.nightPattern);
+    root["alarmPattern"] = displayPatternToString(config.alarmPattern);
+    root["latitude"] = config.latitude;
+    root["longitude"] = config.longitude;
+    root["zoneName"] = config.zoneName;
+    root["timezone"] = config.timezone;
+    double offset;
+    double dstShift;
+    if (tz_rule_offsets(posix_timezone(&config), &offset, &dstShift)) {
+        root["offset"] = offset;
+        root["dstShift"] = dstShift;
+    } else {
+        root["offset"] = config.offset;
+        root["dstShift"] = 0;
+    }
+    root["isAlarmDisabled"] = config.isAlarmDisabled;
+    root["isRadioInstalled"] = config.isRadioInstalled;
+    root["is24Hour"] = config.is24Hour;
+    root["isUseRadio"] = config.isUseRadio;
+    root["version"] = config.version;
+    root["wakeDuration"] = config.wakeDuration;
+    root["telemetryInterval"] = config.telemetryInterval;
+    root["mqttHost"] = config.mqttHost;
+    root["mqttPort"] = config.mqttPort;
+    JsonArray dayAlarmTimes = root["dayAlarmTimes"].to<JsonArray>();
+    for (uint8_t ii = 0; ii < DAYS_PER_WEEK; ii++) {
+        if (config.dayAlarmTimes[ii] == ALARM_TIME_DEFAULT) {
+            dayAlarmTimes.add<JsonVariant>();
+        } else if (config.dayAlarmTimes[ii] == ALARM_TIME_NONE) {
+            dayAlarmTimes.add(-1);
+        } else {
+            dayAlarmTimes.add(config.dayAlarmTimes[ii]);
+        }
+    }
+    char date[11];
+    dateToString(config.alarmStartDate, date, sizeof(date));
+    root["alarmStartDate"] = date;
+    dateToString(config.alarmEndDate, date, sizeof(date));
+    root["alarmEndDate"] = date;
+    JsonArray radioPresets = root["radioPresets"].to<JsonArray>();
+    for (uint8_t ii = 0; ii < RADIO_PRESET_COUNT; ii++) {
+        radioPresets.add(config.radioPresets[ii]);
+    }
+    JsonObject calibration = root["calibration"].to<JsonObject>();
+    JsonArray gamma = calibration["gamma"].to<JsonArray>();
+    for (uint8_t ii = 0; ii < 3; ii++) {
+        gamma.add((float)config.calibration.gamma[ii] / GAMMA_SCALE);
+    }
+    JsonArray whiteBalance = calibration["whiteBalance"].to<JsonArray>();
+    whiteBalance.add(config.calibration.whiteBalance.r);
+    whiteBalance.add(config.calibration.whiteBalance.g);
+    whiteBalance.add(config.calibration.whiteBalance.b);
+    JsonArray ledGain = calibration["ledGain"].to<JsonArray>();
+    for (uint16_t ii = 0; ii < LED_COUNT; ii++) {
+        ledGain.add(config.calibration.ledGain[ii]);
+    }
+    root["powerBudget"] = config.powerBudget;
+    JsonArray brightnessCaps = root["brightnessCaps"].to<JsonArray>();
+    for (uint8_t ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+        if (config.brightnessCaps[ii].startMinute != BRIGHTNESS_CAP_UNUSED) {
+            JsonObject cap = brightnessCaps.add<JsonObject>();
+            cap["start"] = config.brightnessCaps[ii].startMinute;
+            cap["max"] = config.brightnessCaps[ii].maxBrightness;
+        }
+    }
+
+    // Send the response back to the user.
+    response->setLength();
+    request->send(response);
+}
+
+/**
+ * Applies a new configuration, publishing it for loop() to apply and write to
+ * flash. An error response is sent if the configuration is invalid, or was
+ * changed by another task while this was being applied.
+ * 
+ * @param request The web request containing the configuration.
+ * @param jsonObj The new configuration.
+ * @return true if the configuration was applied, false otherwise.
+ */
+bool apply_config_json(AsyncWebServerRequest *request, JsonObject jsonObj) {
+    if (!jsonObj["deviceName"].is<JsonVariant>()) {
+        // Missing or bad top-level information.
+        sendResponsePrintf(request, 400, "Invalid top-level data");
+        return false;
+    }
+
+    // Copy the configuration.
+    flash_config_t current;
+    uint32_t sequence = read_config(&current);
+    flash_config_t configuration;
+    copy_config(&configuration, &current);
+    configuration.magic = MAGIC;
+    const char *name = jsonObj["deviceName"];
+    if ((name == NULL) || (strlen(name) == 0)) {
+        // Missing or bad top-level information.
+        sendResponsePrintf(request, 400, "Bad configuration.");
+        return false;
+    } else {
+        strncpy(configuration.deviceName, name, DEVICE_NAME_MAX_LEN);
+        configuration.deviceName[DEVICE_NAME_MAX_LEN] = '\0';
+    }
+
+    configuration.alarmTime = jsonObj["alarmTime"];
+    configuration.alarmActivation = stringToAlarmt(jsonObj["alarmActivation"]);
+    configuration.radioFrequency = jsonObj["radioFrequency"];
+    configuration.brightness = jsonObj["brightness"];
+    configuration.dayColour = arrayToColour(jsonObj["dayColour"]);
+    configuration.nightColour = arrayToColour(jsonObj["nightColour"]);
+    configuration.alarmColour = arrayToColour(jsonObj["alarmColour"]);
+    configuration.dayPattern = stringToPattern(jsonObj["dayPattern"]);
+    configuration.nightPattern = stringToPattern(jsonObj["nightPattern"]);
+    configuration.alarmPattern = stringToPattern(jsonObj["alarmPattern"]);
+    configuration.latitude = jsonObj["latitude"];
+    configuration.longitude = jsonObj["longitude"];
+    if (jsonObj["zoneName"].is<const char *>()) {
+        const char *zoneName = jsonObj["zoneName"];
+        if ((zoneName[0] != '\0') && (find_zone(zoneName) == NULL)) {
+            sendResponsePrintf(request, 400, "Unknown time zone: %s.", zoneName);
+            return false;
+        }
+        strncpy(configuration.zoneName, zoneName, ZONE_NAME_MAX_LEN);
+        configuration.zoneName[ZONE_NAME_MAX_LEN] = '\0';
+    }
+    if (jsonObj["timezone"].is<const char *>()) {
+        strncpy(configuration.timezone, jsonObj["timezone"], TIMEZONE_MAX_LEN);
+        configuration.timezone[TIMEZONE_MAX_LEN] = '\0';
+    }
+    // The offset is derived from the time zone, so that the two always agree.
+    double dstShift;
+    if (!tz_rule_offsets(posix_timezone(&configuration), &configuration.offset, &dstShift)) {
+        sendResponsePrintf(request, 400, "Bad time zone rule: %s.", configuration.timezone);
+        return false;
+    }
+    configuration.isAlarmDisabled = current.isAlarmDisabled;
+    configuration.isRadioInstalled = current.isRadioInstalled;
+    configuration.is24Hour = jsonObj["is24Hour"];
+    configuration.isUseRadio = jsonObj["isUseRadio"];
+    strncpy(configuration.version, VERSION, VERSION_LEN);
+    configuration.version[VERSION_LEN] = '\0';
+    if (!jsonObj["wakeDuration"].isNull()) {
+        // Read as an int, so that values too big for the field are rejected.
+        int wakeDuration = jsonObj["wakeDuration"] | -1;
+        if (!jsonObj["wakeDuration"].is<int>() || 
+                (wakeDuration != 0 && (wakeDuration < MIN_WAKE_DURATION || wakeDuration > MAX_WAKE_DURATION))) {
+            sendResponsePrintf(request, 400, "Wake duration must be 0 or %u-%u minutes.", 
+                MIN_WAKE_DURATION, MAX_WAKE_DURATION);
+            return false;
+        }
+        configuration.wakeDuration = (uint8_t)wakeDuration;
+    }
+    if (!jsonObj["telemetryInterval"].isNull()) {
+        int telemetryInterval = jsonObj["telemetryInterval"] | -1;
+        if (!jsonObj["telemetryInterval"].is<int>() || (telemetryInterval != 0 && 
+                (telemetryInterval < MIN_TELEMETRY_INTERVAL || telemetryInterval > MAX_TELEMETRY_INTERVAL))) {
+            sendResponsePrintf(request, 400, "Telemetry interval must be 0 or %u-%u ms.", 
+                MIN_TELEMETRY_INTERVAL, MAX_TELEMETRY_INTERVAL);
+            return false;
+        }
+        configuration.telemetryInterval = (uint16_t)telemetryInterval;
+    }
+    if (jsonObj["mqttHost"].is<const char *>()) {
+        strncpy(configuration.mqttHost, jsonObj["mqttHost"], MQTT_HOST_MAX_LEN);
+        configuration.mqttHost[MQTT_HOST_MAX_LEN] = '\0';
+    }
+    if (jsonObj["mqttPort"].is<uint16_t>()) {
+        configuration.mqttPort = jsonObj["mqttPort"];
+        if (configuration.mqttPort == 0) {
+            configuration.mqttPort = MQTT_DEFAULT_PORT;
+        }
+    }
+    if (jsonObj["dayAlarmTimes"].is<JsonArray>()) {
+        // Each day is the minute of its alarm, -1 for none, or null for the
+        // main alarm time.
+        JsonArray dayAlarmTimes = jsonObj["dayAlarmTimes"];
+        for (uint8_t ii = 0; ii < DAYS_PER_WEEK; ii++) {
+            JsonVariant dayTime = dayAlarmTimes[ii];
+            if (dayTime.isNull()) {
+                configuration.dayAlarmTimes[ii] = ALARM_TIME_DEFAULT;
+            } else if (dayTime.is<int>() && dayTime.as<int>() == -1) {
+                configuration.dayAlarmTimes[ii] = ALARM_TIME_NONE;
+            } else if (dayTime.is<uint16_t>() && dayTime.as<uint16_t>() < HOURS_PER_DAY * MINUTES_PER_HOUR) {
+                configuration.dayAlarmTimes[ii] = dayTime;
             } else {
-                display(FONT_R, 0x00, 0x0F, 0x0F, false);
+                sendResponsePrintf(request, 400, "Bad alarm time for day %u.", (unsigned int)ii);
+                return false;
             }
-            break;
-        case state_t::SETUP_MENU_12_24_HOURS:
-            if (myNewConfiguration.is24Hour) {
-                display(FONT_BLANK, 0x02, 0x04, FONT_H, false);
-            } else {
-                display(FONT_BLANK, 0x01, 0x02, FONT_H, false);
+        }
+    }
+    if (jsonObj["alarmStartDate"].is<const char *>() &&
+            !stringToDate(jsonObj["alarmStartDate"], &configuration.alarmStartDate)) {
+        sendResponsePrintf(request, 400, "The alarm start date must be YYYY-MM-DD.");
+        return false;
+    }
+    if (jsonObj["alarmEndDate"].is<const char *>() &&
+            !stringToDate(jsonObj["alarmEndDate"], &configuration.alarmEndDate)) {
+        sendResponsePrintf(request, 400, "The alarm end date must be YYYY-MM-DD.");
+        return false;
+    }
+    if (jsonObj["radioPresets"].is<JsonArray>()) {
+        JsonArray radioPresets = jsonObj["radioPresets"];
+        for (uint8_t ii = 0; ii < RADIO_PRESET_COUNT; ii++) {
+            configuration.radioPresets[ii] = (ii < radioPresets.size()) ? radioPresets[ii] : 0;
+        }
+    }
+    if (jsonObj["calibration"]["gamma"].is<JsonArray>()) {
+        JsonArray gamma = jsonObj["calibration"]["gamma"];
+        for (uint8_t ii = 0; ii < 3; ii++) {
+            long tenths = lroundf((gamma[ii] | 0.0f) * GAMMA_SCALE);
+            if (tenths < MIN_GAMMA || tenths > MAX_GAMMA) {
+                sendResponsePrintf(request, 400, "Each gamma must be %.1f-%.1f.", 
+                    (float)MIN_GAMMA / GAMMA_SCALE, (float)MAX_GAMMA / GAMMA_SCALE);
+                return false;
+            }
+            configuration.calibration.gamma[ii] = (uint8_t)tenths;
+        }
+    }
+    if (jsonObj["calibration"]["whiteBalance"].is<JsonArray>()) {
+        configuration.calibration.whiteBalance = arrayToColour(jsonObj["calibration"]["whiteBalance"]);
+    }
+    if (jsonObj["calibration"]["ledGain"].is<JsonArray>()) {
+        JsonArray ledGain = jsonObj["calibration"]["ledGain"];
+        if (ledGain.size() != LED_COUNT) {
+            sendResponsePrintf(request, 400, "There must be a gain for each of the %u LEDs.", 
+                (unsigned int)LED_COUNT);
+            return false;
+        }
+        for (uint16_t ii = 0; ii < LED_COUNT; ii++) {
+            if (!ledGain[ii].is<uint8_t>()) {
+                sendResponsePrintf(request, 400, "Bad gain for LED %u.", (unsigned int)ii);
+                return false;
+            }
+            configuration.calibration.ledGain[ii] = ledGain[ii];
+        }
+    }
+    if (jsonObj["powerBudget"].is<uint16_t>()) {
+        uint16_t powerBudget = jsonObj["powerBudget"];
+        if (powerBudget != 0 && powerBudget < MIN_POWER_BUDGET) {
+            sendResponsePrintf(request, 400, "The power budget must be 0 or at least %u mA.", 
+                MIN_POWER_BUDGET);
+            return false;
+        }
+        configuration.powerBudget = powerBudget;
+    }
+    if (jsonObj["brightnessCaps"].is<JsonArray>()) {
+        // Each cap is {"start": minute of the day, "max": brightness}.
+        JsonArray brightnessCaps = jsonObj["brightnessCaps"];
+        if (brightnessCaps.size() > BRIGHTNESS_CAP_COUNT) {
+            sendResponsePrintf(request, 400, "There can be at most %u brightness caps.", 
+                (unsigned int)BRIGHTNESS_CAP_COUNT);
+            return false;
+        }
+        for (uint8_t ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+            brightness_cap_t *cap = &configuration.brightnessCaps[ii];
+            if (ii >= brightnessCaps.size()) {
+                cap->startMinute = BRIGHTNESS_CAP_UNUSED;
+                cap->maxBrightness = MAX_BRIGHTNESS;
+                continue;
+            }
+            JsonVariant start = brightnessCaps[ii]["start"];
+            JsonVariant max = brightnessCaps[ii]["max"];
+            if (!start.is<uint16_t>() || start.as<uint16_t>() >= HOURS_PER_DAY * MINUTES_PER_HOUR ||
+                    !max.is<uint8_t>() || max.as<uint8_t>() < MIN_BRIGHTNESS || max.as<uint8_t>() > MAX_BRIGHTNESS) {
+                sendResponsePrintf(request, 400, "Bad brightness cap %u.", (unsigned int)ii);
+                return false;
+            }
+            cap->startMinute = start;
+            cap->maxBrightness = max;
+        }
+    }
+
+    // Publish the configuration for loop() to apply and write to flash, unless
+    // it has changed since it was read (e.g. saved from the menu).
+    uint32_t published;
+    if (!publish_config_if(&configuration, sequence, &published)) {
+        sendResponsePrintf(request, 409, "The configuration changed while being written, try again.");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes a new configuration.
+ * 
+ * @param request The web request retrieving the configuration.
+ * @param json The JSON data containing the new information.
+ */
+void writeConfig(AsyncWebServerRequest *request, JsonVariant &json) {
+    #ifndef HIDE_DEBUG
+    Serial.println("Received request to store the configuration.");
+    #endif
+    if (apply_config_json(request, json.as<JsonObject>())) {
+        request->send(200);
+    }
+}
+
+/**
+ * Converts a hexadecimal string to bytes.
+ * 
+ * @param hex The hexadecimal string.
+ * @param bytes The buffer for the bytes.
+ * @param len The number of bytes expected.
+ * @return true if the string holds exactly len bytes, false otherwise.
+ */
+bool hex_to_bytes(const char *hex, uint8_t *bytes, size_t len) {
+    if (hex == NULL || strlen(hex) != len * 2) {
+        return false;
+    }
+    for (size_t ii = 0; ii < len * 2; ii++) {
+        char ch = tolower(hex[ii]);
+        uint8_t nibble;
+        if (ch >= '0' && ch <= '9') {
+            nibble = ch - '0';
+        } else if (ch >= 'a' && ch <= 'f') {
+            nibble = ch - 'a' + 10;
+        } else {
+            return false;
+        }
+        bytes[ii / 2] = (ii % 2 == 0) ? (nibble << 4) : (bytes[ii / 2] | nibble);
+    }
+    return true;
+}
+
+/**
+ * Checks a signature made with the fleet key, comparing every byte to not
+ * leak timing.
+ * 
+ * @param message The message that was signed.
+ * @param len The length of the message.
+ * @param signature The HMAC-SHA256 of the message (FLEET_SIGNATURE_LEN).
+ * @return true if there is a fleet key and the signature matches it, false
+ *         otherwise.
+ */
+bool is_fleet_signature_valid(const uint8_t *message, size_t len, const uint8_t *signature) {
+    if (strlen(FLEET_KEY) == 0) {
+        return false;
+    }
+    uint8_t expected[FLEET_SIGNATURE_LEN];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 
+        (const unsigned char *)FLEET_KEY, strlen(FLEET_KEY), message, len, expected);
+    uint8_t diff = 0;
+    for (size_t ii = 0; ii < FLEET_SIGNATURE_LEN; ii++) {
+        diff |= signature[ii] ^ expected[ii];
+    }
+    return diff == 0;
+}
+
+/**
+ * Rejects a configuration bundle, logging why.
+ * 
+ * @param request The web request containing the bundle.
+ * @param sequence The sequence of the bundle.
+ * @param code The HTTP status code to respond with.
+ * @param message The message to respond with.
+ */
+void reject_bundle(AsyncWebServerRequest *request, uint32_t sequence, int code, const char *message) {
+    LOG_WARNING(EVENT_BUNDLE_REJECTED, sequence, code);
+    sendResponsePrintf(request, code, message);
+}
+
+/**
+ * Applies a signed configuration bundle pushed to the fleet. The bundle holds
+ * the configuration as a JSON string (payload), a sequence that must increase
+ * with each bundle, and the HMAC-SHA256 of "<hostname>:<sequence>:<payload>"
+ * using the fleet key (signature, in hexadecimal). The hostname is this
+ * clock's, so that a bundle signed for one clock can't be replayed to another.
+ * The device name is kept if the payload doesn't have one.
+ * 
+ * @param request The web request containing the bundle.
+ * @param json The bundle.
+ */
+void postConfigBundle(AsyncWebServerRequest *request, JsonVariant &json) {
+    // Only the async_tcp task handles requests, so the buffer can be shared.
+    static char message[HOSTNAME_MAX_LEN + 13 + MAX_BUNDLE_PAYLOAD_LEN];
+    uint32_t sequence = json["sequence"] | (uint32_t)0;
+    if (strlen(FLEET_KEY) == 0) {
+        reject_bundle(request, sequence, 403, "Configuration bundles are disabled.");
+        return;
+    }
+
+    const char *payload = json["payload"];
+    uint8_t signature[FLEET_SIGNATURE_LEN];
+    if (payload == NULL || strlen(payload) > MAX_BUNDLE_PAYLOAD_LEN || 
+            !hex_to_bytes(json["signature"], signature, FLEET_SIGNATURE_LEN)) {
+        reject_bundle(request, sequence, 400, "Bad bundle.");
+        return;
+    }
+
+    // Check the signature. The hostname comes from the shared configuration,
+    // as loop() may be renaming the clock.
+    flash_config_t current;
+    read_config(&current);
+    char hostname[HOSTNAME_MAX_LEN + 1];
+    make_hostname(current.deviceName, hostname);
+    int len = snprintf(message, sizeof(message), "%s:%lu:%s", hostname, (unsigned long)sequence, payload);
+    if (!is_fleet_signature_valid((const uint8_t *)message, len, signature)) {
+        reject_bundle(request, sequence, 403, "Bad signature.");
+        return;
+    }
+    if (sequence <= myFleetSequence) {
+        reject_bundle(request, sequence, 409, "Stale bundle.");
+        return;
+    }
+
+    JsonDocument doc;
+    if (deserializeJson(doc, payload) != DeserializationError::Ok || !doc.is<JsonObject>()) {
+        reject_bundle(request, sequence, 400, "Bad payload.");
+        return;
+    }
+    if (!doc["deviceName"].is<const char *>()) {
+        doc["deviceName"] = current.deviceName;
+    }
+    if (apply_config_json(request, doc.as<JsonObject>())) {
+        myFleetSequence = sequence;
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putUInt(KEY_FLEET_SEQUENCE, sequence);
+        #endif
+        LOG_INFO(EVENT_BUNDLE_APPLIED, sequence, 0);
+        request->send(200);
+    }
+}
+
+/**
+ * Converts a string to a command_type_t.
+ * 
+ * @param str The string to be converted.
+ * @param type Set to the command_type_t that is represented by the string.
+ * @return true if the string is a valid command, false otherwise.
+ */
+bool stringToCommand(std::string str, command_type_t *type) {
+    for (int ii = 0; ii <= MAX_COMMAND_INDEX; ii++) {
+        if (str == COMMAND_STRINGS[ii]) {
+            *type = static_cast<command_type_t>(ii);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Converts a JSON object into a command for the main loop.
+ * 
+ * @param obj The JSON object describing the command.
+ * @param command The command to be filled in.
+ * @return true if the JSON describes a valid command, false otherwise.
+ */
+bool jsonToCommand(JsonObject obj, command_t *command) {
+    const char *action = obj["action"];
+    if (action == NULL || !stringToCommand(action, &command->type)) {
+        return false;
+    }
+
+    if (command->type == command_type_t::PREVIEW_PATTERN) {
+        const char *pattern = obj["pattern"];
+        if (pattern == NULL || !stringToPattern(pattern, &command->pattern)) {
+            return false;
+        }
+        command->colour = arrayToColour(obj["colour"]);
+        command->duration = obj["duration"] | PREVIEW_DURATION;
+        if (command->duration == 0 || command->duration > MAX_PREVIEW_DURATION) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Converts a JSON object into a message for the display, e.g. 
+ * {"text": "21.5*C", "priority": 5, "duration": 30}. The priority and duration
+ * are optional.
+ * 
+ * @param obj The JSON object describing the message.
+ * @param message The message to be filled in.
+ * @return true if the JSON describes a valid message, false otherwise.
+ */
+bool jsonToMessage(JsonObject obj, message_t *message) {
+    const char *text = obj["text"];
+    if (text == NULL || text[0] == '\0' || strlen(text) > MESSAGE_MAX_LEN) {
+        return false;
+    }
+    strncpy(message->text, text, MESSAGE_MAX_LEN);
+    message->text[MESSAGE_MAX_LEN] = '\0';
+    int priority = obj["priority"] | (int)MESSAGE_PRIORITY_DEFAULT;
+    int duration = obj["duration"] | (int)MESSAGE_DEFAULT_DURATION;
+    if (priority < 0 || priority > MAX_MESSAGE_PRIORITY || duration < 1 || duration > MAX_MESSAGE_DURATION) {
+        return false;
+    }
+    message->priority = (uint8_t)priority;
+    message->duration = (uint16_t)duration;
+    return true;
+}
+
+/**
+ * Posts a message for the display.
+ * 
+ * @param request The web request containing the message.
+ * @param json The JSON data containing the message.
+ */
+void postMessage(AsyncWebServerRequest *request, JsonVariant &json) {
+    message_t message = {};
+    if (!json.is<JsonObject>() || !jsonToMessage(json.as<JsonObject>(), &message)) {
+        sendResponsePrintf(request, 400, 
+            "A message needs 1-%u characters of text, a priority of 0-%u and a duration of 1-%u s.",
+            (unsigned int)MESSAGE_MAX_LEN, (unsigned int)MAX_MESSAGE_PRIORITY, 
+            (unsigned int)MAX_MESSAGE_DURATION);
+        return;
+    }
+    if (!post_message(message.text, message.priority, message.duration)) {
+        sendResponsePrintf(request, 503, "Too many messages are waiting.");
+        return;
+    }
+    request->send(200);
+}
+
+/**
+ * Queues one or more actions (e.g. snoozing the alarm) for the main loop.
+ * The body is either a single command object, or an array of them.
+ * 
+ * @param request The web request containing the actions.
+ * @param json The JSON data containing the actions.
+ */
+void postAction(AsyncWebServerRequest *request, JsonVariant &json) {
+    int64_t receivedTime = esp_timer_get_time();
+    command_t commands[COMMAND_QUEUE_SIZE];
+    size_t count = 0;
+    if (json.is<JsonArray>()) {
+        JsonArray arr = json.as<JsonArray>();
+        if (arr.size() == 0 || arr.size() > COMMAND_QUEUE_SIZE) {
+            sendResponsePrintf(request, 400, "Between 1 and %u actions are allowed.",
+                (unsigned int)COMMAND_QUEUE_SIZE);
+            return;
+        }
+        for (JsonVariant item : arr) {
+            if (!jsonToCommand(item.as<JsonObject>(), &commands[count])) {
+                sendResponsePrintf(request, 400, "Bad action at index %u.", (unsigned int)count);
+                return;
             }
-            break;
-        case state_t::SETUP_MENU_BRIGHTNESS:
-            display(FONT_B,
-                    FONT_R,
-                    FONT_I,
-                    myNewConfiguration.brightness % MAX_BRIGHTNESS,
-                    false);
-            break;
+            count++;
+        }
+    } else if (jsonToCommand(json.as<JsonObject>(), &commands[0])) {
+        count = 1;
+    } else {
+        sendResponsePrintf(request, 400, "Bad action.");
+        return;
+    }
+
+    // Queue the validated commands for the main loop, all or none of them.
+    for (size_t ii = 0; ii < count; ii++) {
+        commands[ii].receivedTime = receivedTime;
+    }
+    if (!queue_commands(commands, count)) {
+        sendResponsePrintf(request, 503, "No room to queue %u actions, none were queued.",
+            (unsigned int)count);
+        return;
     }
+
+    request->send(200);
 }
 
-/*
- * Interrupt Service Routine (ISR) for updating the rotary encoder's value in
- * response to the user rotating it.
+/**
+ * Handles a command received with MQTT, in the same form as for /action, or a
+ * message for the display, in the same form as for /message.
+ * 
+ * @param topic The topic the command was received on.
+ * @param payload The command or message.
+ * @param length The length of the command or message.
  */
-void IRAM_ATTR rotary_tick() {
-    myEncoder.tick();
+void mqtt_received(char *topic, uint8_t *payload, unsigned int length) {
+    JsonDocument doc;
+    if (deserializeJson(doc, payload, length) != DeserializationError::Ok) {
+        #ifndef HIDE_DEBUG
+        Serial.println("Ignoring bad MQTT command.");
+        #endif
+        return;
+    }
+
+    if (doc["text"].is<const char *>()) {
+        message_t message = {};
+        if (!jsonToMessage(doc.as<JsonObject>(), &message)) {
+            #ifndef HIDE_DEBUG
+            Serial.println("Ignoring bad MQTT message.");
+            #endif
+            return;
+        }
+        if (post_message(message.text, message.priority, message.duration)) {
+            myMqttStats.commands++;
+        }
+        return;
+    }
+
+    command_t command = {};
+    if (!jsonToCommand(doc.as<JsonObject>(), &command)) {
+        #ifndef HIDE_DEBUG
+        Serial.println("Ignoring bad MQTT command.");
+        #endif
+        return;
+    }
+    command.receivedTime = esp_timer_get_time();
+    if (queue_command(&command)) {
+        myMqttStats.commands++;
+    }
 }
 
-/*
- * Handles the user rotating the rotary encoder.
+/**
+ * Builds an MQTT topic for this clock.
  * 
- * @param amount The number of detents that the encoder has been rotated.
- *               Negative values are clockwise.
+ * @param hostname The host name of the clock.
+ * @param name The last part of the topic.
+ * @param topic The buffer for the topic (MQTT_TOPIC_LEN).
  */
-void rotate(int32_t amount) {
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t origMinute;
-    uint16_t freqWhole;
-    uint8_t freqFrac;
-    amount *= -1;
-    Serial.printf("rotate by %d in state %d.\n", amount, myState);
-    switch (myState) {
-        case state_t::SHOW_SNOOZE:
-            // Increase/decrease the snooze.
-            mySnoozeRemaining += (amount * SECONDS_PER_MINUTE);
-            if (mySnoozeRemaining <= 0) {
-                // Turn the alarm off.
-                stop_alarm();
-            } else if (mySnoozeRemaining > MAX_SNOOZE) {
-                mySnoozeRemaining = MAX_SNOOZE;
+void make_mqtt_topic(const char *hostname, const char *name, char *topic) {
+    snprintf(topic, MQTT_TOPIC_LEN, "%s/%s/%s", MQTT_TOPIC_PREFIX, hostname, name);
+}
+
+/**
+ * The MQTT task, which keeps the connection to the broker, reconnecting with
+ * an increasing delay, and sends the queued messages. Commands are received on
+ * "espclock/<hostname>/command", and queued for the main loop.
+ * 
+ * @param arg Unused.
+ */
+void mqtt_task(void *arg) {
+    flash_config_t config;
+    uint32_t configSequence = 0;
+    char hostname[HOSTNAME_MAX_LEN + 1];
+    char topic[MQTT_TOPIC_LEN];
+    uint32_t retryDelay = MQTT_MIN_RETRY;
+    unsigned long retryTime = 0;
+    bool isConfigRead = false;
+
+    myMqtt.setCallback(mqtt_received);
+    myMqtt.setSocketTimeout(5);
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(MQTT_POLL_INTERVAL));
+        if (!isConfigRead || seqlock_sequence(&mySharedConfiguration) != configSequence) {
+            flash_config_t newConfig;
+            uint32_t sequence;
+            if (!try_read_config(&newConfig, &sequence)) {
+                continue;
             }
-            break;
-        case state_t::MENU_ALARM_MINUTES:
-            // Change the minute value for the alarm.
-            hour = myNewConfiguration.alarmTime / MINUTES_PER_HOUR;
-            minute = myNewConfiguration.alarmTime % MINUTES_PER_HOUR;
-            origMinute = minute;
-            minute = (minute + amount + MINUTES_PER_HOUR) % MINUTES_PER_HOUR;
-            if ((amount > 0) && (minute < origMinute)) {
-                // The minute has wrapped around the top of the hour.
-                hour = (hour + 1) % HOURS_PER_DAY;
-            } else if ((amount < 0) && (minute > origMinute)) {
-                // The minute has wrapped around the bottom of the hour.
-                hour = (hour - 1 + HOURS_PER_DAY) % HOURS_PER_DAY;
+            if (isConfigRead && myMqtt.connected() && 
+                    (strcmp(newConfig.mqttHost, config.mqttHost) != 0 || newConfig.mqttPort != config.mqttPort)) {
+                // Move to the new broker.
+                myMqtt.disconnect();
+                retryDelay = MQTT_MIN_RETRY;
+                retryTime = millis();
             }
-            myNewConfiguration.alarmTime = (hour * MINUTES_PER_HOUR) + minute;
-            break;
-        case state_t::MENU_ALARM_HOURS:
-            // Change the hour value for the alarm.
-            hour = myNewConfiguration.alarmTime / MINUTES_PER_HOUR;
-            minute = myNewConfiguration.alarmTime % MINUTES_PER_HOUR;
-            hour = (hour + amount + HOURS_PER_DAY) % HOURS_PER_DAY;
-            myNewConfiguration.alarmTime = (hour * MINUTES_PER_HOUR) + minute;
-            break;
-        case state_t::MENU_ALARM_DAYS:
-            // Change the alarm enabled days.
-            switch (myNewConfiguration.alarmActivation) {
-                case alarm_t::ALARM_DISABLED:
-                    if (amount > 0) {
-                        myNewConfiguration.alarmActivation = alarm_t::WEEKDAYS;
-                    } else {
-                        myNewConfiguration.alarmActivation = alarm_t::ONE_TIME;
-                    }
-                    break;
-                case alarm_t::WEEKDAYS:
-                    if (amount > 0) {
-                        myNewConfiguration.alarmActivation = alarm_t::ALL_DAYS;
-                    } else {
-                        myNewConfiguration.alarmActivation = alarm_t::ALARM_DISABLED;
-                    }
-                    break;
-                case alarm_t::ALL_DAYS:
-                    if (amount > 0) {
-                        myNewConfiguration.alarmActivation = alarm_t::ONE_TIME;
-                    } else {
-                        myNewConfiguration.alarmActivation = alarm_t::WEEKDAYS;
-                    }
-                    break;
-                case alarm_t::ONE_TIME:
-                    if (amount > 0) {
-                        myNewConfiguration.alarmActivation = alarm_t::ALARM_DISABLED;
-                    } else {
-                        myNewConfiguration.alarmActivation = alarm_t::ALL_DAYS;
-                    }
-                    break;
+            copy_config(&config, &newConfig);
+            configSequence = sequence;
+            isConfigRead = true;
+        }
+
+        if (config.mqttHost[0] == '\0' || WiFi.status() != WL_CONNECTED) {
+            // Keep the queued messages until the broker can be reached.
+            myMqttStats.isConnected = false;
+            continue;
+        }
+
+        if (!myMqtt.connected()) {
+            myMqttStats.isConnected = false;
+            if ((long)(millis() - retryTime) < 0) {
+                continue;
             }
-            break;
-        case state_t::SETUP_MENU_RADIO_WHOLE:
-            // Change the radio frequency whole digits.
-            freqWhole = myNewConfiguration.radioFrequency / 10;
-            freqFrac = myNewConfiguration.radioFrequency % 10;
-            freqWhole += amount;
-            while (freqWhole > MAX_RADIO_FREQUENCY) {
-                freqWhole -= freqWhole - MAX_RADIO_FREQUENCY + MIN_RADIO_FREQUENCY - 1;
+            strcpy(hostname, myHostname);
+            make_mqtt_topic(hostname, MQTT_TOPIC_STRINGS[mqtt_topic_t::MQTT_STATUS], topic);
+            myMqtt.setServer(config.mqttHost, config.mqttPort);
+            if (!myMqtt.connect(hostname, topic, 0, true, "offline")) {
+                retryTime = millis() + retryDelay;
+                retryDelay = (retryDelay * 2 > MQTT_MAX_RETRY) ? MQTT_MAX_RETRY : retryDelay * 2;
+                continue;
             }
-            while (freqWhole < MIN_RADIO_FREQUENCY) {
-                freqWhole = freqWhole + MAX_RADIO_FREQUENCY - MIN_RADIO_FREQUENCY + 1;
+            retryDelay = MQTT_MIN_RETRY;
+            myMqttStats.connects++;
+            myMqttStats.isConnected = true;
+            myMqtt.publish(topic, "online", true);
+            make_mqtt_topic(hostname, "command", topic);
+            myMqtt.subscribe(topic);
+        }
+
+        myMqtt.loop();
+
+        // Send the queued messages, leaving any that fail for the next
+        // connection. A message is only cleared if it wasn't replaced while
+        // being sent.
+        for (int ii = 0; ii <= MAX_MQTT_TOPIC_INDEX; ii++) {
+            mqtt_slot_t *slot = &myMqttSlots[ii];
+            portENTER_CRITICAL(&myMqttMux);
+            bool isPending = slot->isPending;
+            mqtt_message_t message = slot->message;
+            uint32_t version = slot->version;
+            portEXIT_CRITICAL(&myMqttMux);
+            if (!isPending) {
+                continue;
             }
-            Serial.printf("New frequency: %d.\n", freqWhole);
-            myNewConfiguration.radioFrequency = (freqWhole * 10) + freqFrac;
-            Serial.printf("Final frequency: %ld.\n", myNewConfiguration.radioFrequency);
-            break;
-        case state_t::SETUP_MENU_RADIO_FRACTION:
-            // Change the radio frequency fractional digit.
-            freqWhole = myNewConfiguration.radioFrequency / 10;
-            freqFrac = myNewConfiguration.radioFrequency % 10;
-            freqFrac = (freqFrac + amount + 10) % 10;
-            myNewConfiguration.radioFrequency = (freqWhole * 10) + freqFrac;
-            Serial.printf("Frac: final frequency: %ld.\n", myNewConfiguration.radioFrequency);
-            break;
-        case state_t::SETUP_MENU_12_24_HOURS:
-            if ((amount % 2) != 0) {
-                myNewConfiguration.is24Hour = !myNewConfiguration.is24Hour;
+
+            make_mqtt_topic(hostname, MQTT_TOPIC_STRINGS[message.topic], topic);
+            if (!myMqtt.publish(topic, message.payload, message.retain)) {
+                break;
             }
-            break;
-        case state_t::SETUP_MENU_BRIGHTNESS:
-            myNewConfiguration.brightness = 
-                (myNewConfiguration.brightness + amount + MAX_BRIGHTNESS) % MAX_BRIGHTNESS;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_R:
-            // Colour will automatically wrap around as it's only 8 bits.
-            myNewConfiguration.dayColour.r += amount;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_G:
-            // Colour will automatically wrap around as it's only 8 bits.
-            myNewConfiguration.dayColour.g += amount;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_B:
-            // Colour will automatically wrap around as it's only 8 bits.
-            myNewConfiguration.dayColour.b += amount;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_R:
-            // Colour will automatically wrap around as it's only 8 bits.
-            myNewConfiguration.nightColour.r += amount;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_G:
-            // Colour will automatically wrap around as it's only 8 bits.
-            myNewConfiguration.nightColour.g += amount;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_B:
-            // Colour will automatically wrap around as it's only 8 bits.
-            myNewConfiguration.nightColour.b += amount;
-            break;
-        case state_t::SETUP_MENU_ALARM_PATTERN: {
-            uint8_t val = myNewConfiguration.alarmPattern;
-            val = (val + amount + ALARM_PATTERN_COUNT) % ALARM_PATTERN_COUNT;
-            myNewConfiguration.alarmPattern = static_cast<display_pattern_t>(val);
-            break;
+            portENTER_CRITICAL(&myMqttMux);
+            if (slot->version == version) {
+                slot->isPending = false;
+            }
+            portEXIT_CRITICAL(&myMqttMux);
+            myMqttStats.published++;
+        }
+    }
+}
+
+/**
+ * Starts the MQTT task, once the network is available.
+ */
+void start_mqtt() {
+    if (myMqttTask == NULL) {
+        xTaskCreate(mqtt_task, "mqtt", MQTT_TASK_STACK_SIZE, NULL, MQTT_TASK_PRIORITY, &myMqttTask);
+    }
+}
+
+/**
+ * Retrieves the state and statistics of the WiFi connection.
+ * 
+ * @param request The web request retrieving the statistics.
+ */
+void getWifiStats(AsyncWebServerRequest *request) {
+    wifi_stats_t stats;
+    portENTER_CRITICAL(&myWifiMux);
+    stats = myWifiStats;
+    portEXIT_CRITICAL(&myWifiMux);
+
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+    bool isConnected = stats.state == wifi_state_t::WIFI_CONNECTED;
+    uint32_t connected = isConnected ? (millis() - stats.connectedAt) / 1000 : 0;
+    root["state"] = WIFI_STATE_STRINGS[static_cast<int>(stats.state)];
+    root["connects"] = stats.connects;
+    root["disconnects"] = stats.disconnects;
+    root["failures"] = stats.failures;
+    root["lastConnectTimeMs"] = stats.lastConnectTime;
+    root["connectedSeconds"] = connected;
+    root["totalConnectedSeconds"] = stats.totalConnected + connected;
+    if (isConnected) {
+        root["rssi"] = WiFi.RSSI();
+        root["channel"] = WiFi.channel();
+    }
+
+    response->setLength();
+    request->send(response);
+}
+
+/**
+ * Retrieves the statistics of the MQTT client.
+ * 
+ * @param request The web request retrieving the statistics.
+ */
+void getMqttStats(AsyncWebServerRequest *request) {
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+
+    root["isConnected"] = myMqttStats.isConnected.load();
+    root["connects"] = myMqttStats.connects.load();
+    root["published"] = myMqttStats.published.load();
+    root["dropped"] = myMqttStats.dropped.load();
+    root["commands"] = myMqttStats.commands.load();
+    uint32_t queued = 0;
+    portENTER_CRITICAL(&myMqttMux);
+    for (int ii = 0; ii <= MAX_MQTT_TOPIC_INDEX; ii++) {
+        queued += myMqttSlots[ii].isPending ? 1 : 0;
+    }
+    portEXIT_CRITICAL(&myMqttMux);
+    root["queued"] = queued;
+
+    response->setLength();
+    request->send(response);
+}
+
+/**
+ * Retrieves the statistics of the actions executed by the main loop.
+ * 
+ * @param request The web request retrieving the statistics.
+ */
+void getActionStats(AsyncWebServerRequest *request) {
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+
+    root["executed"] = myCommandStats.executed.load();
+    root["dropped"] = myCommandStats.dropped.load();
+    root["lastLatencyUs"] = myCommandStats.lastLatency.load();
+    root["averageLatencyUs"] = myCommandStats.averageLatency.load();
+    root["maxLatencyUs"] = myCommandStats.maxLatency.load();
+
+    response->setLength();
+    request->send(response);
+}
+
+/**
+ * Converts a string to a pattern_op_code_t.
+ * 
+ * @param str The string to be converted.
+ * @param code Set to the pattern_op_code_t that is represented by the string.
+ * @return true if the string is a valid instruction, false otherwise.
+ */
+bool stringToPatternOp(std::string str, pattern_op_code_t *code) {
+    for (int ii = 0; ii <= MAX_PATTERN_OP_INDEX; ii++) {
+        if (str == PATTERN_OP_STRINGS[ii]) {
+            *code = static_cast<pattern_op_code_t>(ii);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Converts a string to a pattern_register_t.
+ * 
+ * @param str The string to be converted.
+ * @param reg Set to the pattern_register_t that is represented by the string.
+ * @return true if the string is a valid register, false otherwise.
+ */
+bool stringToPatternRegister(std::string str, pattern_register_t *reg) {
+    for (int ii = 0; ii <= MAX_PATTERN_REGISTER_INDEX; ii++) {
+        if (str == PATTERN_REGISTER_STRINGS[ii]) {
+            *reg = static_cast<pattern_register_t>(ii);
+            return true;
         }
-        default:
-            // Do nothing.
-            break;
     }
+
+    return false;
 }
 
-/*
- * Handles the user clicking on the button in the rotary encoder.
+/**
+ * Compiles a single instruction of a custom pattern, e.g. "ADD H PHASE 32".
+ * 
+ * @param text The text of the instruction.
+ * @param op The instruction to be filled in.
+ * @return true if the text is a valid instruction, false otherwise.
  */
-void click() {
-    Serial.printf("click.\n");
-    switch (myState) {
-        case state_t::INITIALISING: // Fall through
-        case state_t::RUNNING:
-            if (myAlarmState == alarm_state_t::INACTIVE) {
-                // Show the alarm time.
-                myState = state_t::SHOW_ALARM;
-                myCountdownTimer = SHOW_ALARM_COUNTDOWN;
-            } else {
-                // Show the snooze time.
-                myState = state_t::SHOW_SNOOZE;
-                myCountdownTimer = SHOW_SNOOZE_COUNTDOWN;
-                if (myAlarmState == alarm_state_t::ACTIVE) {
-                    snooze_alarm();
-                }
-            }
-            break;
-        case state_t::SHOW_ALARM:
-            // Start setting the alarm values.
-            enter_menu();
-            break;
-        case state_t::MENU_ALARM_MINUTES:
-            // Move to the next alarm menu.
-            myState = state_t::MENU_ALARM_HOURS;
-            break;
-        case state_t::MENU_ALARM_HOURS:
-            // Move to the next alarm menu.
-            myState = state_t::MENU_ALARM_DAYS;
-            break;
-        case state_t::MENU_ALARM_DAYS:
-            // Menu is finished, back to running.
-            exit_menu();
-            break;
-        case state_t::SETUP_MENU_RADIO_WHOLE:
-            myState = state_t::SETUP_MENU_RADIO_FRACTION;
-            break;
-        case state_t::SETUP_MENU_RADIO_FRACTION:
-            myState = state_t::SETUP_MENU_12_24_HOURS;
-            break;
-        case state_t::SETUP_MENU_12_24_HOURS:
-            myState = state_t::SETUP_MENU_BRIGHTNESS;
-            break;
-        case state_t::SETUP_MENU_BRIGHTNESS:
-            myState = state_t::SETUP_MENU_DAY_COLOUR_INTRO;
-            myCountdownTimer = SHOW_INTRO_COUNTDOWN;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:
-            myState = state_t::SETUP_MENU_DAY_COLOUR_R;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_R:
-            myState = state_t::SETUP_MENU_DAY_COLOUR_G;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_G:
-            myState = state_t::SETUP_MENU_DAY_COLOUR_B;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_B:
-            myState = state_t::SETUP_MENU_NIGHT_COLOUR_INTRO;
-            myCountdownTimer = SHOW_INTRO_COUNTDOWN;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO:
-            myState = state_t::SETUP_MENU_NIGHT_COLOUR_R;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_R:
-            myState = state_t::SETUP_MENU_NIGHT_COLOUR_G;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_G:
-            myState = state_t::SETUP_MENU_NIGHT_COLOUR_B;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_B:
-            myState = state_t::SETUP_MENU_ALARM_PATTERN;
-            break;
-        case state_t::SETUP_MENU_ALARM_PATTERN:
-            // Menu is finished, back to running.
-            exit_menu();
-            break;
-        case state_t::CANCELLED:
-            myState = state_t::RUNNING;
-            break;
+bool compile_pattern_op(const char *text, pattern_op_t *op) {
+    char buffer[48];
+    char *tokens[4];
+    char *savePtr = NULL;
+    uint8_t count = 0;
+    strncpy(buffer, text, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    for (char *token = strtok_r(buffer, " \t", &savePtr); token != NULL; token = strtok_r(NULL, " \t", &savePtr)) {
+        if (count == 4) {
+            return false;
+        }
+        tokens[count++] = token;
+    }
+
+    pattern_op_code_t code;
+    pattern_register_t reg;
+    if (count < 3 || !stringToPatternOp(tokens[0], &code) || !stringToPatternRegister(tokens[1], &reg)) {
+        return false;
+    }
+    bool isUnary = (code == pattern_op_code_t::OP_SET || code == pattern_op_code_t::OP_TRI);
+    if (count != (isUnary ? 3 : 4)) {
+        return false;
+    }
+    op->code = code;
+    op->dest = reg;
+    op->a = 0;
+    if (!isUnary) {
+        if (!stringToPatternRegister(tokens[2], &reg)) {
+            return false;
+        }
+        op->a = reg;
+    }
+
+    // The last operand is either a register or a number.
+    const char *last = tokens[count - 1];
+    if (stringToPatternRegister(last, &reg)) {
+        op->x = reg;
+    } else {
+        char *end;
+        long value = strtol(last, &end, 10);
+        if (*end != '\0' || end == last || value < INT16_MIN || value > INT16_MAX) {
+            return false;
+        }
+        op->code |= PATTERN_IMMEDIATE;
+        op->x = (int16_t)value;
     }
+    return true;
 }
 
-/*
- * Handles the user double-clicking on the button on the rotary encoder.
+/**
+ * Uploads a custom pattern. The body contains the slot (1-4), the animation
+ * period (loops) and the program, as an array of instructions.
+ * 
+ * @param request The web request containing the pattern.
+ * @param json The JSON data describing the pattern.
  */
-void double_click() {
-    Serial.printf("double click.\n");
-    switch (myState) {
-        case state_t::RUNNING:    // Fall-through
-        case state_t::SHOW_ALARM:
-            // Start the menu for setting the alarm values.
-            enter_menu();
-            break;
-        case state_t::SHOW_SNOOZE:
-            // Stop the alarm and snooze.
-            stop_alarm();
-            break;
-        case state_t::MENU_ALARM_MINUTES:            // Fall-through
-        case state_t::MENU_ALARM_HOURS:              // Fall-through
-        case state_t::MENU_ALARM_DAYS:               // Fall-through
-        case state_t::SETUP_MENU_RADIO_WHOLE:        // Fall-through
-        case state_t::SETUP_MENU_RADIO_FRACTION:     // Fall-through
-        case state_t::SETUP_MENU_12_24_HOURS:        // Fall-through
-        case state_t::SETUP_MENU_BRIGHTNESS:         // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:   // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_R:       // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_G:       // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_B:       // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO: // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_R:     // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_G:     // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_B:     // Fall-through
-        case state_t::SETUP_MENU_ALARM_PATTERN:
-            // Exit the menu.
-            exit_menu();
-            break;
-        default:
-            // Do nothing.
-            break;
+void postPattern(AsyncWebServerRequest *request, JsonVariant &json) {
+    JsonObject obj = json.as<JsonObject>();
+    uint8_t slot = obj["slot"] | 0;
+    if (slot < 1 || slot > CUSTOM_PATTERN_COUNT) {
+        sendResponsePrintf(request, 400, "The slot must be 1-%u.", (unsigned int)CUSTOM_PATTERN_COUNT);
+        return;
+    }
+
+    custom_pattern_t pattern = {};
+    pattern.magic = PATTERN_MAGIC;
+    pattern.period = obj["period"] | 0;
+    if (pattern.period == 0 || pattern.period > MAX_PATTERN_PERIOD) {
+        sendResponsePrintf(request, 400, "The period must be 1-%u.", (unsigned int)MAX_PATTERN_PERIOD);
+        return;
+    }
+
+    JsonArray program = obj["program"];
+    if (program.isNull() || program.size() == 0 || program.size() > MAX_PATTERN_OPS) {
+        sendResponsePrintf(request, 400, "Between 1 and %u instructions are allowed.",
+            (unsigned int)MAX_PATTERN_OPS);
+        return;
     }
+    for (JsonVariant item : program) {
+        const char *text = item;
+        if (text == NULL || !compile_pattern_op(text, &pattern.ops[pattern.opCount])) {
+            sendResponsePrintf(request, 400, "Bad instruction at index %u.", (unsigned int)pattern.opCount);
+            return;
+        }
+        pattern.opCount++;
+    }
+
+    // Make sure the pattern can be drawn well within a loop.
+    pattern.renderTime = benchmark_pattern(&pattern);
+    if (pattern.renderTime > MAX_PATTERN_RENDER_TIME) {
+        sendResponsePrintf(request, 400, "The pattern takes %u us to render, the limit is %u us.",
+            (unsigned int)pattern.renderTime, (unsigned int)MAX_PATTERN_RENDER_TIME);
+        return;
+    }
+
+    // Store the pattern, then have the main loop load it.
+    if (!write_pattern(slot - 1, &pattern)) {
+        sendResponsePrintf(request, 500, "Unable to store the pattern.");
+        return;
+    }
+    command_t command = {};
+    command.type = command_type_t::LOAD_PATTERN;
+    command.slot = slot - 1;
+    command.receivedTime = esp_timer_get_time();
+    queue_command(&command);
+
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+    root["renderTimeUs"] = pattern.renderTime;
+    response->setLength();
+    request->send(response);
 }
 
-/*
- * Handles the user long-pressing on the button on the rotary encoder.
- * Long presses are used to cancel out of the menu.
+/**
+ * Retrieves a summary of the custom patterns.
+ * 
+ * @param request The web request retrieving the patterns.
  */
-void long_press() {
-    Serial.printf("long press.\n");
-    switch (myState) {
-        case state_t::MENU_ALARM_MINUTES:            // Fall-through
-        case state_t::MENU_ALARM_HOURS:              // Fall-through
-        case state_t::MENU_ALARM_DAYS:               // Fall-through
-        case state_t::SETUP_MENU_RADIO_WHOLE:        // Fall-through
-        case state_t::SETUP_MENU_RADIO_FRACTION:     // Fall-through
-        case state_t::SETUP_MENU_12_24_HOURS:        // Fall-through
-        case state_t::SETUP_MENU_BRIGHTNESS:         // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:   // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_R:       // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_G:       // Fall-through
-        case state_t::SETUP_MENU_DAY_COLOUR_B:       // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO: // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_R:     // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_G:     // Fall-through
-        case state_t::SETUP_MENU_NIGHT_COLOUR_B:     // Fall-through
-        case state_t::SETUP_MENU_ALARM_PATTERN:
-            // Exit the menu, discarding changes.
-            exit_menu(true);
-            myState = state_t::CANCELLED;
-            myCountdownTimer = SHOW_ALARM_COUNTDOWN;
-            break;
-        default:
-            // Do nothing.
-            break;
+void getPatterns(AsyncWebServerRequest *request) {
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+    JsonArray patterns = root.to<JsonArray>();
+    for (uint8_t ii = 0; ii < CUSTOM_PATTERN_COUNT; ii++) {
+        custom_pattern_t pattern;
+        JsonObject obj = patterns.add<JsonObject>();
+        obj["pattern"] = DISPLAY_PATTERN_STRINGS[display_pattern_t::CUSTOM_1 + ii];
+        obj["isLoaded"] = read_pattern(ii, &pattern);
+        obj["period"] = pattern.period;
+        obj["instructions"] = pattern.opCount;
+        obj["renderTimeUs"] = pattern.renderTime;
+    }
+
+    response->setLength();
+    request->send(response);
+}
+
+/**
+ * Dumps the display recording, oldest record first. The dump starts with a
+ * recording_dump_t, and is followed by the records.
+ * 
+ * @param request The web request retrieving the recording.
+ */
+void getRecording(AsyncWebServerRequest *request) {
+    uint8_t *dump = (uint8_t *)malloc(sizeof(recording_dump_t) + RECORDING_SIZE);
+    if (dump == NULL) {
+        sendResponsePrintf(request, 503, "Not enough memory.");
+        return;
     }
+
+    recording_dump_t *header = (recording_dump_t *)dump;
+    uint8_t *records = &dump[sizeof(recording_dump_t)];
+    portENTER_CRITICAL(&myRecordingMux);
+    uint32_t length = recording_copy(&myRecording, records);
+    portEXIT_CRITICAL(&myRecordingMux);
+    header->magic = RECORDING_MAGIC;
+    header->ledCount = LED_COUNT;
+    header->loopDelay = LOOP_DELAY;
+    header->length = length;
+
+    size_t total = sizeof(recording_dump_t) + length;
+    AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", total,
+        [dump, total](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+            size_t len = (total - index < maxLen) ? total - index : maxLen;
+            memcpy(buffer, &dump[index], len);
+            return len;
+        });
+    request->onDisconnect([dump]() {
+        free(dump);
+    });
+    request->send(response);
 }
 
-/*
- * Handles the expiry of the countdown timer.
+/**
+ * Reads part of the log file for a web client. The log file mutex is only
+ * held while reading, so that the log can be written between chunks.
+ * 
+ * @param offset The offset in the log file.
+ * @param buffer Set to what was read.
+ * @param length The length to read.
+ * @return true if it was read, false otherwise.
  */
-void countdown_expired() {
-    Serial.printf("countdown expired.\n");
-    switch (myState) {
-        case state_t::SHOW_IP_1:
-            myState = state_t::SHOW_IP_2;
-            myCountdownTimer = SHOW_IP_COUNTDOWN;
-            break;
-        case state_t::SHOW_IP_2:
-            myState = state_t::SHOW_IP_3;
-            myCountdownTimer = SHOW_IP_COUNTDOWN;
-            break;
-        case state_t::SHOW_IP_3:
-            myState = state_t::SHOW_IP_4;
-            myCountdownTimer = SHOW_IP_COUNTDOWN;
-            break;
-        case state_t::SHOW_IP_4:
-            if (myLastTimestamp > 0) {
-                myState = state_t::RUNNING;
-            } else {
-                myState = state_t::INITIALISING;
+bool read_log_file(size_t offset, uint8_t *buffer, size_t length) {
+    if (xSemaphoreTake(myLogFileMutex, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    bool isRead = false;
+    if (myIsLogFileReady) {
+        File file = LittleFS.open(LOG_FILE, FILE_READ);
+        isRead = file && file.seek(offset) && file.read(buffer, length) == length;
+        file.close();
+    }
+    xSemaphoreGive(myLogFileMutex);
+    return isRead;
+}
+
+/**
+ * Reads the next entries of the event log being sent to a web client. The
+ * first read fixes the entries to send, which are those in the log file
+ * then. The log file mutex is only held while reading, so that the log can
+ * be written between chunks.
+ * 
+ * @param state The state of the log being sent.
+ * @return true if any entries were read, false at the end of the log or if
+ *         the log file couldn't be read.
+ */
+bool read_log_entries(log_stream_t *state) {
+    if (xSemaphoreTake(myLogFileMutex, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    state->entryCount = 0;
+    state->entryPos = 0;
+    if (myIsLogFileReady) {
+        File file = LittleFS.open(LOG_FILE, FILE_READ);
+        log_file_header_t header;
+        if (file && file.read((uint8_t *)&header, sizeof(log_file_header_t)) == sizeof(log_file_header_t)) {
+            if (!state->isStarted) {
+                state->next = (header.next > LOG_FILE_ENTRIES) ? header.next - LOG_FILE_ENTRIES : 0;
+                state->end = header.next;
+                state->isStarted = true;
+            } else if (header.next - state->next > LOG_FILE_ENTRIES) {
+                // The entries still to send have been overwritten since.
+                state->next = header.next - LOG_FILE_ENTRIES;
+                if (state->next > state->end) {
+                    state->next = state->end;
+                }
             }
-            break;
-        case state_t::SHOW_ALARM: // Fall-through
-        case state_t::SHOW_SNOOZE: // Fall-through
-        case state_t::CANCELLED:
-            // It's time to show the clock again.
-            myState = state_t::RUNNING;
-            break;
-        case state_t::SETUP_MENU_DAY_COLOUR_INTRO:
-            myState = state_t::SETUP_MENU_DAY_COLOUR_R;
-            break;
-        case state_t::SETUP_MENU_NIGHT_COLOUR_INTRO:
-            myState = state_t::SETUP_MENU_NIGHT_COLOUR_R;
-            break;
+            while (state->entryCount < LOG_STREAM_ENTRIES && state->next < state->end) {
+                file.seek(sizeof(log_file_header_t) + ((state->next % LOG_FILE_ENTRIES) * sizeof(log_entry_t)));
+                if (file.read((uint8_t *)&state->entries[state->entryCount], sizeof(log_entry_t)) != 
+                        sizeof(log_entry_t)) {
+                    break;
+                }
+                state->entryCount++;
+                state->next++;
+            }
+        }
+        file.close();
+    }
+    xSemaphoreGive(myLogFileMutex);
+    return state->entryCount > 0;
+}
+
+/**
+ * Sends the event log, oldest entry first. The log is sent as text, unless the
+ * "binary" parameter is given, in which case the raw log file is sent. Writing
+ * the log file would hold up the web server, so loop() writes the entries held
+ * in RAM and the response waits for it.
+ * 
+ * @param request The web request retrieving the log.
+ */
+void getLog(AsyncWebServerRequest *request) {
+    if (!myIsLogFileReady) {
+        sendResponsePrintf(request, 503, "The log is unavailable.");
+        return;
+    }
+    std::shared_ptr<log_stream_t> state = std::make_shared<log_stream_t>();
+    state->flushCount = myLogFlushCount;
+    state->isStarted = false;
+    state->entryCount = 0;
+    state->entryPos = 0;
+    state->lineLen = 0;
+    state->linePos = 0;
+    myIsLogFlushRequested = true;
+
+    AsyncWebServerResponse *response;
+    if (request->hasParam("binary")) {
+        size_t total = sizeof(log_file_header_t) + (LOG_FILE_ENTRIES * sizeof(log_entry_t));
+        response = request->beginResponse("application/octet-stream", total,
+            [state, total](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                if (myLogFlushCount == state->flushCount) {
+                    return RESPONSE_TRY_AGAIN;
+                }
+                size_t len = (total - index < maxLen) ? total - index : maxLen;
+                return read_log_file(index, buffer, len) ? len : 0;
+            });
+        response->addHeader("Content-Disposition", "attachment; filename=\"log.bin\"");
+        request->send(response);
+        return;
     }
+
+    response = request->beginChunkedResponse("text/plain",
+        [state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+            if (myLogFlushCount == state->flushCount) {
+                return RESPONSE_TRY_AGAIN;
+            }
+            size_t len = 0;
+            while (len < maxLen) {
+                if (state->linePos == state->lineLen) {
+                    // Format the next entry, reading more if needed.
+                    if (state->entryPos == state->entryCount && !read_log_entries(state.get())) {
+                        break;
+                    }
+                    state->lineLen = format_log_entry(&state->entries[state->entryPos++], 
+                        state->line, sizeof(state->line));
+                    state->linePos = 0;
+                }
+                size_t count = state->lineLen - state->linePos;
+                if (count > maxLen - len) {
+                    count = maxLen - len;
+                }
+                memcpy(&buffer[len], &state->line[state->linePos], count);
+                state->linePos += count;
+                len += count;
+            }
+            return len;
+        });
+    request->send(response);
 }
 
 /**
- * Converts an alarm_t value into a representative string.
+ * Retrieves the statistics of the latency between inputs and the display.
  * 
- * @param alarm The alarm to convert.
- * @return String representation of the alarm.
+ * @param request The web request retrieving the statistics.
  */
-const std::string alarmtToString(alarm_t alarm) {
-    return ALARM_STRINGS[static_cast<int>(alarm)];
+void getInputStats(AsyncWebServerRequest *request) {
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+
+    root["events"] = myInputStats.events.load();
+    root["droppedEdges"] = myButtonDropped.load();
+    root["lastLatencyUs"] = myInputStats.lastLatency.load();
+    root["averageLatencyUs"] = myInputStats.averageLatency.load();
+    root["maxLatencyUs"] = myInputStats.maxLatency.load();
+
+    response->setLength();
+    request->send(response);
 }
 
 /**
- * Converts a display_pattern_t value into a representative string.
+ * Retrieves the estimated current drawn by the LEDs.
  * 
- * @param pattern The pattern to convert.
- * @return String representation of the pattern.
+ * @param request The web request retrieving the power statistics.
  */
-const std::string displayPatternToString(display_pattern_t pattern) {
-    return DISPLAY_PATTERN_STRINGS[static_cast<int>(pattern)];
+void getPowerStats(AsyncWebServerRequest *request) {
+    flash_config_t config;
+    read_config(&config);
+
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+
+    root["budgetMa"] = config.powerBudget;
+    root["frames"] = myPowerStats.frames.load();
+    root["limitedFrames"] = myPowerStats.limitedFrames.load();
+    root["lastMa"] = myPowerStats.lastCurrent.load();
+    root["averageMa"] = myPowerStats.averageCurrent.load();
+    root["peakMa"] = myPowerStats.peakCurrent.load();
+    root["peakDemandMa"] = myPowerStats.peakDemand.load();
+
+    response->setLength();
+    request->send(response);
 }
 
 /**
- * Converts a string to an alarm_t.
+ * Retrieves the last sample of the heap and task stacks. This is served even
+ * while memory is low, so it avoids allocating a JSON document.
  * 
- * @param str The string to be converted.
- * @return The alarm_t that is represented by the string.
+ * @param request The web request retrieving the memory statistics.
  */
-alarm_t stringToAlarmt(std::string str) {
-    for (int ii = 0; ii < MAX_ALARM_T_INDEX; ii++) {
-        if (str == ALARM_STRINGS[ii]) {
-            return static_cast<alarm_t>(ii);
+void getMemory(AsyncWebServerRequest *request) {
+    memory_stats_t stats;
+    portENTER_CRITICAL(&myMemoryMux);
+    stats = myMemoryStats;
+    portEXIT_CRITICAL(&myMemoryMux);
+
+    char buffer[320];
+    int len = snprintf(buffer, sizeof(buffer), 
+        "{\"freeHeap\":%lu,\"minFreeHeap\":%lu,\"largestBlock\":%lu,\"heapSize\":%lu,"
+        "\"isDegraded\":%s,\"degradedCount\":%lu,\"resetReason\":%d,\"recoveredAlarms\":%lu,"
+        "\"stackUnused\":{",
+        (unsigned long)stats.freeHeap, (unsigned long)stats.minFreeHeap, 
+        (unsigned long)stats.largestBlock, (unsigned long)stats.heapSize,
+        myIsMemoryLow ? "true" : "false", (unsigned long)stats.degradedCount,
+        (int)esp_reset_reason(), (unsigned long)myRecoveredAlarms);
+    for (uint8_t ii = 0; ii < MONITORED_TASK_COUNT; ii++) {
+        len += snprintf(&buffer[len], sizeof(buffer) - len, "%s\"%s\":%ld", 
+            (ii == 0) ? "" : ",", MONITORED_TASK_STRINGS[ii], (long)stats.stackUnused[ii]);
+    }
+    snprintf(&buffer[len], sizeof(buffer) - len, "}}");
+    request->send(200, "application/json", buffer);
+}
+
+/**
+ * Retrieves the radio status, including the stations found by the last scan.
+ * 
+ * @param request The web request retrieving the radio status.
+ */
+void getRadio(AsyncWebServerRequest *request) {
+    radio_station_t stations[MAX_RADIO_STATIONS];
+    portENTER_CRITICAL(&myRadioMux);
+    uint8_t count = myRadioStationCount;
+    memcpy(stations, myRadioStations, count * sizeof(radio_station_t));
+    portEXIT_CRITICAL(&myRadioMux);
+
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+    root["isScanning"] = myRadioScansPending.load() > 0;
+    JsonArray stationArray = root["stations"].to<JsonArray>();
+    for (uint8_t ii = 0; ii < count; ii++) {
+        JsonObject station = stationArray.add<JsonObject>();
+        station["frequency"] = stations[ii].frequency;
+        station["level"] = stations[ii].level;
+    }
+    JsonObject i2c = root["i2c"].to<JsonObject>();
+    i2c["transactions"] = myI2cStats.transactions.load();
+    i2c["averageLatencyUs"] = myI2cStats.averageLatency.load();
+    i2c["maxLatencyUs"] = myI2cStats.maxLatency.load();
+
+    response->setLength();
+    request->send(response);
+}
+
+/**
+ * Retrieves the dates on which the alarm is skipped.
+ * 
+ * @param request The web request retrieving the dates.
+ */
+void getSkipDates(AsyncWebServerRequest *request) {
+    if (!myIsFilesystemMounted) {
+        sendResponsePrintf(request, 503, "The skipped dates are unavailable during an update.");
+        return;
+    }
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+    JsonArray dates = root["dates"].to<JsonArray>();
+    if (LittleFS.exists(SKIP_DATES_FILE)) {
+        File file = LittleFS.open(SKIP_DATES_FILE, FILE_READ);
+        uint32_t date;
+        char text[11];
+        while (file && file.read((uint8_t *)&date, sizeof(uint32_t)) == sizeof(uint32_t)) {
+            dateToString(date, text, sizeof(text));
+            dates.add(text);
         }
+        file.close();
     }
 
-    return alarm_t::ALARM_DISABLED;
+    response->setLength();
+    request->send(response);
 }
 
 /**
- * Converts a string to an display_pattern_t.
+ * Replaces the dates on which the alarm is skipped, e.g. public holidays. The
+ * body holds the dates as "YYYY-MM-DD" strings, in any order. They are stored
+ * sorted, so that each date can be found with a binary search.
  * 
- * @param str The string to be converted.
- * @return The display_pattern_t that is represented by the string.
+ * @param request The web request containing the dates.
+ * @param json The JSON data containing the dates.
  */
-display_pattern_t stringToPattern(std::string str) {
-    for (int ii = 0; ii < MAX_DISPLAY_PATTERN_INDEX; ii++) {
-        if (str == DISPLAY_PATTERN_STRINGS[ii]) {
-            return static_cast<display_pattern_t>(ii);
+void postSkipDates(AsyncWebServerRequest *request, JsonVariant &json) {
+    if (!myIsFilesystemMounted) {
+        sendResponsePrintf(request, 503, "The skipped dates are unavailable during an update.");
+        return;
+    }
+    JsonArray dates = json["dates"];
+    if (dates.isNull() || dates.size() > MAX_SKIP_DATES) {
+        sendResponsePrintf(request, 400, "Up to %u dates are allowed.", (unsigned int)MAX_SKIP_DATES);
+        return;
+    }
+
+    std::vector<uint32_t> values;
+    values.reserve(dates.size());
+    for (JsonVariant item : dates) {
+        uint32_t date;
+        if (!stringToDate(item.as<const char *>(), &date) || date == 0) {
+            sendResponsePrintf(request, 400, "Bad date at index %u.", (unsigned int)values.size());
+            return;
         }
+        values.push_back(date);
+    }
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    // Replace the list in one step, so it is never seen part written.
+    File file = LittleFS.open(SKIP_DATES_TEMP_FILE, FILE_WRITE);
+    if (!file) {
+        sendResponsePrintf(request, 500, "Unable to store the dates.");
+        return;
+    }
+    size_t size = values.size() * sizeof(uint32_t);
+    size_t res = (size == 0) ? 0 : file.write((const uint8_t *)values.data(), size);
+    file.close();
+    if (res != size || !LittleFS.rename(SKIP_DATES_TEMP_FILE, SKIP_DATES_FILE)) {
+        LittleFS.remove(SKIP_DATES_TEMP_FILE);
+        sendResponsePrintf(request, 500, "Unable to store the dates.");
+        return;
     }
 
-    return display_pattern_t::SOLID_COLOUR;
+    // Have the main loop check the new dates.
+    command_t command = {};
+    command.type = command_type_t::RELOAD_SKIP_DATES;
+    command.receivedTime = esp_timer_get_time();
+    if (!queue_command(&command)) {
+        // The queue is full, so have the skipped dates read again when next
+        // checked instead.
+        myFilesystemGeneration++;
+    }
+    request->send(200);
 }
 
 /**
- * Converts a JSON array to a colour_t.
+ * Retrieves when the alarm next sounds, according to the alarm rules.
  * 
- * @param arr The JSON array containing red, green and blue values.
- * @return The colour_t representation of the colour data.
+ * @param request The web request retrieving the next alarm.
  */
-colour_t arrayToColour(JsonArray arr) {
-    colour_t colour;
-    if (arr.size() != 3) {
-        colour.r = 255;
-        colour.g = 255;
-        colour.b = 255;
+void getNextAlarm(AsyncWebServerRequest *request) {
+    if (!myIsFilesystemMounted) {
+        // The skipped dates can't be checked.
+        sendResponsePrintf(request, 503, "The next alarm is unavailable during an update.");
+        return;
+    }
+    flash_config_t config;
+    read_config(&config);
+    time_t now;
+    time(&now);
+    time_t next = (now >= MIN_VALID_TIMESTAMP) ? next_alarm(&config, now) : 0;
+
+    AsyncJsonResponse *response = new AsyncJsonResponse();
+    JsonVariant root = response->getRoot();
+    if (next == 0) {
+        root["time"] = nullptr;
     } else {
-        colour.r = arr[0];
-        colour.g = arr[1];
-        colour.b = arr[2];
+        struct tm tm_val;
+        localtime_r(&next, &tm_val);
+        char text[20];
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M", &tm_val);
+        root["time"] = (uint32_t)next;
+        root["local"] = text;
     }
 
-    return colour;
+    response->setLength();
+    request->send(response);
 }
 
 /**
- * Sends a response to a request with a printf-style message.
+ * Retrieves the names of the time zones in the time zone database. The names
+ * are streamed, as the list is too long for a JSON document.
  * 
- * @param request The request to which the reply is sent.
- * @param code The HTTP response code.
- * @param format The format of the message (printf-style.)
- * @param ... Variable arguments for filling in the format.
+ * @param request The web request retrieving the time zones.
  */
-void sendResponsePrintf(AsyncWebServerRequest *request, const int code, const char *format, ...) {
-    // Prepare the buffer with the contents of the message.
-    char buffer[256];
-    va_list args;
-    va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+void getTimezones(AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->print("[");
+    for (size_t ii = 0; ii < ZONE_RULE_COUNT; ii++) {
+        response->printf("%s\"%s\"", (ii == 0) ? "" : ",", ZONE_RULES[ii].name);
+    }
+    response->print("]");
+    request->send(response);
+}
 
-    // Send the response.
-    if (request != NULL) {
-        request->send(code, "text/plain", buffer);
+/**
+ * Updates the time, snooze and alarms when the second has changed. This is
+ * also called while ArduinoOTA is receiving an update, as that blocks the
+ * loop, so that alarms still go off.
+ */
+void update_time() {
+    if ((myState != state_t::INITIALISING) && (myLastTimestamp != 0)) {
+        time_t now;
+        time(&now);
+        if (now != myLastTimestamp) {
+            // The second has changd.
+            if (myIsAlarmResumePending && !myIsTimeStale && now >= MIN_VALID_TIMESTAMP) {
+                // NTP has confirmed the time, so the alarm saved in flash can
+                // be resumed, unless another has been started since.
+                myIsAlarmResumePending = false;
+                if (myAlarmState == alarm_state_t::INACTIVE) {
+                    resume_saved_alarm(&myPendingAlarm);
+                }
+            }
+            if (myAlarmState == alarm_state_t::SNOOZE) {
+                if (mySnoozeRemaining == 1) {
+                    // The snooze timer has expired.
+                    start_alarm();
+                } else {
+                    mySnoozeRemaining--;
+                    persist_alarm(false);
+                }
+            }
+            if ((now / SECONDS_PER_MINUTE) != (myLastTimestamp / SECONDS_PER_MINUTE)) {
+                // The minute has changed.
+                tm *tm_val = localtime(&now);
+                myHour = tm_val->tm_hour;
+                myMinute = tm_val->tm_min;
+                myMinuteOfDay = (((uint16_t)myHour) * MINUTES_PER_HOUR) + myMinute;
+                
+                // Check for the alarm, and the wake-up light leading up to it.
+                // A stale time could set them off hours early or late.
+                if (myIsTimeStale) {
+                    // Wait for NTP.
+                } else if (is_alarm_due(now)) {
+                    start_alarm();
+                } else if (myAlarmState == alarm_state_t::INACTIVE &&
+                           myConfiguration.wakeDuration > 0 &&
+                           is_alarm_due(now + (myConfiguration.wakeDuration * SECONDS_PER_MINUTE))) {
+                    start_wake();
+                }
+
+                if ((now / SECONDS_PER_HOUR) != (myLastTimestamp / SECONDS_PER_HOUR)) {
+                    // The hour has changed, recalculate sunrise/sunset.
+                    syncSunClock(tm_val);
+
+                    // Keep the last known time in flash, in case of a power cut.
+                    persist_time(now, !myIsTimeProvisional);
+                }
+
+                // Determine if we're currently in daytime or nighttime.
+                checkDaytime(tm_val);
+            }
+
+            // Update the last processed timestamp.
+            myLastTimestamp = now;
+            persist_time(now);
+        }
     }
-    // Clean up the variable length arguments.
-    va_end(args);
 }
 
 /**
- * Retrieves a JSON representation of the current configuration.
+ * Prepares for an OTA update, from either ArduinoOTA or the web server. The
+ * file system is unmounted for file system updates, but everything else keeps
+ * running (including alarms) until the update has been written.
  * 
- * @param request The web request retrieving the configuration.
+ * @param isFilesystem Flag set when the update is of the file system.
+ * @param source Where the update is coming from.
+ * @return true if the update can start, false if one is already running.
  */
-void getConfig(AsyncWebServerRequest *request) {
-    #ifndef HIDE_DEBUG
-    Serial.println("Retriving configuration for web client");
-    #endif
-    AsyncJsonResponse *response = new AsyncJsonResponse();
-    JsonVariant root = response->getRoot();
+bool ota_started(bool isFilesystem, ota_source_t source) {
+    uint8_t expected = ota_state_t::OTA_IDLE;
+    if (!myOtaState.compare_exchange_strong(expected, ota_state_t::OTA_RECEIVING)) {
+        return false;
+    }
+    myOtaProgress = 0;
+    myIsOtaFilesystem = isFilesystem;
+    LOG_INFO(EVENT_OTA_STARTED, isFilesystem ? U_SPIFFS : U_FLASH, source);
+    flush_log();
+
+    if (isFilesystem) {
+        // Stop the log writing to the file system that's being replaced.
+        xSemaphoreTake(myLogFileMutex, portMAX_DELAY);
+        myIsLogFileReady = false;
+        set_filesystem_mounted(false);
+        LittleFS.end();
+        xSemaphoreGive(myLogFileMutex);
+    }
+    return true;
+}
 
-    root["deviceName"] = myConfiguration.deviceName;
-    root["alarmTime"] = myConfiguration.alarmTime;
-    root["alarmActivation"] = alarmtToString(myConfiguration.alarmActivation);
-    root["radioFrequency"] = myConfiguration.radioFrequency;
-    root["brightness"] = myConfiguration.brightness;
-    JsonArray dayColour = root["dayColour"].to<JsonArray>();
-    dayColour.add(myConfiguration.dayColour.r);
-    dayColour.add(myConfiguration.dayColour.g);
-    dayColour.add(myConfiguration.dayColour.b);
-    JsonArray nightColour = root["nightColour"].to<JsonArray>();
-    nightColour.add(myConfiguration.nightColour.r);
-    nightColour.add(myConfiguration.nightColour.g);
-    nightColour.add(myConfiguration.nightColour.b);
-    JsonArray alarmColour = root["alarmColour"].to<JsonArray>();
-    alarmColour.add(myConfiguration.alarmColour.r);
-    alarmColour.add(myConfiguration.alarmColour.g);
-    alarmColour.add(myConfiguration.alarmColour.b);
-    root["dayPattern"] = displayPatternToString(myConfiguration.dayPattern);
-    root["nightPattern"] = displayPatternToString(myConfiguration.nightPattern);
-    root["alarmPattern"] = displayPatternToString(myConfiguration.alarmPattern);
-    root["latitude"] = myConfiguration.latitude;
-    root["longitude"] = myConfiguration.longitude;
-    root["timezone"] = myConfiguration.timezone;
-    root["offset"] = myConfiguration.offset;
-    root["isAlarmDisabled"] = myConfiguration.isAlarmDisabled;
-    root["isRadioInstalled"] = myConfiguration.isRadioInstalled;
-    root["is24Hour"] = myConfiguration.is24Hour;
-    root["isUseRadio"] = myConfiguration.isUseRadio;
-    root["version"] = myConfiguration.version;
+/**
+ * Records the progress of an OTA update, for display.
+ * 
+ * @param done The number of bytes received.
+ * @param total The expected number of bytes.
+ */
+void ota_progress(size_t done, size_t total) {
+    if (total > 0) {
+        uint32_t percent = (uint32_t)(((uint64_t)done * 100) / total);
+        myOtaProgress = (percent > 100) ? 100 : percent;
+    }
+}
 
-    // Send the response back to the user.
-    response->setLength();
-    request->send(response);
+/**
+ * Completes an OTA update that has been written and verified. The restart
+ * happens in the main loop, once there is no alarm sounding. Firmware updates
+ * must then be confirmed as working before they are kept.
+ * 
+ * @param size The size of the update (bytes).
+ */
+void ota_finished(size_t size) {
+    if (!myIsOtaFilesystem) {
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putUChar(KEY_OTA_BOOTS, 1);
+        #endif
+    }
+    myOtaProgress = 100;
+    LOG_INFO(EVENT_OTA_COMPLETE, size, 0);
+    myOtaState = ota_state_t::OTA_RESTART_PENDING;
 }
 
 /**
- * Writes a new configuration.
+ * Abandons an OTA update, remounting the file system if it was unmounted.
  * 
- * @param request The web request retrieving the configuration.
- * @param json The JSON data containing the new information.
+ * @param error The reason for the failure.
+ * @param source Where the update was coming from.
  */
-void writeConfig(AsyncWebServerRequest *request, JsonVariant &json) {
-    #ifndef HIDE_DEBUG
-    Serial.println("Received request to store the configuration.");
-    #endif
-    JsonObject jsonObj = json.as<JsonObject>();
-    if (!jsonObj["deviceName"].is<JsonVariant>()) {
-        // Missing or bad top-level information.
-        sendResponsePrintf(request, 400, "Invalid top-level data");
-        return;
+void ota_failed(int32_t error, ota_source_t source) {
+    if (myIsOtaFilesystem && LittleFS.begin()) {
+        // The file system may have been partly overwritten, so check the log.
+        set_filesystem_mounted(true);
+        init_log_file();
     }
+    LOG_ERROR(EVENT_OTA_FAILED, error, source);
+    myOtaState = ota_state_t::OTA_IDLE;
+}
 
-    // Copy the configuration.
-    flash_config_t configuration;
-    configuration.magic = MAGIC;
-    const char *name = jsonObj["deviceName"];
-    if ((name == NULL) || (strlen(name) == 0)) {
-        // Missing or bad top-level information.
-        sendResponsePrintf(request, 400, "Bad configuration.");
+/**
+ * Restarts into an OTA update once it has been written, waiting until the
+ * alarm isn't waking, sounding or snoozing, so that it isn't missed.
+ */
+void restart_for_ota() {
+    if (myOtaState != ota_state_t::OTA_RESTART_PENDING || myAlarmState != alarm_state_t::INACTIVE) {
         return;
-    } else {
-        strncpy(configuration.deviceName, name, DEVICE_NAME_MAX_LEN);
-        configuration.deviceName[DEVICE_NAME_MAX_LEN] = '\0';
     }
+    time_t now;
+    time(&now);
+    persist_time(now, true);
+    flush_log();
+    delay(100);
+    ESP.restart();
+}
 
-    configuration.alarmTime = jsonObj["alarmTime"];
-    configuration.alarmActivation = stringToAlarmt(jsonObj["alarmActivation"]);
-    configuration.radioFrequency = jsonObj["radioFrequency"];
-    configuration.brightness = jsonObj["brightness"];
-    configuration.dayColour = arrayToColour(jsonObj["dayColour"]);
-    configuration.nightColour = arrayToColour(jsonObj["nightColour"]);
-    configuration.alarmColour = arrayToColour(jsonObj["alarmColour"]);
-    configuration.dayPattern = stringToPattern(jsonObj["dayPattern"]);
-    configuration.nightPattern = stringToPattern(jsonObj["nightPattern"]);
-    configuration.alarmPattern = stringToPattern(jsonObj["alarmPattern"]);
-    configuration.latitude = jsonObj["latitude"];
-    configuration.longitude = jsonObj["longitude"];
-    strncpy(configuration.timezone, jsonObj["timezone"], TIMEZONE_MAX_LEN);
-    configuration.timezone[TIMEZONE_MAX_LEN] = '\0';
-    configuration.offset = jsonObj["offset"];
-    configuration.isAlarmDisabled = myConfiguration.isAlarmDisabled;
-    configuration.isRadioInstalled = myConfiguration.isRadioInstalled;
-    configuration.is24Hour = jsonObj["is24Hour"];
-    configuration.isUseRadio = jsonObj["isUseRadio"];
-    strncpy(configuration.version, VERSION, VERSION_LEN);
-    configuration.version[VERSION_LEN] = '\0';
+/**
+ * Stops the Arduino core from confirming the firmware as soon as it starts,
+ * where the bootloader supports rollback, so that confirm_ota_boot() does so.
+ * 
+ * @return true to confirm the firmware later.
+ */
+extern "C" bool verifyRollbackLater() {
+    return true;
+}
 
-    bool updateLocation = false;
-    if ((strncmp(configuration.timezone, myConfiguration.timezone, TIMEZONE_MAX_LEN) != 0 ||
-         configuration.latitude != myConfiguration.latitude ||
-         configuration.longitude != myConfiguration.longitude) &&
-        myState != state_t::INITIALISING) {
-        updateLocation = true;
+/**
+ * Counts the boots of a firmware update until it is confirmed as working,
+ * rolling back to the previous firmware if it fails to be confirmed within
+ * OTA_MAX_BOOTS boots. This must be called before anything that could crash.
+ * 
+ * @return true if the previous firmware has been rolled back to.
+ */
+bool check_ota_boot() {
+    uint8_t boots = prefs.getUChar(KEY_OTA_BOOTS, 0);
+    if (boots == OTA_ROLLED_BACK) {
+        // This is the previous firmware, running again after a rollback.
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putUChar(KEY_OTA_BOOTS, 0);
+        #endif
+        return true;
+    } else if (boots > OTA_MAX_BOOTS) {
+        const esp_partition_t *previous = esp_ota_get_next_update_partition(NULL);
+        if (previous != NULL && esp_ota_set_boot_partition(previous) == ESP_OK) {
+            #ifndef DISABLE_CONFIG_WRITES
+            prefs.putUChar(KEY_OTA_BOOTS, OTA_ROLLED_BACK);
+            #endif
+            ESP.restart();
+        }
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putUChar(KEY_OTA_BOOTS, 0);
+        #endif
+    } else if (boots > 0) {
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putUChar(KEY_OTA_BOOTS, boots + 1);
+        #endif
+        myIsOtaUnconfirmed = true;
     }
+    return false;
+}
 
-    // Copy the structure to the configuration structure and write it to flash.
-    copy_config(&myConfiguration, &configuration);
-    if (myIsInMenu) {
-        copy_config(&myNewConfiguration, &configuration);
+/**
+ * Confirms that a firmware update is working, once it has run for
+ * OTA_CONFIRM_TIME with the loop keeping up. This doesn't wait for WiFi, so
+ * that a working update isn't rolled back because the network is down.
+ */
+void confirm_ota_boot() {
+    unsigned long now = millis();
+    if (!myIsOtaUnconfirmed || now < OTA_CONFIRM_TIME || 
+            (uint64_t)myLoopCount * LOOP_DELAY * OTA_CONFIRM_LOOP_FACTOR < now) {
+        return;
     }
-    write_config(&myConfiguration);
+    uint8_t boots = prefs.getUChar(KEY_OTA_BOOTS, 0);
+    #ifndef DISABLE_CONFIG_WRITES
+    prefs.putUChar(KEY_OTA_BOOTS, 0);
+    #endif
+    esp_ota_mark_app_valid_cancel_rollback();
+    myIsOtaUnconfirmed = false;
+    LOG_INFO(EVENT_OTA_CONFIRMED, boots - 1, 0);
+}
 
-    if (updateLocation) {
-        sun.setPosition(myConfiguration.latitude, myConfiguration.longitude, myConfiguration.offset);
-        setenv("TZ", myConfiguration.timezone, 1);
-        tzset();
-        time_t now;
-        time(&now);
-        tm *tm_val = localtime(&now);
-        syncSunClock(tm_val);
+/**
+ * Completes an update uploaded through the web server, once the upload
+ * handler has received all of it.
+ * 
+ * @param request The web request containing the update.
+ */
+void postUpdate(AsyncWebServerRequest *request) {
+    if (request != myOtaRequest) {
+        sendResponsePrintf(request, 409, "An update is already in progress.");
+        return;
     }
-
-    request->send(200);
+    myOtaRequest = NULL;
+    if (myOtaError != NULL) {
+        sendResponsePrintf(request, 400, "Update failed: %s", myOtaError);
+        return;
+    }
+    sendResponsePrintf(request, 200, "Update complete, restarting once any alarm has finished.");
 }
 
 /**
- * Set up WiFi, using WiFiManager to give the user a place to enter the
- * network credentials if necessary.
+ * Receives an update uploaded through the web server, verifying its SHA-256
+ * digest as it is written. The expected digest is given in hexadecimal in
+ * the "sha256" parameter, and the HMAC-SHA256 of the digest (as bytes) using
+ * the fleet key in the "signature" parameter. "type=filesystem" uploads a
+ * file system image, e.g.:
+ *   curl -F "image=@firmware.bin" "http://clock.local/update?sha256=<digest>&signature=<hmac>"
+ * 
+ * @param request The web request containing the update.
+ * @param filename The name of the uploaded file.
+ * @param index The offset of this part of the update.
+ * @param data The part of the update.
+ * @param len The length of the part.
+ * @param final Flag set when this is the last part.
  */
-void setupWifi() {
-    WiFi.mode(WIFI_STA);
-    WiFiManager wm;
-    wm.setConfigPortalTimeout(CONFIG_TIMEOUT);
-    boolean res = wm.autoConnect("ESPClock");
-    if (!res) {
-        // Startup failed, reboot.
-        ESP.restart();
-        delay(5000);
+void uploadUpdate(AsyncWebServerRequest *request, const String &filename, size_t index, 
+        uint8_t *data, size_t len, bool final) {
+    if (index == 0) {
+        if (myOtaRequest != NULL || myOtaState != ota_state_t::OTA_IDLE) {
+            // Only one update can be written at a time.
+            return;
+        }
+        myOtaRequest = request;
+        myOtaError = NULL;
+        myOtaReceived = 0;
+        request->onDisconnect([request]() {
+            if (myOtaRequest == request) {
+                // The upload was abandoned part way through.
+                myOtaRequest = NULL;
+                if (myOtaError == NULL) {
+                    mbedtls_md_free(&myOtaHash);
+                    Update.abort();
+                    ota_failed(OTA_ABANDONED_ERROR, ota_source_t::OTA_SOURCE_HTTP);
+                }
+            }
+        });
+        const AsyncWebParameter *digest = request->getParam("sha256");
+        if (digest == NULL || !hex_to_bytes(digest->value().c_str(), myOtaDigest, OTA_DIGEST_LEN)) {
+            myOtaError = "the sha256 parameter must be the image's SHA-256 digest.";
+            return;
+        }
+        const AsyncWebParameter *signature = request->getParam("signature");
+        uint8_t signatureBytes[FLEET_SIGNATURE_LEN];
+        if (signature == NULL || !hex_to_bytes(signature->value().c_str(), signatureBytes, FLEET_SIGNATURE_LEN) ||
+                !is_fleet_signature_valid(myOtaDigest, OTA_DIGEST_LEN, signatureBytes)) {
+            myOtaError = "the signature parameter must be the digest signed with the fleet key.";
+            return;
+        }
+        const AsyncWebParameter *type = request->getParam("type");
+        bool isFilesystem = type != NULL && type->value() == "filesystem";
+        if (!ota_started(isFilesystem, ota_source_t::OTA_SOURCE_HTTP)) {
+            myOtaError = "an update is already in progress.";
+            return;
+        }
+        if (!Update.begin(UPDATE_SIZE_UNKNOWN, isFilesystem ? U_SPIFFS : U_FLASH)) {
+            myOtaError = Update.errorString();
+            ota_failed(Update.getError(), ota_source_t::OTA_SOURCE_HTTP);
+            return;
+        }
+        mbedtls_md_init(&myOtaHash);
+        mbedtls_md_setup(&myOtaHash, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+        mbedtls_md_starts(&myOtaHash);
+    }
+    if (request != myOtaRequest || myOtaError != NULL) {
+        return;
+    }
+
+    // Hash and write this part.
+    mbedtls_md_update(&myOtaHash, data, len);
+    if (Update.write(data, len) != len) {
+        myOtaError = Update.errorString();
+        mbedtls_md_free(&myOtaHash);
+        Update.abort();
+        ota_failed(Update.getError(), ota_source_t::OTA_SOURCE_HTTP);
+        return;
+    }
+    myOtaReceived += len;
+    ota_progress(myOtaReceived, request->contentLength());
+
+    if (final) {
+        // Only keep the update if it is exactly what was expected.
+        uint8_t digest[OTA_DIGEST_LEN];
+        mbedtls_md_finish(&myOtaHash, digest);
+        mbedtls_md_free(&myOtaHash);
+        if (memcmp(digest, myOtaDigest, OTA_DIGEST_LEN) != 0) {
+            myOtaError = "the SHA-256 digest doesn't match.";
+            Update.abort();
+            ota_failed(OTA_VERIFY_ERROR, ota_source_t::OTA_SOURCE_HTTP);
+        } else if (!Update.end(true)) {
+            myOtaError = Update.errorString();
+            ota_failed(Update.getError(), ota_source_t::OTA_SOURCE_HTTP);
+        } else {
+            ota_finished(myOtaReceived);
+        }
     }
-    myIPAddress = WiFi.localIP();
 }
 
 /**
@@ -1357,20 +5753,82 @@ bool setupWebServer() {
     // Set up the web server.
     webServer = new AsyncWebServer(80);
 
+    // Set up the memory statistics, which are always available. Every other
+    // handler is filtered out while memory is low.
+    webServer->on("/memory", HTTP_GET, getMemory);
+
     // Set up the configuration retrieval.
-    webServer->on("/config", HTTP_GET, getConfig);
+    webServer->on("/config", HTTP_GET, getConfig).setFilter(is_memory_available);
 
     // Set up the device write handler.
     AsyncCallbackJsonWebHandler* handler = 
         new AsyncCallbackJsonWebHandler("/writeConfig", writeConfig);
+    handler->setFilter(is_memory_available);
     webServer->addHandler(handler);
 
+    // Set up the configuration bundle handler, for pushes to the fleet.
+    AsyncCallbackJsonWebHandler* bundleHandler = 
+        new AsyncCallbackJsonWebHandler("/configBundle", postConfigBundle);
+    bundleHandler->setFilter(is_memory_available);
+    webServer->addHandler(bundleHandler);
+
+    // Set up the action handlers.
+    AsyncCallbackJsonWebHandler* actionHandler = 
+        new AsyncCallbackJsonWebHandler("/action", postAction);
+    actionHandler->setFilter(is_memory_available);
+    webServer->addHandler(actionHandler);
+    AsyncCallbackJsonWebHandler* messageHandler = 
+        new AsyncCallbackJsonWebHandler("/message", postMessage);
+    messageHandler->setFilter(is_memory_available);
+    webServer->addHandler(messageHandler);
+    webServer->on("/actionStats", HTTP_GET, getActionStats).setFilter(is_memory_available);
+    webServer->on("/inputStats", HTTP_GET, getInputStats).setFilter(is_memory_available);
+    webServer->on("/powerStats", HTTP_GET, getPowerStats).setFilter(is_memory_available);
+    webServer->on("/mqttStats", HTTP_GET, getMqttStats).setFilter(is_memory_available);
+    webServer->on("/wifiStats", HTTP_GET, getWifiStats).setFilter(is_memory_available);
+
+    // Set up the alarm calendar's skipped dates and next alarm.
+    AsyncCallbackJsonWebHandler* skipDatesHandler = 
+        new AsyncCallbackJsonWebHandler("/skipDates", postSkipDates);
+    skipDatesHandler->setFilter(is_memory_available);
+    webServer->addHandler(skipDatesHandler);
+    webServer->on("/skipDates", HTTP_GET, getSkipDates).setFilter(is_memory_available);
+    webServer->on("/nextAlarm", HTTP_GET, getNextAlarm).setFilter(is_memory_available);
+
+    // Set up the time zone database.
+    webServer->on("/timezones", HTTP_GET, getTimezones).setFilter(is_memory_available);
+
+    // Set up the OTA update upload.
+    webServer->on("/update", HTTP_POST, postUpdate, uploadUpdate).setFilter(is_memory_available);
+
+    // Set up the custom pattern handlers.
+    AsyncCallbackJsonWebHandler* patternHandler = 
+        new AsyncCallbackJsonWebHandler("/pattern", postPattern);
+    patternHandler->setFilter(is_memory_available);
+    webServer->addHandler(patternHandler);
+    webServer->on("/patterns", HTTP_GET, getPatterns).setFilter(is_memory_available);
+
+    // Set up the display recording dump.
+    webServer->on("/recording", HTTP_GET, getRecording).setFilter(is_memory_available);
+
+    // Set up the radio status retrieval.
+    webServer->on("/radio", HTTP_GET, getRadio).setFilter(is_memory_available);
+
+    // Set up the event log download.
+    webServer->on("/log", HTTP_GET, getLog).setFilter(is_memory_available);
+
     // Set up the static file sharing.
-    webServer->serveStatic("/", LittleFS, "/").setDefaultFile("home.html").setCacheControl("max-age=3600");
-    webServer->serveStatic("/icons", LittleFS, "/icons").setCacheControl("max-age=3600");
+    webServer->serveStatic("/", LittleFS, "/").setDefaultFile("home.html").setCacheControl("max-age=3600")
+        .setFilter(is_memory_available);
+    webServer->serveStatic("/icons", LittleFS, "/icons").setCacheControl("max-age=3600")
+        .setFilter(is_memory_available);
 
-    // Set up the 404 handler.
+    // Set up the 404 handler, which also refuses requests while memory is low.
     webServer->onNotFound([](AsyncWebServerRequest *request) {
+        if (myIsMemoryLow) {
+            request->send(503);
+            return;
+        }
         Serial.println("404, not found.");
         request->send(404);
     });
@@ -1382,87 +5840,369 @@ bool setupWebServer() {
 }
 
 /**
- * Sets up this device to receive OTA flash/firmware updates.
+ * Sets up this device to receive OTA flash/firmware updates with ArduinoOTA,
+ * using the fleet key as the password. ArduinoOTA isn't started without a
+ * fleet key. Updates can also be uploaded through the web server (see
+ * uploadUpdate).
  */
 void setupOTA() {
-    // Setup over-the-air (OTA) flash updates.
+    if (strlen(FLEET_KEY) == 0) {
+        return;
+    }
+    ArduinoOTA.setHostname(myHostname);
+    ArduinoOTA.setPassword(FLEET_KEY);
+    ArduinoOTA.setPort(OTA_PORT);
+    ArduinoOTA.setRebootOnSuccess(false);
+
     ArduinoOTA.onStart([]() {
-        // Handles the starting of an OTA flash update.
-        String type;
-        if (ArduinoOTA.getCommand() == U_FLASH) {
-            type = "sketch";
-        } else {
-            type = "filesystem";
-        }
+        myIsArduinoOtaStarted = ota_started(ArduinoOTA.getCommand() == U_SPIFFS, 
+            ota_source_t::OTA_SOURCE_ARDUINO);
+    });
 
-        // Turn off the web server and LittleFS for uploads.
-        webServer->end();
-        LittleFS.end();
-        Serial.printf("Start updating %s", type);
+    ArduinoOTA.onProgress([](unsigned int done, unsigned int total) {
+        // ArduinoOTA blocks the loop until the update has been received, so
+        // keep the watchdog, time, alarms and progress display going from here.
+        esp_task_wdt_reset();
+        if (myIsArduinoOtaStarted && millis() - myLastOtaProgressTime >= LOOP_DELAY) {
+            myLastOtaProgressTime = millis();
+            ota_progress(done, total);
+            update_time();
+            display_ota_progress();
+        }
     });
 
     ArduinoOTA.onEnd([]() {
-        // Handles the end of a OTA flash update.
-        Serial.printf("OTA Update finished.");
+        if (myIsArduinoOtaStarted) {
+            myIsArduinoOtaStarted = false;
+            ota_finished(Update.size());
+        }
     });
 
     ArduinoOTA.onError([](ota_error_t error) {
-        // Handles an error in the OTA upload.
-        Serial.printf("Error[%u]: ", error);
-        if (error == OTA_AUTH_ERROR) {
-            Serial.printf("Auth Failed");
-        } else if (error == OTA_BEGIN_ERROR) {
-            Serial.printf("Begin Failed");
-        } else if (error == OTA_CONNECT_ERROR) {
-            Serial.printf("Connect Failed");
-        } else if (error == OTA_RECEIVE_ERROR) {
-            Serial.printf("Receive Failed");
-        } else if (error == OTA_END_ERROR) {
-            Serial.printf("End Failed");
+        if (myIsArduinoOtaStarted) {
+            myIsArduinoOtaStarted = false;
+            ota_failed(error, ota_source_t::OTA_SOURCE_ARDUINO);
         }
     });
 
     ArduinoOTA.begin();
 }
 
+/**
+ * Starts the services that need the network, once WiFi has connected.
+ */
+void start_network_services() {
+    myIPAddress = WiFi.localIP();
+    myIsNetworkStarted = true;
+    log_boot_phase("WiFi");
+
+    // Now we have an IP address, show it.
+    post_ip_address();
+
+    // Set up the web server.
+    if (!setupWebServer()) {
+        flush_log();
+        delay(1000);
+        ESP.restart();
+    }
+
+    make_hostname(myConfiguration.deviceName, myHostname);
+    setupOTA();
+    start_telemetry();
+    start_mqtt();
+
+    // Start the NTP clock.
+    //Serial.println("Initialising NTP.");
+    sntp_set_time_sync_notification_cb(ntp_time_received_cb);
+    // settimeofday_cb(ntp_time_received_cb);
+    configTime(0, 0, "10.0.1.1", "pool.ntp.org");
+    setenv("TZ", posix_timezone(&myConfiguration), 1);
+    tzset();
+
+    start_mdns();
+    log_boot_phase("network services");
+}
+
+/**
+ * Moves the WiFi connection to a new state.
+ * 
+ * @param state The new state.
+ */
+void set_wifi_state(wifi_state_t state) {
+    portENTER_CRITICAL(&myWifiMux);
+    myWifiStats.state = state;
+    portEXIT_CRITICAL(&myWifiMux);
+}
+
+/**
+ * Starts connecting to the saved network. The access point last connected to
+ * is tried first, skipping the scan, unless the last attempt failed.
+ */
+void begin_wifi_connection() {
+    String ssid = wifiManager.getWiFiSSID(true);
+    String pass = wifiManager.getWiFiPass(true);
+    myIsWifiFastConnect = myWifiCache.magic == WIFI_CACHE_MAGIC && myWifiStats.failures == 0;
+    if (myIsWifiFastConnect) {
+        WiFi.begin(ssid.c_str(), pass.c_str(), myWifiCache.channel, myWifiCache.bssid);
+    } else {
+        WiFi.begin(ssid.c_str(), pass.c_str());
+    }
+    myWifiAttemptTime = millis();
+    set_wifi_state(wifi_state_t::WIFI_CONNECTING);
+}
+
+/**
+ * Starts the WiFi configuration portal, which is serviced by handle_network().
+ * The portal has its own web server on port 80, so the clock's web server is
+ * stopped until the portal has finished.
+ */
+void start_wifi_portal() {
+    if (myIsNetworkStarted) {
+        webServer->end();
+    }
+    wifiManager.startConfigPortal("ESPClock");
+    myIsPortalStarted = true;
+    set_wifi_state(wifi_state_t::WIFI_PORTAL);
+}
+
+/**
+ * Stops the WiFi configuration portal, if it hasn't already stopped itself,
+ * and restarts the clock's web server in its place.
+ */
+void stop_wifi_portal() {
+    if (wifiManager.getConfigPortalActive()) {
+        wifiManager.stopConfigPortal();
+    }
+    myIsPortalStarted = false;
+    if (myIsNetworkStarted) {
+        webServer->begin();
+    }
+}
+
+/**
+ * Waits before retrying the WiFi connection, doubling the wait each time.
+ */
+void wait_wifi_retry() {
+    myWifiRetryTime = millis() + myWifiBackoff;
+    myWifiBackoff = (myWifiBackoff * 2 > WIFI_MAX_BACKOFF) ? WIFI_MAX_BACKOFF : myWifiBackoff * 2;
+    set_wifi_state(wifi_state_t::WIFI_WAITING);
+}
+
+/**
+ * Handles the WiFi connection being made, caching the access point and
+ * starting the network services the first time.
+ */
+void wifi_connected() {
+    unsigned long now = millis();
+    if (myIsPortalStarted) {
+        stop_wifi_portal();
+    }
+
+    portENTER_CRITICAL(&myWifiMux);
+    myWifiStats.state = wifi_state_t::WIFI_CONNECTED;
+    myWifiStats.connects++;
+    myWifiStats.failures = 0;
+    myWifiStats.lastConnectTime = now - myWifiAttemptTime;
+    myWifiStats.connectedAt = now;
+    portEXIT_CRITICAL(&myWifiMux);
+    myWifiBackoff = WIFI_MIN_BACKOFF;
+    LOG_INFO(EVENT_WIFI_CONNECTED, now - myWifiAttemptTime, WiFi.RSSI());
+
+    // Keep the access point, so that the next connection can skip the scan.
+    uint8_t *bssid = WiFi.BSSID();
+    int32_t channel = WiFi.channel();
+    if (bssid != NULL && (myWifiCache.magic != WIFI_CACHE_MAGIC || myWifiCache.channel != channel ||
+            memcmp(myWifiCache.bssid, bssid, sizeof(myWifiCache.bssid)) != 0)) {
+        myWifiCache.magic = WIFI_CACHE_MAGIC;
+        memcpy(myWifiCache.bssid, bssid, sizeof(myWifiCache.bssid));
+        myWifiCache.channel = channel;
+        #ifndef DISABLE_CONFIG_WRITES
+        prefs.putBytes(KEY_WIFI_CACHE, &myWifiCache, sizeof(wifi_cache_t));
+        #endif
+    }
+
+    if (!myIsNetworkStarted) {
+        start_network_services();
+    } else {
+        myIPAddress = WiFi.localIP();
+    }
+}
+
+/**
+ * Handles a failed attempt to connect to WiFi. After several failures in a
+ * row the configuration portal is started, in case the network has changed.
+ */
+void wifi_failed() {
+    portENTER_CRITICAL(&myWifiMux);
+    uint32_t failures = ++myWifiStats.failures;
+    portEXIT_CRITICAL(&myWifiMux);
+    if (myIsWifiFastConnect) {
+        // The access point may have moved, scan for it next time.
+        myWifiCache.magic = 0;
+    }
+
+    if (failures % WIFI_PORTAL_FAILURES == 0) {
+        LOG_WARNING(EVENT_WIFI_PORTAL, failures, 0);
+        start_wifi_portal();
+    } else {
+        wait_wifi_retry();
+    }
+}
+
+/**
+ * Runs the WiFi connection state machine, reconnecting in the background so
+ * that the clock and alarms keep running while the network is unavailable.
+ */
+void handle_network() {
+    bool isConnected = WiFi.status() == WL_CONNECTED;
+    switch (myWifiStats.state) {
+        case wifi_state_t::WIFI_PORTAL:
+            wifiManager.process();
+            if (isConnected) {
+                wifi_connected();
+            } else if (!wifiManager.getConfigPortalActive()) {
+                // The portal timed out, go back to retrying the saved network.
+                stop_wifi_portal();
+                if (wifiManager.getWiFiSSID(true).length() == 0) {
+                    start_wifi_portal();
+                } else {
+                    wait_wifi_retry();
+                }
+            }
+            break;
+
+        case wifi_state_t::WIFI_CONNECTING:
+            if (isConnected) {
+                wifi_connected();
+            } else if (millis() - myWifiAttemptTime >= WIFI_CONNECT_TIMEOUT) {
+                wifi_failed();
+            }
+            break;
+
+        case wifi_state_t::WIFI_CONNECTED:
+            if (!isConnected) {
+                unsigned long now = millis();
+                portENTER_CRITICAL(&myWifiMux);
+                uint32_t connected = (now - myWifiStats.connectedAt) / 1000;
+                myWifiStats.disconnects++;
+                myWifiStats.totalConnected += connected;
+                portEXIT_CRITICAL(&myWifiMux);
+                LOG_WARNING(EVENT_WIFI_DISCONNECTED, connected, myWifiBackoff);
+                wait_wifi_retry();
+            }
+            break;
+
+        case wifi_state_t::WIFI_WAITING:
+            if (isConnected) {
+                wifi_connected();
+            } else if ((long)(millis() - myWifiRetryTime) >= 0) {
+                begin_wifi_connection();
+            }
+            break;
+    }
+}
+
+/**
+ * Set up WiFi, connecting to the saved network in the background. WiFiManager
+ * gives the user a place to enter the network credentials if there are none.
+ * The portal runs in non-blocking mode, so that the clock keeps running while
+ * waiting for the network.
+ */
+void setupWifi() {
+    WiFi.mode(WIFI_STA);
+    WiFi.setAutoReconnect(false);
+    wifiManager.setConfigPortalBlocking(false);
+    wifiManager.setConfigPortalTimeout(CONFIG_TIMEOUT);
+
+    memset(&myWifiStats, 0, sizeof(wifi_stats_t));
+    if (prefs.getBytes(KEY_WIFI_CACHE, &myWifiCache, sizeof(wifi_cache_t)) != sizeof(wifi_cache_t)) {
+        myWifiCache.magic = 0;
+    }
+    if (wifiManager.getWiFiSSID(true).length() == 0) {
+        start_wifi_portal();
+    } else {
+        begin_wifi_connection();
+    }
+}
+
+/*
+ * Sets the default values for the configuration.
+ *
+ * @param config The configuration to be filled with the default values.
+ */
+void set_default_config(flash_config_t *config) {
+    memset(config, 0, sizeof(flash_config_t));
+    config->magic = MAGIC;
+    strcpy(config->deviceName, "ESP Clock");
+    config->alarmTime = 6 * 60;   // 6 AM
+    config->alarmActivation = alarm_t::ALARM_DISABLED;
+    config->radioFrequency = 993; // Triple J Perth
+    config->brightness = 0x0F;    // Maximum brightness
+    config->dayColour.r = 0xFF;
+    config->dayColour.g = 0xFF;
+    config->dayColour.b = 0xFF;
+    config->nightColour.r = 0xFF;
+    config->nightColour.g = 0x00;
+    config->nightColour.b = 0x00;
+    config->alarmColour.r = 0x00;
+    config->alarmColour.g = 0x00;
+    config->alarmColour.b = 0xFF;
+    config->dayPattern = display_pattern_t::RAINBOW_DIGITS;
+    config->nightPattern = display_pattern_t::SOLID_COLOUR;
+    config->alarmPattern = display_pattern_t::RAINBOW_DIGITS;
+    config->latitude = LATITUDE;
+    config->longitude = LONGITUDE;
+    strcpy(config->zoneName, "Australia/Perth");
+    strcpy(config->timezone, "AWST-8");
+    config->offset = 8;
+    config->isAlarmDisabled = false;
+    config->isRadioInstalled = true;
+    config->is24Hour = true;
+    config->isUseRadio = false;
+    config->mqttPort = MQTT_DEFAULT_PORT;
+    for (uint8_t ii = 0; ii < DAYS_PER_WEEK; ii++) {
+        config->dayAlarmTimes[ii] = ALARM_TIME_DEFAULT;
+    }
+    for (uint8_t ii = 0; ii < 3; ii++) {
+        config->calibration.gamma[ii] = GAMMA_SCALE;
+    }
+    config->calibration.whiteBalance.r = 0xFF;
+    config->calibration.whiteBalance.g = 0xFF;
+    config->calibration.whiteBalance.b = 0xFF;
+    memset(config->calibration.ledGain, FULL_LED_GAIN, sizeof(config->calibration.ledGain));
+    for (uint8_t ii = 0; ii < BRIGHTNESS_CAP_COUNT; ii++) {
+        config->brightnessCaps[ii].startMinute = BRIGHTNESS_CAP_UNUSED;
+        config->brightnessCaps[ii].maxBrightness = MAX_BRIGHTNESS;
+    }
+    config->powerBudget = DEFAULT_POWER_BUDGET;
+}
+
 /*
  * Setup routine run at power-on and reset times.
  */
 void setup() {
     Serial.begin(115200);
 
-    // Initialise the configuration.
+    // Initialise the configuration. Configurations saved by earlier versions
+    // are shorter, so any fields added since then keep their defaults.
     prefs.begin("esp-clock", false);
-    size_t res = prefs.getBytes(KEY_CONFIG, &myConfiguration, sizeof(flash_config_t));
-    if (res != sizeof(flash_config_t) || myConfiguration.magic != MAGIC) {
-        // There is no saved configuration - set defaults.
-        myConfiguration.magic = MAGIC;
-        strcpy(myConfiguration.deviceName, "ESP Clock");
-        myConfiguration.alarmTime = 6 * 60;   // 6 AM
-        myConfiguration.alarmActivation = alarm_t::ALARM_DISABLED;
-        myConfiguration.radioFrequency = 993; // Triple J Perth
-        myConfiguration.brightness = 0x0F;    // Maximum brightness
-        myConfiguration.dayColour.r = 0xFF;
-        myConfiguration.dayColour.g = 0xFF;
-        myConfiguration.dayColour.b = 0xFF;
-        myConfiguration.nightColour.r = 0xFF;
-        myConfiguration.nightColour.g = 0x00;
-        myConfiguration.nightColour.b = 0x00;
-        myConfiguration.alarmColour.r = 0x00;
-        myConfiguration.alarmColour.g = 0x00;
-        myConfiguration.alarmColour.b = 0xFF;
-        myConfiguration.dayPattern = display_pattern_t::RAINBOW_DIGITS;
-        myConfiguration.nightPattern = display_pattern_t::SOLID_COLOUR;
-        myConfiguration.alarmPattern = display_pattern_t::RAINBOW_DIGITS;
-        myConfiguration.latitude = LATITUDE;
-        myConfiguration.longitude = LONGITUDE;
-        strcpy(myConfiguration.timezone, "AWST-8");
-        myConfiguration.offset = 8;
-        myConfiguration.isAlarmDisabled = false;
-        myConfiguration.isRadioInstalled = true;
-        myConfiguration.is24Hour = true;
-        myConfiguration.isUseRadio = false;
+    set_default_config(&myConfiguration);
+    flash_config_t stored;
+    size_t res = prefs.getBytes(KEY_CONFIG, &stored, sizeof(flash_config_t));
+    if (res >= sizeof(stored.magic) && stored.magic == MAGIC) {
+        memcpy(&myConfiguration, &stored, res);
+        if (res <= offsetof(flash_config_t, zoneName)) {
+            // Keep using the time zone rule from before there were zone names.
+            myConfiguration.zoneName[0] = '\0';
+        }
     }
+    build_calibration();
+    myTelemetryInterval = myConfiguration.telemetryInterval;
+    myFleetSequence = prefs.getUInt(KEY_FLEET_SEQUENCE, 0);
+    myRecoveredAlarms = prefs.getUInt(KEY_ALARMS_RECOVERED, 0);
+    bool isRolledBack = check_ota_boot();
+
+    log_boot_phase("configuration");
 
     // Set the version string each time.
     strncpy(myConfiguration.version, VERSION, VERSION_LEN);
@@ -1479,6 +6219,26 @@ void setup() {
     leds.Begin();
     display(FONT_BLANK, FONT_BLANK, FONT_BLANK, FONT_BLANK, false, false, false);
 
+    // Initialise the time zone and sunset calculator.
+    apply_timezone(true);
+
+    // Show the last known time straight away, until NTP confirms it.
+    if (restore_cached_time()) {
+        time_t now;
+        time(&now);
+        tm *tm_val = localtime(&now);
+        myHour = tm_val->tm_hour;
+        myMinute = tm_val->tm_min;
+        myMinuteOfDay = (((uint16_t)myHour) * MINUTES_PER_HOUR) + myMinute;
+        myLastTimestamp = now;
+        myIsTimeProvisional = true;
+        myState = state_t::RUNNING;
+        syncSunClock(tm_val);
+        checkDaytime(tm_val, true);
+        update_display();
+    }
+    log_boot_phase("cached time");
+
     // Initialise the radio, if it exists.
     if (myConfiguration.isRadioInstalled) {
         Wire.setPins(PIN_RADIO_SDA, PIN_RADIO_SCL);
@@ -1490,12 +6250,26 @@ void setup() {
             radio.setMute(true);
             radio.setMono(true);
             Serial.println("Radio initialised.");
+
+            // From here on, only the radio task talks to the radio.
+            myRadioQueue = xQueueCreate(RADIO_QUEUE_SIZE, sizeof(radio_request_t));
+            xTaskCreate(radio_task, "radio", RADIO_TASK_STACK_SIZE, NULL, 
+                RADIO_TASK_PRIORITY, &myRadioTask);
         }
     }
 
     // Check if alarms are disabled permanently.
     myConfiguration.isAlarmDisabled = (digitalRead(PIN_NO_ALARM) == LOW);
 
+    // Prepare the queue for commands from the web server.
+    init_command_queue();
+
+    // Prepare the queue for messages for the display.
+    myMessageQueue = xQueueCreate(MESSAGE_QUEUE_SIZE, sizeof(message_t));
+
+    // Share the configuration with the web server.
+    myConfigSequence = publish_config(&myConfiguration);
+
     // Initialise the clock's state.
     pinMode(PIN_ENCODER_SW, INPUT_PULLUP);
     if (digitalRead(PIN_ENCODER_SW) == LOW) {
@@ -1506,89 +6280,50 @@ void setup() {
         } else {
             myState = state_t::SETUP_MENU_12_24_HOURS;
         }
-    } else {
+    } else if (!myIsTimeProvisional) {
         myState = state_t::INITIALISING;
     }
-    
-    // Set up the WiFi connection.
-    setupWifi();
 
-    if (myState == state_t::INITIALISING) {
-        // Now we have an IP address, show it.
-        myState = state_t::SHOW_IP_1;
-        myCountdownTimer = SHOW_IP_COUNTDOWN;
-    }
-    
     // Set up the file system.
     if (!LittleFS.begin()) {
         Serial.println("Unable to start LittleFS.");
         delay(1000);
         ESP.restart();
     }
-
-    // Set up the web server.
-    if (!setupWebServer()) {
-        delay(1000);
-        ESP.restart();
+    set_filesystem_mounted(true);
+    init_log_file();
+    if (isRolledBack) {
+        LOG_ERROR(EVENT_OTA_ROLLED_BACK, OTA_MAX_BOOTS, 0);
     }
-
-    setupOTA();
-
-    // Initialise the sunset calculator.
-    sun.setPosition(myConfiguration.latitude, myConfiguration.longitude, TZ_OFFSET);
-
-    // Start the NTP clock.
-    //Serial.println("Initialising NTP.");
-    sntp_set_time_sync_notification_cb(ntp_time_received_cb);
-    // settimeofday_cb(ntp_time_received_cb);
-    configTime(0, 0, "10.0.1.1", "pool.ntp.org");
-    setenv("TZ", myConfiguration.timezone, 1);
-    tzset();
-
-    // Enable OTA flashing.
-    //Serial.println("Initialising OTA");
-    ArduinoOTA.setPort(8266);
-    ArduinoOTA.onStart([]() {
-        Serial.printf("OTA starting\n");
-    });
-    ArduinoOTA.onEnd([]() {
-        Serial.printf("OTA Complete\n");
-    });
-    ArduinoOTA.onError([](ota_error_t error) {
-        Serial.printf("Error[%u]: ", error);
-        switch (error) {
-            case OTA_AUTH_ERROR:
-                Serial.printf("Auth Failed.\n");
-                break;
-            case OTA_BEGIN_ERROR:
-                Serial.printf("Begin Failed.\n");
-                break;
-            case OTA_CONNECT_ERROR:
-                Serial.printf("Connect Failed.\n");
-                break;
-            case OTA_RECEIVE_ERROR:
-                Serial.printf("Receive Failed.\n");
-                break;
-            case OTA_END_ERROR:
-                Serial.printf("End Failed.\n");
-                break;
-        }
-    });
-    ArduinoOTA.begin();
+    load_patterns();
+    log_boot_phase("hardware");
 
     // Initialise the button.
-    myButton.begin();
+    init_button();
 
-    // Initialise the buzzer.
-    pinMode(PIN_BUZZER, OUTPUT);
-    digitalWrite(PIN_BUZZER, HIGH);
+    // Initialise the buzzer, with a chirp to show that we're running.
+    setupBuzzer();
+    start_tones(&myClickTones);
 
     // Initialise the rotary encoder.
     attachInterrupt(digitalPinToInterrupt(PIN_ENCODER_A), rotary_tick, CHANGE);
     attachInterrupt(digitalPinToInterrupt(PIN_ENCODER_B), rotary_tick, CHANGE);
 
+    // Pick up any alarm that was going when the clock was reset.
+    resume_alarm();
+
+    // Start connecting to WiFi, the network services start once connected.
+    setupWifi();
+    log_boot_phase("setup");
+
+    // Have the task watchdog reset the clock if the loop stalls. The web
+    // server's task is watched by AsyncTCP (CONFIG_ASYNC_TCP_USE_WDT).
+    esp_task_wdt_init(WATCHDOG_TIMEOUT, true);
+    esp_task_wdt_add(NULL);
+
     //Serial.println("Clock started successfully.");
     Serial.printf("Clock started successfully.\n");
+    LOG_INFO(EVENT_STARTED, esp_reset_reason(), millis());
 }
 
 /*
@@ -1596,15 +6331,25 @@ void setup() {
  */
 void loop() {
     unsigned long loopStartTime = millis();
+    int64_t loopStartMicros = esp_timer_get_time();
+    myLoopCount++;
+    esp_task_wdt_reset();
 
-    // Handle any OTA updates.
+    // Handle the WiFi connection and any OTA updates.
+    handle_network();
     ArduinoOTA.handle();
+    restart_for_ota();
+    confirm_ota_boot();
+
+    // Pick up any configuration changes made through the web server.
+    sync_config();
+    step_sun_table();
 
     myBrightnessCounter--;
     if (myBrightnessCounter <= 0) {
         // Check the brightness.
-        uint16_t ldr = analogRead(PIN_LDR);
-        set_brightness(ldr);
+        myLdr = analogRead(PIN_LDR);
+        set_brightness(myLdr);
         myBrightnessCounter = BRIGHTNESS_CHECK_COUNTDOWN;
     }
 
@@ -1616,44 +6361,38 @@ void loop() {
         }
     }
 
-    // Update the animation step.
-    display_pattern_t pattern;
-    if (myIsInMenu) {
-        pattern = display_pattern_t::MENU;
-    } else if (myAlarmState == alarm_state_t::ACTIVE) {
-        pattern = myConfiguration.alarmPattern;
-    } else if (myIsDaytime) {
-        pattern = myConfiguration.dayPattern;
-    } else {
-        pattern = myConfiguration.nightPattern;
+    // Update the day/night transition and the wake-up light.
+    step_day_blend();
+    step_wake();
+
+    // Execute any commands from the web server.
+    process_commands();
+
+    // Pick up any messages for the display.
+    update_messages();
+
+    // Sample the heap and task stacks.
+    if (myLoopCount % MEMORY_CHECK_LOOPS == 0) {
+        check_memory();
     }
-    switch (pattern) {
-        case display_pattern_t::FLASHING:
-            myAnimationStep = (myAnimationStep + 1) % MAX_ANIMATION_STEP_FLASH;
-            break;
-        case display_pattern_t::PULSING:
-            myAnimationStep = (myAnimationStep + 1) % MAX_ANIMATION_STEP_PULSE;
-            break;
-        case display_pattern_t::RAINBOW_DIGITS:
-            myAnimationStep = (myAnimationStep + 1) % MAX_ANIMATION_STEP_RAINBOW_DIGITS;
-            break;
-        case display_pattern_t::RAINBOW_SEGMENTS:
-            myAnimationStep = (myAnimationStep + 1) % MAX_ANIMATION_STEP_RAINBOW_SEGMENTS;
-            break;
+
+    // Write the event log to flash once it is half full, periodically, or
+    // when it's been asked for.
+    if (myIsLogFlushRequested || myLogHead - myLogFlushed >= LOG_RAM_ENTRIES / 2 ||
+            (myLogHead != myLogFlushed && millis() - myLogFlushTime >= LOG_FLUSH_INTERVAL)) {
+        flush_log();
     }
 
-    // Update the buzzer.
-    if (myAlarmState == alarm_state_t::ACTIVE && !myConfiguration.isUseRadio) {
-        if (myBuzzerTicksRemaining == 1) {
-            myBuzzerStep = (myBuzzerStep + 1) % BUZZER_STEP_COUNT;
-            digitalWrite(PIN_BUZZER, ((myBuzzerStep % 2) == 0 ? HIGH : LOW));
-            myBuzzerTicksRemaining = BUZZER_STEP_TICKS[myBuzzerStep];
-            
-        } else if (myBuzzerTicksRemaining > 0) {
-            myBuzzerTicksRemaining--;
-        }
+    // Update the pattern preview.
+    if (myPreviewRemaining > 0) {
+        myPreviewRemaining--;
     }
 
+    // Update the animation step.
+    colour_t baseColour;
+    display_pattern_t pattern = get_display_pattern(&baseColour);
+    myAnimationStep = next_animation_step(pattern, get_custom_pattern(pattern), myAnimationStep);
+
     // Read the alarm enable switch.
     myIsAlarmSwitchEnabled = digitalRead(PIN_ALARM_ENABLE) == LOW;
     if (!myIsAlarmSwitchEnabled && myAlarmState != alarm_state_t::INACTIVE) {
@@ -1661,101 +6400,24 @@ void loop() {
         stop_alarm();
     }
 
-    // Read the encoder.
-    static long lastEncoderPos = -1;
-    long encoderPos = myEncoder.getPosition();
-    //myEncoder.setPosition(0);
-    if (encoderPos != lastEncoderPos) {
-        // The encoder has been changed by the user since the last loop.
-        digitalWrite(PIN_BUZZER, !digitalRead(PIN_BUZZER));
-        Serial.printf("Encoder moved to: %ld.\n", encoderPos);
-        rotate(encoderPos - lastEncoderPos);
-        lastEncoderPos = encoderPos;
-    }
-
-    // Read the top button.
-    myButton.read();
-    if (myButton.pressedFor(LONG_PRESS_INTERVAL)) {
-        // This is a long press.
-        if (!myIsLongPress) {
-            // Register it as a new long-press.
-            myIsLongPress = true;
-            myWasPressed = false;
-            long_press();
-        }
-    } else if (myButton.wasPressed()) {
-        Serial.printf("Button was pressed.\n");
-        // See if the releasing of the button was from a long press.
-        if (myIsLongPress) {
-            myIsLongPress = false;
-        } else {
-            // Button has been pressed, but we need to check for click vs double-click.
-            if (myWasPressed) {
-                // This is the end of a double-click.
-                double_click();
-                myWasPressed = false;
-            } else {
-                // This is either a single-click or the start of a double-click.
-                myWasPressed = true;
-            }
-        }
-    } else if (myWasPressed) {
-        if (myButton.releasedFor(DOUBLE_CLICK_INTERVAL)) {
-            // The double-click has timed out, so it's a click.
-            click();
-            myWasPressed = false;
-        }
-    }
+    // Handle the encoder and button.
+    process_encoder();
+    process_button();
 
     // Update the time if necessary.
-    if ((myState != state_t::INITIALISING) && (myLastTimestamp != 0)) {
-        time_t now;
-        time(&now);
-        if (now != myLastTimestamp) {
-            // The second has changd.
-            if (myAlarmState == alarm_state_t::SNOOZE) {
-                if (mySnoozeRemaining == 1) {
-                    // The snooze timer has expired.
-                    start_alarm();
-                } else {
-                    mySnoozeRemaining--;
-                }
-            }
-            if ((now / SECONDS_PER_MINUTE) != (myLastTimestamp / SECONDS_PER_MINUTE)) {
-                // The minute has changed.
-                tm *tm_val = localtime(&now);
-                myHour = tm_val->tm_hour;
-                myMinute = tm_val->tm_min;
-                myMinuteOfDay = (((uint16_t)myHour) * MINUTES_PER_HOUR) + myMinute;
-                
-                // Check for alarm.
-                if (!myConfiguration.isAlarmDisabled &&
-                    myIsAlarmSwitchEnabled &&
-                    myMinuteOfDay == myConfiguration.alarmTime &&
-                    (myConfiguration.alarmActivation == alarm_t::ALL_DAYS ||
-                     myConfiguration.alarmActivation == alarm_t::ONE_TIME ||
-                     (myConfiguration.alarmActivation == alarm_t::WEEKDAYS &&
-                      tm_val->tm_wday != WDAY_SUNDAY &&
-                      tm_val->tm_wday != WDAY_SATURDAY))) {
-                    start_alarm();
-                }
-
-                if ((now / SECONDS_PER_HOUR) != (myLastTimestamp / SECONDS_PER_HOUR)) {
-                    // The hour has changed, recalculate sunrise/sunset.
-                    syncSunClock(tm_val);
-                }
-
-                // Determine if we're currently in daytime or nighttime.
-                checkDaytime(tm_val);
-            }
-
-            // Update the last processed timestamp.
-            myLastTimestamp = now;
-        }
-    }
+    update_time();
 
     // Choose what to display based on the current state.
+    int64_t renderStartTime = esp_timer_get_time();
     update_display();
+    input_displayed();
+    int64_t renderEndTime = esp_timer_get_time();
+    if (myIsRecording) {
+        record_loop(myEncoderPosition, (uint32_t)(renderEndTime - renderStartTime));
+    }
+    send_loop_telemetry((uint32_t)(renderEndTime - loopStartMicros), 
+        (uint32_t)(renderEndTime - renderStartTime));
+    publish_state_changes();
 
     // Determine how long the delay should be to match our tick duration.
     unsigned long now = millis();
@@ -34,6 +34,13 @@ app.get('/config', (_, res) => {
             deviceName: "Test Clock",
             alarmTime: 360,
             alarmActivation: 'ALARM_DISABLED',
+            wakeDuration: 0,
+            telemetryInterval: 0,
+            mqttHost: "",
+            mqttPort: 1883,
+            dayAlarmTimes: [null, null, null, null, null, null, null],
+            alarmStartDate: "",
+            alarmEndDate: "",
             radioFrequency: 99.3,
             brightness: 15,
             dayColour: [255, 255, 255],
@@ -66,6 +73,10 @@ app.post('/writeConfig', (req, res) => {
                 deviceName: req.body.deviceName,
                 alarmTime: req.body.alarmTime,
                 alarmActivation: req.body.alarmActivation,
+                wakeDuration: req.body.wakeDuration,
+                dayAlarmTimes: req.body.dayAlarmTimes,
+                alarmStartDate: req.body.alarmStartDate,
+                alarmEndDate: req.body.alarmEndDate,
                 radioFrequency: req.body.radioFrequency,
                 brightness: req.body.brightness,
                 dayColour: req.body.dayColour,
@@ -74,10 +85,15 @@ app.post('/writeConfig', (req, res) => {
                 dayPattern: req.body.dayPattern,
                 nightPattern: req.body.nightPattern,
                 alarmPattern: req.body.alarmPattern,
+                powerBudget: req.body.powerBudget,
+                brightnessCaps: req.body.brightnessCaps,
+                calibration: req.body.calibration,
                 latitude: req.body.latitude,
                 longitude: req.body.longitude,
+                zoneName: req.body.zoneName,
                 timezone: req.body.timezone,
-                offset: req.body.offset,
+                mqttHost: req.body.mqttHost,
+                mqttPort: req.body.mqttPort,
                 isRadioInstalled: req.body.isRadioInstalled,
                 is24Hour: req.body.is24Hour,
                 isUseRadio: req.body.isUseRadio
@@ -95,6 +111,44 @@ app.post('/writeConfig', (req, res) => {
     });
 });
 
+// The dates on which the alarm is skipped, kept in memory.
+let skipDates = [];
+
+app.get('/skipDates', (_, res) => {
+    res.status(200).send({ dates: skipDates });
+});
+
+app.post('/skipDates', (req, res) => {
+    const dates = req.body.dates;
+    if (!Array.isArray(dates) || dates.some(d => !/^\d{4}-\d{2}-\d{2}$/.test(d))) {
+        res.status(400).send('Bad date');
+        return;
+    }
+    skipDates = [...new Set(dates)].sort();
+    res.sendStatus(200);
+});
+
+app.get('/nextAlarm', (_, res) => {
+    res.status(200).send({ time: null });
+});
+
+app.post('/message', (req, res) => {
+    const { text, priority = 5, duration = 10 } = req.body;
+    if (typeof text !== 'string' || text.length === 0 || text.length > 63 ||
+            priority < 0 || priority > 9 || duration < 1 || duration > 3600) {
+        res.status(400).send('Bad message');
+        return;
+    }
+    console.log(`Message (priority ${priority}, ${duration} s): ${text}`);
+    res.sendStatus(200);
+});
+
+app.get('/timezones', (_, res) => {
+    // The names in the clock's time zone database.
+    const header = fs.readFileSync(path.join(__dirname, '../include/timezones.h'), 'utf8');
+    res.status(200).send([...header.matchAll(/^    \{"([^"]+)"/gm)].map(m => m[1]));
+});
+
 var server = app.listen(port, () => {
     console.log(`Test server running at http://localhost:${port}`);
 });
\ No newline at end of file
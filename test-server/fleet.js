@@ -0,0 +1,362 @@
+// Discovers the clocks on the local network with mDNS/DNS-SD, and pushes
+// signed configuration bundles or OTA updates to them in parallel.
+//
+// Usage:
+//   node fleet.js discover [--timeout <ms>]
+//   node fleet.js push <config.json> [--key <fleet key>] [--hosts <a,b,...>] [--timeout <ms>]
+//   node fleet.js update <image.bin> [--filesystem] [--key <fleet key>] [--hosts <a,b,...>] [--timeout <ms>]
+//
+// The fleet key may also be given in the FLEET_KEY environment variable, and
+// must match the FLEET_KEY build flag of the clocks.
+const crypto = require('crypto');
+const dgram = require('dgram');
+const fs = require('fs');
+
+const MDNS_ADDRESS = '224.0.0.251';
+const MDNS_PORT = 5353;
+const SERVICE = '_espclock._tcp.local';
+const TYPE_A = 1;
+const TYPE_PTR = 12;
+const TYPE_TXT = 16;
+const TYPE_SRV = 33;
+const HOSTNAME_MAX_LEN = 32;
+
+/**
+ * Encodes a DNS name.
+ *
+ * @param name The name, e.g. "_espclock._tcp.local".
+ * @returns The encoded name.
+ */
+function encodeName(name) {
+    const parts = name.split('.').map(label => {
+        const bytes = Buffer.from(label);
+        return Buffer.concat([Buffer.from([bytes.length]), bytes]);
+    });
+    return Buffer.concat([...parts, Buffer.from([0])]);
+}
+
+/**
+ * Decodes a (possibly compressed) DNS name.
+ *
+ * @param data The DNS message.
+ * @param offset The offset of the name.
+ * @returns The name and the offset after it.
+ */
+function decodeName(data, offset) {
+    const labels = [];
+    let end = null;
+    for (let jumps = 0; jumps < 16; jumps++) {
+        const len = data.readUInt8(offset);
+        if (len === 0) {
+            return { name: labels.join('.'), end: end === null ? offset + 1 : end };
+        }
+        if ((len & 0xc0) === 0xc0) {
+            if (end === null) {
+                end = offset + 2;
+            }
+            offset = data.readUInt16BE(offset) & 0x3fff;
+        } else {
+            labels.push(data.toString('utf8', offset + 1, offset + 1 + len));
+            offset += 1 + len;
+        }
+    }
+    throw new Error('Too many name compression jumps');
+}
+
+/**
+ * Builds an mDNS query for a PTR record.
+ *
+ * @param name The name to query.
+ * @returns The query message.
+ */
+function buildQuery(name) {
+    const header = Buffer.alloc(12);
+    header.writeUInt16BE(1, 4); // One question.
+    const question = Buffer.alloc(4);
+    question.writeUInt16BE(TYPE_PTR, 0);
+    question.writeUInt16BE(1, 2); // IN
+    return Buffer.concat([header, encodeName(name), question]);
+}
+
+/**
+ * Decodes the records in an mDNS response.
+ *
+ * @param data The response message.
+ * @returns The answer and additional records.
+ */
+function decodeResponse(data) {
+    const counts = [data.readUInt16BE(4), data.readUInt16BE(6), data.readUInt16BE(8), data.readUInt16BE(10)];
+    let offset = 12;
+    for (let ii = 0; ii < counts[0]; ii++) {
+        offset = decodeName(data, offset).end + 4;
+    }
+    const records = [];
+    const total = counts[1] + counts[2] + counts[3];
+    for (let ii = 0; ii < total; ii++) {
+        const { name, end } = decodeName(data, offset);
+        const type = data.readUInt16BE(end);
+        const length = data.readUInt16BE(end + 8);
+        const rdata = end + 10;
+        const record = { name, type };
+        if (type === TYPE_PTR) {
+            record.target = decodeName(data, rdata).name;
+        } else if (type === TYPE_SRV) {
+            record.port = data.readUInt16BE(rdata + 4);
+            record.target = decodeName(data, rdata + 6).name;
+        } else if (type === TYPE_A) {
+            record.address = [...data.subarray(rdata, rdata + 4)].join('.');
+        } else if (type === TYPE_TXT) {
+            record.txt = {};
+            for (let pos = rdata; pos < rdata + length;) {
+                const entry = data.toString('utf8', pos + 1, pos + 1 + data.readUInt8(pos));
+                const split = entry.indexOf('=');
+                if (split > 0) {
+                    record.txt[entry.substring(0, split)] = entry.substring(split + 1);
+                }
+                pos += 1 + data.readUInt8(pos);
+            }
+        }
+        records.push(record);
+        offset = rdata + length;
+    }
+    return records;
+}
+
+/**
+ * Discovers the clocks on the local network.
+ *
+ * @param timeout How long to wait for responses (ms).
+ * @returns The clocks found, with their names, addresses and versions.
+ */
+function discover(timeout) {
+    return new Promise((resolve, reject) => {
+        const records = [];
+        const socket = dgram.createSocket({ type: 'udp4', reuseAddr: true });
+        socket.on('error', reject);
+        socket.on('message', (data) => {
+            try {
+                records.push(...decodeResponse(data));
+            } catch (err) {
+                // Ignore malformed responses.
+            }
+        });
+        socket.bind(0, () => {
+            // Sending from a port other than 5353 asks for unicast replies.
+            const query = buildQuery(SERVICE);
+            socket.send(query, MDNS_PORT, MDNS_ADDRESS);
+            setTimeout(() => socket.send(query, MDNS_PORT, MDNS_ADDRESS), timeout / 3);
+        });
+        setTimeout(() => {
+            socket.close();
+            const byName = (type, name) => records.find(r => r.type === type && r.name === name);
+            const clocks = new Map();
+            for (const ptr of records.filter(r => r.type === TYPE_PTR && r.name === SERVICE)) {
+                const srv = byName(TYPE_SRV, ptr.target);
+                const a = srv && byName(TYPE_A, srv.target);
+                if (!a || clocks.has(a.address)) {
+                    continue;
+                }
+                const txt = byName(TYPE_TXT, ptr.target);
+                clocks.set(a.address, {
+                    name: ptr.target.substring(0, ptr.target.length - SERVICE.length - 1),
+                    host: srv.target,
+                    address: a.address,
+                    port: srv.port,
+                    version: txt && txt.txt.version
+                });
+            }
+            resolve([...clocks.values()]);
+        }, timeout);
+    });
+}
+
+/**
+ * Makes a clock's hostname from its device name, as the clock does, so that
+ * a bundle can be signed for that clock alone.
+ *
+ * @param name The device name.
+ * @returns The hostname.
+ */
+function makeHostname(name) {
+    let hostname = '';
+    for (const byte of Buffer.from(name)) {
+        if (hostname.length >= HOSTNAME_MAX_LEN) {
+            break;
+        }
+        const ch = String.fromCharCode(byte);
+        if (/[A-Za-z0-9]/.test(ch)) {
+            hostname += ch.toLowerCase();
+        } else if (hostname.length > 0 && !hostname.endsWith('-')) {
+            hostname += '-';
+        }
+    }
+    hostname = hostname.replace(/-+$/, '');
+    return hostname || 'espclock';
+}
+
+/**
+ * Sends an HTTP request to a clock, timing it.
+ *
+ * @param url The URL.
+ * @param options The fetch options.
+ * @param timeout The request timeout (ms).
+ * @returns The response and the time taken (ms).
+ */
+async function timedFetch(url, options, timeout) {
+    const start = process.hrtime.bigint();
+    const response = await fetch(url, { ...options, signal: AbortSignal.timeout(timeout) });
+    const body = await response.text();
+    return { response, body, latency: Number(process.hrtime.bigint() - start) / 1e6 };
+}
+
+/**
+ * Pushes a configuration to a clock as a signed bundle. The clock's current
+ * configuration is read first, so that the bundle is complete, keeps the
+ * clock's name, and is signed for that clock's hostname.
+ *
+ * @param address The address of the clock.
+ * @param config The configuration values to change.
+ * @param key The fleet key.
+ * @param sequence The sequence of the bundle.
+ * @param timeout The request timeout (ms).
+ * @returns The latency of the push (ms).
+ */
+async function push(address, config, key, sequence, timeout) {
+    const current = await timedFetch(`http://${address}/config`, {}, timeout);
+    if (!current.response.ok) {
+        throw new Error(`reading config failed: HTTP ${current.response.status} ${current.body}`);
+    }
+    const existing = JSON.parse(current.body);
+    const payload = JSON.stringify({ ...existing, ...config, deviceName: existing.deviceName });
+    const hostname = makeHostname(existing.deviceName);
+    const signature = crypto.createHmac('sha256', key).update(`${hostname}:${sequence}:${payload}`).digest('hex');
+    const result = await timedFetch(`http://${address}/configBundle`, {
+        method: 'POST',
+        headers: { 'Content-Type': 'application/json' },
+        body: JSON.stringify({ sequence, payload, signature })
+    }, timeout);
+    if (!result.response.ok) {
+        throw new Error(`HTTP ${result.response.status} ${result.body}`);
+    }
+    return result.latency;
+}
+
+/**
+ * Uploads an OTA update to a clock, with its SHA-256 digest so that the clock
+ * can verify it as it is written, and the digest signed with the fleet key so
+ * that the clock accepts it. The clock restarts into the update once any
+ * alarm has finished.
+ *
+ * @param address The address of the clock.
+ * @param image The contents of the update.
+ * @param isFilesystem Flag set when the update is a file system image.
+ * @param key The fleet key.
+ * @param timeout The request timeout (ms).
+ * @returns The latency of the upload (ms).
+ */
+async function update(address, image, isFilesystem, key, timeout) {
+    const digest = crypto.createHash('sha256').update(image).digest();
+    const signature = crypto.createHmac('sha256', key).update(digest).digest('hex');
+    const form = new FormData();
+    form.append('image', new Blob([image]), 'image.bin');
+    const type = isFilesystem ? '&type=filesystem' : '';
+    const query = `sha256=${digest.toString('hex')}&signature=${signature}${type}`;
+    const result = await timedFetch(`http://${address}/update?${query}`, {
+        method: 'POST',
+        body: form
+    }, timeout);
+    if (!result.response.ok) {
+        throw new Error(`HTTP ${result.response.status} ${result.body}`);
+    }
+    return result.latency;
+}
+
+/**
+ * Runs an operation on each clock in parallel, reporting the results.
+ *
+ * @param addresses The addresses of the clocks.
+ * @param operation The operation, given an address and returning its latency.
+ * @param action What the operation does to each clock, for the summary.
+ * @returns The process exit code.
+ */
+async function forEachClock(addresses, operation, action) {
+    const results = await Promise.allSettled(addresses.map(operation));
+    let failures = 0;
+    results.forEach((result, ii) => {
+        if (result.status === 'fulfilled') {
+            console.log(`${addresses[ii]}\tOK\t${result.value.toFixed(1)} ms`);
+        } else {
+            failures++;
+            console.log(`${addresses[ii]}\tFAILED\t${result.reason.message}`);
+        }
+    });
+    const latencies = results.filter(r => r.status === 'fulfilled').map(r => r.value);
+    const max = latencies.length ? Math.max(...latencies).toFixed(1) : '-';
+    console.log(`${addresses.length - failures} of ${addresses.length} clocks ${action} (max ${max} ms)`);
+    return failures === 0 ? 0 : 1;
+}
+
+/**
+ * Finds the clocks to act on.
+ *
+ * @param hosts The comma separated addresses given, or null to discover them.
+ * @param timeout How long to wait for discovery responses (ms).
+ * @returns The addresses of the clocks.
+ */
+async function findClocks(hosts, timeout) {
+    return hosts ? hosts.split(',') : (await discover(timeout)).map(c => c.address);
+}
+
+async function main(args) {
+    const option = (name, fallback) => {
+        const index = args.indexOf(name);
+        return index >= 0 ? args[index + 1] : fallback;
+    };
+    const timeout = parseInt(option('--timeout', '3000'), 10);
+
+    if (args[0] === 'discover') {
+        const clocks = await discover(timeout);
+        for (const clock of clocks) {
+            console.log(`${clock.address}\t${clock.host}\t${clock.name}\t${clock.version || '?'}`);
+        }
+        console.log(`${clocks.length} clocks found`);
+        return 0;
+    }
+
+    const key = option('--key', process.env.FLEET_KEY);
+    if ((args[0] === 'push' || args[0] === 'update') && !key) {
+        console.log('The fleet key must be given with --key or FLEET_KEY');
+        return 2;
+    }
+
+    if (args[0] === 'push' && args[1]) {
+        const config = JSON.parse(fs.readFileSync(args[1]));
+        const addresses = await findClocks(option('--hosts', null), timeout);
+        const sequence = Math.floor(Date.now() / 1000);
+        return forEachClock(addresses, a => push(a, config, key, sequence, timeout), 'updated');
+    }
+
+    if (args[0] === 'update' && args[1]) {
+        const image = fs.readFileSync(args[1]);
+        const isFilesystem = args.includes('--filesystem');
+        const addresses = await findClocks(option('--hosts', null), timeout);
+        // Writing the image to flash takes far longer than a configuration push.
+        const uploadTimeout = Math.max(timeout, 120000);
+        return forEachClock(addresses, a => update(a, image, isFilesystem, key, uploadTimeout), 'uploaded');
+    }
+
+    console.log('Usage: node fleet.js discover | push <config.json> [--key <key>] [--hosts <a,b>] | ' +
+        'update <image.bin> [--filesystem] [--key <key>] [--hosts <a,b>]');
+    return 2;
+}
+
+if (require.main === module) {
+    main(process.argv.slice(2)).then(code => {
+        process.exitCode = code;
+    }, err => {
+        console.error(err.message);
+        process.exitCode = 1;
+    });
+}
+
+module.exports = { buildQuery, decodeResponse };
@@ -0,0 +1,166 @@
+// Decodes display recordings dumped from the clock's /recording endpoint, and
+// compares two of them to catch changes in what is displayed or how long it
+// takes to render.
+//
+// Usage:
+//   node recording.js <recording>                 Summarise a recording.
+//   node recording.js <baseline> <candidate>      Compare two recordings.
+const fs = require('fs');
+
+const RECORDING_MAGIC = 0xc10cf4a0;
+const DUMP_HEADER_SIZE = 12;
+const RECORD_HEADER_SIZE = 6;
+const RECORD_INPUTS = 1;
+const RECORD_FRAME = 2;
+
+/**
+ * Reads a recording, replaying the frame changes from the first full frame.
+ *
+ * @param file The file containing the dumped recording.
+ * @returns The frames and input changes, with loop numbers relative to the
+ *          first full frame.
+ */
+function readRecording(file) {
+    const data = fs.readFileSync(file);
+    if (data.length < DUMP_HEADER_SIZE || data.readUInt32LE(0) !== RECORDING_MAGIC) {
+        throw new Error(file + ' is not a display recording');
+    }
+    const ledCount = data.readUInt16LE(4);
+    const loopDelay = data.readUInt16LE(6);
+    const end = DUMP_HEADER_SIZE + data.readUInt32LE(8);
+
+    let pixels = null;
+    let firstLoop = 0;
+    const frames = [];
+    const inputs = [];
+    for (let pos = DUMP_HEADER_SIZE; pos + RECORD_HEADER_SIZE <= end;) {
+        const type = data.readUInt8(pos);
+        const length = data.readUInt8(pos + 1);
+        const loop = data.readUInt32LE(pos + 2);
+        const body = pos + RECORD_HEADER_SIZE;
+        pos = body + length;
+
+        if (type === RECORD_FRAME) {
+            const renderTime = data.readUInt16LE(body);
+            const count = data.readUInt8(body + 2);
+            if (pixels === null) {
+                if (count < ledCount) {
+                    // The changes can't be applied until there's a full frame.
+                    continue;
+                }
+                pixels = Buffer.alloc(ledCount * 3);
+                firstLoop = loop;
+            }
+            for (let ii = 0; ii < count; ii++) {
+                const led = body + 3 + (ii * 4);
+                data.copy(pixels, data.readUInt8(led) * 3, led + 1, led + 4);
+            }
+            frames.push({ loop: loop - firstLoop, renderTime, pixels: Buffer.from(pixels) });
+        } else if (type === RECORD_INPUTS && pixels !== null) {
+            inputs.push({
+                loop: loop - firstLoop,
+                time: data.readUInt32LE(body),
+                encoder: data.readInt32LE(body + 4),
+                button: data.readUInt8(body + 8),
+                ldr: data.readUInt16LE(body + 9)
+            });
+        }
+    }
+    return { ledCount, loopDelay, frames, inputs };
+}
+
+/**
+ * Calculates the render time statistics for a recording.
+ *
+ * @param recording The recording.
+ * @returns The average and maximum render times (us).
+ */
+function renderStats(recording) {
+    const times = recording.frames.map(f => f.renderTime);
+    const total = times.reduce((a, b) => a + b, 0);
+    return {
+        average: times.length ? total / times.length : 0,
+        max: times.length ? Math.max(...times) : 0
+    };
+}
+
+/**
+ * Finds the frame displayed at each loop.
+ *
+ * @param recording The recording.
+ * @returns A map of loop number to the frame's pixels.
+ */
+function framesByLoop(recording) {
+    const result = new Map();
+    if (recording.frames.length === 0) {
+        return result;
+    }
+    const last = recording.frames[recording.frames.length - 1].loop;
+    let index = 0;
+    for (let loop = 0; loop <= last; loop++) {
+        while (index + 1 < recording.frames.length && recording.frames[index + 1].loop <= loop) {
+            index++;
+        }
+        result.set(loop, recording.frames[index].pixels);
+    }
+    return result;
+}
+
+function summarise(file) {
+    const recording = readRecording(file);
+    const stats = renderStats(recording);
+    const loops = recording.frames.length ? recording.frames[recording.frames.length - 1].loop + 1 : 0;
+    console.log(`${file}: ${loops} loops (${(loops * recording.loopDelay) / 1000} s), ` +
+        `${recording.frames.length} frames, ${recording.inputs.length} input changes`);
+    console.log(`Render time: average ${stats.average.toFixed(1)} us, max ${stats.max} us`);
+}
+
+function compare(baselineFile, candidateFile) {
+    const baseline = readRecording(baselineFile);
+    const candidate = readRecording(candidateFile);
+    if (baseline.ledCount !== candidate.ledCount) {
+        console.log(`LED counts differ: ${baseline.ledCount} vs ${candidate.ledCount}`);
+        return 1;
+    }
+
+    // Compare the displays loop by loop, from each recording's first full frame.
+    const baseFrames = framesByLoop(baseline);
+    const candidateFrames = framesByLoop(candidate);
+    let compared = 0;
+    let differences = 0;
+    for (const [loop, pixels] of baseFrames) {
+        const other = candidateFrames.get(loop);
+        if (other === undefined) {
+            break;
+        }
+        compared++;
+        if (!pixels.equals(other)) {
+            if (differences === 0) {
+                const leds = [];
+                for (let ii = 0; ii < baseline.ledCount; ii++) {
+                    if (pixels.compare(other, ii * 3, (ii * 3) + 3, ii * 3, (ii * 3) + 3) !== 0) {
+                        leds.push(ii);
+                    }
+                }
+                console.log(`First difference at loop ${loop}, LEDs ${leds.join(', ')}`);
+            }
+            differences++;
+        }
+    }
+    console.log(`${differences} of ${compared} loops differ`);
+
+    const baseStats = renderStats(baseline);
+    const candidateStats = renderStats(candidate);
+    console.log(`Render time: average ${baseStats.average.toFixed(1)} -> ${candidateStats.average.toFixed(1)} us, ` +
+        `max ${baseStats.max} -> ${candidateStats.max} us`);
+    return differences === 0 ? 0 : 1;
+}
+
+if (process.argv.length === 3) {
+    summarise(process.argv[2]);
+} else if (process.argv.length === 4) {
+    process.exitCode = compare(process.argv[2], process.argv[3]);
+} else {
+    console.log('Usage: node recording.js <recording> [<candidate recording>]');
+    process.exitCode = 2;
+}
@@ -0,0 +1,162 @@
+// Receives the telemetry datagrams sent by the clock, and decodes them into a
+// summary each second, or into CSV for further analysis.
+//
+// Usage:
+//   node telemetry.js [--port <port>] [--csv]
+const dgram = require('dgram');
+
+const TELEMETRY_MAGIC = 0xc10c7e1e;
+const DATAGRAM_HEADER_SIZE = 12;
+const RECORD_HEADER_SIZE = 6;
+const TELEMETRY_LOOP = 1;
+const TELEMETRY_STATE = 2;
+const TELEMETRY_BRIGHTNESS = 3;
+const TELEMETRY_HEAP = 4;
+
+const STATES = [
+    'INITIALISING', 'SHOW_MESSAGE', 'RUNNING',
+    'SHOW_ALARM', 'SHOW_SNOOZE', 'MENU_ALARM_HOURS', 'MENU_ALARM_MINUTES', 'MENU_ALARM_DAYS',
+    'SETUP_MENU_RADIO_WHOLE', 'SETUP_MENU_RADIO_FRACTION', 'SETUP_MENU_12_24_HOURS',
+    'SETUP_MENU_BRIGHTNESS', 'SETUP_MENU_DAY_COLOUR_INTRO', 'SETUP_MENU_DAY_COLOUR_R',
+    'SETUP_MENU_DAY_COLOUR_G', 'SETUP_MENU_DAY_COLOUR_B', 'SETUP_MENU_NIGHT_COLOUR_INTRO',
+    'SETUP_MENU_NIGHT_COLOUR_R', 'SETUP_MENU_NIGHT_COLOUR_G', 'SETUP_MENU_NIGHT_COLOUR_B',
+    'SETUP_MENU_ALARM_PATTERN', 'CANCELLED'
+];
+const ALARM_STATES = ['INACTIVE', 'WAKING', 'ACTIVE', 'SNOOZE'];
+
+/**
+ * Decodes a telemetry datagram.
+ *
+ * @param data The datagram.
+ * @returns The datagram's header values and records, or null if it isn't a
+ *          telemetry datagram.
+ */
+function decodeDatagram(data) {
+    if (data.length < DATAGRAM_HEADER_SIZE || data.readUInt32LE(0) !== TELEMETRY_MAGIC) {
+        return null;
+    }
+    const datagram = {
+        sequence: data.readUInt32LE(4),
+        dropped: data.readUInt16LE(8),
+        loopDelay: data.readUInt16LE(10),
+        records: []
+    };
+    for (let pos = DATAGRAM_HEADER_SIZE; pos + RECORD_HEADER_SIZE <= data.length;) {
+        const type = data.readUInt8(pos);
+        const length = data.readUInt8(pos + 1);
+        const loop = data.readUInt32LE(pos + 2);
+        const body = pos + RECORD_HEADER_SIZE;
+        pos = body + length;
+        if (pos > data.length) {
+            break;
+        }
+
+        if (type === TELEMETRY_LOOP) {
+            datagram.records.push({ type: 'loop', loop,
+                loopTime: data.readUInt16LE(body), renderTime: data.readUInt16LE(body + 2) });
+        } else if (type === TELEMETRY_STATE) {
+            datagram.records.push({ type: 'state', loop,
+                state: STATES[data.readUInt8(body)] || data.readUInt8(body),
+                alarmState: ALARM_STATES[data.readUInt8(body + 1)] || data.readUInt8(body + 1) });
+        } else if (type === TELEMETRY_BRIGHTNESS) {
+            datagram.records.push({ type: 'brightness', loop,
+                ldr: data.readUInt16LE(body), brightness: data.readUInt8(body + 2) });
+        } else if (type === TELEMETRY_HEAP) {
+            datagram.records.push({ type: 'heap', loop,
+                freeHeap: data.readUInt32LE(body), largestBlock: data.readUInt32LE(body + 4) });
+        }
+    }
+    return datagram;
+}
+
+/**
+ * Collects the records received in a second, and prints their summary.
+ */
+class Summary {
+    constructor() {
+        this.reset();
+    }
+
+    reset() {
+        this.datagrams = 0;
+        this.lost = 0;
+        this.dropped = 0;
+        this.loops = [];
+        this.heap = null;
+        this.brightness = null;
+    }
+
+    add(datagram, lost) {
+        this.datagrams++;
+        this.lost += lost;
+        this.dropped += datagram.dropped;
+        for (const record of datagram.records) {
+            if (record.type === 'loop') {
+                this.loops.push(record);
+            } else if (record.type === 'state') {
+                console.log(`Loop ${record.loop}: state ${record.state}, alarm ${record.alarmState}`);
+            } else if (record.type === 'heap') {
+                this.heap = record;
+            } else if (record.type === 'brightness') {
+                this.brightness = record;
+            }
+        }
+    }
+
+    print() {
+        if (this.datagrams === 0) {
+            return;
+        }
+        const stats = (values) => {
+            const total = values.reduce((a, b) => a + b, 0);
+            return `avg ${(values.length ? total / values.length : 0).toFixed(0)} max ${Math.max(0, ...values)} us`;
+        };
+        let line = `${this.loops.length} loops, loop ${stats(this.loops.map(l => l.loopTime))}, ` +
+            `render ${stats(this.loops.map(l => l.renderTime))}`;
+        if (this.heap) {
+            line += `, heap ${this.heap.freeHeap} (largest ${this.heap.largestBlock})`;
+        }
+        if (this.brightness) {
+            line += `, LDR ${this.brightness.ldr} -> ${this.brightness.brightness}`;
+        }
+        if (this.lost || this.dropped) {
+            line += `, ${this.lost} datagrams lost, ${this.dropped} records dropped`;
+        }
+        console.log(line);
+        this.reset();
+    }
+}
+
+const args = process.argv.slice(2);
+const portIndex = args.indexOf('--port');
+const port = portIndex >= 0 ? parseInt(args[portIndex + 1], 10) : 65432;
+const isCsv = args.includes('--csv');
+
+const summary = new Summary();
+let nextSequence = null;
+const socket = dgram.createSocket('udp4');
+socket.on('message', (data, remote) => {
+    const datagram = decodeDatagram(data);
+    if (datagram === null) {
+        return;
+    }
+    const lost = (nextSequence === null || datagram.sequence < nextSequence) ? 0 : datagram.sequence - nextSequence;
+    nextSequence = datagram.sequence + 1;
+
+    if (isCsv) {
+        for (const record of datagram.records) {
+            const values = Object.keys(record).filter(k => k !== 'type' && k !== 'loop').map(k => record[k]);
+            console.log([remote.address, datagram.sequence, record.loop, record.type, ...values].join(','));
+        }
+    } else {
+        summary.add(datagram, lost);
+    }
+});
+socket.on('listening', () => {
+    console.error(`Listening for telemetry on UDP port ${socket.address().port}`);
+});
+socket.bind(port);
+
+if (!isCsv) {
+    setInterval(() => summary.print(), 1000);
+}
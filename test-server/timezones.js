@@ -0,0 +1,93 @@
+// Generates the clock's time zone database (include/timezones.h) from the
+// IANA tz database installed on this machine. Each zone in zone.tab is mapped
+// to the POSIX TZ rule at the end of its compiled TZif file, and the zones are
+// sorted by name so that the clock can find one with a binary search.
+//
+// Usage:
+//   node timezones.js [--zoneinfo <dir>] [--output <file>]
+const fs = require('fs');
+const path = require('path');
+
+/**
+ * Reads the POSIX TZ rule from the footer of a version 2+ TZif file.
+ *
+ * @param file The TZif file.
+ * @returns The rule, or null if the file doesn't have one.
+ */
+function readRule(file) {
+    const data = fs.readFileSync(file);
+    if (data.toString('latin1', 0, 4) !== 'TZif' || data[4] < 0x32) {
+        return null;
+    }
+    const end = data.lastIndexOf(0x0a);
+    const start = data.lastIndexOf(0x0a, end - 1);
+    const rule = data.toString('latin1', start + 1, end);
+    return rule.length > 0 ? rule : null;
+}
+
+/**
+ * Determines whether newlib's tzset() can handle a rule. It can't parse
+ * negative transition times, e.g. "M3.5.0/-1".
+ *
+ * @param rule The POSIX TZ rule.
+ * @returns true if the rule can be used, false otherwise.
+ */
+function isSupported(rule) {
+    return !/\/-/.test(rule);
+}
+
+function main(args) {
+    const option = (name, fallback) => {
+        const index = args.indexOf(name);
+        return index >= 0 ? args[index + 1] : fallback;
+    };
+    const zoneinfo = option('--zoneinfo', '/usr/share/zoneinfo');
+    const output = option('--output', path.join(__dirname, '../include/timezones.h'));
+
+    const version = (fs.readFileSync(path.join(zoneinfo, 'tzdata.zi'), 'utf8').match(/^# version (\S+)/) || [])[1];
+    const names = fs.readFileSync(path.join(zoneinfo, 'zone.tab'), 'utf8').split('\n')
+        .filter(line => line && !line.startsWith('#'))
+        .map(line => line.split('\t')[2]);
+    names.push('UTC');
+
+    const zones = [];
+    for (const name of [...new Set(names)]) {
+        const rule = readRule(path.join(zoneinfo, name));
+        if (rule === null || !isSupported(rule)) {
+            console.error(`Skipping ${name} (${rule})`);
+            continue;
+        }
+        zones.push({ name, rule });
+    }
+    // Sort by byte value, to match strcmp() on the clock.
+    zones.sort((a, b) => (a.name < b.name ? -1 : (a.name > b.name ? 1 : 0)));
+
+    const lines = [
+        '// The time zone database: IANA zone names and their POSIX TZ rules, sorted by',
+        `// name for a binary search. Generated by test-server/timezones.js from tzdata`,
+        `// ${version || 'unknown'}, do not edit.`,
+        '#ifndef TIMEZONES_H',
+        '#define TIMEZONES_H',
+        '',
+        '// A time zone in the time zone database.',
+        'typedef struct {',
+        '    const char *name;',
+        '    const char *rule;',
+        '} zone_rule_t;',
+        '',
+        'const zone_rule_t ZONE_RULES[] = {',
+        ...zones.map((zone, ii) => `    {"${zone.name}", "${zone.rule}"}${ii < zones.length - 1 ? ',' : ''}`),
+        '};',
+        '',
+        '// The number of time zones in the database.',
+        'const size_t ZONE_RULE_COUNT = sizeof(ZONE_RULES) / sizeof(zone_rule_t);',
+        '',
+        '#endif',
+        ''
+    ];
+    fs.writeFileSync(output, lines.join('\n'));
+    const longest = Math.max(...zones.map(z => z.name.length));
+    console.log(`${zones.length} zones written to ${output} (longest name ${longest})`);
+}
+
+main(process.argv.slice(2));
@@ -0,0 +1,330 @@
+#include <unity.h>
+#include <display_recording.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The loops that each pattern is shown for in a scripted session.
+#define SESSION_PHASE_LOOPS 20
+
+// The loop at which the calibration and the custom pattern are changed,
+// while the custom pattern is shown.
+#define SESSION_CHANGE_LOOP (SESSION_PHASE_LOOPS * 2 + SESSION_PHASE_LOOPS / 2)
+
+// The most a channel may differ from a recording made on the clock, where
+// the float maths (and powf() building the calibration) may round
+// differently.
+#define DEVICE_TOLERANCE 1
+
+// The patterns shown in turn during a scripted session.
+const display_pattern_t SESSION_PATTERNS[] = {
+    FLASHING, PULSING, CUSTOM_2, MENU, RAINBOW_SEGMENTS, RAINBOW_DIGITS
+};
+const uint8_t SESSION_PATTERN_COUNT = sizeof(SESSION_PATTERNS) / sizeof(SESSION_PATTERNS[0]);
+
+// What a replay found.
+typedef struct {
+    uint32_t firstLoop;
+    uint32_t loops;
+    uint32_t frames;
+    uint32_t differentLoops;
+    uint32_t firstDifferentLoop;
+    int firstDifferentLed;
+    uint8_t largestDifference;
+    uint32_t patternLoops[MENU + 1];
+    uint64_t recordedRenderTime;   // us
+    double replayedRenderTime;     // us
+} replay_report_t;
+
+recording_t myRecording;
+recorder_t myRecorder;
+custom_pattern_t myPatterns[CUSTOM_PATTERN_COUNT];
+uint32_t myRecordCounts[RECORD_PATTERN + 1];
+uint8_t myDump[sizeof(recording_dump_t) + RECORDING_SIZE];
+replay_t myReplay;
+
+void write_record(record_type_t type, uint32_t loop, const void *data, uint8_t length) {
+    recording_add(&myRecording, type, loop, data, length);
+    myRecordCounts[type]++;
+}
+
+void set_custom_pattern(custom_pattern_t *pattern, uint16_t period) {
+    // T0 = TRI(PHASE + LED * 8), H = H + T0, L = MAX(L, 64)
+    const pattern_op_t ops[] = {
+        { OP_MUL | PATTERN_IMMEDIATE, REG_T0, REG_LED, 2048 },
+        { OP_ADD, REG_T0, REG_T0, REG_PHASE },
+        { OP_TRI, REG_T0, 0, REG_T0 },
+        { OP_ADD, REG_H, REG_H, REG_T0 },
+        { OP_MAX | PATTERN_IMMEDIATE, REG_L, REG_L, 64 }
+    };
+    memset(pattern, 0, sizeof(custom_pattern_t));
+    pattern->period = period;
+    pattern->opCount = sizeof(ops) / sizeof(ops[0]);
+    memcpy(pattern->ops, ops, sizeof(ops));
+}
+
+/*
+ * Runs a scripted session through the display code as loop() does, recording
+ * it as the clock does.
+ *
+ * @param loops The number of loops to run.
+ */
+void run_session(uint32_t loops) {
+    recorded_loop_t current;
+    memset(&current, 0, sizeof(recorded_loop_t));
+    current.patterns = myPatterns;
+    recorded_output_t *output = &current.output;
+    output->calibration.gamma[0] = 22;
+    output->calibration.gamma[1] = 20;
+    output->calibration.gamma[2] = 18;
+    output->calibration.whiteBalance = { 255, 230, 200 };
+    memset(output->calibration.ledGain, FULL_LED_GAIN, LED_COUNT);
+    output->calibration.ledGain[3] = 200;
+    output->powerBudget = 400;
+
+    led_output_t ledOutput;
+    build_led_output(&ledOutput, &output->calibration);
+    frame_t frame;
+    uint8_t pixels[LED_COUNT * 3];
+    current.pixels = pixels;
+    display_state_t *display = &current.display;
+    recorder_begin(&myRecorder, 0);
+    for (uint32_t loop = 0; loop < loops; loop++) {
+        current.loop = loop;
+        if (loop == SESSION_CHANGE_LOOP) {
+            output->calibration.whiteBalance.b = 255;
+            output->powerBudget = 0;
+            build_led_output(&ledOutput, &output->calibration);
+            set_custom_pattern(&myPatterns[1], 50);
+        }
+
+        // The inputs: the time, the encoder and the light level.
+        uint32_t minutes = (12 * 60) + (loop / 30);
+        current.inputs.time = 1700000000 + (loop / 100);
+        current.inputs.encoder = loop / 15;
+        current.inputs.ldr = 2000 + (((loop / 10) % 7) * 250);
+
+        // What loop() makes of them.
+        uint8_t phase = (loop / SESSION_PHASE_LOOPS) % SESSION_PATTERN_COUNT;
+        display_pattern_t pattern = SESSION_PATTERNS[phase];
+        const custom_pattern_t *custom = (pattern == CUSTOM_2) ? &myPatterns[1] : NULL;
+        if (loop % SESSION_PHASE_LOOPS == 0) {
+            display->animationStep = 0;
+        } else {
+            display->animationStep = next_animation_step(pattern, custom, display->animationStep);
+        }
+        display->digits[0] = (minutes / 60) / 10;
+        display->digits[1] = (minutes / 60) % 10;
+        display->digits[2] = (minutes % 60) / 10;
+        display->digits[3] = (minutes % 60) % 10;
+        display->colon = ((loop / 50) % 2) == 0;
+        display->pm = true;
+        display->alarmSet = phase > 2;
+        display->pattern = pattern;
+        display->menuField = (pattern == MENU) ? (loop / 3) % (MENU_FIELD_BLUE + 1) : MENU_FIELD_NONE;
+        display->colour = { (uint8_t)(loop / 40), 128, 255 };
+        display->brightness = current.inputs.ldr / 4095.0f;
+
+        auto start = std::chrono::steady_clock::now();
+        render_display(&frame, display, custom);
+        frame_power_t power;
+        frame_to_pixels(&frame, display->brightness, &ledOutput, output->powerBudget, pixels, &power);
+        current.renderTime = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        recorder_loop(&myRecorder, &current, write_record);
+    }
+}
+
+/*
+ * Dumps the recording as GET /recording does.
+ *
+ * @return The length of the dump.
+ */
+size_t dump_recording() {
+    recording_dump_t *header = (recording_dump_t *)myDump;
+    header->magic = RECORDING_MAGIC;
+    header->ledCount = LED_COUNT;
+    header->loopDelay = LOOP_DELAY;
+    header->length = recording_copy(&myRecording, &myDump[sizeof(recording_dump_t)]);
+    return sizeof(recording_dump_t) + header->length;
+}
+
+/*
+ * Replays a dumped recording, comparing each loop with what was recorded.
+ *
+ * @param dump The dumped recording.
+ * @param length The length of the dump.
+ * @param tolerance The largest difference in a channel to ignore.
+ * @param report Set to what the replay found.
+ * @return true if there was something to replay, false otherwise.
+ */
+bool replay_dump(const uint8_t *dump, size_t length, uint8_t tolerance, replay_report_t *report) {
+    memset(report, 0, sizeof(replay_report_t));
+    report->firstDifferentLed = -1;
+    if (!replay_begin(&myReplay, dump, length)) {
+        return false;
+    }
+    report->firstLoop = myReplay.loop + 1;
+    while (true) {
+        auto start = std::chrono::steady_clock::now();
+        if (!replay_loop(&myReplay)) {
+            break;
+        }
+        report->replayedRenderTime += std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count();
+
+        report->loops++;
+        report->patternLoops[myReplay.display.pattern]++;
+        if (myReplay.hasFrame) {
+            report->frames++;
+            report->recordedRenderTime += myReplay.renderTime;
+        }
+        uint8_t difference;
+        int led = replay_compare(&myReplay, tolerance, &difference);
+        if (difference > report->largestDifference) {
+            report->largestDifference = difference;
+        }
+        if (led >= 0) {
+            if (report->differentLoops == 0) {
+                report->firstDifferentLoop = myReplay.loop;
+                report->firstDifferentLed = led;
+            }
+            report->differentLoops++;
+        }
+    }
+    return true;
+}
+
+void report_replay(const replay_report_t *report) {
+    char message[200];
+    snprintf(message, sizeof(message),
+        "Replayed %u loops from loop %u: %u differ (largest %u), render %.1f us/frame recorded, %.2f us/loop replayed.",
+        report->loops, report->firstLoop, report->differentLoops, report->largestDifference,
+        report->frames ? (double)report->recordedRenderTime / report->frames : 0.0,
+        report->loops ? report->replayedRenderTime / report->loops : 0.0);
+    TEST_MESSAGE(message);
+    if (report->differentLoops > 0) {
+        snprintf(message, sizeof(message), "First difference at loop %u, LED %d.",
+            report->firstDifferentLoop, report->firstDifferentLed);
+        TEST_MESSAGE(message);
+    }
+}
+
+void setUp(void) {
+    recording_clear(&myRecording);
+    memset(myRecordCounts, 0, sizeof(myRecordCounts));
+    memset(myPatterns, 0, sizeof(myPatterns));
+    set_custom_pattern(&myPatterns[1], 100);
+}
+
+void tearDown(void) {
+}
+
+void test_replay_matches_recording(void) {
+    uint32_t loops = SESSION_PHASE_LOOPS * SESSION_PATTERN_COUNT;
+    run_session(loops);
+    TEST_ASSERT_EQUAL(0, myRecording.start);
+
+    replay_report_t report;
+    TEST_ASSERT_TRUE(replay_dump(myDump, dump_recording(), 0, &report));
+    report_replay(&report);
+    TEST_ASSERT_EQUAL(0, report.firstLoop);
+    TEST_ASSERT_EQUAL(loops, report.loops);
+    TEST_ASSERT_EQUAL(0, report.differentLoops);
+    TEST_ASSERT_EQUAL(0, report.largestDifference);
+    for (uint8_t ii = 0; ii < SESSION_PATTERN_COUNT; ii++) {
+        TEST_ASSERT_EQUAL(SESSION_PHASE_LOOPS, report.patternLoops[SESSION_PATTERNS[ii]]);
+    }
+}
+
+void test_animation_steps_are_not_recorded(void) {
+    uint32_t loops = SESSION_PHASE_LOOPS * SESSION_PATTERN_COUNT;
+    run_session(loops);
+
+    // Only the loops where something other than the step changed.
+    TEST_ASSERT_LESS_THAN(loops / 3, myRecordCounts[RECORD_DISPLAY]);
+    TEST_ASSERT_GREATER_THAN(loops / 2, myRecordCounts[RECORD_FRAME]);
+    TEST_ASSERT_EQUAL(2, myRecordCounts[RECORD_PATTERN]);
+}
+
+void test_replay_starts_at_full_frame(void) {
+    // Long enough for the ring buffer to have wrapped many times.
+    run_session(SESSION_PHASE_LOOPS * SESSION_PATTERN_COUNT * 20);
+    TEST_ASSERT_NOT_EQUAL(0, myRecording.start);
+
+    replay_report_t report;
+    TEST_ASSERT_TRUE(replay_dump(myDump, dump_recording(), 0, &report));
+    report_replay(&report);
+    TEST_ASSERT_GREATER_THAN(0, report.firstLoop);
+    TEST_ASSERT_GREATER_THAN(SESSION_PHASE_LOOPS * 2, report.loops);
+    TEST_ASSERT_EQUAL(0, report.differentLoops);
+}
+
+void test_replay_finds_differences(void) {
+    run_session(SESSION_PHASE_LOOPS * SESSION_PATTERN_COUNT);
+    size_t length = dump_recording();
+
+    // Change an LED in a frame part way through, as a change in the display
+    // code would.
+    uint8_t *records = &myDump[sizeof(recording_dump_t)];
+    uint32_t frames = 0;
+    record_header_t header;
+    for (uint32_t pos = 0; pos < myRecording.used; pos += sizeof(record_header_t) + header.length) {
+        memcpy(&header, &records[pos], sizeof(record_header_t));
+        if (header.type == RECORD_FRAME && ++frames == 50) {
+            recorded_led_t *led = (recorded_led_t *)&records[pos + sizeof(record_header_t) + sizeof(recorded_frame_t)];
+            led->r ^= 0x10;
+
+            replay_report_t report;
+            TEST_ASSERT_TRUE(replay_dump(myDump, length, 0, &report));
+            report_replay(&report);
+            TEST_ASSERT_GREATER_THAN(0, report.differentLoops);
+            TEST_ASSERT_EQUAL(header.loop, report.firstDifferentLoop);
+            TEST_ASSERT_EQUAL(led->led, report.firstDifferentLed);
+            TEST_ASSERT_EQUAL(0x10, report.largestDifference);
+            return;
+        }
+    }
+    TEST_FAIL_MESSAGE("Not enough frames recorded.");
+}
+
+void test_rejects_bad_dumps(void) {
+    run_session(SESSION_PHASE_LOOPS);
+    size_t length = dump_recording();
+    replay_report_t report;
+    TEST_ASSERT_FALSE(replay_dump(myDump, sizeof(recording_dump_t) - 1, 0, &report));
+    TEST_ASSERT_FALSE(replay_dump(myDump, length - 1, 0, &report));
+    myDump[0] ^= 0xFF;
+    TEST_ASSERT_FALSE(replay_dump(myDump, length, 0, &report));
+}
+
+void test_replay_dump(void) {
+    // A recording from the clock, e.g. "RECORDING=dump.bin pio test -e native".
+    const char *path = getenv("RECORDING");
+    if (path == NULL) {
+        TEST_IGNORE_MESSAGE("Set RECORDING to the path of a dump from GET /recording to replay it.");
+    }
+    FILE *file = fopen(path, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    size_t length = fread(myDump, 1, sizeof(myDump), file);
+    fclose(file);
+
+    replay_report_t report;
+    TEST_ASSERT_TRUE_MESSAGE(replay_dump(myDump, length, DEVICE_TOLERANCE, &report),
+        "The recording has no full frame to start from.");
+    report_replay(&report);
+    TEST_ASSERT_EQUAL(0, report.differentLoops);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_replay_matches_recording);
+    RUN_TEST(test_animation_steps_are_not_recorded);
+    RUN_TEST(test_replay_starts_at_full_frame);
+    RUN_TEST(test_replay_finds_differences);
+    RUN_TEST(test_rejects_bad_dumps);
+    RUN_TEST(test_replay_dump);
+    return UNITY_END();
+}
@@ -0,0 +1,182 @@
+#include <unity.h>
+#include <radio_stations.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The most stations the simulated band can hold.
+#define MAX_SIM_STATIONS 32
+
+// The signal level lost for each 100 kHz away from a station.
+#define SIM_LEVEL_FALLOFF 3
+
+// The signal level of an empty frequency.
+#define SIM_NOISE_LEVEL 2
+
+// A station broadcasting in the simulated band.
+typedef struct {
+    uint16_t frequency;
+    uint8_t level;
+} sim_station_t;
+
+// A simulated TEA5767. Each station also shows (weaker) on the neighbouring
+// frequencies, and the signal level is 4 bits, as with the real receiver.
+typedef struct {
+    sim_station_t stations[MAX_SIM_STATIONS];
+    uint8_t stationCount;
+    uint16_t frequency;
+    bool isMuted;
+    uint32_t tunes;
+    uint32_t unmutedTunes;
+} sim_tea5767_t;
+
+sim_tea5767_t mySim;
+
+void sim_add_station(uint16_t frequency, uint8_t level) {
+    mySim.stations[mySim.stationCount].frequency = frequency;
+    mySim.stations[mySim.stationCount].level = level;
+    mySim.stationCount++;
+}
+
+uint8_t sim_tune(uint16_t frequency) {
+    mySim.frequency = frequency;
+    mySim.tunes++;
+    if (!mySim.isMuted) {
+        mySim.unmutedTunes++;
+    }
+
+    int level = SIM_NOISE_LEVEL;
+    for (uint8_t ii = 0; ii < mySim.stationCount; ii++) {
+        int distance = abs((int)frequency - (int)mySim.stations[ii].frequency);
+        int stationLevel = (int)mySim.stations[ii].level - (distance * SIM_LEVEL_FALLOFF);
+        if (stationLevel > level) {
+            level = stationLevel;
+        }
+    }
+    return (level > 15) ? 15 : (uint8_t)level;
+}
+
+void sim_set_mute(bool mute) {
+    mySim.isMuted = mute;
+}
+
+const radio_driver_t SIM_DRIVER = { sim_tune, sim_set_mute };
+
+void setUp(void) {
+    memset(&mySim, 0, sizeof(sim_tea5767_t));
+    mySim.isMuted = false;
+}
+
+void tearDown(void) {
+}
+
+void test_scan_ranks_stations(void) {
+    sim_add_station(921, 10);
+    sim_add_station(1003, 14);
+    sim_add_station(1057, 12);
+    sim_add_station(963, 6);
+
+    radio_station_t stations[MAX_RADIO_STATIONS];
+    uint8_t count = radio_scan_band(&SIM_DRIVER, stations);
+
+    // Every frequency was checked, with the receiver muted.
+    TEST_ASSERT_EQUAL(RADIO_SCAN_COUNT, mySim.tunes);
+    TEST_ASSERT_EQUAL(0, mySim.unmutedTunes);
+    TEST_ASSERT_TRUE(mySim.isMuted);
+
+    // Only the peaks count, the neighbours and the weak station don't.
+    TEST_ASSERT_EQUAL(3, count);
+    TEST_ASSERT_EQUAL(1003, stations[0].frequency);
+    TEST_ASSERT_EQUAL(14, stations[0].level);
+    TEST_ASSERT_EQUAL(1057, stations[1].frequency);
+    TEST_ASSERT_EQUAL(921, stations[2].frequency);
+}
+
+void test_scan_finds_stations_at_band_edges(void) {
+    sim_add_station(RADIO_SCAN_START, 9);
+    sim_add_station(RADIO_SCAN_END, 11);
+
+    radio_station_t stations[MAX_RADIO_STATIONS];
+    TEST_ASSERT_EQUAL(2, radio_scan_band(&SIM_DRIVER, stations));
+    TEST_ASSERT_EQUAL(RADIO_SCAN_END, stations[0].frequency);
+    TEST_ASSERT_EQUAL(RADIO_SCAN_START, stations[1].frequency);
+}
+
+void test_scan_counts_plateau_once(void) {
+    // A station strong enough to max out the level on either side.
+    sim_add_station(990, 18);
+
+    radio_station_t stations[MAX_RADIO_STATIONS];
+    TEST_ASSERT_EQUAL(1, radio_scan_band(&SIM_DRIVER, stations));
+    TEST_ASSERT_EQUAL(15, stations[0].level);
+}
+
+void test_scan_keeps_strongest(void) {
+    // More stations than fit in the table, with levels 7-15.
+    for (uint8_t ii = 0; ii < 20; ii++) {
+        sim_add_station(880 + (ii * 10), 7 + (ii % 9));
+    }
+
+    radio_station_t stations[MAX_RADIO_STATIONS];
+    TEST_ASSERT_EQUAL(MAX_RADIO_STATIONS, radio_scan_band(&SIM_DRIVER, stations));
+    for (uint8_t ii = 1; ii < MAX_RADIO_STATIONS; ii++) {
+        TEST_ASSERT_TRUE(stations[ii - 1].level >= stations[ii].level);
+    }
+
+    // The four weakest (levels 7, 7, 7 and 8) were dropped.
+    TEST_ASSERT_EQUAL(15, stations[0].level);
+    TEST_ASSERT_EQUAL(8, stations[MAX_RADIO_STATIONS - 1].level);
+}
+
+void test_play_uses_first_good_frequency(void) {
+    sim_add_station(945, 4);
+    sim_add_station(1012, 9);
+    sim_add_station(1040, 13);
+
+    // The alarm frequency, then the presets, with an unused preset.
+    uint16_t frequencies[] = {945, 0, 1012, 1040};
+    uint8_t levels[4];
+    TEST_ASSERT_EQUAL(2, radio_play_first(&SIM_DRIVER, frequencies, 4, levels));
+    TEST_ASSERT_EQUAL(1012, mySim.frequency);
+    TEST_ASSERT_FALSE(mySim.isMuted);
+
+    // The poor frequency was tried, the unused and later ones weren't.
+    TEST_ASSERT_EQUAL(2, mySim.tunes);
+    TEST_ASSERT_EQUAL(0, mySim.unmutedTunes);
+    TEST_ASSERT_EQUAL(4, levels[0]);
+    TEST_ASSERT_EQUAL(0, levels[1]);
+    TEST_ASSERT_EQUAL(9, levels[2]);
+    TEST_ASSERT_EQUAL(0, levels[3]);
+}
+
+void test_play_falls_back_to_buzzer(void) {
+    // Nothing but noise, even on the preset.
+    sim_add_station(1012, 4);
+
+    uint16_t frequencies[] = {945, 1012, 0};
+    uint8_t levels[3];
+    TEST_ASSERT_EQUAL(-1, radio_play_first(&SIM_DRIVER, frequencies, 3, levels));
+    TEST_ASSERT_TRUE(mySim.isMuted);
+    TEST_ASSERT_EQUAL(2, mySim.tunes);
+    TEST_ASSERT_EQUAL(SIM_NOISE_LEVEL, levels[0]);
+    TEST_ASSERT_EQUAL(4, levels[1]);
+}
+
+void test_play_with_no_frequencies(void) {
+    uint16_t frequencies[] = {0, 0};
+    uint8_t levels[2];
+    TEST_ASSERT_EQUAL(-1, radio_play_first(&SIM_DRIVER, frequencies, 2, levels));
+    TEST_ASSERT_EQUAL(0, mySim.tunes);
+    TEST_ASSERT_TRUE(mySim.isMuted);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_scan_ranks_stations);
+    RUN_TEST(test_scan_finds_stations_at_band_edges);
+    RUN_TEST(test_scan_counts_plateau_once);
+    RUN_TEST(test_scan_keeps_strongest);
+    RUN_TEST(test_play_uses_first_good_frequency);
+    RUN_TEST(test_play_falls_back_to_buzzer);
+    RUN_TEST(test_play_with_no_frequencies);
+    return UNITY_END();
+}
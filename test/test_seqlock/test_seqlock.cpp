@@ -0,0 +1,172 @@
+#include <unity.h>
+#include <seqlock.h>
+#include <atomic>
+#include <thread>
+
+// Larger than the clock's configuration, so that a copy takes long enough to
+// race with a writer, even on a single core.
+#define SNAPSHOT_WORDS 4096
+
+// The publishes made by each writer in the stress test.
+#define STRESS_PUBLISHES 200000
+
+// A value whose words are all the same when it hasn't been torn.
+typedef struct {
+    uint32_t words[SNAPSHOT_WORDS];
+} snapshot_t;
+
+seqlock_t<snapshot_t> myShared;
+
+void fill_snapshot(snapshot_t *snapshot, uint32_t value) {
+    for (uint32_t ii = 0; ii < SNAPSHOT_WORDS; ii++) {
+        snapshot->words[ii] = value;
+    }
+}
+
+bool is_consistent(const snapshot_t *snapshot) {
+    for (uint32_t ii = 1; ii < SNAPSHOT_WORDS; ii++) {
+        if (snapshot->words[ii] != snapshot->words[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void setUp(void) {
+    snapshot_t initial;
+    fill_snapshot(&initial, 0);
+    seqlock_publish(&myShared, &initial);
+}
+
+void tearDown(void) {
+}
+
+void test_publish_then_read(void) {
+    snapshot_t value;
+    fill_snapshot(&value, 42);
+    uint32_t published = seqlock_publish(&myShared, &value);
+    TEST_ASSERT_EQUAL(0, published & 1);
+    TEST_ASSERT_EQUAL(published, seqlock_sequence(&myShared));
+
+    snapshot_t copy;
+    uint32_t sequence;
+    TEST_ASSERT_TRUE(seqlock_try_read(&myShared, &copy, &sequence));
+    TEST_ASSERT_EQUAL(published, sequence);
+    TEST_ASSERT_EQUAL_MEMORY(&value, &copy, sizeof(snapshot_t));
+
+    fill_snapshot(&value, 43);
+    TEST_ASSERT_EQUAL(published + 2, seqlock_publish(&myShared, &value));
+    TEST_ASSERT_EQUAL(published + 2, seqlock_read(&myShared, &copy));
+    TEST_ASSERT_EQUAL(43, copy.words[SNAPSHOT_WORDS - 1]);
+}
+
+void test_read_during_write_fails(void) {
+    // Simulate a writer that has started, but not finished.
+    uint32_t sequence = seqlock_sequence(&myShared);
+    myShared.sequence.store(sequence + 1);
+
+    snapshot_t copy;
+    uint32_t readSequence;
+    TEST_ASSERT_FALSE(seqlock_try_read(&myShared, &copy, &readSequence));
+
+    myShared.sequence.store(sequence);
+    TEST_ASSERT_TRUE(seqlock_try_read(&myShared, &copy, &readSequence));
+}
+
+void test_concurrent_no_tearing(void) {
+    std::atomic<bool> isDone(false);
+    std::atomic<uint32_t> torn(0);
+    std::atomic<uint32_t> backwards(0);
+    std::atomic<uint32_t> consistent(0);
+    std::atomic<uint32_t> retries(0);
+    uint32_t startSequence = seqlock_sequence(&myShared);
+
+    // Two writers, like loop() and the web server both publishing.
+    auto writer = [](uint32_t id) {
+        snapshot_t value;
+        for (uint32_t ii = 1; ii <= STRESS_PUBLISHES; ii++) {
+            fill_snapshot(&value, (id << 24) | ii);
+            seqlock_publish(&myShared, &value);
+        }
+    };
+
+    // Readers making single attempts, like loop() does.
+    auto reader = [&]() {
+        snapshot_t copy;
+        uint32_t last = 0;
+        while (!isDone.load()) {
+            uint32_t sequence;
+            if (!seqlock_try_read(&myShared, &copy, &sequence)) {
+                retries++;
+                continue;
+            }
+            if (!is_consistent(&copy)) {
+                torn++;
+            }
+            if (sequence < last || (sequence & 1) != 0) {
+                backwards++;
+            }
+            last = sequence;
+            consistent++;
+        }
+    };
+
+    std::thread reader1(reader);
+    std::thread reader2(reader);
+    std::thread writer1(writer, 1);
+    std::thread writer2(writer, 2);
+    writer1.join();
+    writer2.join();
+    isDone = true;
+    reader1.join();
+    reader2.join();
+
+    char message[100];
+    snprintf(message, sizeof(message), "%u consistent reads, %u retries.",
+        (unsigned)consistent.load(), (unsigned)retries.load());
+    TEST_MESSAGE(message);
+    TEST_ASSERT_EQUAL(0, torn.load());
+    TEST_ASSERT_EQUAL(0, backwards.load());
+    TEST_ASSERT_GREATER_THAN(0, consistent.load());
+
+    // The writers didn't interleave, so every publish moved the sequence on
+    // by exactly two.
+    snapshot_t copy;
+    uint32_t sequence = seqlock_read(&myShared, &copy);
+    TEST_ASSERT_EQUAL(startSequence + (4 * STRESS_PUBLISHES), sequence);
+    TEST_ASSERT_TRUE(is_consistent(&copy));
+    TEST_ASSERT_EQUAL(STRESS_PUBLISHES, copy.words[0] & 0xffffff);
+}
+
+void test_publish_if_rejects_stale(void) {
+    snapshot_t value;
+    uint32_t base = seqlock_read(&myShared, &value);
+
+    // Another writer publishes after the value was read.
+    fill_snapshot(&value, 7);
+    uint32_t other = seqlock_publish(&myShared, &value);
+
+    fill_snapshot(&value, 8);
+    uint32_t sequence = 0;
+    TEST_ASSERT_FALSE(seqlock_publish_if(&myShared, &value, base, &sequence));
+    TEST_ASSERT_EQUAL(other, seqlock_sequence(&myShared));
+
+    snapshot_t copy;
+    seqlock_read(&myShared, &copy);
+    TEST_ASSERT_EQUAL(7, copy.words[0]);
+
+    // Based on the latest value, it is published.
+    TEST_ASSERT_TRUE(seqlock_publish_if(&myShared, &value, other, &sequence));
+    TEST_ASSERT_EQUAL(other + 2, sequence);
+    seqlock_read(&myShared, &copy);
+    TEST_ASSERT_EQUAL(8, copy.words[SNAPSHOT_WORDS - 1]);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_publish_then_read);
+    RUN_TEST(test_read_during_write_fails);
+    RUN_TEST(test_concurrent_no_tearing);
+    RUN_TEST(test_publish_if_rejects_stale);
+    return UNITY_END();
+}
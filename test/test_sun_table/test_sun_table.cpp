@@ -0,0 +1,137 @@
+#include <unity.h>
+#include <sun_table.h>
+#include <chrono>
+#include <string.h>
+
+// The number of times the table is built (and looked up) when comparing the
+// costs.
+#define BENCHMARK_ROUNDS 20
+
+// The day of the (leap) year of each solstice.
+#define JUNE_SOLSTICE 172
+#define DECEMBER_SOLSTICE 355
+
+SunSet sun;
+sun_table_t myTable;
+
+void build_table(sun_table_t *table, double latitude, double longitude, double offset, uint16_t daysPerStep) {
+    sun_table_begin(table, latitude, longitude, offset);
+    while (!sun_table_step(table, &sun, daysPerStep)) {
+        // Keep going until the table is complete.
+    }
+}
+
+void setUp(void) {
+    memset(&myTable, 0, sizeof(sun_table_t));
+}
+
+void tearDown(void) {
+}
+
+void test_matches_direct_calculation(void) {
+    build_table(&myTable, -31.95, 115.86, 8, SUN_TABLE_DAYS);
+    TEST_ASSERT_TRUE(sun_table_matches(&myTable, -31.95, 115.86, 8));
+    TEST_ASSERT_FALSE(sun_table_matches(&myTable, -31.95, 115.86, 9));
+    TEST_ASSERT_EQUAL(0, myTable.polarDays);
+
+    // 1 January, 29 February, 1 March, 21 June and 31 December.
+    const int dates[][3] = {{1, 1, 0}, {2, 29, 59}, {3, 1, 60}, {6, 21, 172}, {12, 31, 365}};
+    sun.setPosition(-31.95, 115.86, 8);
+    for (const int *date : dates) {
+        sun.setCurrentDate(SUN_TABLE_YEAR, date[0], date[1]);
+        TEST_ASSERT_EQUAL((uint16_t)sun.calcCivilSunrise(), myTable.civilSunrise[date[2]]);
+        TEST_ASSERT_EQUAL((uint16_t)sun.calcSunrise(), myTable.sunrise[date[2]]);
+        TEST_ASSERT_EQUAL((uint16_t)sun.calcSunset(), myTable.sunset[date[2]]);
+        TEST_ASSERT_EQUAL((uint16_t)sun.calcCivilSunset(), myTable.civilSunset[date[2]]);
+    }
+}
+
+void test_steps_match_single_pass(void) {
+    sun_table_t single;
+    memset(&single, 0, sizeof(sun_table_t));
+    build_table(&single, 51.48, 0, 0, SUN_TABLE_DAYS);
+    build_table(&myTable, 51.48, 0, 0, 4);
+    TEST_ASSERT_EQUAL(SUN_TABLE_DAYS, myTable.days);
+    TEST_ASSERT_EQUAL_MEMORY(&single, &myTable, sizeof(sun_table_t));
+
+    // Stepping a complete table does nothing.
+    TEST_ASSERT_TRUE(sun_table_step(&myTable, &sun, 4));
+    TEST_ASSERT_EQUAL_MEMORY(&single, &myTable, sizeof(sun_table_t));
+}
+
+void test_partial_table_does_not_match(void) {
+    sun_table_begin(&myTable, 51.48, 0, 0);
+    TEST_ASSERT_FALSE(sun_table_step(&myTable, &sun, 100));
+    TEST_ASSERT_EQUAL(100, myTable.days);
+    TEST_ASSERT_FALSE(sun_table_matches(&myTable, 51.48, 0, 0));
+}
+
+void check_in_range(const sun_table_t *table) {
+    for (uint16_t day = 0; day < SUN_TABLE_DAYS; day++) {
+        TEST_ASSERT_LESS_OR_EQUAL(SUN_TABLE_MINUTES, table->civilSunrise[day]);
+        TEST_ASSERT_LESS_OR_EQUAL(SUN_TABLE_MINUTES, table->sunrise[day]);
+        TEST_ASSERT_LESS_OR_EQUAL(SUN_TABLE_MINUTES, table->sunset[day]);
+        TEST_ASSERT_LESS_OR_EQUAL(SUN_TABLE_MINUTES, table->civilSunset[day]);
+    }
+}
+
+void test_northern_polar_days(void) {
+    // Tromsø has a polar day in June and a polar night in December.
+    build_table(&myTable, 69.65, 18.96, 1, SUN_TABLE_DAYS);
+    TEST_ASSERT_GREATER_THAN(0, myTable.polarDays);
+    check_in_range(&myTable);
+
+    TEST_ASSERT_EQUAL(0, myTable.sunrise[JUNE_SOLSTICE]);
+    TEST_ASSERT_EQUAL(SUN_TABLE_MINUTES, myTable.sunset[JUNE_SOLSTICE]);
+    TEST_ASSERT_EQUAL(myTable.sunrise[DECEMBER_SOLSTICE], myTable.sunset[DECEMBER_SOLSTICE]);
+}
+
+void test_southern_polar_days(void) {
+    // McMurdo Station has them the other way around.
+    build_table(&myTable, -77.85, 166.67, 12, SUN_TABLE_DAYS);
+    TEST_ASSERT_GREATER_THAN(0, myTable.polarDays);
+    check_in_range(&myTable);
+
+    TEST_ASSERT_EQUAL(myTable.sunrise[JUNE_SOLSTICE], myTable.sunset[JUNE_SOLSTICE]);
+    TEST_ASSERT_EQUAL(0, myTable.sunrise[DECEMBER_SOLSTICE]);
+    TEST_ASSERT_EQUAL(SUN_TABLE_MINUTES, myTable.sunset[DECEMBER_SOLSTICE]);
+}
+
+void test_benchmark(void) {
+    // Calculating the times for a day, as syncSunClock() used to each hour.
+    auto start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < BENCHMARK_ROUNDS; ii++) {
+        build_table(&myTable, -31.95 + ii, 115.86, 8, SUN_TABLE_DAYS);
+    }
+    auto calculated = std::chrono::steady_clock::now();
+
+    // Looking up the times for a day, as syncSunClock() does now.
+    volatile uint32_t sum = 0;
+    for (int ii = 0; ii < BENCHMARK_ROUNDS; ii++) {
+        for (uint16_t day = 0; day < SUN_TABLE_DAYS; day++) {
+            sum += myTable.civilSunrise[day] + myTable.sunrise[day] +
+                myTable.sunset[day] + myTable.civilSunset[day];
+        }
+    }
+    auto lookedUp = std::chrono::steady_clock::now();
+
+    double days = (double)BENCHMARK_ROUNDS * SUN_TABLE_DAYS;
+    double calculateNs = std::chrono::duration<double, std::nano>(calculated - start).count() / days;
+    double lookupNs = std::chrono::duration<double, std::nano>(lookedUp - calculated).count() / days;
+    char message[120];
+    snprintf(message, sizeof(message), "Per day: calculated in %.1f ns, looked up in %.1f ns (%.0fx).",
+        calculateNs, lookupNs, calculateNs / (lookupNs > 0 ? lookupNs : 1));
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(lookupNs < calculateNs);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_matches_direct_calculation);
+    RUN_TEST(test_steps_match_single_pass);
+    RUN_TEST(test_partial_table_does_not_match);
+    RUN_TEST(test_northern_polar_days);
+    RUN_TEST(test_southern_polar_days);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}